@@ -10,7 +10,7 @@ PFFT_VERSION=1.0.8-alpha3-fftw3-2don2d
 TMP="tmp-pfft-$PFFT_VERSION"
 LOGFILE="build.log"
 
-mkdir $TMP 
+mkdir -p $TMP
 ROOT=`dirname $0`/../
 if ! [ -f $ROOT/depends/pfft-$PFFT_VERSION.tar.gz ]; then
 wget https://github.com/rainwoodman/pfft/releases/download/$PFFT_VERSION/pfft-$PFFT_VERSION.tar.gz \
@@ -33,3 +33,23 @@ if ! grep PFFT_DONE ${LOGFILE}.double > /dev/null; then
     tail ${LOGFILE}.double
     exit 1
 fi
+
+# The float libraries are only needed for single precision PM meshes (OPT += -DUSE_PFFTF)
+if [ "$PFFT_SINGLE" != "1" ]; then
+    exit 0
+fi
+
+echo "Optimization for single" ${OPTIMIZE1}
+(
+mkdir -p single;cd single
+
+../pfft-${PFFT_VERSION}/configure --prefix=$PREFIX --disable-shared --enable-static --enable-openmp \
+--disable-fortran --disable-dependency-tracking --disable-doc --enable-mpi --enable-float ${OPTIMIZE1} &&
+make -j 8   &&
+make install && echo "PFFT_DONE"
+) 2>&1 > ${LOGFILE}.single
+
+if ! grep PFFT_DONE ${LOGFILE}.single > /dev/null; then
+    tail ${LOGFILE}.single
+    exit 1
+fi
@@ -25,6 +25,7 @@
 #include <libgadget/uvbg.h>
 #include <libgadget/stats.h>
 #include <libgadget/plane.h>
+#include <libgadget/exchange.h>
 
 static int
 BlackHoleFeedbackMethodAction (ParameterSet * ps, const char * name, void * data)
@@ -107,15 +108,26 @@ create_gadget_parameter_set()
     param_declare_double(ps, "TimeLimitCPU", REQUIRED, 0, "CPU time to run for in seconds. Code will stop if it notices that the time to end of the next PM step is longer than the remaining time.");
 
     param_declare_int   (ps, "MaxDomainTimeBinDepth", OPTIONAL, 8, "Forces a domain decompositon every 2^MaxDomainTimeBinDepth timesteps.");
+    param_declare_int   (ps, "GasTreeRefit", OPTIONAL, 0, "Keep the gas tree between short (non-PM) timesteps and refit it to the drifted particles, instead of rebuilding it every timestep.");
+    param_declare_double(ps, "GasTreeRefitMaxMoved", OPTIONAL, 0.05, "When refitting the gas tree, rebuild it instead if more than this fraction of particles have left their tree leaf.");
+    param_declare_int   (ps, "TreeBuildSortedKeys", OPTIONAL, 0, "Build the tree from particles radix sorted by Peano-Hilbert key, splitting each local domain into key ranges in parallel, instead of inserting particles one at a time. Scales better with many threads. Falls back to the insertion build if more than 8 particles share a key.");
     param_declare_int   (ps, "DomainOverDecompositionFactor", OPTIONAL, -1, "Create on average this number of sub domains on a MPI rank. Higher numbers improve the load balancing. For optimal tree building efficiency, use one domain per thread (the default).");
     param_declare_double(ps, "RandomParticleOffset", OPTIONAL, 8., "Internally shift the particles within a periodic box by a random fraction of a PM grid cell each domain decomposition, ensuring that tree openings are decorrelated between timesteps. This shift is subtracted before particles are saved.");
 
     param_declare_int   (ps, "DomainUseGlobalSorting", OPTIONAL, 1, "Determining the initial refinement of chunks globally. Enabling this produces better domains at costs of slowing down the domain decomposition.");
+    param_declare_int   (ps, "ExchangeCompress", OPTIONAL, 0, "Pack the particles and slots sent by the domain exchange losslessly, storing only the bytes which differ from the previous particle. Reduces the bytes sent by 2-4x at the cost of packing and unpacking. Useful if the exchange is limited by the network.");
+    param_declare_int   (ps, "DomainUseWalkCost", OPTIONAL, 0, "Balance the domains by the number of tree interactions each particle needed in the gravity and SPH treewalks since the last domain decomposition, rather than by the number of particles. Falls back to the particle number if the memory bound is not met.");
+    param_declare_int   (ps, "DomainIncrementalRebalance", OPTIONAL, 0, "If > 0, the domain decomposition on PM steps keeps the current top tree and assignment of top leaves to tasks: only the top leaves whose cost changed are refined or merged, and the top leaves at the boundaries between neighbouring tasks are moved to the less loaded task. A full decomposition is done after this many rebalances, or if the rebalanced domain does not fit in memory. Moves far fewer particles when the distribution changes slowly.");
     param_declare_double(ps, "ErrTolIntAccuracy", OPTIONAL, 0.02, "Controls the length of the short-range timestep. Smaller values are shorter timesteps.");
     param_declare_double(ps, "ErrTolForceAcc", OPTIONAL, 0.002, "Force accuracy required from tree. Controls tree opening criteria. Lower values are more accurate.");
     param_declare_double(ps, "BHOpeningAngle", OPTIONAL, 0.175, "Barnes-Hut opening angle. Alternative purely geometric tree opening angle. Lower values are more accurate.");
     param_declare_double(ps, "MaxBHOpeningAngle", OPTIONAL, 0.9, "Barnes-Hut opening angle, applied in addition to the relative aceleration criterion. Lower values are more accurate.");
     param_declare_double(ps, "TreeRcut", OPTIONAL, 6, "Number of mesh cells at which we cease walking.");
+    param_declare_int(ps, "TreeUseQuadrupole", OPTIONAL, 0, "If 1, include the quadrupole moment of tree nodes in the short-range force. This is more accurate at fixed opening criterion, so ErrTolForceAcc or BHOpeningAngle can be larger.");
+    param_declare_int(ps, "TreeGroupSize", OPTIONAL, 0, "If > 1, the short-range gravity tree is walked once for each group of up to this many nearby particles, using a conservative opening criterion and a shared interaction list. Reduces the cost of the tree walk in dense regions. Maximum 64.");
+    param_declare_int(ps, "TreeUseFMM", OPTIONAL, 0, "If 1, compute the short-range gravity between particles on the same processor with the fast multipole method, using cell-cell interactions. Forces from other processors still use the tree walk.");
+    param_declare_double(ps, "FMMOpeningAngle", OPTIONAL, 0.25, "Opening angle for the fast multipole method: cells interact directly if the sum of their sizes is less than this times their separation. Lower values are more accurate.");
+    param_declare_int(ps, "TreeUseLET", OPTIONAL, 0, "If 1, build a locally essential tree for the short-range gravity: each processor imports the remote tree nodes and particles its walk needs in one bulk exchange and then walks locally, instead of exporting particles to other processors.");
     param_declare_int(ps, "TreeUseBH", OPTIONAL, 2, "If 1, use Barnes-Hut opening angle rather than the standard Gadget acceleration based opening angle. If 2, use BH criterion for the first timestep only, before we have relative accelerations.");
     param_declare_int(ps, "SplitGravityTimestepsOn", OPTIONAL, 1, "This flag enables the momentum conserving hierarchical timestepping, where only active particles gravitate, from Gadget 4, for the short-range gravity, and splits the hydro and gravitational timesteps.");
 
@@ -123,6 +135,35 @@ create_gadget_parameter_set()
                                                       "Larger values suppresses grid anisotropy. ShortRangeForceWindowType = erfc supports any value. 'exact' only supports 1.5. ");
     param_declare_int(ps,    "Nmesh", OPTIONAL, -1, "Size of the PM grid on which to compute the long-range force.");
 
+    static ParameterEnum PMWindowEnum [] = {
+        {"cic", PETAPM_WINDOW_CIC},
+        {"tsc", PETAPM_WINDOW_TSC},
+        {"pcs", PETAPM_WINDOW_PCS},
+        {NULL, PETAPM_WINDOW_CIC},
+    };
+    param_declare_enum(ps,    "PMWindow", PMWindowEnum, OPTIONAL, "cic", "Mass assignment window of the PM grid: cic (cloud in cell), tsc (triangular shaped cloud) or pcs (piecewise cubic spline). "
+                                                                          "Higher order windows are smoother and alias less, but touch 27 or 64 cells per particle instead of 8.");
+    param_declare_int(ps,    "PMInterlace", OPTIONAL, 0, "If 1, also deposit the particles to the PM grid shifted by half a cell and average the two, which removes most of the aliasing. "
+                                                       "With tsc or pcs this allows an Nmesh equal to the particle grid at an accuracy similar to a mesh twice as fine.");
+    param_declare_int(ps,    "PMSinglePrecision", OPTIONAL, 0, "If 1, do the FFTs of the PM grid and the exchange of the grid cells in single precision. "
+                                                             "This halves the memory and communication of the PM step, at a relative error of about 1e-6 in the long-range force. "
+                                                             "Needs the code to be compiled with OPT += -DUSE_PFFTF.");
+    param_declare_double(ps, "PMIncrementalDeposit", OPTIONAL, 0, "If > 0, keep the PM density mesh between PM steps and deposit again only the particles which changed mass "
+                                                                 "or moved by more than this fraction of a PM cell since their last deposit. Needs memory for one more real space PM mesh. "
+                                                                 "The other particles stay where they were deposited, so this should be small. Only useful with RandomParticleOffset = 0, "
+                                                                 "as a change of the particle offset forces a full deposit. "
+                                                                 "Needs the code to be compiled with OPT += -DPM_INCREMENTAL_DEPOSIT, which stores the last deposit in each particle.");
+    param_declare_int(ps,    "PMFullDepositInterval", OPTIONAL, 16, "With PMIncrementalDeposit, deposit all particles every this many PM steps, to bound the accumulated round-off.");
+    param_declare_int(ps,    "PMMaxFusedFields", OPTIONAL, 4, "Largest number of PM force components (potential and three accelerations) sent back from the FFT mesh and read out to the particles together, "
+                                                           "in one cell exchange and one pass over the particles. Each fused component needs its own copy of the mesh cells around the local particles, "
+                                                           "three times over during the exchange, so the memory of the readout grows linearly with this number. "
+                                                           "Fewer components are fused if the memory is not free. 1 reads out one component at a time.");
+    param_declare_int(ps,    "PMPowerMultipoles", OPTIONAL, 0, "If 1, also save the redshift space monopole, quadrupole and hexadecapole of the matter power spectrum on each PM step. "
+                                                             "This needs one more mass deposit and FFT.");
+    param_declare_int(ps,    "PMPowerLOSAxis", OPTIONAL, 2, "Line of sight axis of the redshift space power spectrum multipoles: 0, 1 or 2 for x, y or z.");
+    param_declare_int(ps,    "PMPowerCross", OPTIONAL, 0, "If 1, also save the auto and cross power spectra of CDM, baryons and neutrino particles on each PM step. "
+                                                        "This needs one more mass deposit and FFT for each species.");
+
     static ParameterEnum ShortRangeForceWindowTypeEnum [] = {
         {"exact", SHORTRANGE_FORCE_WINDOW_TYPE_EXACT},
         {"erfc", SHORTRANGE_FORCE_WINDOW_TYPE_ERFC },
@@ -196,6 +237,8 @@ create_gadget_parameter_set()
     param_declare_int(ps, "GravitySofteningGas", OPTIONAL, 1, "Unused. Previously was for adaptive softening.");
 
     param_declare_int(ps, "ImportBufferBoost", OPTIONAL, 2, "Memory factor to allow for there being more particles imported during treewlk than exported. Increase this if code crashes during treewalk with out of memory.");
+    param_declare_int(ps, "TreeWalkAsyncExport", OPTIONAL, 0, "If 1, tree walks send exported particles as soon as each toptree round is done, without an alltoall of the export counts, and evaluate imported particles as they arrive, overlapping with the walk of local particles. Imports may then be evaluated at the same time as the primary walk.");
+    param_declare_int(ps, "NodeSharedComm", OPTIONAL, 0, "If 1, the memory of each task (MaxMemSizePerNode) is allocated at startup in one MPI shared memory window per node, so that tree walks read the queries exported by tasks on the same node in place, and the domain exchange and the PM mesh exchange send one aggregated message per pair of nodes instead of one per pair of tasks. Reduces the number of network messages when there are many tasks per node.");
     param_declare_double(ps, "PartAllocFactor", OPTIONAL, 1.5, "Over-allocation factor of particles. The load can be imbalanced to allow for the work to be more balanced.");
     param_declare_double(ps, "TopNodeAllocFactor", OPTIONAL, 0.5, "Initial TopNode allocation as a fraction of maximum particle number.");
     param_declare_double(ps, "SlotsIncreaseFactor", OPTIONAL, 0.01, "Percentage factor to increase slot allocation by when requested.");
@@ -379,6 +422,7 @@ create_gadget_parameter_set()
     param_declare_double(ps, "ExcursionSetZStart", OPTIONAL, 25., "Redshift at which we start the excursion set");
     param_declare_int(ps, "ReionUseParticleSFR", OPTIONAL, 0, "Use the gas particle SFR instead of the usual excursion set stellar mass / timescale");
     param_declare_double(ps, "ReionSFRTimescale", OPTIONAL, 0.1, "timescale to calculate the SFR from stellar mass filtered grids (units of Hubble time)");
+    param_declare_int(ps, "ReionFilterBatch", OPTIONAL, 1, "Number of filter radii transformed back to real space together. Larger values need more memory but do fewer FFTs.");
     /*End Parameters for the Excursion Set Algorithm*/
 
     param_set_action(ps, "BlackHoleFeedbackMethod", BlackHoleFeedbackMethodAction, NULL);
@@ -430,8 +474,11 @@ void read_parameter_file(char *fname, int * ShowBacktrace, double * MaxMemSizePe
     set_hydro_params(ps);
     set_qso_lightup_params(ps);
     set_treewalk_params(ps);
+    set_forcetree_params(ps);
     set_gravshort_tree_params(ps);
+    set_gravpm_params(ps);
     set_domain_params(ps);
+    set_exchange_params(ps);
     set_sfr_params(ps);
     set_sync_params(ps);
     set_uvbg_params(ps);
@@ -52,6 +52,7 @@ typedef struct {
     int SubSampleDistance; /** Frequency of subsampling */
     int PreSort; /** PreSort the local particles before subsampling, creating a fair subsample */
     int NTopLeaves; /** Number of Peano-Hilbert segments to create before balancing. Should be DomainOverDecompositionFactor * NTask*/
+    int UseWalkCost; /** Balance the measured treewalk work (P[i].WalkCost), rather than the particle number*/
 } DomainDecompositionPolicy;
 
 /* It is important for the stability of the code that this struct is 64-bit aligned!*/
@@ -93,6 +94,8 @@ void set_domain_params(ParameterSet * ps)
             domain_params.DomainOverDecompositionFactor = 4;
         domain_params.TopNodeAllocFactor = param_get_double(ps, "TopNodeAllocFactor");
         domain_params.DomainUseGlobalSorting = param_get_int(ps, "DomainUseGlobalSorting");
+        domain_params.DomainUseWalkCost = param_get_int(ps, "DomainUseWalkCost");
+        domain_params.DomainIncrementalRebalance = param_get_int(ps, "DomainIncrementalRebalance");
         domain_params.SetAsideFactor = 1.;
     }
     MPI_Bcast(&domain_params, sizeof(DomainParams), MPI_BYTE, 0, MPI_COMM_WORLD);
@@ -109,7 +112,7 @@ domain_check_memory_bound(const DomainDecomp * ddecomp, int64_t *TopLeafWork, in
 static int domain_attempt_decompose(DomainDecomp * ddecomp, DomainDecompositionPolicy * policy, const int MaxTopNodes);
 
 static int
-domain_balance(DomainDecomp * ddecomp);
+domain_balance(DomainDecomp * ddecomp, DomainDecompositionPolicy * policy);
 
 static int domain_determine_global_toptree(DomainDecompositionPolicy * policy, struct local_topnode_data * topTree, int * topTreeSize, const int MaxTopNodes, MPI_Comm DomainComm);
 
@@ -166,7 +169,7 @@ void domain_decompose_full(DomainDecomp * ddecomp)
 #ifdef DEBUG
         domain_test_id_uniqueness(PartManager);
 #endif
-        message(0, "Attempting new domain decomposition policy: Topleaves=%d GlobalSort=%d, SubSampleDistance=%d PreSort=%d\n", policies[i].NTopLeaves, domain_params.DomainUseGlobalSorting, policies[i].SubSampleDistance, policies[i].PreSort);
+        message(0, "Attempting new domain decomposition policy: Topleaves=%d GlobalSort=%d, SubSampleDistance=%d PreSort=%d WalkCost=%d\n", policies[i].NTopLeaves, domain_params.DomainUseGlobalSorting, policies[i].SubSampleDistance, policies[i].PreSort, policies[i].UseWalkCost);
 
         /* Keep going with the same policy until we have enough topnodes to make it work.*/
         do {
@@ -186,7 +189,7 @@ void domain_decompose_full(DomainDecomp * ddecomp)
         } while(decompose_failed);
 
         /* Still try an exchange if this is the last policy.*/
-        if(domain_balance(ddecomp) && (i < Npolicies-1))
+        if(domain_balance(ddecomp, &policies[i]) && (i < Npolicies-1))
             continue;
 
         /* copy the used nodes from temp to the true. */
@@ -225,6 +228,11 @@ void domain_decompose_full(DomainDecomp * ddecomp)
      *the same as the particles, garbage is at the end and all particles are in peano order.*/
     slots_gc_sorted(PartManager, SlotsManager);
 
+    /* Start measuring the work for the next decomposition.*/
+    #pragma omp parallel for
+    for(i = 0; i < PartManager->NumPart; i++)
+        PartManager->Base[i].WalkCost = 0;
+
     /*Ensure collective*/
     MPIU_Barrier(ddecomp->DomainComm);
     message(0, "Domain decomposition done.\n");
@@ -258,7 +266,7 @@ static inline int inside_topleaf(const int topleaf, const double Pos[3], const F
 
 /* This is a cut-down version of the domain decomposition that leaves the
  * domain grid intact, but exchanges the particles and rebuilds the tree */
-int domain_maintain(DomainDecomp * ddecomp, struct DriftData * drift)
+int domain_maintain(DomainDecomp * ddecomp, struct DriftData * drift, struct ForceTree * reusetree)
 {
     message(0, "Attempting a domain exchange\n");
 
@@ -272,6 +280,10 @@ int domain_maintain(DomainDecomp * ddecomp, struct DriftData * drift)
 
     /*Garbage particles are counted so we have an accurate memory estimate*/
     int ngarbage = 0;
+    /* Move a kept tree out of the way of the particle slots, which may grow during the exchange.
+     * The tree is left at the top of the heap afterwards, so that the caller can allocate below it.*/
+    if(reusetree && force_tree_allocated(reusetree))
+        force_tree_move(reusetree, 1);
     gadget_thread_arrays gthread = gadget_setup_thread_arrays("exchangelist", 1, PartManager->NumPart);
 
     ForceTree tree = force_tree_top_build(ddecomp, 1);
@@ -320,11 +332,318 @@ int domain_maintain(DomainDecomp * ddecomp, struct DriftData * drift)
     ExchangeData->ExchangeList = (int *) myrealloc(ExchangeData->ExchangeList, sizeof(int) * ExchangeData->nexchange);
     walltime_measure("/Domain/drift");
 
+    /* The exchange re-orders the particles, so a kept tree is only still valid if no particles move.*/
+    const int anyexchange = MPIU_Any(ExchangeData->nexchange > 0, ddecomp->DomainComm);
+
     /* Try a domain exchange. Note ExchangeList is freed inside.*/
     int errno = domain_exchange(domain_layoutfunc, ddecomp, ExchangeData, PartManager, SlotsManager, 10000, ddecomp->DomainComm);
+
+    if(reusetree && (anyexchange || errno))
+        force_tree_free(reusetree);
     return errno;
 }
 
+/* Copy the reachable part of the top tree below old node no to new node newno,
+ * keeping the daughters of each node together, and point the top leaves at the new nodes.*/
+static void
+domain_toptree_compact(struct topnode_data * OldTopNodes, struct topnode_data * NewTopNodes, struct topleaf_data * TopLeaves, int no, int newno, int * next)
+{
+    NewTopNodes[newno] = OldTopNodes[no];
+    if(OldTopNodes[no].Daughter == -1) {
+        TopLeaves[OldTopNodes[no].Leaf].topnode = newno;
+        return;
+    }
+    const int daughter = *next;
+    NewTopNodes[newno].Daughter = daughter;
+    (*next) += 8;
+    int j;
+    for(j = 0; j < 8; j++)
+        domain_toptree_compact(OldTopNodes, NewTopNodes, TopLeaves, OldTopNodes[no].Daughter + j, daughter + j, next);
+}
+
+/* Split the top leaves whose cost or count is above twice the limit into their 8 daughters,
+ * and merge sets of 8 sibling leaves on the same task whose total is below half the limit into their parent.
+ * The leaves keep their task and their order, so the leaves of each task stay contiguous.
+ * MaxTopNodes is the space in TopNodes and TopLeaves. Returns the number of leaves which changed.*/
+static int
+domain_refine_leaves(DomainDecomp * ddecomp, const int64_t * cost, const int64_t * count, const int64_t costlimit, const int64_t countlimit, const int MaxTopNodes)
+{
+    const int NTopLeaves = ddecomp->NTopLeaves;
+    struct topnode_data * TopNodes = ddecomp->TopNodes;
+    /* For the leaves merged into their parent, the parent node*/
+    int * merged = ta_malloc("merged", int, NTopLeaves);
+    int i, j, nchanged = 0, nsplit = 0;
+    for(i = 0; i < NTopLeaves; i++)
+        merged[i] = -1;
+
+    const int NOldTopNodes = ddecomp->NTopNodes;
+    for(i = 0; i < NOldTopNodes; i++) {
+        const int daughter = TopNodes[i].Daughter;
+        if(daughter < 0)
+            continue;
+        /* A node all of whose daughters are leaves on one task*/
+        if(TopNodes[daughter].Daughter != -1)
+            continue;
+        const int task = ddecomp->TopLeaves[TopNodes[daughter].Leaf].Task;
+        int64_t sumcost = 0, sumcount = 0;
+        for(j = 0; j < 8; j++) {
+            const int leaf = TopNodes[daughter + j].Leaf;
+            if(TopNodes[daughter + j].Daughter != -1 || ddecomp->TopLeaves[leaf].Task != task)
+                break;
+            sumcost += cost[leaf];
+            sumcount += count[leaf];
+        }
+        if(j < 8 || 2 * sumcost >= costlimit || 2 * sumcount >= countlimit)
+            continue;
+        for(j = 0; j < 8; j++)
+            merged[TopNodes[daughter + j].Leaf] = i;
+        TopNodes[i].Daughter = -1;
+        nchanged += 8;
+    }
+
+    for(i = 0; i < NTopLeaves; i++) {
+        const int no = ddecomp->TopLeaves[i].topnode;
+        if(merged[i] >= 0 || TopNodes[no].Shift < 3)
+            continue;
+        if(cost[i] <= 2 * costlimit && count[i] <= 2 * countlimit)
+            continue;
+        /* No space for another 8 nodes: refine the rest next time*/
+        if(ddecomp->NTopNodes + 8 > MaxTopNodes || NTopLeaves + 7 * (nsplit + 1) > MaxTopNodes)
+            break;
+        TopNodes[no].Daughter = ddecomp->NTopNodes;
+        for(j = 0; j < 8; j++) {
+            struct topnode_data * sub = &TopNodes[ddecomp->NTopNodes + j];
+            sub->Shift = TopNodes[no].Shift - 3;
+            sub->StartKey = TopNodes[no].StartKey + j * (1L << sub->Shift);
+            sub->Daughter = -1;
+            sub->Leaf = -1;
+        }
+        ddecomp->NTopNodes += 8;
+        nsplit++;
+        nchanged++;
+    }
+
+    if(nchanged == 0) {
+        ta_free(merged);
+        return 0;
+    }
+
+    /* Number the new leaves in the order of the old ones. A split leaf is replaced by its daughters,
+     * which are in key order, and merged leaves by their parent, at the place of the first daughter.*/
+    struct topleaf_data * NewTopLeaves = (struct topleaf_data *) mymalloc("NewTopLeaves", sizeof(NewTopLeaves[0]) * MaxTopNodes);
+    int nleaves = 0;
+    for(i = 0; i < NTopLeaves; i++) {
+        const int no = ddecomp->TopLeaves[i].topnode;
+        const int task = ddecomp->TopLeaves[i].Task;
+        if(merged[i] >= 0) {
+            TopNodes[no].Leaf = -1;
+            /* The parent was an internal node, with no leaf, until the first daughter*/
+            const int parent = merged[i];
+            if(TopNodes[parent].Leaf >= 0)
+                continue;
+            TopNodes[parent].Leaf = nleaves;
+            NewTopLeaves[nleaves].topnode = parent;
+            NewTopLeaves[nleaves].Task = task;
+            nleaves++;
+        }
+        else if(TopNodes[no].Daughter >= 0) {
+            TopNodes[no].Leaf = -1;
+            for(j = 0; j < 8; j++) {
+                TopNodes[TopNodes[no].Daughter + j].Leaf = nleaves;
+                NewTopLeaves[nleaves].topnode = TopNodes[no].Daughter + j;
+                NewTopLeaves[nleaves].Task = task;
+                nleaves++;
+            }
+        }
+        else {
+            TopNodes[no].Leaf = nleaves;
+            NewTopLeaves[nleaves] = ddecomp->TopLeaves[i];
+            nleaves++;
+        }
+    }
+    memcpy(ddecomp->TopLeaves, NewTopLeaves, sizeof(NewTopLeaves[0]) * nleaves);
+    myfree(NewTopLeaves);
+    ddecomp->NTopLeaves = nleaves;
+    ta_free(merged);
+    return nchanged;
+}
+
+/* Set the leaf range of each task from the task of each leaf. The leaves of each task are contiguous.*/
+static void
+domain_set_task_ranges(DomainDecomp * ddecomp, const int NTask)
+{
+    int ta, i = 0;
+    for(ta = 0; ta < NTask; ta++) {
+        ddecomp->Tasks[ta].StartLeaf = i;
+        while(i < ddecomp->NTopLeaves && ddecomp->TopLeaves[i].Task == ta)
+            i++;
+        ddecomp->Tasks[ta].EndLeaf = i;
+    }
+    if(i != ddecomp->NTopLeaves)
+        endrun(5, "Top leaves are not ordered by task: %d of %d assigned\n", i, ddecomp->NTopLeaves);
+    ddecomp->Tasks[NTask].StartLeaf = ddecomp->NTopLeaves;
+    ddecomp->TopLeaves[ddecomp->NTopLeaves].Task = NTask;
+    ddecomp->TopLeaves[ddecomp->NTopLeaves].topnode = -1;
+}
+
+/* Move the boundaries between tasks so each task has close to an equal share of the cost,
+ * in one pass over the prefix sum of the leaf costs. The boundary after each task is put at the leaf
+ * where the cumulative cost is closest to its share. The leaves stay in Peano order and each task keeps
+ * at least one leaf. Returns the number of leaves moved to a different task.*/
+static int64_t
+domain_balance_boundaries(DomainDecomp * ddecomp, const int64_t * cost, const int NTask)
+{
+    const int NTopLeaves = ddecomp->NTopLeaves;
+    if(NTopLeaves < NTask)
+        return 0;
+    double totcost = 0;
+    int ta, i;
+    for(i = 0; i < NTopLeaves; i++)
+        totcost += cost[i];
+
+    int64_t nmoved = 0;
+    /* Cost of the leaves assigned so far*/
+    double cumcost = 0;
+    i = 0;
+    for(ta = 0; ta < NTask; ta++) {
+        int end = NTopLeaves;
+        if(ta < NTask - 1) {
+            const double target = totcost * (ta + 1) / NTask;
+            /* Leave one leaf for each of the later tasks*/
+            const int maxend = NTopLeaves - (NTask - 1 - ta);
+            end = i + 1;
+            cumcost += cost[i];
+            /* Add the next leaf while the middle of it is below the share*/
+            while(end < maxend && cumcost + 0.5 * cost[end] < target) {
+                cumcost += cost[end];
+                end++;
+            }
+        }
+        for(; i < end; i++) {
+            if(ddecomp->TopLeaves[i].Task != ta)
+                nmoved++;
+            ddecomp->TopLeaves[i].Task = ta;
+        }
+    }
+    return nmoved;
+}
+
+/* Number of passes of leaf refinement in one rebalance*/
+#define DOMAIN_REFINE_PASSES 4
+
+/* Rebalance the current domain in place. Returns 1 if the result is outside the memory bound
+ * or the exchange failed, leaving a valid but unbalanced domain.*/
+static int
+domain_rebalance_attempt(DomainDecomp * ddecomp)
+{
+    int NTask;
+    MPI_Comm_size(ddecomp->DomainComm, &NTask);
+
+    /* Move the top tree to the low side, with space to refine, as the decomposition does*/
+    const int MaxTopNodes = ddecomp->NTopNodes + 8 * DOMAIN_REFINE_PASSES * ddecomp->NTopLeaves;
+    struct topnode_data * TopNodes = (struct topnode_data *) mymalloc("TopNodes", MaxTopNodes * sizeof(TopNodes[0]));
+    struct topleaf_data * TopLeaves = (struct topleaf_data *) mymalloc("TopLeaves", (MaxTopNodes + 1) * sizeof(TopLeaves[0]));
+    memcpy(TopNodes, ddecomp->TopNodes, ddecomp->NTopNodes * sizeof(TopNodes[0]));
+    memcpy(TopLeaves, ddecomp->TopLeaves, ddecomp->NTopLeaves * sizeof(TopLeaves[0]));
+    myfree(ddecomp->TopLeaves);
+    myfree(ddecomp->TopNodes);
+    ddecomp->TopNodes = TopNodes;
+    ddecomp->TopLeaves = TopLeaves;
+
+    const int UseWalkCost = domain_params.DomainUseWalkCost;
+    int64_t * TopLeafCount = (int64_t *) mymalloc("TopLeafCount", MaxTopNodes * sizeof(TopLeafCount[0]));
+    int64_t * TopLeafWork = NULL;
+    if(UseWalkCost)
+        TopLeafWork = (int64_t *) mymalloc("TopLeafWork", MaxTopNodes * sizeof(TopLeafWork[0]));
+
+    /* Refine or coarsen the leaves whose cost has moved away from the target,
+     * measuring the costs again after each change. This also sets P[i].TopLeaf for the exchange.*/
+    int pass, nchanged = 0;
+    for(pass = 0; pass <= DOMAIN_REFINE_PASSES; pass++) {
+        domain_compute_costs(ddecomp, TopLeafWork, TopLeafCount);
+        if(pass == DOMAIN_REFINE_PASSES)
+            break;
+        const int64_t * cost = TopLeafWork ? TopLeafWork : TopLeafCount;
+        int64_t totcost = 0, totcount = 0;
+        int i;
+        for(i = 0; i < ddecomp->NTopLeaves; i++) {
+            totcost += cost[i];
+            totcount += TopLeafCount[i];
+        }
+        const int64_t costlimit = 1 + totcost / (domain_params.DomainOverDecompositionFactor * NTask);
+        const int64_t countlimit = 1 + totcount / (domain_params.DomainOverDecompositionFactor * NTask);
+        const int changed = domain_refine_leaves(ddecomp, cost, TopLeafCount, costlimit, countlimit, MaxTopNodes);
+        if(changed == 0)
+            break;
+        nchanged += changed;
+        domain_set_task_ranges(ddecomp, NTask);
+    }
+
+    const int64_t nmoved = domain_balance_boundaries(ddecomp, TopLeafWork ? TopLeafWork : TopLeafCount, NTask);
+    domain_set_task_ranges(ddecomp, NTask);
+    message(0, "Incremental domain rebalance: %d top leaves refined or merged, %ld moved between tasks. NTopLeaves=%d NTopNodes=%d\n",
+            nchanged, nmoved, ddecomp->NTopLeaves, ddecomp->NTopNodes);
+
+    int status = domain_check_memory_bound(ddecomp, TopLeafWork, TopLeafCount);
+    if(TopLeafWork)
+        myfree(TopLeafWork);
+    myfree(TopLeafCount);
+
+    /* Copy the reachable nodes to the high side, as the decomposition does*/
+    ddecomp->TopNodes = (struct topnode_data *) mymalloc2("TopNodes", sizeof(ddecomp->TopNodes[0]) * ddecomp->NTopNodes);
+    ddecomp->TopLeaves = (struct topleaf_data *) mymalloc2("TopLeaves", sizeof(ddecomp->TopLeaves[0]) * (ddecomp->NTopLeaves + 1));
+    memcpy(ddecomp->TopLeaves, TopLeaves, (ddecomp->NTopLeaves + 1) * sizeof(TopLeaves[0]));
+    int next = 1;
+    domain_toptree_compact(TopNodes, ddecomp->TopNodes, ddecomp->TopLeaves, 0, 0, &next);
+    ddecomp->NTopNodes = next;
+    myfree(TopLeaves);
+    myfree(TopNodes);
+    walltime_measure("/Domain/Decompose");
+
+    if(status != 0) {
+        message(0, "Incremental domain rebalance is outside memory bounds.\n");
+        return 1;
+    }
+    if(domain_exchange(domain_layoutfunc, ddecomp, NULL, PartManager, SlotsManager, 10000, ddecomp->DomainComm)) {
+        message(0, "Could not exchange particles\n");
+        return 1;
+    }
+    return 0;
+}
+
+int domain_rebalance(DomainDecomp * ddecomp)
+{
+    /* Number of incremental rebalances since the last full decomposition*/
+    static int NRebalance = 0;
+
+    if(domain_params.DomainIncrementalRebalance <= 0 || !ddecomp->domain_allocated_flag
+        || NRebalance >= domain_params.DomainIncrementalRebalance) {
+        NRebalance = 0;
+        domain_decompose_full(ddecomp);
+        return 1;
+    }
+    message(0, "incremental domain rebalance... (presently allocated=%g MB)\n", mymalloc_usedbytes() / (1024.0 * 1024.0));
+
+    if(domain_rebalance_attempt(ddecomp)) {
+        NRebalance = 0;
+        domain_decompose_full(ddecomp);
+        return 1;
+    }
+    NRebalance++;
+
+    /* As after a full decomposition: order the slots as the particles, and start measuring the work again.*/
+    slots_gc_sorted(PartManager, SlotsManager);
+    int i;
+    #pragma omp parallel for
+    for(i = 0; i < PartManager->NumPart; i++)
+        PartManager->Base[i].WalkCost = 0;
+
+    MPIU_Barrier(ddecomp->DomainComm);
+    message(0, "Domain rebalance done.\n");
+    walltime_measure("/Domain/PeanoSort");
+    return 0;
+}
+
 /* this function generates several domain decomposition policies for attempting
  * creating the domain. */
 static int
@@ -349,6 +668,9 @@ domain_policies_init(DomainDecompositionPolicy policies[],
         /* Desired number of TopLeaves should scale like the total number of processors. If we don't get a good balance domain decomposition, we need more topnodes.
          * Need to scale evenly with processors so the round robin balances.*/
         policies[i].NTopLeaves = domain_params.DomainOverDecompositionFactor * NTask * (i+1);
+        /* Balancing the work may put too many particles on the ranks holding dense regions.
+         * If the memory bound is not met, fall back to balancing the particle load.*/
+        policies[i].UseWalkCost = domain_params.DomainUseWalkCost && (i < NPolicy / 2);
     }
 
     return NPolicy;
@@ -405,7 +727,7 @@ void domain_free(DomainDecomp * ddecomp)
 
 /*! This function carries out the actual domain decomposition for all
  *  particle types. It will try to balance the work-load for each ddecomp,
- *  as estimated based on the P[i]-GravCost values.  The decomposition will
+ *  as estimated based on the P[i].WalkCost values.  The decomposition will
  *  respect the maximum allowed memory-imbalance given by the value of
  *  PartAllocFactor.
  */
@@ -464,22 +786,28 @@ domain_attempt_decompose(DomainDecomp * ddecomp, DomainDecompositionPolicy * pol
  *
  * */
 static int
-domain_balance(DomainDecomp * ddecomp)
+domain_balance(DomainDecomp * ddecomp, DomainDecompositionPolicy * policy)
 {
     /*!< a table that gives the total number of particles held by each processor */
     int64_t * TopLeafCount = (int64_t *) mymalloc("TopLeafCount",  ddecomp->NTopLeaves * sizeof(TopLeafCount[0]));
+    /*!< a table that gives the measured work in each top leaf */
+    int64_t * TopLeafWork = NULL;
+    if(policy->UseWalkCost)
+        TopLeafWork = (int64_t *) mymalloc("TopLeafWork",  ddecomp->NTopLeaves * sizeof(TopLeafWork[0]));
 
-    domain_compute_costs(ddecomp, NULL, TopLeafCount);
+    domain_compute_costs(ddecomp, TopLeafWork, TopLeafCount);
 
     /* first try work balance */
-    domain_assign_balanced(ddecomp, TopLeafCount, 1);
+    domain_assign_balanced(ddecomp, TopLeafWork ? TopLeafWork : TopLeafCount, 1);
 
-    int status = domain_check_memory_bound(ddecomp, NULL, TopLeafCount);
+    int status = domain_check_memory_bound(ddecomp, TopLeafWork, TopLeafCount);
     if(status != 0)
         message(0, "Domain decomposition is outside memory bounds.\n");
 
     walltime_measure("/Domain/Decompose");
 
+    if(TopLeafWork)
+        myfree(TopLeafWork);
     myfree(TopLeafCount);
 
     return status;
@@ -541,6 +869,8 @@ domain_check_memory_bound(const DomainDecomp * ddecomp, int64_t *TopLeafWork, in
             message(0, "Task: [%3d]  work=%8.4f  particle load=%8.4f\n", i,
                list_work[i] / ((double) sumwork / NTask), list_load[i] / (((double) sumload) / NTask));
         }
+        ta_free(list_work);
+        ta_free(list_load);
         return 1;
     }
     ta_free(list_work);
@@ -961,6 +1291,16 @@ mp_order_by_key(const void * data, void * radix, void * arg)
     ((uint64_t *) radix)[0] = pa->Key;
 }
 
+/* Cost of a particle for the toptree refinement: the measured treewalk work if the policy balances it,
+ * plus one so that particles which did no work still count.*/
+static inline int64_t
+domain_particle_cost(const DomainDecompositionPolicy * policy, const int i)
+{
+    if(!policy->UseWalkCost)
+        return 1;
+    return 1 + (int64_t) P[i].WalkCost;
+}
+
 /**
  * This function performs local refinement of the topTree.
  *
@@ -1018,7 +1358,7 @@ domain_check_for_local_refine_subsample(
                 continue;
             }
             LPfull[i].Key = PEANO(P[i].Pos, PartManager->BoxSize);
-            LPfull[i].Cost = 1;
+            LPfull[i].Cost = domain_particle_cost(policy, i);
         }
 
         /* First sort to ensure spatially 'even' subsamples and remove garbage.*/
@@ -1042,7 +1382,7 @@ domain_check_for_local_refine_subsample(
         {
             int j = i * policy->SubSampleDistance;
             LP[i].Key = PEANO(P[j].Pos, PartManager->BoxSize);
-            LP[i].Cost = 1;
+            LP[i].Cost = domain_particle_cost(policy, j);
         }
     }
 
@@ -1274,6 +1614,11 @@ int domain_determine_global_toptree(DomainDecompositionPolicy * policy,
 
     costlimit = TotCost / (policy->NTopLeaves);
     countlimit = TotCount / (policy->NTopLeaves);
+    /* With fewer samples than leaves a zero limit would refine every node down to a single Peano cell.*/
+    if(countlimit < 1)
+        countlimit = 1;
+    if(costlimit < 1)
+        costlimit = 1;
 
     domain_toptree_truncate(topTree, topTreeSize, countlimit, costlimit);
 
@@ -1399,7 +1744,7 @@ domain_compute_costs(DomainDecomp * ddecomp, int64_t *TopLeafWork, int64_t *TopL
             P[n].TopLeaf = leaf;
 
             if(local_TopLeafWork)
-                local_TopLeafWork[leaf + tid * ddecomp->NTopLeaves] += 1;
+                local_TopLeafWork[leaf + tid * ddecomp->NTopLeaves] += 1 + (int64_t) P[n].WalkCost;
 
             local_TopLeafCount[leaf + tid * ddecomp->NTopLeaves] += 1;
         }
@@ -1420,13 +1765,13 @@ domain_compute_costs(DomainDecomp * ddecomp, int64_t *TopLeafWork, int64_t *TopL
         }
     }
 
+    MPI_Allreduce(local_TopLeafCount, TopLeafCount, ddecomp->NTopLeaves, MPI_INT64, MPI_SUM, ddecomp->DomainComm);
+    myfree(local_TopLeafCount);
+
     if(local_TopLeafWork) {
         MPI_Allreduce(local_TopLeafWork, TopLeafWork, ddecomp->NTopLeaves, MPI_INT64, MPI_SUM, ddecomp->DomainComm);
         myfree(local_TopLeafWork);
     }
-
-    MPI_Allreduce(local_TopLeafCount, TopLeafCount, ddecomp->NTopLeaves, MPI_INT64, MPI_SUM, ddecomp->DomainComm);
-    myfree(local_TopLeafCount);
 }
 
 /**
@@ -51,6 +51,12 @@ typedef struct DomainParams
     int DomainOverDecompositionFactor;
     /** Use a global sort for the first few domain policies to try.*/
     int DomainUseGlobalSorting;
+    /** Balance the work measured in the gravity and SPH treewalks, instead of the number of particles,
+     * for the first few domain policies to try.*/
+    int DomainUseWalkCost;
+    /** If > 0, domain_rebalance keeps the top tree and task assignment and only moves the top leaves
+     * at the boundaries between tasks, doing a full decomposition after this many rebalances.*/
+    int DomainIncrementalRebalance;
     /** Initial number of Top level tree nodes as a fraction of particles */
     double TopNodeAllocFactor;
     /** Fraction of local particle slots to leave free for, eg, star formation*/
@@ -64,8 +70,16 @@ void set_domain_par(DomainParams dp);
 
 /* Do a full domain decomposition, which splits the particles into even clumps*/
 void domain_decompose_full(DomainDecomp * ddecomp);
-/* Exchange particles which have moved into the new domains, not re-doing the split unless we have to*/
-int domain_maintain(DomainDecomp * ddecomp, struct DriftData * drift);
+/* Rebalance the domain incrementally: refine or merge the top leaves whose cost has changed,
+ * and move the top leaves at the boundaries between neighbouring tasks from the more to the less loaded task.
+ * Does a full decomposition instead if DomainIncrementalRebalance is not set, periodically, or if the rebalance fails.
+ * Returns 1 if it did a full decomposition, 0 if the rebalance was incremental.*/
+int domain_rebalance(DomainDecomp * ddecomp);
+struct ForceTree;
+/* Exchange particles which have moved into the new domains, not re-doing the split unless we have to.
+ * If reusetree is not NULL it is moved to the top of the heap, out of the way of the exchange, and left there.
+ * It is freed if any particles were exchanged, as the exchange re-orders the particles it refers to.*/
+int domain_maintain(DomainDecomp * ddecomp, struct DriftData * drift, struct ForceTree * reusetree);
 
 /** This function determines the TopLeaves entry for the given key.*/
 static inline int
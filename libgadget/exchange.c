@@ -1,6 +1,7 @@
 #include <mpi.h>
 #include <omp.h>
 #include <string.h>
+#include <limits.h>
 #include "exchange.h"
 #include "forcetree.h"
 #include "slotsmanager.h"
@@ -10,6 +11,13 @@
 
 #include "utils.h"
 #include "utils/mpsort.h"
+#include "utils/xorpack.h"
+
+/* If true, the particles and slots are packed with xorpack for the exchange*/
+static int ExchangeCompress = 0;
+
+/* Number of records packed together: the chunks are packed and unpacked in parallel*/
+#define EXCHANGE_PACK_CHUNK 1024
 
 /*Number of structure types for particles*/
 typedef struct {
@@ -54,6 +62,23 @@ static void domain_build_plan(int iter, ExchangeLayoutFunc layoutfunc, const voi
 static size_t domain_find_iter_space(ExchangePlan * plan, const struct part_manager_type * pman, const struct slots_manager_type * sman);
 static void domain_build_exchange_list(ExchangeLayoutFunc layoutfunc, const void * layout_userdata, ExchangePlan * plan, struct part_manager_type * pman, struct slots_manager_type * sman, MPI_Comm Comm);
 
+void
+set_exchange_params(ParameterSet * ps)
+{
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    if(ThisTask == 0)
+        ExchangeCompress = param_get_int(ps, "ExchangeCompress");
+    MPI_Bcast(&ExchangeCompress, 1, MPI_INT, 0, MPI_COMM_WORLD);
+}
+
+/*This is a helper for the tests*/
+void
+exchange_set_compress(const int compress)
+{
+    ExchangeCompress = compress;
+}
+
 /* This function builds the count/displ arrays from
  * the rows stored in the entry struct of the plan.
  * MPI expects these numbers to be tightly packed in memory,
@@ -193,6 +218,149 @@ shall_we_compact_slots(int * compact, ExchangePlan * plan, const struct slots_ma
     MPI_Allreduce(lcompact, compact, 6, MPI_INT, MPI_LOR, Comm);
 }
 
+/* Number of chunks of the records sent to each task, and the index of the first chunk of each task in chunkstart*/
+static int64_t
+exchange_count_chunks(const int * counts, int64_t * chunkstart, const int NTask)
+{
+    int64_t nchunk = 0;
+    int task;
+    for(task = 0; task < NTask; task++) {
+        chunkstart[task] = nchunk;
+        nchunk += (counts[task] + EXCHANGE_PACK_CHUNK - 1) / EXCHANGE_PACK_CHUNK;
+    }
+    chunkstart[NTask] = nchunk;
+    return nchunk;
+}
+
+/* Sends the records of elsize bytes in sendbuf to recvbuf, as MPI_Alltoallv_sparse.
+ * The records for each task are packed with xorpack in chunks of EXCHANGE_PACK_CHUNK,
+ * each preceded by its packed size. The records are sent unpacked if any task
+ * does not have the memory for the packed buffers.
+ * The packed records of each task are padded to whole records, and sent in units of elsize bytes,
+ * so that the MPI counts and displacements overflow no sooner than for the unpacked records.
+ * The unpacked and packed number of bytes sent are added to bytes.*/
+static void
+exchange_packed_alltoallv(char * sendbuf, int * sendcounts, int * senddispls, MPI_Datatype type, const size_t elsize,
+        char * recvbuf, int * recvcounts, int * recvdispls, int64_t bytes[2], MPI_Comm Comm)
+{
+    int NTask, task;
+    MPI_Comm_size(Comm, &NTask);
+    int64_t * chunkstart = ta_malloc("chunkstart", int64_t, 2 * (NTask + 1));
+    int64_t * recvchunkstart = chunkstart + NTask + 1;
+    const int64_t nchunk = exchange_count_chunks(sendcounts, chunkstart, NTask);
+    const int64_t nrecvchunk = exchange_count_chunks(recvcounts, recvchunkstart, NTask);
+    uint32_t * chunksize = (uint32_t *) mymalloc("chunksize", (nchunk + nrecvchunk + 1) * sizeof(uint32_t));
+    uint32_t * recvchunksize = chunksize + nchunk;
+    int * packcounts = ta_malloc("packcounts", int, 4 * NTask);
+    int * packdispls = packcounts + NTask;
+    int * recvpackcounts = packdispls + NTask;
+    int * recvpackdispls = recvpackcounts + NTask;
+
+    /* Packed size of each chunk*/
+    for(task = 0; task < NTask; task++) {
+        int64_t c;
+        #pragma omp parallel for schedule(dynamic)
+        for(c = chunkstart[task]; c < chunkstart[task + 1]; c++) {
+            const int64_t first = (c - chunkstart[task]) * EXCHANGE_PACK_CHUNK;
+            const int64_t n = DMIN(EXCHANGE_PACK_CHUNK, sendcounts[task] - first);
+            chunksize[c] = xorpack_encode(sendbuf + (senddispls[task] + first) * elsize, n, elsize, NULL);
+        }
+        int64_t packed = 0;
+        for(c = chunkstart[task]; c < chunkstart[task + 1]; c++)
+            packed += sizeof(uint32_t) + chunksize[c];
+        const int64_t units = (packed + elsize - 1) / elsize;
+        if(units > INT_MAX)
+            endrun(1, "Packed exchange to task %d has %ld records of %lu bytes, more than an MPI count\n", task, units, elsize);
+        packcounts[task] = units;
+    }
+    MPI_Alltoall_sparse(packcounts, recvpackcounts, MPI_INT, Comm);
+    int64_t sendunits = 0, recvunits = 0;
+    for(task = 0; task < NTask; task++) {
+        if(sendunits > INT_MAX || recvunits > INT_MAX)
+            endrun(1, "Packed exchange displacement to task %d is %ld, from task %d is %ld records of %lu bytes, more than an MPI count\n",
+                    task, sendunits, task, recvunits, elsize);
+        packdispls[task] = sendunits;
+        recvpackdispls[task] = recvunits;
+        sendunits += packcounts[task];
+        recvunits += recvpackcounts[task];
+    }
+    const int64_t sendbytes = sendunits * elsize;
+    const int64_t recvbytes = recvunits * elsize;
+    /* The headers of two allocations*/
+    const int nomemory = sendbytes + recvbytes + 4096 * 4L > (int64_t) mymalloc_freebytes();
+    if(MPIU_Any(nomemory, Comm)) {
+        message(0, "Not enough memory to pack the exchange, sending unpacked.\n");
+        MPI_Alltoallv_sparse(sendbuf, sendcounts, senddispls, type,
+                recvbuf, recvcounts, recvdispls, type, Comm);
+        for(task = 0; task < NTask; task++) {
+            bytes[0] += (int64_t) sendcounts[task] * elsize;
+            bytes[1] += (int64_t) sendcounts[task] * elsize;
+        }
+        ta_free(packcounts);
+        myfree(chunksize);
+        ta_free(chunkstart);
+        return;
+    }
+
+    char * packbuf = (char *) mymalloc("PackBuf", sendbytes + 1);
+    char * recvpackbuf = (char *) mymalloc("RecvPackBuf", recvbytes + 1);
+    for(task = 0; task < NTask; task++) {
+        /* Chunk offsets within the packed records of this task*/
+        char * start = packbuf + (int64_t) packdispls[task] * elsize;
+        int64_t c, offset = 0;
+        for(c = chunkstart[task]; c < chunkstart[task + 1]; c++) {
+            memcpy(start + offset, &chunksize[c], sizeof(uint32_t));
+            const uint32_t size = chunksize[c];
+            /* Stash the offset of the chunk data until the chunks are packed*/
+            chunksize[c] = offset + sizeof(uint32_t);
+            offset += sizeof(uint32_t) + size;
+        }
+        /* Zero the padding to the last record*/
+        memset(start + offset, 0, (int64_t) packcounts[task] * elsize - offset);
+        #pragma omp parallel for schedule(dynamic)
+        for(c = chunkstart[task]; c < chunkstart[task + 1]; c++) {
+            const int64_t first = (c - chunkstart[task]) * EXCHANGE_PACK_CHUNK;
+            const int64_t n = DMIN(EXCHANGE_PACK_CHUNK, sendcounts[task] - first);
+            xorpack_encode(sendbuf + (senddispls[task] + first) * elsize, n, elsize, start + chunksize[c]);
+        }
+        bytes[0] += (int64_t) sendcounts[task] * elsize;
+        bytes[1] += (int64_t) packcounts[task] * elsize;
+    }
+
+    /* The packed records are sent as opaque units of elsize bytes*/
+    MPI_Datatype MPI_PACKUNIT;
+    MPI_Type_contiguous(elsize, MPI_BYTE, &MPI_PACKUNIT);
+    MPI_Type_commit(&MPI_PACKUNIT);
+    MPI_Alltoallv_sparse(packbuf, packcounts, packdispls, MPI_PACKUNIT,
+            recvpackbuf, recvpackcounts, recvpackdispls, MPI_PACKUNIT, Comm);
+    MPI_Type_free(&MPI_PACKUNIT);
+
+    for(task = 0; task < NTask; task++) {
+        /* Find the chunks from their sizes, then unpack them*/
+        const char * start = recvpackbuf + (int64_t) recvpackdispls[task] * elsize;
+        int64_t c, offset = 0;
+        for(c = recvchunkstart[task]; c < recvchunkstart[task + 1]; c++) {
+            uint32_t size;
+            memcpy(&size, start + offset, sizeof(uint32_t));
+            recvchunksize[c] = offset + sizeof(uint32_t);
+            offset += sizeof(uint32_t) + size;
+        }
+        if((offset + elsize - 1) / elsize != recvpackcounts[task])
+            endrun(1, "Packed exchange from task %d has %ld bytes, expected %d records of %lu bytes\n", task, offset, recvpackcounts[task], elsize);
+        #pragma omp parallel for schedule(dynamic)
+        for(c = recvchunkstart[task]; c < recvchunkstart[task + 1]; c++) {
+            const int64_t first = (c - recvchunkstart[task]) * EXCHANGE_PACK_CHUNK;
+            const int64_t n = DMIN(EXCHANGE_PACK_CHUNK, recvcounts[task] - first);
+            xorpack_decode(start + recvchunksize[c], n, elsize, recvbuf + (recvdispls[task] + first) * elsize);
+        }
+    }
+    myfree(recvpackbuf);
+    myfree(packbuf);
+    ta_free(packcounts);
+    myfree(chunksize);
+    ta_free(chunkstart);
+}
+
 static int domain_exchange_once(ExchangePlan * plan, int do_gc, struct part_manager_type * pman, struct slots_manager_type * sman, MPI_Comm Comm)
 {
     size_t n;
@@ -218,33 +386,63 @@ static int domain_exchange_once(ExchangePlan * plan, int do_gc, struct part_mana
 
     partBuf = (struct particle_data *) mymalloc2("partBuf", plan->toGoSum.base * sizeof(struct particle_data));
 
-    ExchangePlanEntry * toGoPtr = ta_malloc("toGoPtr", ExchangePlanEntry, plan->NTask);
-    memset(toGoPtr, 0, sizeof(toGoPtr[0]) * plan->NTask);
+    /* Each thread packs the particles of a static chunk of the list. The particles going to a target are
+     * ordered by thread, then by position in the list, in both the particle and the slot buffers,
+     * so the receiver finds the slots of each type in the order of the particles.*/
+    const int NumThreads = omp_get_max_threads();
+    ExchangePlanEntry * toGoPtr = (ExchangePlanEntry *) mymalloc("toGoPtr", (size_t) NumThreads * plan->NTask * sizeof(ExchangePlanEntry));
+    memset(toGoPtr, 0, (size_t) NumThreads * plan->NTask * sizeof(ExchangePlanEntry));
 
-    for(n = 0; n < plan->last; n++)
+    /* The same static schedule is used for counting and packing*/
+    #pragma omp parallel num_threads(NumThreads)
     {
-        const int i = plan->ExchangeList[n];
-        /* preparing for export */
-        const int target = plan->layouts[n].target;
-
-        int type = plan->layouts[n].ptype;
-
-        /* watch out thread unsafe */
-        int bufPI = toGoPtr[target].slots[type];
-        toGoPtr[target].slots[type] ++;
-        size_t elsize = sman->info[type].elsize;
-        if(sman->info[type].enabled)
-            memcpy(slotBuf[type] + (bufPI + plan->toGoOffset[target].slots[type]) * elsize,
-                (char*) sman->info[type].ptr + pman->Base[i].PI * elsize, elsize);
-        /* now copy the base P; after PI has been updated */
-        memcpy(&(partBuf[plan->toGoOffset[target].base + toGoPtr[target].base]), pman->Base+i, sizeof(struct particle_data));
-        toGoPtr[target].base ++;
-        /* mark the particle for removal. Both secondary and base slots will be marked. */
-        slots_mark_garbage(i, pman, sman);
+        const int tid = omp_get_thread_num();
+        ExchangePlanEntry * myPtr = toGoPtr + (size_t) tid * plan->NTask;
+        #pragma omp for schedule(static)
+        for(n = 0; n < plan->last; n++) {
+            myPtr[plan->layouts[n].target].base++;
+            myPtr[plan->layouts[n].target].slots[plan->layouts[n].ptype]++;
+        }
+        /* Replace the counts with the first buffer entry of each thread*/
+        #pragma omp for
+        for(n = 0; n < (size_t) plan->NTask; n++) {
+            ExchangePlanEntry start = plan->toGoOffset[n];
+            int t;
+            for(t = 0; t < NumThreads; t++) {
+                ExchangePlanEntry * ptr = &toGoPtr[(size_t) t * plan->NTask + n];
+                const int64_t count = ptr->base;
+                ptr->base = start.base;
+                start.base += count;
+                int type;
+                for(type = 0; type < 6; type++) {
+                    const int64_t scount = ptr->slots[type];
+                    ptr->slots[type] = start.slots[type];
+                    start.slots[type] += scount;
+                }
+            }
+        }
+        #pragma omp for schedule(static)
+        for(n = 0; n < plan->last; n++)
+        {
+            const int i = plan->ExchangeList[n];
+            /* preparing for export */
+            const int target = plan->layouts[n].target;
+            const int type = plan->layouts[n].ptype;
+            const size_t elsize = sman->info[type].elsize;
+            if(sman->info[type].enabled)
+                memcpy(slotBuf[type] + myPtr[target].slots[type] * elsize,
+                    (char*) sman->info[type].ptr + pman->Base[i].PI * elsize, elsize);
+            myPtr[target].slots[type]++;
+            /* now copy the base P; after PI has been updated */
+            memcpy(&partBuf[myPtr[target].base], pman->Base+i, sizeof(struct particle_data));
+            myPtr[target].base++;
+            /* mark the particle for removal. Both secondary and base slots will be marked. */
+            slots_mark_garbage(i, pman, sman);
+        }
     }
 
+    myfree(toGoPtr);
     myfree(plan->layouts);
-    ta_free(toGoPtr);
     walltime_measure("/Domain/exchange/makebuf");
 
     /* Do a gc if we were asked to, or if we need one
@@ -285,8 +483,14 @@ static int domain_exchange_once(ExchangePlan * plan, int do_gc, struct part_mana
 #ifdef DEBUG
     message(0, "Starting particle data exchange\n");
 #endif
+    /* Bytes sent, unpacked and packed*/
+    int64_t bytes[2] = {0};
     /* recv at the end */
-    MPI_Alltoallv_sparse(partBuf, sendcounts, senddispls, MPI_TYPE_PARTICLE,
+    if(ExchangeCompress)
+        exchange_packed_alltoallv((char *) partBuf, sendcounts, senddispls, MPI_TYPE_PARTICLE, sizeof(struct particle_data),
+                (char *) (pman->Base + pman->NumPart), recvcounts, recvdispls, bytes, Comm);
+    else
+        MPI_Alltoallv_sparse(partBuf, sendcounts, senddispls, MPI_TYPE_PARTICLE,
                  pman->Base + pman->NumPart, recvcounts, recvdispls, MPI_TYPE_PARTICLE,
                  Comm);
 
@@ -314,11 +518,19 @@ static int domain_exchange_once(ExchangePlan * plan, int do_gc, struct part_mana
 #endif
 
         /* recv at the end */
-        MPI_Alltoallv_sparse(slotBuf[ptype], sendcounts, senddispls, MPI_TYPE_SLOT[ptype],
+        if(ExchangeCompress)
+            exchange_packed_alltoallv(slotBuf[ptype], sendcounts, senddispls, MPI_TYPE_SLOT[ptype], elsize,
+                    ptr + N_slots * elsize, recvcounts, recvdispls, bytes, Comm);
+        else
+            MPI_Alltoallv_sparse(slotBuf[ptype], sendcounts, senddispls, MPI_TYPE_SLOT[ptype],
                      ptr + N_slots * elsize,
                      recvcounts, recvdispls, MPI_TYPE_SLOT[ptype],
                      Comm);
     }
+    if(ExchangeCompress) {
+        MPI_Allreduce(MPI_IN_PLACE, bytes, 2, MPI_INT64, MPI_SUM, Comm);
+        message(0, "Exchange packed %ld bytes into %ld bytes, ratio %g\n", bytes[0], bytes[1], (double) bytes[0] / DMAX(bytes[1], 1));
+    }
 
 #ifdef DEBUG
         message(0, "Done with AlltoAllv\n");
@@ -440,6 +652,12 @@ domain_find_iter_space(ExchangePlan * plan, const struct part_manager_type * pma
 
     nlimit -= 4096 * 2L + plan->NTask * 2 * sizeof(MPI_Request);
 
+    /* Per thread buffer entries of the parallel packing*/
+    const size_t threadptr = (size_t) omp_get_max_threads() * plan->NTask * sizeof(ExchangePlanEntry) + 4096 * 2L;
+    if(nlimit < threadptr + 4096 * 4L)
+        endrun(1, "Not enough memory free to pack the particles!\n");
+    nlimit -= threadptr;
+
     /* Save some memory for memory headers and wasted space at the end of each allocation.
      * Need max. 2*4096 for each heap-allocated array.*/
     nlimit -= 4096 * 4L;
@@ -513,7 +731,7 @@ domain_build_plan(int iter, ExchangeLayoutFunc layoutfunc, const void * layout_u
         plan->toGo[plan->layouts[n].target].slots[plan->layouts[n].ptype]++;
     }
 
-    MPI_Alltoall(plan->toGo, 1, MPI_TYPE_PLAN_ENTRY, plan->toGet, 1, MPI_TYPE_PLAN_ENTRY, Comm);
+    MPI_Alltoall_sparse(plan->toGo, plan->toGet, MPI_TYPE_PLAN_ENTRY, Comm);
 
     memset(&plan->toGoOffset[0], 0, sizeof(plan->toGoOffset[0]));
     memset(&plan->toGetOffset[0], 0, sizeof(plan->toGetOffset[0]));
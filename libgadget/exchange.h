@@ -16,6 +16,11 @@ typedef struct PreExchangeList{
     int64_t ngarbage;
 } PreExchangeList;
 
+/*Set the parameters of the exchange*/
+void set_exchange_params(ParameterSet * ps);
+/* Test helper: pack the exchanged particles and slots with xorpack*/
+void exchange_set_compress(const int compress);
+
 int domain_exchange(ExchangeLayoutFunc, const void * layout_userdata, PreExchangeList * preexch, struct part_manager_type * pman, struct slots_manager_type * sman, int maxiter, MPI_Comm Comm);
 void domain_test_id_uniqueness(struct part_manager_type * pman);
 
@@ -981,7 +981,7 @@ static void fof_reduce_groups(
     int Nmine = Send_count[ThisTask];
     Send_count[ThisTask] = 0;
 
-    MPI_Alltoall(Send_count, 1, MPI_INT, Recv_count, 1, MPI_INT, Comm);
+    MPI_Alltoall_sparse(Send_count, Recv_count, MPI_INT, Comm);
 
     int nimport = 0;
     for(i = 0; i < NTask; i ++) {
@@ -1367,7 +1367,7 @@ void fof_seed(FOFGroups * fof, ActiveParticles * act, double atime, const RandTa
         Send_count[ExportGroups[i].seed_task]++;
     }
 
-    MPI_Alltoall(Send_count, 1, MPI_INT, Recv_count, 1, MPI_INT, Comm);
+    MPI_Alltoall_sparse(Send_count, Recv_count, MPI_INT, Comm);
 
     int Nimport = 0;
 
@@ -15,6 +15,7 @@
 #include "utils/endrun.h"
 #include "utils/system.h"
 #include "utils/mymalloc.h"
+#include "utils/openmpsort.h"
 
 /*! \file forcetree.c
  *  \brief gravitational tree
@@ -37,6 +38,8 @@ static struct forcetree_params
        particles needs usually about ~0.65*N nodes.
        If the allocated memory is not sufficient, this parameter will be increased.*/
     double TreeAllocFactor;
+    /* If true, build the tree from particles sorted by key, rather than by inserting them one at a time.*/
+    int TreeBuildSortedKeys;
 } ForceTreeParams;
 
 void
@@ -46,6 +49,16 @@ init_forcetree_params(const double treeallocfactor)
     ForceTreeParams.TreeAllocFactor = treeallocfactor;
 }
 
+void
+set_forcetree_params(ParameterSet * ps)
+{
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    if(ThisTask == 0)
+        ForceTreeParams.TreeBuildSortedKeys = param_get_int(ps, "TreeBuildSortedKeys");
+    MPI_Bcast(&ForceTreeParams.TreeBuildSortedKeys, 1, MPI_INT, 0, MPI_COMM_WORLD);
+}
+
 static ForceTree
 force_tree_build(int mask, DomainDecomp * ddecomp, const ActiveParticles * act, const int DoMoments, const int alloc_father, const char * EmergencyOutputDir);
 
@@ -53,7 +66,7 @@ static void
 force_treeupdate_pseudos(const int no, const int level, const ForceTree * const tree);
 
 static void
-force_create_node_for_topnode(int no, int topnode, struct NODE * Nodes, const DomainDecomp * ddecomp, const int bits, const int x, const int y, const int z, int *nextfree, const int lastnode);
+force_create_node_for_topnode(int no, int topnode, struct NODE * Nodes, struct NodeCold * NodesCold, const DomainDecomp * ddecomp, const int bits, const int x, const int y, const int z, int *nextfree, const int lastnode);
 
 static void
 force_exchange_pseudodata(const ForceTree * const tree, const DomainDecomp * const ddecomp);
@@ -61,6 +74,15 @@ force_exchange_pseudodata(const ForceTree * const tree, const DomainDecomp * con
 static void
 add_particle_moment_to_node(struct NODE * pnode, const struct particle_data * const part);
 
+static void
+force_tree_set_node_pointers(ForceTree * tree);
+
+static void
+force_tree_resize_nodes(ForceTree * tree, const int allocnodes);
+
+static int
+force_get_sibling(const int sib, const int j, const int * suns);
+
 #ifdef DEBUG
 /* Walk the constructed tree, validating sibling and nextnode as we go*/
 static void force_validate_nextlist(const ForceTree * tree)
@@ -70,18 +92,18 @@ static void force_validate_nextlist(const ForceTree * tree)
     {
         struct NODE * current = &tree->Nodes[no];
         if(current->sibling != -1 && !node_is_node(current->sibling, tree))
-            endrun(5, "Node %d (type %d) has sibling %d next %d father %d first %d final %d last %d ntop %d\n", no, current->f.ChildType, current->sibling, current->s.suns[0], current->father, tree->firstnode, tree->firstnode + tree->numnodes, tree->lastnode, tree->NTopLeaves);
+            endrun(5, "Node %d (type %d) has sibling %d next %d father %d first %d final %d last %d ntop %d\n", no, current->f.ChildType, current->sibling, current->first, tree->NodesCold[no].father, tree->firstnode, tree->firstnode + tree->numnodes, tree->lastnode, tree->NTopLeaves);
 
         if(current->f.ChildType == PSEUDO_NODE_TYPE) {
             /* pseudo particle: nextnode should be a pseudo particle, sibling should be a node. */
-            if(!node_is_pseudo_particle(current->s.suns[0], tree))
-                endrun(5, "Pseudo Node %d has next node %d sibling %d father %d first %d final %d last %d ntop %d\n", no, current->s.suns[0], current->sibling, current->father, tree->firstnode, tree->firstnode + tree->numnodes, tree->lastnode, tree->NTopLeaves);
+            if(!node_is_pseudo_particle(current->first, tree))
+                endrun(5, "Pseudo Node %d has next node %d sibling %d father %d first %d final %d last %d ntop %d\n", no, current->first, current->sibling, tree->NodesCold[no].father, tree->firstnode, tree->firstnode + tree->numnodes, tree->lastnode, tree->NTopLeaves);
         }
         else if(current->f.ChildType == NODE_NODE_TYPE) {
             /* Next node should be another node */
-            if(!node_is_node(current->s.suns[0], tree))
-                endrun(5, "Node Node %d has next node which is particle %d sibling %d father %d first %d final %d last %d ntop %d\n", no, current->s.suns[0], current->sibling, current->father, tree->firstnode, tree->firstnode + tree->numnodes, tree->lastnode, tree->NTopLeaves);
-            no = current->s.suns[0];
+            if(!node_is_node(current->first, tree))
+                endrun(5, "Node Node %d has next node which is particle %d sibling %d father %d first %d final %d last %d ntop %d\n", no, current->first, current->sibling, tree->NodesCold[no].father, tree->firstnode, tree->firstnode + tree->numnodes, tree->lastnode, tree->NTopLeaves);
+            no = current->first;
             continue;
         }
         no = current->sibling;
@@ -89,13 +111,14 @@ static void force_validate_nextlist(const ForceTree * tree)
     /* Every node should have a valid father: collect those that do not.*/
     for(no = tree->firstnode; no < tree->firstnode + tree->numnodes; no++)
     {
-        if(!node_is_node(tree->Nodes[no].father, tree) && tree->Nodes[no].father >= 0) {
+        if(!node_is_node(tree->NodesCold[no].father, tree) && tree->NodesCold[no].father >= 0) {
             struct NODE *current = &tree->Nodes[no];
-            message(1, "Danger! no %d has father %d, next %d sib %d, (ptype = %d) len %g center (%g %g %g) mass %g cofm %g %g %g TL %d DLM %d ITL %d nocc %d suns %d %d %d %d\n", no, current->father, current->s.suns[0], current->sibling, current->f.ChildType,
+            const struct NodeChild * cs = &tree->NodesCold[no].s;
+            message(1, "Danger! no %d has father %d, next %d sib %d, (ptype = %d) len %g center (%g %g %g) mass %g cofm %g %g %g TL %d DLM %d ITL %d nocc %d suns %d %d %d %d\n", no, tree->NodesCold[no].father, current->first, current->sibling, current->f.ChildType,
                 current->len, current->center[0], current->center[1], current->center[2],
                 current->mom.mass, current->mom.cofm[0], current->mom.cofm[1], current->mom.cofm[2],
-                current->f.TopLevel, current->f.DependsOnLocalMass, current->f.InternalTopLevel, current->s.noccupied,
-                current->s.suns[0], current->s.suns[1], current->s.suns[2], current->s.suns[3]);
+                current->f.TopLevel, current->f.DependsOnLocalMass, current->f.InternalTopLevel, cs->noccupied,
+                cs->suns[0], cs->suns[1], cs->suns[2], cs->suns[3]);
         }
     }
     walltime_measure("/Tree/Build/Validate");
@@ -213,7 +236,8 @@ force_tree_build(int mask, DomainDecomp * ddecomp, const ActiveParticles *act, c
         tree = force_treeallocate(maxnodes, PartManager->MaxPart, ddecomp, alloc_father, 0);
         tree.mask = mask;
         tree.BoxSize = PartManager->BoxSize;
-        force_tree_create_nodes(&tree, act, mask, ddecomp);
+        if(!ForceTreeParams.TreeBuildSortedKeys || force_tree_create_nodes_sorted(&tree, act, mask, ddecomp))
+            force_tree_create_nodes(&tree, act, mask, ddecomp);
         if(tree.numnodes >= tree.lastnode - tree.firstnode)
         {
             message(1, "Not enough tree nodes (%ld) for %ld particles. Created %d\n", maxnodes, act->NumActiveParticle, tree.numnodes);
@@ -246,10 +270,7 @@ force_tree_build(int mask, DomainDecomp * ddecomp, const ActiveParticles *act, c
     }
 #endif
     report_memory_usage("FORCETREE");
-    tree.Nodes_base = (struct NODE *) myrealloc(tree.Nodes_base, (tree.numnodes +1) * sizeof(struct NODE));
-
-    /*Update the oct-tree struct so it knows about the memory change*/
-    tree.Nodes = tree.Nodes_base - tree.firstnode;
+    force_tree_resize_nodes(&tree, tree.numnodes + 1);
 
     tree.moments_computed_flag = 0;
 
@@ -259,6 +280,11 @@ force_tree_build(int mask, DomainDecomp * ddecomp, const ActiveParticles *act, c
         walltime_measure("/Tree/Build/Moments");
     }
 
+    /* Put the nodes in walk order. This also drops any empty nodes removed by the moment calculation.*/
+    force_tree_renumber_nodes(&tree, ddecomp);
+    force_tree_resize_nodes(&tree, tree.numnodes + 1);
+    walltime_measure("/Tree/Build/Renumber");
+
     int64_t allact = tree.NumParticles;
     int maxnumnodes = tree.numnodes;
 #ifdef DEBUG
@@ -298,6 +324,20 @@ static inline int inside_node(const struct NODE * node, const double Pos[3])
     return inside;
 }
 
+/* Fraction of the box within which a particle may be on the other side of a node face for get_subnode
+ * than for inside_node, because the node centres are rounded as the tree is refined.*/
+#define NODE_FACE_TOLERANCE (sizeof(MyFloat) > sizeof(float) ? 1e-12 : 1e-5)
+
+/* Check whether a particle is inside a node and not on or near one of its faces,
+ * so that get_subnode would also put it in this node, when descending from the root.*/
+static inline int inside_node_interior(const struct NODE * node, const double Pos[3], const double BoxSize)
+{
+    const double maxdist = node->len - 2 * NODE_FACE_TOLERANCE * BoxSize;
+    return (fabs(2*(Pos[0] - node->center[0])) < maxdist) &&
+        (fabs(2*(Pos[1] - node->center[1])) < maxdist) &&
+        (fabs(2*(Pos[2] - node->center[2])) < maxdist);
+}
+
 /*Initialise an internal node at nfreep. The parent is assumed to be locked, and
  * we have assured that nothing else will change nfreep while we are here.*/
 static void init_internal_node(struct NODE *nfreep, struct NODE *parent, int subnode)
@@ -306,7 +346,6 @@ static void init_internal_node(struct NODE *nfreep, struct NODE *parent, int sub
     const MyFloat lenhalf = 0.25 * parent->len;
     nfreep->len = 0.5 * parent->len;
     nfreep->sibling = -10;
-    nfreep->father = -10;
     nfreep->f.TopLevel = 0;
     nfreep->f.InternalTopLevel = 0;
     nfreep->f.DependsOnLocalMass = 0;
@@ -319,14 +358,281 @@ static void init_internal_node(struct NODE *nfreep, struct NODE *parent, int sub
         const int sign = (subnode & (1 << j)) ? 1 : -1;
         nfreep->center[j] = parent->center[j] + sign*lenhalf;
     }
-    for(j = 0; j < NMAXCHILD; j++)
-        nfreep->s.suns[j] = -1;
-    nfreep->s.noccupied = 0;
+    nfreep->first = -1;
     memset(&(nfreep->mom.cofm),0,3*sizeof(MyFloat));
     nfreep->mom.mass = 0;
     nfreep->mom.hmax = 0;
 }
 
+/* Initialise the build data for a new node with parent father. The node has no children.*/
+static void init_cold_node(struct NodeCold * cold, const int father)
+{
+    int j;
+    cold->father = father;
+    for(j = 0; j < NMAXCHILD; j++)
+        cold->s.suns[j] = -1;
+    cold->s.noccupied = 0;
+    memset(&(cold->quad),0,6*sizeof(MyFloat));
+}
+
+/* Should a particle be in a tree with this mask? This is the same test as in force_tree_create_nodes.*/
+static inline int
+force_tree_wants_particle(const int i, const int mask)
+{
+    return ((1<<P[i].Type) & mask) && !P[i].IsGarbage && !(P[i].Swallowed && P[i].Type==5);
+}
+
+/* Find the deepest node of the local tree which contains Pos, or -1 if Pos is not in a local top leaf.
+ * This is usually a leaf, but may be an internal node if the child containing Pos was removed as empty
+ * when the moments were computed.*/
+static int
+force_tree_find_leaf(const int topleaf, const double Pos[3], const ForceTree * tree, const DomainDecomp * ddecomp)
+{
+    if(topleaf < ddecomp->Tasks[tree->ThisTask].StartLeaf || topleaf >= ddecomp->Tasks[tree->ThisTask].EndLeaf)
+        return -1;
+    int no = ddecomp->TopLeaves[topleaf].treenode;
+    if(!inside_node(&tree->Nodes[no], Pos))
+        return -1;
+    while(tree->Nodes[no].f.ChildType == NODE_NODE_TYPE) {
+        int j, child = -1;
+        for(j = 0; j < NMAXCHILD; j++) {
+            const int sun = tree->NodesCold[no].s.suns[j];
+            if(sun >= 0 && inside_node(&tree->Nodes[sun], Pos)) {
+                child = sun;
+                break;
+            }
+        }
+        if(child < 0)
+            break;
+        no = child;
+    }
+    if(tree->Nodes[no].f.ChildType != PARTICLE_NODE_TYPE && tree->Nodes[no].f.ChildType != NODE_NODE_TYPE)
+        return -1;
+    return no;
+}
+
+/* Get nnew unused nodes at the end of the tree for the refit, growing the node allocation if needed.
+ * Returns the index of the first, or -1 if the tree has reached the pseudo particles.*/
+static int
+force_tree_refit_get_nodes(ForceTree * tree, const int nnew)
+{
+    if(tree->firstnode + tree->numnodes + nnew >= tree->lastnode)
+        return -1;
+    if(tree->numnodes + nnew > tree->allocnodes) {
+        int64_t allocnodes = tree->allocnodes + DMAX(tree->allocnodes / 16, 8 * nnew);
+        if(tree->firstnode + allocnodes > tree->lastnode)
+            allocnodes = tree->lastnode - tree->firstnode;
+        force_tree_resize_nodes(tree, allocnodes);
+    }
+    const int first = tree->firstnode + tree->numnodes;
+    tree->numnodes += nnew;
+    return first;
+}
+
+/* Add particle p to the node no found by force_tree_find_leaf. If the child containing it has been removed,
+ * a new leaf is created; if the leaf is full it is split, as in force_tree_create_nodes.
+ * Returns the leaf the particle was added to, or -1 if no more nodes could be allocated.*/
+static int
+force_tree_refit_insert(ForceTree * tree, int no, const int p)
+{
+    while(1) {
+        struct NODE * nop = &tree->Nodes[no];
+        struct NodeChild * ns = &tree->NodesCold[no].s;
+        if(nop->f.ChildType == NODE_NODE_TYPE) {
+            /* Empty children are compacted to the end of suns, so this node has a free slot.*/
+            int j;
+            for(j = 0; j < NMAXCHILD; j++)
+                if(ns->suns[j] < 0)
+                    break;
+            const int child = force_tree_refit_get_nodes(tree, 1);
+            if(j == NMAXCHILD || child < 0)
+                return -1;
+            nop = &tree->Nodes[no];
+            ns = &tree->NodesCold[no].s;
+            init_internal_node(&tree->Nodes[child], nop, get_subnode(nop, P[p].Pos));
+            init_cold_node(&tree->NodesCold[child], no);
+            ns->suns[j] = child;
+            if(j == 0)
+                nop->first = child;
+            no = child;
+            continue;
+        }
+        if(ns->noccupied < NMAXCHILD) {
+            ns->suns[ns->noccupied++] = p;
+            if(tree->Father)
+                tree->Father[p] = no;
+            return no;
+        }
+        /* Leaf is full: split it into eight new leaves and re-attach its particles.*/
+        const int first = force_tree_refit_get_nodes(tree, 8);
+        if(first < 0)
+            return -1;
+        nop = &tree->Nodes[no];
+        ns = &tree->NodesCold[no].s;
+        int oldsuns[NMAXCHILD], i;
+        memcpy(oldsuns, ns->suns, NMAXCHILD * sizeof(int));
+        for(i = 0; i < 8; i++) {
+            init_internal_node(&tree->Nodes[first + i], nop, i);
+            init_cold_node(&tree->NodesCold[first + i], no);
+        }
+        for(i = 0; i < NMAXCHILD; i++) {
+            const int child = first + get_subnode(nop, P[oldsuns[i]].Pos);
+            struct NodeChild * cs = &tree->NodesCold[child].s;
+            cs->suns[cs->noccupied++] = oldsuns[i];
+            if(tree->Father)
+                tree->Father[oldsuns[i]] = child;
+        }
+        nop->f.ChildType = NODE_NODE_TYPE;
+        ns->noccupied = NODEFULL;
+        for(i = 0; i < NMAXCHILD; i++)
+            ns->suns[i] = i < 8 ? first + i : -1;
+        nop->first = first;
+        no = first + get_subnode(nop, P[p].Pos);
+    }
+}
+
+/* Reset the siblings of the nodes below no, after nodes were added by the refit.*/
+static void
+force_tree_refit_siblings(const int no, const ForceTree * tree)
+{
+    if(tree->Nodes[no].f.ChildType != NODE_NODE_TYPE)
+        return;
+    int j;
+    const int * suns = tree->NodesCold[no].s.suns;
+    for(j = 0; j < 8; j++) {
+        if(suns[j] < 0)
+            continue;
+        tree->Nodes[suns[j]].sibling = force_get_sibling(tree->Nodes[no].sibling, j, suns);
+        force_tree_refit_siblings(suns[j], tree);
+    }
+}
+
+int
+force_tree_refit(ForceTree * tree, const DomainDecomp * ddecomp, const double MaxMovedFrac)
+{
+    int i;
+    /* The tree must have been built against the current particle table and domain.*/
+    int fail = !force_tree_allocated(tree) || tree->firstnode != PartManager->MaxPart ||
+        tree->TopLeaves != ddecomp->TopLeaves || tree->NTopLeaves != ddecomp->NTopLeaves;
+
+    /* Particles may have been created or changed type: these are not in the tree, so check the count.*/
+    int64_t numwanted = 0;
+    if(!fail) {
+        #pragma omp parallel for reduction(+: numwanted)
+        for(i = 0; i < PartManager->NumPart; i++)
+            if(force_tree_wants_particle(i, tree->mask))
+                numwanted++;
+    }
+
+    /* First check, without changing the tree, that the refit can succeed: every particle which has left its leaf
+     * must still be in a local top leaf, the tree must contain all the particles it should, and not too many may move.*/
+    int64_t nkept = 0, nmoved = 0;
+    if(!fail) {
+        #pragma omp parallel for reduction(+: nkept, nmoved) reduction(|: fail)
+        for(i = tree->firstnode; i < tree->firstnode + tree->numnodes; i++) {
+            const struct NODE * nop = &tree->Nodes[i];
+            const struct NodeChild * ns = &tree->NodesCold[i].s;
+            if(nop->f.ChildType != PARTICLE_NODE_TYPE)
+                continue;
+            int j;
+            for(j = 0; j < ns->noccupied; j++) {
+                const int p = ns->suns[j];
+                if(!force_tree_wants_particle(p, tree->mask))
+                    continue;
+                if(inside_node(nop, P[p].Pos))
+                    nkept++;
+                else {
+                    nmoved++;
+                    if(force_tree_find_leaf(P[p].TopLeaf, P[p].Pos, tree, ddecomp) < 0)
+                        fail = 1;
+                }
+            }
+        }
+    }
+    if(nkept + nmoved != numwanted)
+        fail = 1;
+
+    int64_t moved_tot[2] = {nmoved, tree->NumParticles};
+    MPI_Allreduce(MPI_IN_PLACE, moved_tot, 2, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    if(moved_tot[0] > MaxMovedFrac * moved_tot[1])
+        fail = 1;
+    if(MPIU_Any(fail, MPI_COMM_WORLD)) {
+        message(0, "Tree refit not possible (%ld of %ld particles changed leaf): rebuilding.\n", moved_tot[0], moved_tot[1]);
+        return 1;
+    }
+
+    /* Remove particles which are now garbage, or have left their leaf. The second kind are flagged for re-insertion.*/
+    char * moved = (char *) mymalloc2("RefitMoved", PartManager->NumPart * sizeof(char));
+    memset(moved, 0, PartManager->NumPart * sizeof(char));
+    #pragma omp parallel for
+    for(i = tree->firstnode; i < tree->firstnode + tree->numnodes; i++) {
+        struct NODE * nop = &tree->Nodes[i];
+        struct NodeChild * ns = &tree->NodesCold[i].s;
+        if(nop->f.ChildType != PARTICLE_NODE_TYPE)
+            continue;
+        int j, nocc = 0;
+        for(j = 0; j < ns->noccupied; j++) {
+            const int p = ns->suns[j];
+            if(!force_tree_wants_particle(p, tree->mask))
+                continue;
+            if(!inside_node(nop, P[p].Pos)) {
+                moved[p] = 1;
+                continue;
+            }
+            ns->suns[nocc++] = p;
+        }
+        ns->noccupied = nocc;
+    }
+
+    /* Re-insert the particles which changed leaf, creating new nodes where needed.
+     * This is serial, but only a small fraction of the particles should need it.
+     * The only failure left is running out of nodes, after which the tree is no longer valid.*/
+    const int oldnumnodes = tree->numnodes;
+    for(i = 0; i < PartManager->NumPart; i++) {
+        if(!moved[i])
+            continue;
+        const int no = force_tree_find_leaf(P[i].TopLeaf, P[i].Pos, tree, ddecomp);
+        if(force_tree_refit_insert(tree, no, i) < 0) {
+            fail = 1;
+            break;
+        }
+    }
+    myfree(moved);
+
+    /* New nodes were added at the end: link them into the walk and put the tree back in walk order.*/
+    if(!fail && tree->numnodes > oldnumnodes) {
+        #pragma omp parallel for
+        for(i = ddecomp->Tasks[tree->ThisTask].StartLeaf; i < ddecomp->Tasks[tree->ThisTask].EndLeaf; i++)
+            force_tree_refit_siblings(ddecomp->TopLeaves[i].treenode, tree);
+        force_tree_renumber_nodes(tree, ddecomp);
+    }
+
+    if(MPIU_Any(fail, MPI_COMM_WORLD)) {
+        message(0, "Tree refit ran out of nodes (%ld of %ld particles changed leaf): rebuilding.\n", moved_tot[0], moved_tot[1]);
+        return 1;
+    }
+    tree->NumParticles = nkept + nmoved;
+    /* Return the moments to the state left by force_tree_create_nodes, so that they can be recomputed for the new positions.*/
+    #pragma omp parallel for
+    for(i = tree->firstnode; i < tree->firstnode + tree->numnodes; i++) {
+        struct NODE * nop = &tree->Nodes[i];
+        if(nop->f.ChildType == PSEUDO_NODE_TYPE)
+            continue;
+        memset(&nop->mom, 0, sizeof(nop->mom));
+        if(nop->f.ChildType == PARTICLE_NODE_TYPE) {
+            int j;
+            const struct NodeChild * ns = &tree->NodesCold[i].s;
+            for(j = 0; j < ns->noccupied; j++)
+                add_particle_moment_to_node(nop, &P[ns->suns[j]]);
+        }
+    }
+    tree->moments_computed_flag = 0;
+    tree->hmax_computed_flag = 0;
+    message(0, "Refit tree (type mask: %d): %ld of %ld particles changed leaf.\n", tree->mask, moved_tot[0], moved_tot[1]);
+    walltime_measure("/Tree/Refit");
+    return 0;
+}
+
 /* Size of the free Node thread cache.
  * 12 8-node rows (works out at 8kB) was found
  * to be optimal for an Intel skylake and
@@ -360,7 +666,7 @@ modify_internal_node(int parent, int subnode, int p_toplace, const ForceTree tb)
 {
     if(tb.Father)
         tb.Father[p_toplace] = parent;
-    tb.Nodes[parent].s.suns[subnode] = p_toplace;
+    tb.NodesCold[parent].s.suns[subnode] = p_toplace;
     add_particle_moment_to_node(&tb.Nodes[parent], &P[p_toplace]);
     return 0;
 }
@@ -378,12 +684,13 @@ create_new_node_layer(int firstparent, int p_toplace, const ForceTree tb, int *n
     do {
         int i;
         struct NODE *nprnt = &tb.Nodes[parent];
+        struct NodeChild *sprnt = &tb.NodesCold[parent].s;
 
         /* Braces to scope oldsuns and newsuns*/
         {
         int newsuns[NMAXCHILD];
 
-        int * oldsuns = nprnt->s.suns;
+        int * oldsuns = sprnt->suns;
 
         /*We have two particles here, so create a new child node to store them both.*/
         /* if we are here the node must be large enough, thus contain exactly one child. */
@@ -406,9 +713,9 @@ create_new_node_layer(int firstparent, int p_toplace, const ForceTree tb, int *n
             if(firstparent != parent)
             {
                 nprnt->f.ChildType = PARTICLE_NODE_TYPE;
-                nprnt->s.noccupied = NMAXCHILD;
+                sprnt->noccupied = NMAXCHILD;
                 tb.Nodes[firstparent].f.ChildType = NODE_NODE_TYPE;
-                tb.Nodes[firstparent].s.noccupied = NODEFULL;
+                tb.NodesCold[firstparent].s.noccupied = NODEFULL;
             }
             return 1;
         }
@@ -418,7 +725,7 @@ create_new_node_layer(int firstparent, int p_toplace, const ForceTree tb, int *n
             /* We create a new leaf node.*/
             init_internal_node(nfreep, nprnt, i);
             /*Set father of new node*/
-            nfreep->father = parent;
+            init_cold_node(&tb.NodesCold[newsuns[i]], parent);
         }
         /*Initialize the remaining entries to empty*/
         for(i=8; i<NMAXCHILD;i++)
@@ -430,32 +737,33 @@ create_new_node_layer(int firstparent, int p_toplace, const ForceTree tb, int *n
             * we will always have a free slot. */
             int subnode = get_subnode(nprnt, P[oldsuns[i]].Pos);
             int child = newsuns[subnode];
-            struct NODE * nchild = &tb.Nodes[child];
-            modify_internal_node(child, nchild->s.noccupied, oldsuns[i], tb);
-            nchild->s.noccupied++;
+            struct NodeChild * schild = &tb.NodesCold[child].s;
+            modify_internal_node(child, schild->noccupied, oldsuns[i], tb);
+            schild->noccupied++;
         }
         /* Copy the new node array into the node*/
-        memcpy(nprnt->s.suns, newsuns, NMAXCHILD * sizeof(int));
+        memcpy(sprnt->suns, newsuns, NMAXCHILD * sizeof(int));
+        nprnt->first = newsuns[0];
         } /* After this brace oldsuns and newsuns are invalid*/
 
         /* Set sibling for the new rank. Since empty at this point, point onwards.*/
         for(i=0; i<7; i++) {
-            int child = nprnt->s.suns[i];
+            int child = sprnt->suns[i];
             struct NODE * nchild = &tb.Nodes[child];
-            nchild->sibling = nprnt->s.suns[i+1];
+            nchild->sibling = sprnt->suns[i+1];
         }
         /* Final child needs special handling: set to the parent's sibling.*/
-        tb.Nodes[nprnt->s.suns[7]].sibling = nprnt->sibling;
+        tb.Nodes[sprnt->suns[7]].sibling = nprnt->sibling;
         /* Zero the momenta for the parent*/
         memset(&nprnt->mom, 0, sizeof(nprnt->mom));
 
         /* Now try again to add the new particle*/
         int subnode = get_subnode(nprnt, P[p_toplace].Pos);
-        int child = nprnt->s.suns[subnode];
-        struct NODE * nchild = &tb.Nodes[child];
-        if(nchild->s.noccupied < NMAXCHILD) {
-            modify_internal_node(child, nchild->s.noccupied, p_toplace, tb);
-            nchild->s.noccupied++;
+        int child = sprnt->suns[subnode];
+        struct NodeChild * schild = &tb.NodesCold[child].s;
+        if(schild->noccupied < NMAXCHILD) {
+            modify_internal_node(child, schild->noccupied, p_toplace, tb);
+            schild->noccupied++;
             break;
         }
         /* The attached particles are already within one subnode of the new node.
@@ -465,7 +773,7 @@ create_new_node_layer(int firstparent, int p_toplace, const ForceTree tb, int *n
              * so mark it a Node-containing node. It cannot be accessed until
              * we mark the top-level parent, so no need for atomics.*/
             tb.Nodes[child].f.ChildType = NODE_NODE_TYPE;
-            tb.Nodes[child].s.noccupied = NODEFULL;
+            tb.NodesCold[child].s.noccupied = NODEFULL;
             parent = child;
         }
     } while(1);
@@ -473,7 +781,7 @@ create_new_node_layer(int firstparent, int p_toplace, const ForceTree tb, int *n
     /* A new node is created. Mark the (original) parent as an internal node with node children.
      * This goes last so that we don't access the child before it is constructed.*/
     tb.Nodes[firstparent].f.ChildType = NODE_NODE_TYPE;
-    tb.Nodes[firstparent].s.noccupied = NODEFULL;
+    tb.NodesCold[firstparent].s.noccupied = NODEFULL;
     return 0;
 }
 
@@ -487,7 +795,7 @@ int add_particle_to_tree(int i, int cur_start, const ForceTree tb, struct NodeCa
     do
     {
         /*No lock needed: if we have an internal node here it will be stable*/
-        nocc = tb.Nodes[cur].s.noccupied;
+        nocc = tb.NodesCold[cur].s.noccupied;
 
         /* This node still has space for a particle (or needs conversion)*/
         if(nocc < NODEFULL)
@@ -496,7 +804,7 @@ int add_particle_to_tree(int i, int cur_start, const ForceTree tb, struct NodeCa
         /* This node has child subnodes: find them.*/
         int subnode = get_subnode(&tb.Nodes[cur], P[i].Pos);
         /*No lock needed: if we have an internal node here it will be stable*/
-        child = tb.Nodes[cur].s.suns[subnode];
+        child = tb.NodesCold[cur].s.suns[subnode];
 
         if(child > tb.lastnode || child < tb.firstnode)
             endrun(1,"Corruption in tree build: N[%d].[%d] = %d > lastnode (%d)\n",cur, subnode, child, tb.lastnode);
@@ -505,8 +813,8 @@ int add_particle_to_tree(int i, int cur_start, const ForceTree tb, struct NodeCa
     while(child >= tb.firstnode);
 
     /* We have a guaranteed spot.*/
-    nocc = tb.Nodes[cur].s.noccupied;
-    tb.Nodes[cur].s.noccupied++;
+    nocc = tb.NodesCold[cur].s.noccupied;
+    tb.NodesCold[cur].s.noccupied++;
 
     /* Now we have something that isn't an internal node. We can place the particle! */
     if(nocc < NMAXCHILD)
@@ -538,6 +846,8 @@ merge_partial_force_trees(int left, int right, struct NodeCache * nc, int * nnex
             endrun(10, "Encountered invalid node: %d %d < first %d\n", this_left, this_right, tb.firstnode);
         struct NODE * nleft = &tb.Nodes[this_left];
         struct NODE * nright = &tb.Nodes[this_right];
+        struct NodeChild * sleft = &tb.NodesCold[this_left].s;
+        struct NodeChild * sright = &tb.NodesCold[this_right].s;
         if(nc->nnext_thread >= tb.lastnode)
             return 1;
 #ifdef DEBUG
@@ -553,20 +863,20 @@ merge_partial_force_trees(int left, int right, struct NodeCache * nc, int * nnex
 #endif
         /* Two node nodes: keep walking down*/
         if(nleft->f.ChildType == NODE_NODE_TYPE && nright->f.ChildType == NODE_NODE_TYPE) {
-            if(tb.Nodes[nleft->s.suns[0]].father < 0 || tb.Nodes[nright->s.suns[0]].father < 0)
+            if(tb.NodesCold[sleft->suns[0]].father < 0 || tb.NodesCold[sright->suns[0]].father < 0)
                 endrun(7, "Walking to nodes (%d %d) from (%d %d) fathers (%d %d)\n",
-                       nleft->s.suns[0], nright->s.suns[0], this_left, this_right, tb.Nodes[nleft->s.suns[0]].father, tb.Nodes[nright->s.suns[0]].father);
-            this_left = nleft->s.suns[0];
-            this_right = nright->s.suns[0];
+                       sleft->suns[0], sright->suns[0], this_left, this_right, tb.NodesCold[sleft->suns[0]].father, tb.NodesCold[sright->suns[0]].father);
+            this_left = sleft->suns[0];
+            this_right = sright->suns[0];
             continue;
         }
         /* If the right node has particles, add them to the left node, go to sibling on right and left.*/
         else if(nright->f.ChildType == PARTICLE_NODE_TYPE) {
             int i;
-            for(i = 0; i < nright->s.noccupied; i++) {
-                if(nright->s.suns[i] >= tb.firstnode)
-                    endrun(8, "Bad child %d of %d in %d\n", i, nright->s.suns[i], this_right);
-                if(add_particle_to_tree(nright->s.suns[i], this_left, tb, nc, nnext) < 0)
+            for(i = 0; i < sright->noccupied; i++) {
+                if(sright->suns[i] >= tb.firstnode)
+                    endrun(8, "Bad child %d of %d in %d\n", i, sright->suns[i], this_right);
+                if(add_particle_to_tree(sright->suns[i], this_left, tb, nc, nnext) < 0)
                     return 1;
             }
             /* Make sure that nodes which have
@@ -577,24 +887,24 @@ merge_partial_force_trees(int left, int right, struct NodeCache * nc, int * nnex
             /* This condition is checking for the root node, which has no siblings*/
             if(this_right > right) {
                 /* Find the father, then the next child*/
-                struct NODE * fat = &tb.Nodes[nright->father];
+                struct NodeChild * fat = &tb.NodesCold[tb.NodesCold[this_right].father].s;
                 /* Find the position of this child in the father*/
                 int sunloc = 0;
                 for(i = 0; i < 8; i++)
                 {
-                    if(fat->s.suns[i] == this_right) {
+                    if(fat->suns[i] == this_right) {
                         sunloc = i;
                         break;
                     }
                 }
                 /* Change the sibling of the child next to this one*/
                 if(sunloc > 0) {
-                    if(tb.Nodes[fat->s.suns[i-1]].sibling == this_right)
-                        tb.Nodes[fat->s.suns[i-1]].sibling = this_left;
+                    if(tb.Nodes[fat->suns[i-1]].sibling == this_right)
+                        tb.Nodes[fat->suns[i-1]].sibling = this_left;
                 }
             }
             /* Mark the right node as now invalid*/
-            nright->father = -5;
+            tb.NodesCold[this_right].father = -5;
             /* Now go to sibling*/
             this_left = nleft->sibling;
             this_right = nright->sibling;
@@ -605,32 +915,33 @@ merge_partial_force_trees(int left, int right, struct NodeCache * nc, int * nnex
         else if(nleft->f.ChildType == PARTICLE_NODE_TYPE && nright->f.ChildType == NODE_NODE_TYPE) {
             /* Add the left particles to the right*/
             int i;
-            for(i = 0; i < nleft->s.noccupied; i++) {
-                if(nleft->s.suns[i] >= tb.firstnode)
-                    endrun(8, "Bad child %d of %d in left %d\n", i, nleft->s.suns[i], this_left);
-                if(add_particle_to_tree(nleft->s.suns[i], this_right, tb, nc, nnext) < 0)
+            for(i = 0; i < sleft->noccupied; i++) {
+                if(sleft->suns[i] >= tb.firstnode)
+                    endrun(8, "Bad child %d of %d in left %d\n", i, sleft->suns[i], this_left);
+                if(add_particle_to_tree(sleft->suns[i], this_right, tb, nc, nnext) < 0)
                     return 1;
             }
             /* Copy the right node over the left*/
-            memmove(&nleft->s, &nright->s, sizeof(nleft->s));
+            memmove(sleft, sright, sizeof(struct NodeChild));
+            nleft->first = sleft->suns[0];
             nleft->f.ChildType = NODE_NODE_TYPE;
             /* Zero the momenta for the parent*/
             memset(&nleft->mom, 0, sizeof(nleft->mom));
             /* Reset children to the new parent:
              * this assumes nright is a NODE NODE*/
             for(i = 0; i < 8; i++) {
-                int child = nleft->s.suns[i];
-                tb.Nodes[child].father = this_left;
+                int child = sleft->suns[i];
+                tb.NodesCold[child].father = this_left;
             }
             /* Make sure final child points to the parent's sibling.*/
 #ifdef DEBUG
-            int oldsib = tb.Nodes[nleft->s.suns[7]].sibling;
+            int oldsib = tb.Nodes[sleft->suns[7]].sibling;
 #endif
             /* Walk downwards making sure all the children point to the new sibling.
              * Note also changes last particle node child. */
             int nn = this_left;
             while(tb.Nodes[nn].f.ChildType == NODE_NODE_TYPE) {
-                nn = tb.Nodes[nn].s.suns[7];
+                nn = tb.NodesCold[nn].s.suns[7];
 #ifdef DEBUG
                 if(tb.Nodes[nn].sibling != oldsib)
                     endrun(20, "Not the expected sibling %d != %d\n",tb.Nodes[nn].sibling, oldsib);
@@ -638,7 +949,7 @@ merge_partial_force_trees(int left, int right, struct NodeCache * nc, int * nnex
                 tb.Nodes[nn].sibling = nleft->sibling;
             }
             /* Mark the right node as now invalid*/
-            nright->father = -5;
+            tb.NodesCold[this_right].father = -5;
             /* Next iteration is going to sibling*/
             this_left = nleft->sibling;
             this_right = nright->sibling;
@@ -663,10 +974,8 @@ force_tree_create_topnodes(ForceTree * tree, DomainDecomp * ddecomp)
     nfreep->len = PartManager->BoxSize*1.001;
     for(i = 0; i < 3; i++)
         nfreep->center[i] = PartManager->BoxSize/2.;
-    for(i = 0; i < NMAXCHILD; i++)
-        nfreep->s.suns[i] = -1;
-    nfreep->s.noccupied = 0;
-    nfreep->father = -1;
+    init_cold_node(&tree->NodesCold[nnext], -1);
+    nfreep->first = -1;
     nfreep->sibling = -1;
     nfreep->f.TopLevel = 1;
     nfreep->f.InternalTopLevel = 0;
@@ -681,7 +990,7 @@ force_tree_create_topnodes(ForceTree * tree, DomainDecomp * ddecomp)
         * grid. We need to generate these nodes first to make sure that we have a
         * complete top-level tree which allows the easy insertion of the
         * pseudo-particles in the right place */
-    force_create_node_for_topnode(tree->firstnode, 0, tree->Nodes, ddecomp, 1, 0, 0, 0, &nnext, tree->lastnode);
+    force_create_node_for_topnode(tree->firstnode, 0, tree->Nodes, tree->NodesCold, ddecomp, 1, 0, 0, 0, &nnext, tree->lastnode);
     return nnext;
 }
 
@@ -712,7 +1021,7 @@ force_tree_find_topnode(const double * const pos, const ForceTree * const tree)
     {
         /* This node has child subnodes: find them.*/
         int subnode = get_subnode(&tree->Nodes[no], pos);
-        no = tree->Nodes[no].s.suns[subnode];
+        no = tree->NodesCold[no].s.suns[subnode];
     }
 #ifdef DEBUG
     if(!tree->Nodes[no].f.TopLevel || tree->Nodes[no].f.InternalTopLevel || no < tree->firstnode)
@@ -744,6 +1053,7 @@ force_tree_create_nodes(ForceTree * tree, const ActiveParticles * act, int mask,
             /* Make a local copy*/
             topnodes[j + t * (EndLeaf - StartLeaf)] = nnext;
             memmove(&tree->Nodes[nnext], &tree->Nodes[topnodes[j]], sizeof(struct NODE));
+            memmove(&tree->NodesCold[nnext], &tree->NodesCold[topnodes[j]], sizeof(struct NodeCold));
             nnext++;
         }
     }
@@ -807,9 +1117,10 @@ force_tree_create_nodes(ForceTree * tree, const ActiveParticles * act, int mask,
 
             if(P[i].Mass <= 0)
                 endrun(12, "Zero mass particle %d m %g type %d id %ld pos %g %g %g\n", i, P[i].Mass, P[i].Type, P[i].ID, P[i].Pos[0], P[i].Pos[1], P[i].Pos[2]);
-            /*First find the Node for the TopLeaf */
+            /*First find the Node for the TopLeaf. Start from the node of the last particle if this one is inside it:
+             * a particle on a face of the node is placed from the top leaf, so it goes where get_subnode puts it.*/
             int cur;
-            if(inside_node(&tree->Nodes[this_acc], P[i].Pos)) {
+            if(inside_node_interior(&tree->Nodes[this_acc], P[i].Pos, PartManager->BoxSize)) {
                 cur = this_acc;
             } else {
                 /* Get the topnode to which a particle belongs. Each local tree
@@ -853,6 +1164,193 @@ force_tree_create_nodes(ForceTree * tree, const ActiveParticles * act, int mask,
     return;
 }
 
+/* Key and particle index used by the sorted tree build.*/
+struct TreeBuildKey
+{
+    peano_t key;
+    int index;
+};
+
+/* Particle ranges larger than this are built in a new task by the sorted tree build.*/
+#define SORTED_BUILD_TASK_SIZE 4096
+
+/* Build the subtree of node no from the particles keys[start..end), which are sorted by key and all inside the node.
+ * A node with more than NMAXCHILD particles gets eight children, exactly as create_new_node_layer would make.
+ * The child of each particle is found with get_subnode against the node centre, as add_particle_to_tree does.
+ * The key order already puts the particles of each child in one contiguous range, except for particles on
+ * the boundary between two children, whose key may be in the neighbouring cell. If there are any, the range is
+ * partitioned by child, stably, through the same range of scratch. The node is at most 2^shift cells wide on the key grid.
+ * Sets *failed if it runs out of nodes, or if more than NMAXCHILD particles share a cell of the key grid.*/
+static void
+force_tree_sorted_node(const int no, const int start, const int end, const int shift, const ForceTree * tree, struct TreeBuildKey * keys, struct TreeBuildKey * scratch, int * nnext, int * failed)
+{
+    struct NODE * nop = &tree->Nodes[no];
+    struct NodeChild * ns = &tree->NodesCold[no].s;
+    int i;
+    if(end - start <= NMAXCHILD) {
+        for(i = start; i < end; i++)
+            modify_internal_node(no, i - start, keys[i].index, *tree);
+        ns->noccupied = end - start;
+        return;
+    }
+    if(shift == 0) {
+        const int p = keys[start].index;
+        message(1, "Failed placing %d particles in one cell at %g %g %g, type %d, ID %ld.\n",
+                end - start, P[p].Pos[0], P[p].Pos[1], P[p].Pos[2], P[p].Type, P[p].ID);
+        #pragma omp atomic write
+        *failed = 1;
+        return;
+    }
+    const int first = atomic_fetch_and_add(nnext, 8);
+    if(first + 8 > tree->lastnode) {
+        #pragma omp atomic write
+        *failed = 1;
+        return;
+    }
+    for(i = 0; i < 8; i++) {
+        init_internal_node(&tree->Nodes[first + i], nop, i);
+        init_cold_node(&tree->NodesCold[first + i], no);
+        tree->Nodes[first + i].sibling = (i < 7) ? first + i + 1 : nop->sibling;
+    }
+    for(i = 0; i < NMAXCHILD; i++)
+        ns->suns[i] = (i < 8) ? first + i : -1;
+    nop->first = first;
+    nop->f.ChildType = NODE_NODE_TYPE;
+    ns->noccupied = NODEFULL;
+    memset(&nop->mom, 0, sizeof(nop->mom));
+
+    /* Count the particles of each child and check that each child is one contiguous range*/
+    int count[8] = {0}, cstart[8] = {0};
+    int grouped = 1, last = -1, seen = 0;
+    for(i = start; i < end; i++) {
+        const int subnode = get_subnode(nop, P[keys[i].index].Pos);
+        count[subnode]++;
+        if(subnode == last)
+            continue;
+        if(seen & (1 << subnode))
+            grouped = 0;
+        seen |= (1 << subnode);
+        cstart[subnode] = i;
+        last = subnode;
+    }
+    if(!grouped) {
+        /* Partition the range by child, keeping the key order within each child*/
+        int offset[8];
+        offset[0] = cstart[0] = start;
+        for(i = 1; i < 8; i++)
+            offset[i] = cstart[i] = cstart[i-1] + count[i-1];
+        for(i = start; i < end; i++)
+            scratch[offset[get_subnode(nop, P[keys[i].index].Pos)]++] = keys[i];
+        memcpy(keys + start, scratch + start, (end - start) * sizeof(keys[0]));
+    }
+
+    for(i = 0; i < 8; i++) {
+        if(count[i] == 0)
+            continue;
+        const int child = first + i;
+        const int cbegin = cstart[i];
+        const int cend = cstart[i] + count[i];
+        if(count[i] > SORTED_BUILD_TASK_SIZE) {
+            #pragma omp task default(none) firstprivate(child, cbegin, cend, shift, tree, keys, scratch, nnext, failed)
+            force_tree_sorted_node(child, cbegin, cend, shift - 1, tree, keys, scratch, nnext, failed);
+        }
+        else
+            force_tree_sorted_node(child, cbegin, cend, shift - 1, tree, keys, scratch, nnext, failed);
+    }
+}
+
+/*! Creates the nodes of the tree from particles sorted by their Peano-Hilbert key, rather than by insertion.
+ * The particles of each node are a contiguous range of the sorted keys, so each local top leaf is
+ * split recursively into ranges, in parallel. This makes the same nodes as force_tree_create_nodes,
+ * although they are numbered in a different order and there are no thread-local copies of the top leaves.
+ * Returns 1 if the tree could not be built this way, because more than NMAXCHILD particles share a cell
+ * of the key grid, or if the particles are not sorted into their top leaves. The caller should then use force_tree_create_nodes.
+ * If the tree runs out of nodes, numnodes is at least lastnode - firstnode, as for force_tree_create_nodes.*/
+int
+force_tree_create_nodes_sorted(ForceTree * tree, const ActiveParticles * act, int mask, DomainDecomp * ddecomp)
+{
+    int nnext = force_tree_create_topnodes(tree, ddecomp);
+    const int StartLeaf = ddecomp->Tasks[tree->ThisTask].StartLeaf;
+    const int EndLeaf = ddecomp->Tasks[tree->ThisTask].EndLeaf;
+    const double BoxSize = PartManager->BoxSize;
+    int64_t i;
+
+    /* Compute the keys. Particles not in the tree get the maximal key, and are sorted to the end.*/
+    struct TreeBuildKey * keys = (struct TreeBuildKey *) mymalloc2("TreeBuildKeys", (act->NumActiveParticle + 1) * sizeof(struct TreeBuildKey));
+    int numparticles = 0;
+    #pragma omp parallel for reduction(+: numparticles)
+    for(i = 0; i < act->NumActiveParticle; i++)
+    {
+        const int p = act->ActiveParticle ? act->ActiveParticle[i] : i;
+        keys[i].index = p;
+        keys[i].key = PEANOT_MAX;
+        if(!((1<<P[p].Type) & mask))
+            continue;
+        if(P[p].IsGarbage || (P[p].Swallowed && P[p].Type==5))
+            continue;
+        if(P[p].Mass <= 0)
+            endrun(12, "Zero mass particle %d m %g type %d id %ld pos %g %g %g\n", p, P[p].Mass, P[p].Type, P[p].ID, P[p].Pos[0], P[p].Pos[1], P[p].Pos[2]);
+        if(P[p].TopLeaf < StartLeaf || P[p].TopLeaf >= EndLeaf)
+            endrun(5, "Bad topleaf %d start %d end %d type %d ID %ld\n", P[p].TopLeaf, StartLeaf, EndLeaf, P[p].Type, P[p].ID);
+        keys[i].key = PEANO(P[p].Pos, BoxSize);
+        numparticles++;
+    }
+    radix_sort_openmp(keys, act->NumActiveParticle, sizeof(struct TreeBuildKey));
+    walltime_measure("/Tree/Build/Sort");
+
+    /* Top leaves are numbered in key order, so each has a contiguous range of the sorted particles.*/
+    int * leafstart = ta_malloc("leafstart", int, 2 * (EndLeaf - StartLeaf));
+    int * leafend = leafstart + (EndLeaf - StartLeaf);
+    memset(leafstart, 0, 2 * (EndLeaf - StartLeaf) * sizeof(int));
+    int failed = 0;
+    #pragma omp parallel for reduction(+: failed)
+    for(i = 0; i < numparticles; i++) {
+        const int leaf = P[keys[i].index].TopLeaf;
+        if(i == 0 || leaf != P[keys[i-1].index].TopLeaf) {
+            leafstart[leaf - StartLeaf] = i;
+            if(i > 0 && leaf < P[keys[i-1].index].TopLeaf)
+                failed++;
+        }
+        if(i == numparticles - 1 || leaf != P[keys[i+1].index].TopLeaf)
+            leafend[leaf - StartLeaf] = i + 1;
+    }
+
+    /* Scratch space for the particles on node boundaries*/
+    struct TreeBuildKey * scratch = (struct TreeBuildKey *) mymalloc2("TreeBuildScratch", (numparticles + 1) * sizeof(struct TreeBuildKey));
+    if(!failed) {
+        #pragma omp parallel
+        #pragma omp single
+        {
+            int j;
+            for(j = 0; j < EndLeaf - StartLeaf; j++) {
+                if(leafend[j] == leafstart[j])
+                    continue;
+                const int no = ddecomp->TopLeaves[j + StartLeaf].treenode;
+                /* The depth of the top leaf gives its size on the key grid*/
+                int shift = BITS_PER_DIMENSION;
+                int father = tree->NodesCold[no].father;
+                while(father >= 0) {
+                    shift--;
+                    father = tree->NodesCold[father].father;
+                }
+                const int start = leafstart[j], end = leafend[j];
+                #pragma omp task default(none) firstprivate(no, start, end, shift) shared(tree, keys, scratch, nnext, failed)
+                force_tree_sorted_node(no, start, end, shift, tree, keys, scratch, &nnext, &failed);
+            }
+        }
+    }
+    myfree(scratch);
+    ta_free(leafstart);
+    myfree(keys);
+
+    tree->NumParticles = numparticles;
+    tree->numnodes = nnext - tree->firstnode;
+    /* Running out of nodes is handled by the caller*/
+    if(nnext > tree->lastnode)
+        return 0;
+    return failed;
+}
+
 /*! This function recursively creates a set of empty tree nodes which
  *  corresponds to the top-level tree for the ddecomp grid. This is done to
  *  ensure that this top-level tree is always "complete" so that we can easily
@@ -860,7 +1358,7 @@ force_tree_create_nodes(ForceTree * tree, const ActiveParticles * act, int mask,
  *  level in the tree, even when the particle population is so sparse that
  *  some of these nodes are actually empty.
  */
-void force_create_node_for_topnode(int no, int topnode, struct NODE * Nodes, const DomainDecomp * ddecomp, const int bits, const int x, const int y, const int z, int *nextfree, const int lastnode)
+void force_create_node_for_topnode(int no, int topnode, struct NODE * Nodes, struct NodeCold * NodesCold, const DomainDecomp * ddecomp, const int bits, const int x, const int y, const int z, int *nextfree, const int lastnode)
 {
     int i, j, k;
 
@@ -877,16 +1375,16 @@ void force_create_node_for_topnode(int no, int topnode, struct NODE * Nodes, con
 
                 int count = i + 2 * j + 4 * k;
 
-                Nodes[no].s.suns[count] = *nextfree;
+                NodesCold[no].s.suns[count] = *nextfree;
                 /*We are an internal top level node as we now have a child top level.*/
                 Nodes[no].f.InternalTopLevel = 1;
                 Nodes[no].f.ChildType = NODE_NODE_TYPE;
-                Nodes[no].s.noccupied = NODEFULL;
+                NodesCold[no].s.noccupied = NODEFULL;
 
                 /* We create a new leaf node.*/
                 init_internal_node(&Nodes[*nextfree], &Nodes[no], count);
                 /*Set father of new node*/
-                Nodes[*nextfree].father = no;
+                init_cold_node(&NodesCold[*nextfree], no);
                 /*All nodes here are top level nodes*/
                 Nodes[*nextfree].f.TopLevel = 1;
 
@@ -899,7 +1397,8 @@ void force_create_node_for_topnode(int no, int topnode, struct NODE * Nodes, con
                     ddecomp->TopLeaves[curtopnode.Leaf].treenode = *nextfree;
                     /* We set the first child as a pointer to the topleaf, essentially constructing the pseudoparticles early.
                      * We do not set nocc, so this first child will be over-written on local nodes when we construct the full tree.*/
-                    Nodes[*nextfree].s.suns[0] = curtopnode.Leaf + lastnode;
+                    NodesCold[*nextfree].s.suns[0] = curtopnode.Leaf + lastnode;
+                    Nodes[*nextfree].first = curtopnode.Leaf + lastnode;
                     if(ddecomp->TopLeaves[curtopnode.Leaf].Task != ThisTask)
                         Nodes[*nextfree].f.ChildType = PSEUDO_NODE_TYPE;
                 }
@@ -909,29 +1408,160 @@ void force_create_node_for_topnode(int no, int topnode, struct NODE * Nodes, con
                 if(*nextfree >= lastnode)
                     endrun(11, "Not enough force nodes to topnode grid: need %d\n",lastnode);
             }
+    Nodes[no].first = NodesCold[no].s.suns[0];
     /* Set sibling on the child*/
     for(j=0; j<7; j++) {
-        int chld = Nodes[no].s.suns[j];
-        Nodes[chld].sibling = Nodes[no].s.suns[j+1];
+        int chld = NodesCold[no].s.suns[j];
+        Nodes[chld].sibling = NodesCold[no].s.suns[j+1];
     }
-    Nodes[Nodes[no].s.suns[7]].sibling = Nodes[no].sibling;
+    Nodes[NodesCold[no].s.suns[7]].sibling = Nodes[no].sibling;
     for(i = 0; i < 2; i++)
         for(j = 0; j < 2; j++)
             for(k = 0; k < 2; k++)
             {
                 int sub = 7 & peano_hilbert_key((x << 1) + i, (y << 1) + j, (z << 1) + k, bits);
                 int count = i + 2 * j + 4 * k;
-                force_create_node_for_topnode(Nodes[no].s.suns[count], ddecomp->TopNodes[topnode].Daughter + sub, Nodes, ddecomp,
+                force_create_node_for_topnode(NodesCold[no].s.suns[count], ddecomp->TopNodes[topnode].Daughter + sub, Nodes, NodesCold, ddecomp,
                         bits + 1, 2 * x + i, 2 * y + j, 2 * z + k, nextfree, lastnode);
             }
 
 }
 
+/* Count the nodes below a node node, including empty nodes which are still attached.*/
+static int
+force_tree_count_subnodes(const int no, const ForceTree * tree)
+{
+    int j, count = 0;
+    for(j = 0; j < NMAXCHILD; j++) {
+        const int child = tree->NodesCold[no].s.suns[j];
+        if(child < 0)
+            continue;
+        count++;
+        if(tree->Nodes[child].f.ChildType == NODE_NODE_TYPE)
+            count += force_tree_count_subnodes(child, tree);
+    }
+    return count;
+}
+
+/* Assign new indices to the nodes below a node node, in the order the tree walk visits them:
+ * each child comes immediately before its own children, which come before the next child.*/
+static void
+force_tree_number_subnodes(const int no, int * nextindex, int * newindex, const ForceTree * tree)
+{
+    int j;
+    for(j = 0; j < NMAXCHILD; j++) {
+        const int child = tree->NodesCold[no].s.suns[j];
+        if(child < 0)
+            continue;
+        newindex[child - tree->firstnode] = (*nextindex)++;
+        if(tree->Nodes[child].f.ChildType == NODE_NODE_TYPE)
+            force_tree_number_subnodes(child, nextindex, newindex, tree);
+    }
+}
+
+/* Map an old node index to a new one. Particles, pseudo particles and -1 are unchanged.*/
+static inline int
+force_tree_remap_node(const int no, const int * newindex, const ForceTree * tree)
+{
+    if(!node_is_node(no, tree))
+        return no;
+    const int newno = newindex[no - tree->firstnode];
+    if(newno < 0)
+        endrun(5, "Node %d is referenced but is not reachable in the tree\n", no);
+    return newno;
+}
+
+/* Renumber the tree nodes so that the nodes below each local top leaf are stored
+ * contiguously and in the order a tree walk visits them. Walks then stream through the node
+ * array rather than jumping about in it. The top-level nodes come first and keep their indices,
+ * as the shared TopLeaves table refers to them. Nodes which are no longer attached to the tree
+ * (empty nodes removed when computing moments) are dropped and numnodes is reduced.*/
+void
+force_tree_renumber_nodes(ForceTree * tree, const DomainDecomp * ddecomp)
+{
+    int i;
+    /* The top-level nodes are created first, one for each entry in TopNodes, so they are a contiguous block at the start.
+     * Do not test the TopLevel flag here: the copies of top leaves made by each thread during the build also have it set.*/
+    const int ntop = ddecomp->NTopNodes;
+
+    int * newindex = (int *) mymalloc2("NewNodeIndex", tree->numnodes * sizeof(int));
+    int * leafstart = (int *) mymalloc2("LeafStart", (tree->NTopLeaves + 1) * sizeof(int));
+
+    #pragma omp parallel for
+    for(i = 0; i < tree->numnodes; i++)
+        newindex[i] = (i < ntop) ? tree->firstnode + i : -1;
+
+    /* Count the nodes below each local top leaf and find where each block starts*/
+    #pragma omp parallel for
+    for(i = 0; i < tree->NTopLeaves; i++) {
+        const int no = tree->TopLeaves[i].treenode;
+        leafstart[i] = 0;
+        if(tree->TopLeaves[i].Task == tree->ThisTask && tree->Nodes[no].f.ChildType == NODE_NODE_TYPE)
+            leafstart[i] = force_tree_count_subnodes(no, tree);
+    }
+    int nextstart = tree->firstnode + ntop;
+    for(i = 0; i < tree->NTopLeaves; i++) {
+        const int count = leafstart[i];
+        leafstart[i] = nextstart;
+        nextstart += count;
+    }
+    const int newnumnodes = nextstart - tree->firstnode;
+
+    #pragma omp parallel for
+    for(i = 0; i < tree->NTopLeaves; i++) {
+        const int no = tree->TopLeaves[i].treenode;
+        int nextindex = leafstart[i];
+        if(tree->TopLeaves[i].Task == tree->ThisTask && tree->Nodes[no].f.ChildType == NODE_NODE_TYPE)
+            force_tree_number_subnodes(no, &nextindex, newindex, tree);
+    }
+
+    /* Update the links to other nodes.*/
+    #pragma omp parallel for
+    for(i = 0; i < tree->numnodes; i++) {
+        if(newindex[i] < 0)
+            continue;
+        struct NODE * nop = &tree->Nodes[i + tree->firstnode];
+        struct NodeCold * cold = &tree->NodesCold[i + tree->firstnode];
+        nop->sibling = force_tree_remap_node(nop->sibling, newindex, tree);
+        cold->father = force_tree_remap_node(cold->father, newindex, tree);
+        int j;
+        if(nop->f.ChildType == NODE_NODE_TYPE) {
+            for(j = 0; j < NMAXCHILD; j++)
+                cold->s.suns[j] = force_tree_remap_node(cold->s.suns[j], newindex, tree);
+        }
+        else if(nop->f.ChildType == PARTICLE_NODE_TYPE && tree->Father) {
+            for(j = 0; j < cold->s.noccupied; j++)
+                tree->Father[cold->s.suns[j]] = newindex[i];
+        }
+        nop->first = cold->s.suns[0];
+    }
+
+    /* Permute the nodes in place, to avoid needing a second copy of the tree.
+     * Each swap moves one node to its final position, so this is linear in the number of nodes.*/
+    for(i = 0; i < tree->numnodes; i++) {
+        while(newindex[i] >= 0 && newindex[i] != i + tree->firstnode) {
+            const int dest = newindex[i];
+            struct NODE tmp = tree->Nodes[dest];
+            tree->Nodes[dest] = tree->Nodes[i + tree->firstnode];
+            tree->Nodes[i + tree->firstnode] = tmp;
+            struct NodeCold tmpcold = tree->NodesCold[dest];
+            tree->NodesCold[dest] = tree->NodesCold[i + tree->firstnode];
+            tree->NodesCold[i + tree->firstnode] = tmpcold;
+            newindex[i] = newindex[dest - tree->firstnode];
+            newindex[dest - tree->firstnode] = dest;
+        }
+    }
+    tree->numnodes = newnumnodes;
+
+    myfree(leafstart);
+    myfree(newindex);
+}
+
 int
 force_get_father(int no, const ForceTree * tree)
 {
     if(no >= tree->firstnode)
-        return tree->Nodes[no].father;
+        return tree->NodesCold[no].father;
     else if(tree->Father)
         return tree->Father[no];
     else
@@ -975,6 +1605,25 @@ force_get_sibling(const int sib, const int j, const int * suns)
     return nextsib;
 }
 
+/* Add the second moment of a child about the parent center of mass to the parent's quad moment.
+ * This is the parallel axis theorem: the child's own moment (may be NULL for particles),
+ * plus mass * dx_i dx_j, where dx is the offset of the child's center of mass.*/
+static void
+add_quadrupole_moment(MyFloat * quad, const double mass, const double dx[3], const MyFloat * childquad)
+{
+    quad[0] += mass * dx[0] * dx[0];
+    quad[1] += mass * dx[1] * dx[1];
+    quad[2] += mass * dx[2] * dx[2];
+    quad[3] += mass * dx[0] * dx[1];
+    quad[4] += mass * dx[0] * dx[2];
+    quad[5] += mass * dx[1] * dx[2];
+    if(childquad) {
+        int k;
+        for(k = 0; k < 6; k++)
+            quad[k] += childquad[k];
+    }
+}
+
 /* Set the center of mass of the current node*/
 static void
 force_update_particle_node(int no, const ForceTree * tree)
@@ -995,6 +1644,37 @@ force_update_particle_node(int no, const ForceTree * tree)
         for(j = 0; j < 3; j++)
             tree->Nodes[no].mom.cofm[j] = tree->Nodes[no].center[j];
     }
+    /* Second moment about the center of mass. Needs the final cofm, so is done here rather than as particles are added.
+     * Particles never straddle the box edge within a node, so no periodic wrapping is needed.*/
+    memset(&(tree->NodesCold[no].quad),0,6*sizeof(MyFloat));
+    for(j = 0; j < tree->NodesCold[no].s.noccupied; j++) {
+        const struct particle_data * const part = &P[tree->NodesCold[no].s.suns[j]];
+        double dx[3];
+        int k;
+        for(k = 0; k < 3; k++)
+            dx[k] = part->Pos[k] - tree->Nodes[no].mom.cofm[k];
+        add_quadrupole_moment(tree->NodesCold[no].quad, part->Mass, dx, NULL);
+    }
+}
+
+/* Compute the second moment of an internal node from its children.
+ * Must be called after the center of mass of the node is set.*/
+static void
+force_update_node_quadrupole(int no, const ForceTree * tree)
+{
+    int j;
+    memset(&(tree->NodesCold[no].quad),0,6*sizeof(MyFloat));
+    for(j = 0; j < 8; j++)
+    {
+        const int p = tree->NodesCold[no].s.suns[j];
+        if(p < 0)
+            continue;
+        double dx[3];
+        int k;
+        for(k = 0; k < 3; k++)
+            dx[k] = tree->Nodes[p].mom.cofm[k] - tree->Nodes[no].mom.cofm[k];
+        add_quadrupole_moment(tree->NodesCold[no].quad, tree->Nodes[p].mom.mass, dx, tree->NodesCold[p].quad);
+    }
 }
 
 /*! this routine determines the multipole moments for a given internal node
@@ -1016,7 +1696,7 @@ force_update_node_recursive(int no, int sib, int level, const ForceTree * tree)
         endrun(3, "force_update_node_recursive called on node %d of type %d != %d!\n", no, tree->Nodes[no].f.ChildType, NODE_NODE_TYPE);
 #endif
     int j;
-    int * suns = tree->Nodes[no].s.suns;
+    int * suns = tree->NodesCold[no].s.suns;
 
     int childcnt = 0;
     /* Remove any empty children, moving the suns array around
@@ -1031,7 +1711,7 @@ force_update_node_recursive(int no, int sib, int level, const ForceTree * tree)
          * when one of the local domains is empty. */
         while(jj < 8 && !tree->Nodes[suns[jj]].f.TopLevel &&
             tree->Nodes[suns[jj]].f.ChildType == PARTICLE_NODE_TYPE &&
-            tree->Nodes[suns[jj]].s.noccupied == 0) {
+            tree->NodesCold[suns[jj]].s.noccupied == 0) {
                     jj++;
         }
         if(jj < 8)
@@ -1041,6 +1721,7 @@ force_update_node_recursive(int no, int sib, int level, const ForceTree * tree)
         if(suns[j] >= 0 && tree->Nodes[suns[j]].f.ChildType == NODE_NODE_TYPE)
             childcnt++;
     }
+    tree->Nodes[no].first = suns[0];
 
     /*First do the children*/
     for(j = 0; j < 8; j++)
@@ -1091,6 +1772,7 @@ force_update_node_recursive(int no, int sib, int level, const ForceTree * tree)
         tree->Nodes[no].mom.cofm[1] /= mass;
         tree->Nodes[no].mom.cofm[2] /= mass;
     }
+    force_update_node_quadrupole(no, tree);
 
     return -1;
 }
@@ -1139,6 +1821,7 @@ struct topleaf_momentsdata
     MyFloat s[3];
     MyFloat mass;
     MyFloat hmax;
+    MyFloat quad[6];
 };
 
 /*! This function communicates the values of the multipole moments of the
@@ -1162,6 +1845,7 @@ static void force_exchange_pseudodata(const ForceTree * const tree, const Domain
         TopLeafMoments[i].s[2] = tree->Nodes[no].mom.cofm[2];
         TopLeafMoments[i].mass = tree->Nodes[no].mom.mass;
         TopLeafMoments[i].hmax = tree->Nodes[no].mom.hmax;
+        memcpy(TopLeafMoments[i].quad, tree->NodesCold[no].quad, 6*sizeof(MyFloat));
     }
 
     /* share the pseudo-particle data across CPUs */
@@ -1198,6 +1882,7 @@ static void force_exchange_pseudodata(const ForceTree * const tree, const Domain
             tree->Nodes[no].mom.cofm[2] = TopLeafMoments[i].s[2];
             tree->Nodes[no].mom.mass = TopLeafMoments[i].mass;
             tree->Nodes[no].mom.hmax = TopLeafMoments[i].hmax;
+            memcpy(tree->NodesCold[no].quad, TopLeafMoments[i].quad, 6*sizeof(MyFloat));
          }
     }
     myfree(TopLeafMoments);
@@ -1219,15 +1904,15 @@ force_treeupdate_pseudos(const int no, const int level, const ForceTree * const
     /* since we are dealing with top-level nodes, we know that there are 8 consecutive daughter nodes */
     for(j = 0; j < 8; j++)
     {
-        const int p = tree->Nodes[no].s.suns[j];
+        const int p = tree->NodesCold[no].s.suns[j];
 
         /*This may not happen as we are an internal top level node*/
         if(p < tree->firstnode || p >= tree->lastnode)
             endrun(6767, "Updating pseudos: %d -> %d which is not an internal node between %d and %d\n",no, p, tree->firstnode, tree->lastnode);
 #ifdef DEBUG
         /* Check we don't move to another part of the tree*/
-        if(tree->Nodes[p].father != no)
-            endrun(6767, "Tried to update toplevel node %d with parent %d != expected %d\n", p, tree->Nodes[p].father, no);
+        if(tree->NodesCold[p].father != no)
+            endrun(6767, "Tried to update toplevel node %d with parent %d != expected %d\n", p, tree->NodesCold[p].father, no);
 #endif
 
         if(tree->Nodes[p].f.InternalTopLevel) {
@@ -1252,7 +1937,7 @@ force_treeupdate_pseudos(const int no, const int level, const ForceTree * const
 
     for(j = 0; j < 8; j++)
     {
-        const int p = tree->Nodes[no].s.suns[j];
+        const int p = tree->NodesCold[no].s.suns[j];
 
         tree->Nodes[no].mom.mass += (tree->Nodes[p].mom.mass);
         tree->Nodes[no].mom.cofm[0] += (tree->Nodes[p].mom.mass * tree->Nodes[p].mom.cofm[0]);
@@ -1277,6 +1962,7 @@ force_treeupdate_pseudos(const int no, const int level, const ForceTree * const
         tree->Nodes[no].mom.cofm[1] = tree->Nodes[no].center[1];
         tree->Nodes[no].mom.cofm[2] = tree->Nodes[no].center[2];
     }
+    force_update_node_quadrupole(no, tree);
 }
 
 /* Update the hmax in the parent node of the particle p_i*/
@@ -1358,6 +2044,65 @@ void force_update_hmax(ActiveParticles * act, ForceTree * tree, DomainDecomp * d
     message(0, "Root hmax: %lg Tree Mean IPS: %lg\n", tree->Nodes[tree->firstnode].mom.hmax, tree->BoxSize / cbrt(totnumparticles));
 }
 
+/* Set Nodes and the cold node pointers from Nodes_base and the size of the allocation.*/
+static void
+force_tree_set_node_pointers(ForceTree * tree)
+{
+    tree->Nodes = tree->Nodes_base - tree->firstnode;
+    tree->NodesCold_base = (struct NodeCold *) (tree->Nodes_base + tree->allocnodes);
+    tree->NodesCold = tree->NodesCold_base - tree->firstnode;
+}
+
+/* Resize the node allocation to hold allocnodes nodes. The cold data follows the nodes in memory,
+ * so it is moved down before shrinking the allocation, or up after growing it.*/
+static void
+force_tree_resize_nodes(ForceTree * tree, const int allocnodes)
+{
+    const int ncopy = allocnodes < tree->allocnodes ? allocnodes : tree->allocnodes;
+    if(allocnodes < tree->allocnodes)
+        memmove(tree->Nodes_base + allocnodes, tree->NodesCold_base, ncopy * sizeof(struct NodeCold));
+    tree->Nodes_base = (struct NODE *) myrealloc(tree->Nodes_base, allocnodes * (sizeof(struct NODE) + sizeof(struct NodeCold)));
+    if(allocnodes > tree->allocnodes)
+        memmove(tree->Nodes_base + allocnodes, tree->Nodes_base + tree->allocnodes, ncopy * sizeof(struct NodeCold));
+    tree->allocnodes = allocnodes;
+    force_tree_set_node_pointers(tree);
+}
+
+/* Allocate a block at the top or bottom of the heap.*/
+static void *
+force_tree_alloc_block(const char * name, const size_t bytes, const int alloc_high)
+{
+    if(alloc_high)
+        return mymalloc2(name, bytes);
+    return mymalloc(name, bytes);
+}
+
+void
+force_tree_move(ForceTree * tree, const int alloc_high)
+{
+    if(tree->alloc_high_flag == alloc_high)
+        return;
+    /* Allocate the new blocks in the same order as force_treeallocate, Father first,
+     * so that force_tree_free works on the moved tree. The old blocks are then freed nodes first.
+     * Only the used part is copied: the built nodes, and Father for the current particles.*/
+    int * newFather = NULL;
+    if(tree->Father) {
+        newFather = (int *) force_tree_alloc_block("Father", tree->nfather * sizeof(int), alloc_high);
+        const int64_t nused = PartManager->NumPart < tree->nfather ? PartManager->NumPart : tree->nfather;
+        memcpy(newFather, tree->Father, nused * sizeof(int));
+    }
+    struct NODE * newNodes = (struct NODE *) force_tree_alloc_block("Nodes_base", tree->allocnodes * (sizeof(struct NODE) + sizeof(struct NodeCold)), alloc_high);
+    memcpy(newNodes, tree->Nodes_base, tree->numnodes * sizeof(struct NODE));
+    memcpy(newNodes + tree->allocnodes, tree->NodesCold_base, tree->numnodes * sizeof(struct NodeCold));
+    myfree(tree->Nodes_base);
+    if(tree->Father)
+        myfree(tree->Father);
+    tree->Father = newFather;
+    tree->Nodes_base = newNodes;
+    tree->alloc_high_flag = alloc_high;
+    force_tree_set_node_pointers(tree);
+}
+
 /*! This function allocates the memory used for storage of the tree and of
  *  auxiliary arrays needed for tree-walk and link-lists.  Usually,
  *  maxnodes approximately equal to 0.7*maxpart is sufficient to store the
@@ -1368,25 +2113,25 @@ ForceTree force_treeallocate(const int64_t maxnodes, const int64_t maxpart, cons
     ForceTree tb = {0};
 
     if(alloc_father) {
-        tb.Father = (int *) mymalloc("Father", maxpart * sizeof(int));
+        tb.Father = (int *) force_tree_alloc_block("Father", maxpart * sizeof(int), alloc_high);
         tb.nfather = maxpart;
 #ifdef DEBUG
         memset(tb.Father, -1, maxpart * sizeof(int));
 #endif
     }
-    if(alloc_high)
-        tb.Nodes_base = (struct NODE *) mymalloc2("Nodes_base", (maxnodes + 1) * sizeof(struct NODE));
-    else
-        tb.Nodes_base = (struct NODE *) mymalloc("Nodes_base", (maxnodes + 1) * sizeof(struct NODE));
+    const size_t nodebytes = (maxnodes + 1) * (sizeof(struct NODE) + sizeof(struct NodeCold));
+    tb.Nodes_base = (struct NODE *) force_tree_alloc_block("Nodes_base", nodebytes, alloc_high);
+    tb.alloc_high_flag = alloc_high;
 #ifdef DEBUG
-    memset(tb.Nodes_base, -1, (maxnodes + 1) * sizeof(struct NODE));
+    memset(tb.Nodes_base, -1, nodebytes);
 #endif
     tb.firstnode = maxpart;
     tb.lastnode = maxpart + maxnodes;
     if(maxpart + maxnodes >= 1L<<30)
         endrun(5, "Size of tree overflowed for maxpart = %ld, maxnodes = %ld!\n", maxpart, maxnodes);
     tb.numnodes = 0;
-    tb.Nodes = tb.Nodes_base - maxpart;
+    tb.allocnodes = maxnodes + 1;
+    force_tree_set_node_pointers(&tb);
     tb.tree_allocated_flag = 1;
     tb.NTopLeaves = ddecomp->NTopLeaves;
     tb.TopLeaves = ddecomp->TopLeaves;
@@ -35,10 +35,26 @@ struct NodeChild
     int noccupied;
 };
 
+/* Node data needed by the tree walks. Fields read on every step of a walk come first,
+ * so that a walk which discards a node only touches the start of the struct.
+ * Fields which are only needed while building the tree, to list the particles of a leaf,
+ * or by the quadrupole force, are stored separately in struct NodeCold.*/
 struct NODE
 {
     int sibling;		/*!< this gives the next node in the walk in case the current node can be used */
-    int father;		/*!< this gives the parent node of each node (or -1 if we have the root node) */
+    /* If the current node needs to be opened, go here: the first daughter node of a node containing nodes,
+     * or the pseudo particle of a pseudo node. This is NodeCold.s.suns[0], copied when the tree is built,
+     * so that opening a node does not need the child array. Not used for nodes containing particles,
+     * whose particles are read from NodeCold.s.*/
+    int first;
+    struct {
+        unsigned int InternalTopLevel :1; /* TopLevel and has a child which is also TopLevel*/
+        unsigned int TopLevel :1; /* Node corresponding to a toplevel node */
+        unsigned int DependsOnLocalMass :1;  /* Intersects with local mass */
+        unsigned int ChildType :2; /* Specify the type of children this node has: particles, other nodes, or pseudo-particles.
+                                    * (should be an enum, but not standard in C).*/
+        unsigned int unused : 3; /* Spare bits*/
+    } f;
     MyFloat len;			/*!< sidelength of treenode */
     MyFloat center[3];		/*!< geometrical center of node */
 
@@ -47,22 +63,16 @@ struct NODE
         MyFloat mass;		/*!< mass of node */
         MyFloat hmax;           /*!< maximum amount by which Pos + Hsml of all gas particles in the node exceeds len for this node. */
     } mom;
+};
 
-    /* If the current node needs to be opened, go to the first element of this array.
-     * In principle storing the full array wastes memory, because we only use it for the leaf nodes.
-     * However, in practice the wasted memory is fairly small: there are sum(1/8^n) ~ 0.15 internal nodes
-     * for each leaf node, and we are losing 30% of the memory per node, so the total lost is 5%.
-     * Any attempt to get it back by using a separate allocation means we lost the ability to resize
-     * the Nodes array and that is always worse.*/
+/* Node data which the tree walks do not usually need. Indexed like NODE, via ForceTree.NodesCold.*/
+struct NodeCold
+{
+    int father;		/*!< this gives the parent node of each node (or -1 if we have the root node) */
+    /* Children of the node. Walks only read this for the particles of a leaf.*/
     struct NodeChild s;
-    struct {
-        unsigned int InternalTopLevel :1; /* TopLevel and has a child which is also TopLevel*/
-        unsigned int TopLevel :1; /* Node corresponding to a toplevel node */
-        unsigned int DependsOnLocalMass :1;  /* Intersects with local mass */
-        unsigned int ChildType :2; /* Specify the type of children this node has: particles, other nodes, or pseudo-particles.
-                                    * (should be an enum, but not standard in C).*/
-        unsigned int unused : 3; /* Spare bits*/
-    } f;
+    MyFloat quad[6];        /*!< second mass moment about the center of mass, sum m dx_i dx_j. Order is xx, yy, zz, xy, xz, yz.
+                                 Used for the quadrupole correction to the tree force.*/
 };
 
 /*Structure containing the Node pointer, and various Tree metadata.*/
@@ -71,6 +81,9 @@ struct NODE
  * no = ForceTree.firstnode..ForceTree.lastnode corresponds to actual tree nodes,
  * and is the only memory allocated in ForceTree.Nodes_base. After the tree is built this becomes
  * no = ForceTree.firstnode..ForceTree.numnodes which is the only allocated memory.
+ * Once built the nodes below the top-level tree are numbered in the order the tree is walked,
+ * so that a walk moves forward through memory. Top-level nodes keep their indices, because
+ * DomainDecomp.TopLeaves refers to them and is shared between trees.
  * no > ForceTree.lastnode means a pseudo particle on another processor*/
 typedef struct ForceTree {
     /*Is 1 if the tree is allocated. Only used inside force_tree_allocated() and when allocating.*/
@@ -81,12 +94,16 @@ typedef struct ForceTree {
     int moments_computed_flag;
     /* Flags that the tree contains all active particles*/
     int full_particle_tree_flag;
+    /* Is 1 if Nodes_base and Father are allocated at the top of the heap, 0 if at the bottom.*/
+    int alloc_high_flag;
     /*Index of first internal node. Difference between Nodes and Nodes_base. == MaxPart*/
     int firstnode;
     /*Index of first pseudo-particle node*/
     int lastnode;
     /* Number of actually allocated nodes*/
     int numnodes;
+    /* Number of nodes there is space for in Nodes_base*/
+    int allocnodes;
     /* Types which are included have their bits set to 1*/
     int mask;
     /* Number of particles stored in this tree*/
@@ -100,10 +117,14 @@ typedef struct ForceTree {
     /*!< this is a pointer used to access the nodes which is shifted such that Nodes[firstnode]
      *   gives the first allocated node */
     struct NODE *Nodes;
+    /* Pointer to the build data for each node, shifted like Nodes.*/
+    struct NodeCold *NodesCold;
     /* The following pointers should only be used via accessors or inside of forcetree.c.
      * The exception is the crazy memory shifting done in sfr_eff.c*/
-    /*This points to the actual memory allocated for the nodes.*/
+    /*This points to the actual memory allocated for the nodes.
+     * NodesCold_base is in the same allocation, following allocnodes struct NODEs.*/
     struct NODE * Nodes_base;
+    struct NodeCold * NodesCold_base;
     /*!< gives parent node in tree for every particle */
     int *Father;
     int nfather;
@@ -114,6 +135,9 @@ typedef struct ForceTree {
 /*Initialize the internal parameters of the forcetree module*/
 void init_forcetree_params(const double treeallocfactor);
 
+/* Read the tree build parameters*/
+void set_forcetree_params(ParameterSet * ps);
+
 int force_tree_allocated(const ForceTree * tt);
 
 /* This function propagates changed SPH smoothing lengths up the tree*/
@@ -136,6 +160,17 @@ void force_tree_active_moments(ForceTree * tree, DomainDecomp * ddecomp, const A
  * with all particle types, and of course the tree is smaller.*/
 void force_tree_rebuild_mask(ForceTree * tree, DomainDecomp * ddecomp, int mask, const char * EmergencyOutputDir);
 
+/* Refit a tree built by force_tree_build on an earlier timestep to the drifted particle positions, keeping the node structure.
+ * Nodes are fixed cells of the oct-tree, so their centers and sizes do not change: particles which have left
+ * their leaf are moved to the leaf which now contains them, splitting it if it is full, and particles which are
+ * garbage or no longer match the tree mask are removed. The node allocation must be the last on the heap, as it may grow.
+ * Moments are not recomputed: call force_tree_calc_moments, as after force_tree_rebuild_mask.
+ * Returns 0 on success. Returns 1 if any rank could not refit its tree, or if more than MaxMovedFrac of
+ * the particles changed leaf. These conditions are checked before the tree is changed, except for running out
+ * of nodes while re-inserting particles. A tree for which this returns 1 may be partly refit and must be freed
+ * with force_tree_free and rebuilt. Collective.*/
+int force_tree_refit(ForceTree * tree, const DomainDecomp * ddecomp, const double MaxMovedFrac);
+
 /* Just construct a toptree for domain exchange. If alloc_high is true, allocate the toptree at the upper memory range. */
 ForceTree force_tree_top_build(DomainDecomp * ddecomp, const int alloc_high);
 /* Find the topnode leaf in the tree that the current particle is attached to*/
@@ -147,6 +182,12 @@ void force_tree_calc_moments(ForceTree * tree, DomainDecomp * ddecomp);
 /*Free the memory associated with the tree*/
 void   force_tree_free(ForceTree * tt);
 
+/* Move the memory for the tree nodes and the Father array to new allocations,
+ * at the top of the heap if alloc_high is true and back to the bottom if it is false.
+ * Does nothing if the tree is already there.
+ * Used to make room when the particle slots are resized, and to free memory allocated below the tree.*/
+void force_tree_move(ForceTree * tree, const int alloc_high);
+
 static inline int
 node_is_pseudo_particle(int no, const ForceTree * tree)
 {
@@ -172,12 +213,18 @@ force_get_father(int no, const ForceTree * tt);
 void
 force_tree_create_nodes(ForceTree * tree, const ActiveParticles * act, int mask, DomainDecomp * ddecomp);
 
+int
+force_tree_create_nodes_sorted(ForceTree * tree, const ActiveParticles * act, int mask, DomainDecomp * ddecomp);
+
 ForceTree
 force_treeallocate(const int64_t maxnodes, const int64_t maxpart, const DomainDecomp * ddecomp, const int alloc_father, const int alloc_high);
 
 void
 force_update_node_parallel(const ForceTree * tree, const DomainDecomp * ddecomp);
 
+void
+force_tree_renumber_nodes(ForceTree * tree, const DomainDecomp * ddecomp);
+
 
 #endif
 
@@ -18,6 +18,9 @@
 
 /*! variables for short-range lookup table */
 static float shortrange_table[NTAB], shortrange_table_potential[NTAB], shortrange_table_tidal[NTAB];
+/* Window for the second and third radial derivatives of the potential, used by the quadrupole force.
+ * Normalised so that they are 1 for the Newtonian kernel.*/
+static float shortrange_table_quad2[NTAB], shortrange_table_quad3[NTAB];
 
 void
 gravshort_fill_ntab(const enum ShortRangeForceWindowType ShortRangeForceWindowType, const double Asmth)
@@ -47,6 +50,9 @@ gravshort_fill_ntab(const enum ShortRangeForceWindowType ShortRangeForceWindowTy
         }
         /* we don't have a table for that and don't use it anyways. */
         shortrange_table_tidal[i] = 4.0 * u * u * u / sqrt(M_PI) * exp(-u * u);
+        /* The tidal term is -r dS/dr for the force window S. Successive derivatives of -S/r^3 give these.*/
+        shortrange_table_quad2[i] = (3 * shortrange_table[i] + shortrange_table_tidal[i]) / 3.;
+        shortrange_table_quad3[i] = (15 * shortrange_table[i] + (5 + 2 * u * u) * shortrange_table_tidal[i]) / 15.;
     }
 }
 
@@ -61,7 +67,77 @@ grav_apply_short_range_window(double r, double * fac, double * pot, const double
         return 1;
     /* use a linear interpolation; */
     *fac *= (tabindex + 1 - i) * shortrange_table[tabindex] + (i - tabindex) * shortrange_table[tabindex + 1];
-    *pot *= (tabindex + 1 - i) * shortrange_table_potential[tabindex] + (i - tabindex) * shortrange_table_potential[tabindex];
+    *pot *= (tabindex + 1 - i) * shortrange_table_potential[tabindex] + (i - tabindex) * shortrange_table_potential[tabindex + 1];
     return 0;
 }
 
+/* Add the short-range acceleration and potential at pos from a block of n particles or nodes,
+ * stored as separate arrays of positions and masses. This is the spline softened Newtonian force
+ * followed by grav_apply_short_range_window, but written without branches so that
+ * the compiler can vectorise the loop. Pairs beyond the end of the window table contribute nothing.*/
+void
+grav_short_range_accn_block(const int n, const double * x, const double * y, const double * z, const double * mass,
+        const double pos[3], const double BoxSize, const double h, const double cellsize, double acc[3], double * pot)
+{
+    const double tabfac = 1. / (cellsize * shortrange_force_kernels[1][0]);
+    const double h_inv = 1. / h;
+    const double h3_inv = h_inv * h_inv * h_inv;
+    double ax = 0, ay = 0, az = 0, pt = 0;
+    int k;
+    #pragma omp simd reduction(+: ax, ay, az, pt)
+    for(k = 0; k < n; k++) {
+        const double dx = NEAREST(x[k] - pos[0], BoxSize);
+        const double dy = NEAREST(y[k] - pos[1], BoxSize);
+        const double dz = NEAREST(z[k] - pos[2], BoxSize);
+        const double r2 = dx * dx + dy * dy + dz * dz;
+        const double r = sqrt(r2);
+        const double u = r * h_inv;
+        /* Both halves of the spline are evaluated; clamp u and r so the unused ones stay finite.*/
+        const double uo = u < 0.5 ? 0.5 : u;
+        const double rn = u < 1 ? h : r;
+        const double fin = h3_inv * (10.666666666667 + u * u * (32.0 * u - 38.4));
+        const double pin = h_inv * (-2.8 + u * u * (5.333333333333 + u * u * (6.4 * u - 9.6)));
+        const double fout = h3_inv * (21.333333333333 - 48.0 * uo +
+                        38.4 * uo * uo - 10.666666666667 * uo * uo * uo - 0.066666666667 / (uo * uo * uo));
+        const double pout = h_inv * (-3.2 + 0.066666666667 / uo + uo * uo * (10.666666666667 +
+                        uo * (-16.0 + uo * (9.6 - 2.133333333333 * uo))));
+        const double fac = u < 0.5 ? fin : (u < 1 ? fout : 1. / (rn * rn * rn));
+        const double facpot = u < 0.5 ? pin : (u < 1 ? pout : -1. / rn);
+
+        /* Linear interpolation in the window tables*/
+        const double ti = r * tabfac;
+        const int inrange = ti < NTAB - 1;
+        const int tabindex = inrange ? (int) ti : 0;
+        const double w1 = ti - tabindex;
+        const double w0 = 1 - w1;
+        const double win = inrange ? w0 * shortrange_table[tabindex] + w1 * shortrange_table[tabindex + 1] : 0;
+        const double winpot = inrange ? w0 * shortrange_table_potential[tabindex] + w1 * shortrange_table_potential[tabindex + 1] : 0;
+
+        const double mfac = mass[k] * fac * win;
+        ax += dx * mfac;
+        ay += dy * mfac;
+        az += dz * mfac;
+        pt += mass[k] * facpot * winpot;
+    }
+    acc[0] += ax;
+    acc[1] += ay;
+    acc[2] += az;
+    *pot += pt;
+}
+
+/* multiply the force factor (*fac) and the factors for the second (*fac2) and third (*fac3) radial derivatives
+ * of the potential by the shortrange force window function. Used for the quadrupole force.*/
+int
+grav_apply_short_range_window_quad(double r, double * fac, double * fac2, double * fac3, const double cellsize)
+{
+    const double dx = shortrange_force_kernels[1][0];
+    double i = (r / cellsize / dx);
+    size_t tabindex = floor(i);
+    if(tabindex >= NTAB - 1)
+        return 1;
+    const double w0 = tabindex + 1 - i, w1 = i - tabindex;
+    *fac *= w0 * shortrange_table[tabindex] + w1 * shortrange_table[tabindex + 1];
+    *fac2 *= w0 * shortrange_table_quad2[tabindex] + w1 * shortrange_table_quad2[tabindex + 1];
+    *fac3 *= w0 * shortrange_table_quad3[tabindex] + w1 * shortrange_table_quad3[tabindex + 1];
+    return 0;
+}
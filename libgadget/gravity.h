@@ -19,6 +19,20 @@ struct gravshort_tree_params
     double Rcut;
     /* Softening as a fraction of DM mean separation. */
     double FractionalGravitySoftening;
+    /* If true, add the quadrupole moment of accepted nodes to the tree force,
+     * and use the correspondingly higher order relative acceleration opening criterion.*/
+    int TreeUseQuadrupole;
+    /* If > 1, walk the tree once for groups of up to this many nearby particles, sharing the interaction list.*/
+    int TreeGroupSize;
+    /* If true, compute the short-range force between particles on the same processor with the
+     * fast multipole method in gravshort-fmm.c. The tree walk then only computes forces from other processors.*/
+    int TreeUseFMM;
+    /* Opening angle for the FMM cell-cell interactions: cells interact if the sum of their sizes
+     * is less than this times their separation.*/
+    double FMMOpeningAngle;
+    /* If true, each processor imports the parts of the trees on other processors which its short-range
+     * walk needs, building a locally essential tree, instead of exporting particles to be walked remotely.*/
+    int TreeUseLET;
 };
 
 enum ShortRangeForceWindowType {
@@ -38,9 +52,31 @@ double FORCE_SOFTENING(void);
 
 /*Defined in gravpm.c*/
 void gravpm_init_periodic(PetaPM * pm, double BoxSize, double Asmth, int Nmesh, double G);
+/* Set up the mass assignment window and precision of the PM mesh*/
+void set_gravpm_params(ParameterSet * ps);
+/* Helper for the tests: use the mass assignment window and interlacing for the meshes set up later*/
+void set_gravpm_window(enum PetaPMWindow window, int interlace);
+/* Helper for the tests: use single precision FFTs for the meshes set up later*/
+void set_gravpm_single_precision(int single);
+/* Helper for the tests: deposit incrementally the particles which moved by more than fraction of a cell,
+ * with a full deposit every interval PM steps, on the meshes set up later on*/
+void set_gravpm_incremental(double fraction, int interval);
+/* Helper for the tests: measure the redshift space multipoles along the axis los and the species cross power on the PM steps*/
+void set_gravpm_power_analysis(int multipoles, int los, int cross);
 
 /* Apply the short-range window function, which includes the smoothing kernel.*/
 int grav_apply_short_range_window(double r, double * fac, double * pot, const double cellsize);
+/* Add the softened short-range acceleration and potential at pos from n masses at positions (x, y, z).
+ * Vectorised version of the softening kernel followed by grav_apply_short_range_window. */
+void grav_short_range_accn_block(const int n, const double * x, const double * y, const double * z, const double * mass,
+        const double pos[3], const double BoxSize, const double h, const double cellsize, double acc[3], double * pot);
+/* Apply the short-range window function to the derivatives needed for the quadrupole force.*/
+int grav_apply_short_range_window_quad(double r, double * fac, double * fac2, double * fac3, const double cellsize);
+
+/* Compute the short-range acceleration (without G) and potential on the active particles from the particles
+ * on this processor, using the fast multipole method on the local part of the tree.
+ * Acc and Pot should have space for PartManager->NumPart entries.*/
+void grav_short_fmm_local(const ActiveParticles * act, const ForceTree * tree, const double cellsize, const double Rcut, const double h, const double theta, double (*Acc)[3], double * Pot);
 
 /* Set up the module*/
 void set_gravshort_tree_params(ParameterSet * ps);
@@ -49,9 +85,10 @@ void set_gravshort_treepar(struct gravshort_tree_params tree_params);
 struct gravshort_tree_params get_gravshort_treepar(void);
 
 /* Computes the gravitational force on the PM grid
- * and saves the total matter power spectrum.
+ * and saves the total matter power spectrum,
+ * and if enabled its redshift space multipoles and the power of each species.
  * Parameters: Cosmology, Time, UnitLength_in_cm and PowerOutputDir are used by the power spectrum output code.
- * TimeIC is used by the massive neutrino code. A tree is built and freed during this function*/
+ * TimeIC is used by the massive neutrino code. The mesh regions are built from the domain top leaves, without a tree.*/
 void gravpm_force(PetaPM * pm, DomainDecomp * ddecomp, Cosmology * CP, double Time, double UnitLength_in_cm, const char * PowerOutputDir, double TimeIC);
 
 void grav_short_pair(const ActiveParticles * act, PetaPM * pm, ForceTree * tree, double Rcut, double rho0);
@@ -62,5 +99,8 @@ void measure_power_spectrum(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex *
 
 /* Compute the power spectrum of the Fourier transformed grid in value.*/
 void powerspectrum_add_mode(Power * PowerSpectrum, const int64_t k2, const int kpos[3], pfft_complex * const value, const double invwindow, double Nmesh);
+/* Add the cross power of the Fourier modes a and b, weighted by 2 ell + 1 times the Legendre polynomial of order ell
+ * in the cosine of the angle between the mode and the axis los. ell is 0, 2 or 4: 0 is the usual power spectrum.*/
+void powerspectrum_add_mode_multipole(Power * PowerSpectrum, const int64_t k2, const int kpos[3], pfft_complex * const a, pfft_complex * const b, const double invwindow, double Nmesh, const int ell, const int los);
 
 #endif
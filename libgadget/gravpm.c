@@ -7,7 +7,6 @@
 #include "utils.h"
 
 #include "partmanager.h"
-#include "forcetree.h"
 #include "petapm.h"
 #include "domain.h"
 #include "walltime.h"
@@ -16,8 +15,7 @@
 #include "cosmology.h"
 #include "neutrinos_lra.h"
 
-static int pm_mark_region_for_node(int startno, int rid, int * RegionInd, const ForceTree * tt);
-static void convert_node_to_region(PetaPM * pm, PetaPMRegion * r, struct NODE * Nodes);
+static void bounding_box_to_region(PetaPM * pm, PetaPMRegion * r, const double min[3], const double max[3]);
 
 static int hybrid_nu_gravpm_is_active(int i);
 static void potential_transfer(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex * value);
@@ -39,6 +37,12 @@ static PetaPMFunctions functions [] =
 };
 
 static PetaPMRegion * _prepare(PetaPM * pm, PetaPMParticleStruct * pstruct, void * userdata, int * Nregions);
+static void gravpm_power_multipoles(PetaPM * pm, DomainDecomp * ddecomp, PetaPMParticleStruct * pstruct, const char * PowerOutputDir);
+static void gravpm_power_cross(PetaPM * pm, DomainDecomp * ddecomp, const char * PowerOutputDir);
+#ifdef PM_INCREMENTAL_DEPOSIT
+static char * gravpm_persist_prepare(PetaPM * pm, PetaPMParticleStruct * pstruct, PetaPMParticleStruct * removed);
+static void gravpm_persist_finish(PetaPM * pm, char * changed, int (*active)(int));
+#endif
 
 static struct gravpm_params
 {
@@ -48,13 +52,115 @@ static struct gravpm_params
     double UnitLength_in_cm;
 } GravPM;
 
+/* Mass assignment, precision, incremental deposit and readout of the PM mesh*/
+static struct gravpm_window_params
+{
+    enum PetaPMWindow PMWindow;
+    int PMInterlace;
+    int PMSinglePrecision;
+    /* If > 0, only particles which moved by more than this fraction of a cell
+     * or changed mass since their last deposit are deposited again*/
+    double PMIncrementalDeposit;
+    /* Number of PM steps between full deposits, if incremental*/
+    int PMFullDepositInterval;
+    /* Largest number of force components read out from the mesh together*/
+    int PMMaxFusedFields;
+} GravPMWindow = {PETAPM_WINDOW_CIC, 0, 0, 0, 16, 4};
+
+/* State of the persistent density mesh of the incremental deposit*/
+static struct gravpm_persist_state
+{
+    /* True once the persistent mesh holds a full deposit*/
+    int Valid;
+    /* PM steps since the last full deposit*/
+    int Steps;
+    /* Number of particles on the persistent mesh after the last PM step*/
+    int64_t NDeposited;
+    /* Particle offset of the persistent mesh*/
+    double Offset[3];
+} GravPMPersist;
+
+/* Extra power spectra measured on the PM steps*/
+static struct gravpm_analysis_params
+{
+    /* Redshift space multipoles of the matter power along the axis PMPowerLOSAxis*/
+    int PMPowerMultipoles;
+    int PMPowerLOSAxis;
+    /* Auto and cross power of CDM, baryons and neutrino particles*/
+    int PMPowerCross;
+} GravPMAnalysis = {0, 2, 0};
+
+/* Set the mass assignment, precision and power spectrum parameters from the parameter file*/
+void
+set_gravpm_params(ParameterSet * ps)
+{
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    if(ThisTask == 0) {
+        GravPMWindow.PMWindow = (enum PetaPMWindow) param_get_enum(ps, "PMWindow");
+        GravPMWindow.PMInterlace = param_get_int(ps, "PMInterlace");
+        GravPMWindow.PMSinglePrecision = param_get_int(ps, "PMSinglePrecision");
+        GravPMWindow.PMIncrementalDeposit = param_get_double(ps, "PMIncrementalDeposit");
+#ifndef PM_INCREMENTAL_DEPOSIT
+        if(GravPMWindow.PMIncrementalDeposit > 0)
+            endrun(0, "PMIncrementalDeposit needs the deposit position of each particle: compile with OPT += -DPM_INCREMENTAL_DEPOSIT\n");
+#endif
+        GravPMWindow.PMFullDepositInterval = param_get_int(ps, "PMFullDepositInterval");
+        GravPMWindow.PMMaxFusedFields = param_get_int(ps, "PMMaxFusedFields");
+        if(GravPMWindow.PMMaxFusedFields < 1)
+            endrun(0, "PMMaxFusedFields is %d, must be at least 1\n", GravPMWindow.PMMaxFusedFields);
+        GravPMAnalysis.PMPowerMultipoles = param_get_int(ps, "PMPowerMultipoles");
+        GravPMAnalysis.PMPowerLOSAxis = param_get_int(ps, "PMPowerLOSAxis");
+        GravPMAnalysis.PMPowerCross = param_get_int(ps, "PMPowerCross");
+        if(GravPMAnalysis.PMPowerLOSAxis < 0 || GravPMAnalysis.PMPowerLOSAxis > 2)
+            endrun(0, "PMPowerLOSAxis is %d, not 0, 1 or 2\n", GravPMAnalysis.PMPowerLOSAxis);
+    }
+    MPI_Bcast(&GravPMWindow, sizeof(GravPMWindow), MPI_BYTE, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&GravPMAnalysis, sizeof(GravPMAnalysis), MPI_BYTE, 0, MPI_COMM_WORLD);
+}
+
+void
+set_gravpm_window(enum PetaPMWindow window, int interlace)
+{
+    GravPMWindow.PMWindow = window;
+    GravPMWindow.PMInterlace = interlace;
+}
+
+void
+set_gravpm_single_precision(int single)
+{
+    GravPMWindow.PMSinglePrecision = single;
+}
+
+void
+set_gravpm_incremental(double fraction, int interval)
+{
+    GravPMWindow.PMIncrementalDeposit = fraction;
+    GravPMWindow.PMFullDepositInterval = interval;
+}
+
+void
+set_gravpm_power_analysis(int multipoles, int los, int cross)
+{
+    GravPMAnalysis.PMPowerMultipoles = multipoles;
+    GravPMAnalysis.PMPowerLOSAxis = los;
+    GravPMAnalysis.PMPowerCross = cross;
+}
+
 void
 gravpm_init_periodic(PetaPM * pm, double BoxSize, double Asmth, int Nmesh, double G) {
-    petapm_init(pm, BoxSize, Asmth, Nmesh, G, MPI_COMM_WORLD);
+    petapm_init(pm, BoxSize, Asmth, Nmesh, G, GravPMWindow.PMSinglePrecision, MPI_COMM_WORLD);
+    pm->Window = GravPMWindow.PMWindow;
+    pm->Interlace = GravPMWindow.PMInterlace;
+    pm->MaxFused = GravPMWindow.PMMaxFusedFields;
+    if(GravPMWindow.PMIncrementalDeposit > 0)
+        petapm_alloc_persistent(pm);
+    GravPMPersist.Valid = 0;
 }
 
 /* Computes the gravitational force on the PM grid
- * and saves the total matter power spectrum.
+ * and saves the total matter power spectrum,
+ * and if enabled its redshift space multipoles and the power of each species.
  * Parameters: Cosmology, Time, UnitLength_in_cm and PowerOutputDir are used by the power spectrum output code.
  * TimeIC is used by the massive neutrino code.*/
 void
@@ -91,11 +197,6 @@ gravpm_force(PetaPM * pm, DomainDecomp * ddecomp, Cosmology * CP, double Time, d
         P[i].GravPM[0] = P[i].GravPM[1] = P[i].GravPM[2] = 0;
     }
 
-    /* Tree freed in PM*/
-    ForceTree Tree = {0};
-    /* We include neutrinos in this tree unconditionally, so all particles have a Region.*/
-    force_tree_full(&Tree, ddecomp, 0, PowerOutputDir);
-
     /* Set up parameters*/
     GravPM.Time = Time;
     GravPM.TimeIC = TimeIC;
@@ -106,7 +207,20 @@ gravpm_force(PetaPM * pm, DomainDecomp * ddecomp, Cosmology * CP, double Time, d
      * Therefore the force transfer functions are based on the potential,
      * not the density.
      * */
-    petapm_force(pm, _prepare, &global_functions, functions, &pstruct, &Tree);
+    /* Gravitating particles, before the incremental deposit selects the changed particles*/
+    int (*active)(int) = pstruct.active;
+#ifdef PM_INCREMENTAL_DEPOSIT
+    char * changed = NULL;
+    PetaPMParticleStruct removed;
+    if(GravPMWindow.PMIncrementalDeposit > 0)
+        changed = gravpm_persist_prepare(pm, &pstruct, &removed);
+#endif
+    /*Allocate memory for a power spectrum*/
+    powerspectrum_alloc(pm->ps, pm->Nmesh, omp_get_max_threads(), CP->MassiveNuLinRespOn, pm->BoxSize*UnitLength_in_cm);
+    /* The regions are built from the domain: neutrinos are included unconditionally, so all particles have a Region.*/
+    petapm_force(pm, _prepare, &global_functions, functions, &pstruct, ddecomp);
+    pstruct.active = active;
+    pstruct.removed = NULL;
     powerspectrum_sum(pm->ps);
     /*Now save the power spectrum*/
     powerspectrum_save(pm->ps, PowerOutputDir, "powerspectrum", Time, GrowthFactor(CP, Time, 1.0));
@@ -116,168 +230,270 @@ gravpm_force(PetaPM * pm, DomainDecomp * ddecomp, Cosmology * CP, double Time, d
     /*We are done with the power spectrum, free it*/
     powerspectrum_free(pm->ps);
     walltime_measure("/PMgrav/PowerSpec");
+#ifdef PM_INCREMENTAL_DEPOSIT
+    if(changed)
+        gravpm_persist_finish(pm, changed, active);
+#endif
+
+    if(GravPMAnalysis.PMPowerMultipoles)
+        gravpm_power_multipoles(pm, ddecomp, &pstruct, PowerOutputDir);
+    if(GravPMAnalysis.PMPowerCross)
+        gravpm_power_cross(pm, ddecomp, PowerOutputDir);
 }
 
+#ifdef PM_INCREMENTAL_DEPOSIT
+/* Mass of particle i on the PM mesh, for the gravitating particles given by active*/
+static double
+gravpm_deposit_mass(const int i, int (*active)(int))
+{
+    if(P[i].IsGarbage || P[i].Swallowed || (active && !active(i)))
+        return 0;
+    return P[i].Mass;
+}
+
+/* Particles deposited again by an incremental deposit, and the gravitating particles*/
+static char * GravPMChanged;
+static int (*GravPMActive)(int);
+
+static int gravpm_changed_is_active(int i)
+{
+    return GravPMChanged[i] && (!GravPMActive || GravPMActive(i));
+}
+
+static int gravpm_removed_is_active(int i)
+{
+    return GravPMChanged[i] && P[i].PMDepositMass != 0;
+}
+
+/* Decide whether this PM step deposits all particles to the persistent mesh,
+ * or only changes the particles which moved by more than PMIncrementalDeposit cells or changed mass.
+ * A full deposit is done every PMFullDepositInterval steps, to bound the round-off,
+ * and whenever the particle offset changed or particles on the mesh are garbage or were removed.
+ * Sets pm->Persist, and for an incremental step sets pstruct and removed to deposit the changed particles
+ * and remove their last deposit. Returns the changed flags, for gravpm_persist_finish.*/
+static char *
+gravpm_persist_prepare(PetaPM * pm, PetaPMParticleStruct * pstruct, PetaPMParticleStruct * removed)
+{
+    const double BoxSize = PartManager->BoxSize;
+    int64_t i;
+    int full = !GravPMPersist.Valid || GravPMPersist.Steps >= GravPMWindow.PMFullDepositInterval;
+    int k;
+    for(k = 0; k < 3; k++)
+        if(PartManager->CurrentParticleOffset[k] != GravPMPersist.Offset[k])
+            full = 1;
+
+    int64_t ndeposited = 0;
+    int lost = 0;
+    #pragma omp parallel for reduction(+: ndeposited, lost)
+    for(i = 0; i < PartManager->NumPart; i++) {
+        if(P[i].PMDepositMass == 0)
+            continue;
+        ndeposited++;
+        /* Garbage may be gone by the next step: its deposit is only removed by a full deposit*/
+        if(P[i].IsGarbage || P[i].Swallowed)
+            lost++;
+    }
+    MPI_Allreduce(MPI_IN_PLACE, &ndeposited, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(MPI_IN_PLACE, &lost, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+    if(lost || ndeposited != GravPMPersist.NDeposited)
+        full = 1;
+
+    char * changed = (char *) mymalloc("PMChanged", PartManager->NumPart * sizeof(char) + 1);
+    const double maxdist2 = pow(GravPMWindow.PMIncrementalDeposit * pm->CellSize, 2);
+    int64_t nchanged = 0;
+    #pragma omp parallel for reduction(+: nchanged)
+    for(i = 0; i < PartManager->NumPart; i++) {
+        changed[i] = 1;
+        if(!full) {
+            const double mass = gravpm_deposit_mass(i, pstruct->active);
+            double dx[3], r2 = 0;
+            for(k = 0; k < 3; k++) {
+                dx[k] = NEAREST(P[i].PMDepositPos[k] - P[i].Pos[k], BoxSize);
+                r2 += dx[k] * dx[k];
+            }
+            changed[i] = (mass != P[i].PMDepositMass) || (mass != 0 && r2 > maxdist2);
+            /* Remove the last deposit at its periodic image nearest the particle, which is in the region of the particle*/
+            if(changed[i])
+                for(k = 0; k < 3; k++)
+                    P[i].PMDepositPos[k] = P[i].Pos[k] + dx[k];
+        }
+        nchanged += changed[i];
+    }
+    MPI_Allreduce(MPI_IN_PLACE, &nchanged, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    message(0, "%s PM deposit of %ld particles\n", full ? "Full" : "Incremental", nchanged);
+
+    pm->Persist = full ? PETAPM_PERSIST_STORE : PETAPM_PERSIST_UPDATE;
+    if(full)
+        return changed;
+    GravPMChanged = changed;
+    GravPMActive = pstruct->active;
+    *removed = *pstruct;
+    removed->offset_pos = (char*) &P[0].PMDepositPos[0] - (char*) P;
+    removed->offset_mass = (char*) &P[0].PMDepositMass - (char*) P;
+    removed->active = gravpm_removed_is_active;
+    pstruct->active = gravpm_changed_is_active;
+    pstruct->removed = removed;
+    return changed;
+}
+
+/* Record the deposit of the changed particles, and free the changed flags*/
+static void
+gravpm_persist_finish(PetaPM * pm, char * changed, int (*active)(int))
+{
+    int64_t i;
+    int64_t ndeposited = 0;
+    #pragma omp parallel for reduction(+: ndeposited)
+    for(i = 0; i < PartManager->NumPart; i++) {
+        if(changed[i]) {
+            int k;
+            for(k = 0; k < 3; k++)
+                P[i].PMDepositPos[k] = P[i].Pos[k];
+            P[i].PMDepositMass = gravpm_deposit_mass(i, active);
+        }
+        ndeposited += (P[i].PMDepositMass != 0);
+    }
+    myfree(changed);
+    MPI_Allreduce(MPI_IN_PLACE, &ndeposited, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    GravPMPersist.Steps = (pm->Persist == PETAPM_PERSIST_STORE) ? 1 : GravPMPersist.Steps + 1;
+    GravPMPersist.Valid = 1;
+    GravPMPersist.NDeposited = ndeposited;
+    int k;
+    for(k = 0; k < 3; k++)
+        GravPMPersist.Offset[k] = PartManager->CurrentParticleOffset[k];
+    pm->Persist = PETAPM_PERSIST_NONE;
+}
+#endif
+
+/* Key and particle index used to sweep the particles in Peano-Hilbert order when building the regions.*/
+struct RegionKey
+{
+    peano_t key;
+    int64_t index;
+};
+
+/* Position of particle i of a PetaPMParticleStruct*/
+#define PSTRUCT_POS(pstruct, i) ((double *) ((char *) (pstruct)->Parts + (pstruct)->elsize * (i) + (pstruct)->offset_pos))
+
 static PetaPMRegion * _prepare(PetaPM * pm, PetaPMParticleStruct * pstruct, void * userdata, int * Nregions) {
     /*
      *
-     * walks down the tree, identify nodes that contains local mass and
-     * are sufficiently large in volume.
+     * Splits the local particles into regions without a tree.
      *
-     * for each nodes, a mesh region is created.
-     * the particles in a node are linked to their hosting region
-     * (each particle belongs
-     * to exactly one region even though it may be covered by two)
+     * The particles are sorted by Peano-Hilbert key. Particles sharing a
+     * key prefix are in the same cube of the key grid, so each cube is a
+     * contiguous range of the sorted particles. A region is made for each
+     * cube holding local particles, using the cubes of the domain top leaves
+     * or, if a top leaf is large, its sub-cubes no more than 24 mesh cells across.
+     * The mesh region of each is the bounding box of its particles.
+     * The positions are read from pstruct, the rest of the particle from P.
+     * For an incremental deposit the regions also cover the removed last deposits.
      *
      * */
-    ForceTree * tree = (ForceTree *) userdata;
-    /* In worst case, each topleave becomes a region: thus
-     * NTopLeaves is sufficient */
-    PetaPMRegion * regions = (PetaPMRegion *) mymalloc2("Regions", sizeof(PetaPMRegion) * tree->NTopLeaves);
-    pstruct->RegionInd = (int *) mymalloc2("RegionInd", PartManager->NumPart * sizeof(int));
-    int r = 0;
-
-    int no = tree->firstnode; /* start with the root */
-    while(no >= 0) {
+    DomainDecomp * ddecomp = (DomainDecomp *) userdata;
+    const double BoxSize = PartManager->BoxSize;
+    int64_t i;
 
-        if(!(tree->Nodes[no].f.DependsOnLocalMass)) {
-            /* node doesn't contain particles on this process, do not open */
-            no = tree->Nodes[no].sibling;
+    /* Key shift of the largest cubes of the key grid no more than 24 mesh cells across*/
+    const double keycell = BoxSize * 1.001 / (((peano_t) 1) << BITS_PER_DIMENSION);
+    int maxshift = 3 * BITS_PER_DIMENSION;
+    while(maxshift > 0 && keycell * (((peano_t) 1) << (maxshift / 3)) > pm->CellSize * 24)
+        maxshift -= 3;
+
+    /* Swallowed black hole particles stick around but should not gravitate.
+     * Short-range is handled by not adding them to the tree. They get the maximal key and are sorted to the end.*/
+    struct RegionKey * keys = (struct RegionKey *) mymalloc("PMRegionKeys", (PartManager->NumPart + 1) * sizeof(struct RegionKey));
+    int64_t nkeys = 0;
+    #pragma omp parallel for reduction(+: nkeys)
+    for(i = 0; i < PartManager->NumPart; i++) {
+        keys[i].index = i;
+        keys[i].key = PEANOT_MAX;
+        if(P[i].Swallowed || P[i].IsGarbage)
             continue;
-        }
-        if(
-            /* node is large */
-           (tree->Nodes[no].len <= pm->BoxSize / pm->Nmesh * 24)
-           ||
-            /* node is a top leaf */
-            ( !tree->Nodes[no].f.InternalTopLevel && (tree->Nodes[no].f.TopLevel) )
-                ) {
-            regions[r].no = no;
-            r ++;
-            /* do not open */
-            no = tree->Nodes[no].sibling;
-            continue;
-        }
-        /* open */
-        no = tree->Nodes[no].s.suns[0];
+        keys[i].key = PEANO(PSTRUCT_POS(pstruct, i), BoxSize);
+        nkeys++;
     }
+    radix_sort_openmp(keys, PartManager->NumPart, sizeof(struct RegionKey));
 
+    /* Mark the first particle of each cube. Cubes are never larger than the top leaf of their particles.*/
+    int * first = (int *) mymalloc("PMRegionFirst", (nkeys + 1) * sizeof(int));
+    int r = 0;
+    #pragma omp parallel for reduction(+: r)
+    for(i = 0; i < nkeys; i++) {
+        const int leaf = P[keys[i].index].TopLeaf;
+        const int shift = DMIN(maxshift, ddecomp->TopNodes[ddecomp->TopLeaves[leaf].topnode].Shift);
+        first[i] = (i == 0) || ((keys[i].key >> shift) != (keys[i-1].key >> shift));
+        r += first[i];
+    }
     *Nregions = r;
+    /* Compact the flags into the index of the first particle of each region*/
+    r = 0;
+    for(i = 0; i < nkeys; i++)
+        if(first[i])
+            first[r++] = i;
+    first[r] = nkeys;
+
     int maxNregions;
     MPI_Reduce(&r, &maxNregions, 1, MPI_INT, MPI_MAX, 0, MPI_COMM_WORLD);
     message(0, "max number of regions is %d\n", maxNregions);
 
-    int64_t i;
-    int numswallowed = 0;
-    #pragma omp parallel for reduction(+: numswallowed)
-    for(i =0; i < PartManager->NumPart; i ++) {
-        /* Swallowed black hole particles stick around but should not gravitate.
-         * Short-range is handled by not adding them to the tree. */
-        if(P[i].Swallowed){
-            pstruct->RegionInd[i] = -2;
-            numswallowed++;
-        }
-        else
-            pstruct->RegionInd[i] = -1;
-    }
+    PetaPMRegion * regions = (PetaPMRegion *) mymalloc2("Regions", sizeof(PetaPMRegion) * (*Nregions + 1));
+    pstruct->RegionInd = (int *) mymalloc2("RegionInd", PartManager->NumPart * sizeof(int));
+
+    #pragma omp parallel for
+    for(i = nkeys; i < PartManager->NumPart; i++)
+        pstruct->RegionInd[keys[i].index] = -2;
 
-    /* now lets mark particles to their hosting region */
-    int64_t numpart = 0;
-#pragma omp parallel for reduction(+: numpart)
+    /* The regions are the bounding boxes of their particles*/
+    #pragma omp parallel for schedule(dynamic)
     for(r = 0; r < *Nregions; r++) {
-        regions[r].numpart = pm_mark_region_for_node(regions[r].no, r, pstruct->RegionInd, tree);
-        numpart += regions[r].numpart;
-    }
-    for(i = 0; i < PartManager->NumPart; i ++) {
-        if(pstruct->RegionInd[i] == -1) {
-            message(1, "i = %ld father %d not assigned to a region\n", i, force_get_father(i, tree));
+        double min[3] = {BoxSize, BoxSize, BoxSize}, max[3] = {0, 0, 0};
+        int64_t j;
+        for(j = first[r]; j < first[r+1]; j++) {
+            const int p = keys[j].index;
+            const double * pos = PSTRUCT_POS(pstruct, p);
+            int k;
+            for(k = 0; k < 3; k++) {
+                min[k] = DMIN(min[k], pos[k]);
+                max[k] = DMAX(max[k], pos[k]);
+            }
+            /* The last deposit of the particle is removed in the same region*/
+            if(pstruct->removed && pstruct->removed->active(p)) {
+                const double * oldpos = PSTRUCT_POS(pstruct->removed, p);
+                for(k = 0; k < 3; k++) {
+                    min[k] = DMIN(min[k], oldpos[k]);
+                    max[k] = DMAX(max[k], oldpos[k]);
+                }
+            }
+            pstruct->RegionInd[p] = r;
         }
+        regions[r].numpart = first[r+1] - first[r];
+        regions[r].no = P[keys[first[r]].index].TopLeaf;
+        bounding_box_to_region(pm, &regions[r], min, max);
     }
-    /* All particles shall have been processed just once. Otherwise we die */
-    if((numpart+numswallowed) != PartManager->NumPart) {
-        endrun(1, "Processed only %ld particles out of %ld\n", numpart, PartManager->NumPart);
-    }
-    for(r =0; r < *Nregions; r++) {
-        convert_node_to_region(pm, &regions[r], tree->Nodes);
-    }
-    /*This is done to conserve memory during the PM step*/
-    if(force_tree_allocated(tree)) force_tree_free(tree);
-
-    /*Allocate memory for a power spectrum*/
-    powerspectrum_alloc(pm->ps, pm->Nmesh, omp_get_max_threads(), GravPM.CP->MassiveNuLinRespOn, pm->BoxSize*GravPM.UnitLength_in_cm);
+    myfree(first);
+    myfree(keys);
 
     walltime_measure("/PMgrav/Regions");
     return regions;
 }
 
-static int pm_mark_region_for_node(int startno, int rid, int * RegionInd, const ForceTree * tree) {
-    int numpart = 0;
-    int no = startno;
-    int endno = tree->Nodes[startno].sibling;
-    while(no >= 0 && no != endno)
-    {
-        struct NODE * nop = &tree->Nodes[no];
-        if(nop->f.ChildType == PARTICLE_NODE_TYPE) {
-            int i;
-            for(i = 0; i < nop->s.noccupied; i++) {
-                int p = nop->s.suns[i];
-                RegionInd[p] = rid;
-#ifdef DEBUG
-                /* Check for particles outside of the node. This should never happen,
-                * unless there is a bug in tree build, or the particles are being moved.*/
-                int k;
-                for(k = 0; k < 3; k ++) {
-                    double l = P[p].Pos[k] - tree->Nodes[startno].center[k];
-                    l = fabs(l * 2);
-                    if (l > tree->Nodes[startno].len) {
-                        if(l > tree->Nodes[startno].len * (1+ 1e-7))
-                        endrun(1, "enlarging node size from %g to %g, due to particle of type %d at %g %g %g id=%ld\n",
-                            tree->Nodes[startno].len, l, P[p].Type, P[p].Pos[0], P[p].Pos[1], P[p].Pos[2], P[p].ID);
-                        tree->Nodes[startno].len = l;
-                    }
-                }
-#endif
-            }
-            numpart += nop->s.noccupied;
-            /* Move to sibling*/
-            no = nop->sibling;
-        }
-        /* Generally this function should be handed top leaves which do not contain pseudo particles.
-         * However, sometimes it will receive an internal top node which can, if that top node is small enough.
-         * In this case, just move to the sibling: no particles to mark here.*/
-        else if(nop->f.ChildType == PSEUDO_NODE_TYPE)
-            no = nop->sibling;
-        else if(nop->f.ChildType == NODE_NODE_TYPE)
-            no = nop->s.suns[0];
-        else
-            endrun(122, "Unrecognised Node type %d, memory corruption!\n", nop->f.ChildType);
-    }
-    return numpart;
-}
-
-
-static void convert_node_to_region(PetaPM * pm, PetaPMRegion * r, struct NODE * Nodes) {
+static void bounding_box_to_region(PetaPM * pm, PetaPMRegion * r, const double min[3], const double max[3]) {
     int k;
     double cellsize = pm->BoxSize / pm->Nmesh;
-    int no = r->no;
-#if 0
-    printf("task = %d no = %d len = %g hmax = %g center = %g %g %g\n",
-            ThisTask, no, Nodes[no].len, Nodes[no].hmax,
-            Nodes[no].center[0],
-            Nodes[no].center[1],
-            Nodes[no].center[2]);
-#endif
+    /* The TSC and PCS windows reach one cell further on each side than CIC,
+     * and the interlaced deposit moves particles by half a cell.*/
+    const int pad = (pm->Window > PETAPM_WINDOW_CIC || pm->Interlace) ? 1 : 0;
+    r->len = 0;
     for(k = 0; k < 3; k ++) {
-        r->offset[k] = floor((Nodes[no].center[k] - Nodes[no].len * 0.5) / cellsize);
-        int end = (int) ceil((Nodes[no].center[k] + Nodes[no].len * 0.5) / cellsize) + 1;
+        r->offset[k] = floor(min[k] / cellsize) - pad;
+        int end = (int) ceil(max[k] / cellsize) + 1 + pad;
         r->size[k] = end - r->offset[k] + 1;
-        r->center[k] = Nodes[no].center[k];
+        r->center[k] = 0.5 * (min[k] + max[k]);
+        r->len = DMAX(r->len, max[k] - min[k]);
     }
 
     /* setup the internal data structure of the region */
     petapm_region_init_strides(r);
-
-    r->len  = Nodes[no].len;
 }
 
 /********************
@@ -301,6 +517,30 @@ static double sinc_unnormed(double x) {
     }
 }
 
+/* Inverse of the mass assignment window in Fourier space. The kernel is
+ *
+ * sinc_unnormed(k_x L / 2 Nmesh) ** Window
+ *
+ * k_x = kpos * 2pi / L
+ *
+ * with Window = 2 for CIC, 3 for TSC and 4 for PCS.
+ * */
+static double window_deconvolution(PetaPM * pm, int kpos[3])
+{
+    double f = 1.0;
+    int k;
+    for(k = 0; k < 3; k ++) {
+        double tmp = (kpos[k] * M_PI) / pm->Nmesh;
+        tmp = sinc_unnormed(tmp);
+        double w = 1.0;
+        int p;
+        for(p = 0; p < pm->Window; p++)
+            w *= tmp;
+        f *= 1. / w;
+    }
+    return f;
+}
+
 /* Update the model prediction of LinResp neutrino power spectrum.
  * This should happen after the CFT is computed,
  * and after powerspectrum_add_mode() has been called,
@@ -329,10 +569,32 @@ static void compute_neutrino_power(PetaPM * pm) {
  * Store it in the PowerSpectrum structure */
 void
 powerspectrum_add_mode(Power * PowerSpectrum, const int64_t k2, const int kpos[3], pfft_complex * const value, const double invwindow, double Nmesh)
+{
+    powerspectrum_add_mode_multipole(PowerSpectrum, k2, kpos, value, value, invwindow, Nmesh, 0, 0);
+}
+
+/* Legendre polynomial of (even) order ell, times 2 ell + 1*/
+static double
+legendre_weight(const int ell, const double mu2)
+{
+    switch(ell) {
+        case 0:
+            return 1;
+        case 2:
+            return 5 * (3 * mu2 - 1) / 2.;
+        case 4:
+            return 9 * ((35 * mu2 - 30) * mu2 + 3) / 8.;
+    }
+    endrun(1, "No Legendre polynomial of order %d\n", ell);
+    return 0;
+}
+
+void
+powerspectrum_add_mode_multipole(Power * PowerSpectrum, const int64_t k2, const int kpos[3], pfft_complex * const a, pfft_complex * const b, const double invwindow, double Nmesh, const int ell, const int los)
 {
     if(k2 == 0) {
         /* Save zero mode corresponding to the mean as the normalisation factor.*/
-        PowerSpectrum->Norm = (value[0][0] * value[0][0] + value[0][1] * value[0][1]);
+        PowerSpectrum->Norm = (a[0][0] * b[0][0] + a[0][1] * b[0][1]);
         return;
     }
     /* Measure power spectrum: we don't want the zero mode.
@@ -344,7 +606,9 @@ powerspectrum_add_mode(Power * PowerSpectrum, const int64_t k2, const int kpos[3
         int kint=floor(binsperunit*log(k2)/2.);
         int w;
         const double keff = sqrt(kpos[0]*kpos[0]+kpos[1]*kpos[1]+kpos[2]*kpos[2]);
-        const double m = (value[0][0] * value[0][0] + value[0][1] * value[0][1]);
+        double m = (a[0][0] * b[0][0] + a[0][1] * b[0][1]);
+        if(ell > 0)
+            m *= legendre_weight(ell, (double) kpos[los] * kpos[los] / k2);
         /*Make sure we do not overflow (although this should never happen)*/
         if(kint >= PowerSpectrum->size)
             return;
@@ -363,28 +627,193 @@ powerspectrum_add_mode(Power * PowerSpectrum, const int64_t k2, const int kpos[3
 /*Just read the power spectrum, without changing the input value.*/
 void
 measure_power_spectrum(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex *value) {
-    double f = 1.0;
-    /* the CIC deconvolution kernel is
-     *
-     * sinc_unnormed(k_x L / 2 Nmesh) ** 2
-     *
-     * k_x = kpos * 2pi / L
-     *
-     * */
-    int k;
-    for(k = 0; k < 3; k ++) {
-        double tmp = (kpos[k] * M_PI) / pm->Nmesh;
-        tmp = sinc_unnormed(tmp);
-        f *= 1. / (tmp * tmp);
-    }
+    double f = window_deconvolution(pm, kpos);
     powerspectrum_add_mode(pm->ps, k2, kpos, value, f, pm->Nmesh);
 }
 
+/* Power spectra of the meshes of a petapm_analyse_modes call*/
+struct power_analysis
+{
+    Power * ps;
+    /* Line of sight axis of the multipoles*/
+    int los;
+};
+
+/* Add the monopole, quadrupole and hexadecapole of the mesh*/
+static void
+multipole_analysis(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex * values, const int nfield, void * userdata)
+{
+    struct power_analysis * pa = (struct power_analysis *) userdata;
+    const double f = window_deconvolution(pm, kpos);
+    int l;
+    for(l = 0; l < 3; l++)
+        powerspectrum_add_mode_multipole(&pa->ps[l], k2, kpos, &values[0], &values[0], f, pm->Nmesh, 2 * l, pa->los);
+}
+
+/* Add the auto and cross power of each pair of meshes*/
+static void
+cross_analysis(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex * values, const int nfield, void * userdata)
+{
+    struct power_analysis * pa = (struct power_analysis *) userdata;
+    const double f = window_deconvolution(pm, kpos);
+    int a, b, n = 0;
+    for(a = 0; a < nfield; a++)
+        for(b = a; b < nfield; b++)
+            powerspectrum_add_mode_multipole(&pa->ps[n++], k2, kpos, &values[a], &values[b], f, pm->Nmesh, 0, 0);
+}
+
+/* Allocate, measure, save and free the n power spectra of the nfield meshes in modes*/
+static void
+gravpm_save_power(PetaPM * pm, void * modes, const int nfield, petapm_analysis_func analysis, const int los, const char ** names, const int n, const char * PowerOutputDir)
+{
+    Power * ps = ta_malloc("PMpower", Power, n);
+    int i;
+    for(i = 0; i < n; i++)
+        powerspectrum_alloc(&ps[i], pm->Nmesh, omp_get_max_threads(), 0, pm->BoxSize*GravPM.UnitLength_in_cm);
+    struct power_analysis pa = {ps, los};
+    petapm_analyse_modes(pm, modes, nfield, analysis, &pa);
+    const double D1 = GrowthFactor(GravPM.CP, GravPM.Time, 1.0);
+    for(i = 0; i < n; i++) {
+        powerspectrum_sum(&ps[i]);
+        powerspectrum_save(&ps[i], PowerOutputDir, names[i], GravPM.Time, D1);
+    }
+    for(i = n - 1; i >= 0; i--)
+        powerspectrum_free(&ps[i]);
+    ta_free(ps);
+}
+
+/* Particle moved to redshift space*/
+struct RSDParticle
+{
+    double Pos[3];
+    float Mass;
+};
+
+/* Measure the redshift space monopole, quadrupole and hexadecapole of the matter power,
+ * along the axis PMPowerLOSAxis. The particles gravitating on the PM mesh are moved along the axis
+ * by their peculiar velocity over aH and deposited to a mesh of their own.
+ * The velocities are those of the PM step, which lag the positions by half a kick.*/
+static void
+gravpm_power_multipoles(PetaPM * pm, DomainDecomp * ddecomp, PetaPMParticleStruct * pstruct, const char * PowerOutputDir)
+{
+    const int los = GravPMAnalysis.PMPowerLOSAxis;
+    const double BoxSize = PartManager->BoxSize;
+    /* The internal velocity is a^2 dx/dt*/
+    const double rsd = 1. / (GravPM.Time * GravPM.Time * hubble_function(GravPM.CP, GravPM.Time));
+
+    void * modes = petapm_alloc_modes(pm, 1);
+    struct RSDParticle * rsdpart = (struct RSDParticle *) mymalloc("PMRSDPart", (PartManager->NumPart + 1) * sizeof(struct RSDParticle));
+    int64_t i;
+    #pragma omp parallel for
+    for(i = 0; i < PartManager->NumPart; i++) {
+        int k;
+        for(k = 0; k < 3; k++)
+            rsdpart[i].Pos[k] = P[i].Pos[k];
+        rsdpart[i].Pos[los] += P[i].Vel[los] * rsd;
+        /* Same periodic wrapping as the drift*/
+        while(rsdpart[i].Pos[los] > BoxSize) rsdpart[i].Pos[los] -= BoxSize;
+        while(rsdpart[i].Pos[los] <= 0) rsdpart[i].Pos[los] += BoxSize;
+        rsdpart[i].Mass = P[i].Mass;
+    }
+    PetaPMParticleStruct rsdstruct = *pstruct;
+    rsdstruct.Parts = rsdpart;
+    rsdstruct.elsize = sizeof(rsdpart[0]);
+    rsdstruct.offset_pos = (char*) &rsdpart[0].Pos[0] - (char*) rsdpart;
+    rsdstruct.offset_mass = (char*) &rsdpart[0].Mass - (char*) rsdpart;
+    rsdstruct.RegionInd = NULL;
+    petapm_density_modes(pm, _prepare, &rsdstruct, ddecomp, modes, 0, 1);
+    myfree(rsdpart);
+
+    char * names[3];
+    int l;
+    for(l = 0; l < 3; l++)
+        names[l] = fastpm_strdup_printf("powerspectrum-rsd%c-ell%d", 'x' + los, 2 * l);
+    gravpm_save_power(pm, modes, 1, multipole_analysis, los, (const char **) names, 3, PowerOutputDir);
+    for(l = 2; l >= 0; l--)
+        myfree(names[l]);
+    myfree(modes);
+    walltime_measure("/PMgrav/PowerSpec");
+}
+
+/* Particle types of each species of the cross power*/
+#define NSPECIES 3
+static const char * species_names[NSPECIES] = {"cdm", "baryon", "nu"};
+
+static int species_of_type(const int type)
+{
+    switch(type) {
+        case 1:
+            return 0;
+        case 0:
+        case 4:
+        case 5:
+            return 1;
+        case 2:
+            return 2;
+    }
+    return -1;
+}
+
+/* Species deposited by species_is_active*/
+static int ActiveSpecies;
+
+static int species_is_active(int i)
+{
+    return species_of_type(P[i].Type) == ActiveSpecies;
+}
+
+/* Measure the auto and cross power of the CDM, baryons (gas, stars and black holes) and neutrino particles.
+ * Each species with particles is deposited to a mesh of its own. Neutrinos treated with linear response have no particles,
+ * and all neutrino particles are included even when they are passive tracers.*/
+static void
+gravpm_power_cross(PetaPM * pm, DomainDecomp * ddecomp, const char * PowerOutputDir)
+{
+    int64_t count[NSPECIES] = {0};
+    int64_t i;
+    for(i = 0; i < PartManager->NumPart; i++) {
+        const int s = species_of_type(P[i].Type);
+        if(s >= 0 && !P[i].IsGarbage && !P[i].Swallowed)
+            count[s]++;
+    }
+    MPI_Allreduce(MPI_IN_PLACE, count, NSPECIES, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    int species[NSPECIES];
+    int s, nspecies = 0;
+    for(s = 0; s < NSPECIES; s++)
+        if(count[s] > 0)
+            species[nspecies++] = s;
+
+    PetaPMParticleStruct pstruct = {
+        P,
+        sizeof(P[0]),
+        (char*) &P[0].Pos[0]  - (char*) P,
+        (char*) &P[0].Mass  - (char*) P,
+        NULL,
+        species_is_active,
+        PartManager->NumPart,
+    };
+    void * modes = petapm_alloc_modes(pm, nspecies);
+    for(s = 0; s < nspecies; s++) {
+        ActiveSpecies = species[s];
+        petapm_density_modes(pm, _prepare, &pstruct, ddecomp, modes, s, nspecies);
+    }
+
+    const int npair = nspecies * (nspecies + 1) / 2;
+    char * names[NSPECIES * (NSPECIES + 1) / 2];
+    int a, b, n = 0;
+    for(a = 0; a < nspecies; a++)
+        for(b = a; b < nspecies; b++)
+            names[n++] = fastpm_strdup_printf("powerspectrum-%s-%s", species_names[species[a]], species_names[species[b]]);
+    gravpm_save_power(pm, modes, nspecies, cross_analysis, 0, (const char **) names, npair, PowerOutputDir);
+    for(n = npair - 1; n >= 0; n--)
+        myfree(names[n]);
+    myfree(modes);
+    walltime_measure("/PMgrav/PowerSpec");
+}
+
 static void
 potential_transfer(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex *value)
 {
     const double asmth2 = pow((2 * M_PI) * pm->Asmth / pm->Nmesh,2);
-    double f = 1.0;
     const double smth = exp(-k2 * asmth2) / k2;
         /* fac is - 4pi G     (L / 2pi) **2 / L ** 3
      *        Gravity       k2            DFT (dk **3, but )
@@ -392,21 +821,9 @@ potential_transfer(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex *value)
     const double pot_factor = - pm->G / (M_PI * pm->BoxSize);	/* to get potential */
 
 
-    /* the CIC deconvolution kernel is
-     *
-     * sinc_unnormed(k_x L / 2 Nmesh) ** 2
-     *
-     * k_x = kpos * 2pi / L
-     *
-     * */
-    int k;
-    for(k = 0; k < 3; k ++) {
-        double tmp = (kpos[k] * M_PI) / pm->Nmesh;
-        tmp = sinc_unnormed(tmp);
-        f *= 1. / (tmp * tmp);
-    }
+    const double f = window_deconvolution(pm, kpos);
     /*
-     * first decovolution is CIC in par->mesh
+     * first decovolution is the mass assignment in par->mesh
      * second decovolution is correcting readout
      * I don't understand the second yet!
      * */
@@ -481,7 +898,11 @@ static void force_transfer(PetaPM * pm, int k, pfft_complex * value) {
      *
      * filter is   i K(w)
      * */
-    double fac = -1 * diff_kernel (k * (2 * M_PI / pm->Nmesh)) * (pm->Nmesh / pm->BoxSize);
+    const double w = k * (2 * M_PI / pm->Nmesh);
+    /* The finite difference kernel suits CIC, whose deconvolution it partly offsets.
+     * The smoother TSC and PCS windows need the exact gradient to gain from their lower aliasing.*/
+    const double kernel = (pm->Window > PETAPM_WINDOW_CIC) ? w : diff_kernel(w);
+    double fac = -1 * kernel * (pm->Nmesh / pm->BoxSize);
     tmp0 = - value[0][1] * fac;
     tmp1 = value[0][0] * fac;
     value[0][0] = tmp0;
@@ -0,0 +1,395 @@
+#include <mpi.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "utils.h"
+
+#include "forcetree.h"
+#include "gravity.h"
+#include "walltime.h"
+
+/*! \file gravshort-fmm.c
+ *  \brief Fast multipole short-range gravity between particles on this processor.
+ *
+ *  This computes the short-range force between local particles with a dual tree walk
+ *  over the local part of the force tree. Pairs of well-separated cells interact through
+ *  the monopole of the source and a first order local expansion (the field and its gradient)
+ *  about the center of mass of the sink. Each cell-cell interaction is applied to both cells,
+ *  so momentum is conserved. Local expansions are then passed down the tree to the particles.
+ *  Nearby leaves interact particle by particle. The cost is O(N) rather than O(N log N).
+ *
+ *  Forces from particles on other processors are computed by the tree walk in gravshort-tree.c,
+ *  which skips the local top-level subtrees when the FMM is in use.
+ */
+
+/* Local expansion of the short-range field about the center of mass of a node:
+ * acceleration, its (symmetric) gradient and the potential. Gradient order is xx, yy, zz, xy, xz, yz.*/
+struct FMMLocal
+{
+    double acc[3];
+    double jac[6];
+    double pot;
+};
+
+struct FMMData
+{
+    const ForceTree * tree;
+    /* Local expansions, indexed by node - firstnode*/
+    struct FMMLocal * Local;
+    /* 1 if the node contains an active particle*/
+    char * NodeSink;
+    /* 1 if the particle is active*/
+    char * IsSink;
+    double (*Acc)[3];
+    double * Pot;
+    double cellsize;
+    double Rcut2;
+    double h;
+    double theta;
+    double BoxSize;
+};
+
+/* Number of dual tree walk levels for which new tasks are spawned*/
+#define FMM_TASK_DEPTH 6
+
+#define FMM_LOCAL(fmm, no) (&(fmm)->Local[(no) - (fmm)->tree->firstnode])
+
+static inline int
+fmm_node_is_leaf(const struct NODE * nop)
+{
+    return nop->f.ChildType == PARTICLE_NODE_TYPE;
+}
+
+/* Largest distance from the center of mass to a point in the node*/
+static inline double
+fmm_node_radius(const struct NODE * nop)
+{
+    double r2 = 0;
+    int i;
+    for(i = 0; i < 3; i++) {
+        const double dx = fabs(nop->mom.cofm[i] - nop->center[i]) + 0.5 * nop->len;
+        r2 += dx * dx;
+    }
+    return sqrt(r2);
+}
+
+/* Add to a local expansion the field of a point mass at relative position d.
+ * fac, fac2 and facpot are the windowed 1/r^3, 3/r^5 and -1/r.*/
+static inline void
+fmm_add_to_local(struct FMMLocal * L, const double mass, const double d[3], const double fac, const double fac2, const double facpot)
+{
+    const double mfac = mass * fac, mfac2 = mass * fac2;
+    double jac[6];
+    jac[0] = mfac2 * d[0] * d[0] - mfac;
+    jac[1] = mfac2 * d[1] * d[1] - mfac;
+    jac[2] = mfac2 * d[2] * d[2] - mfac;
+    jac[3] = mfac2 * d[0] * d[1];
+    jac[4] = mfac2 * d[0] * d[2];
+    jac[5] = mfac2 * d[1] * d[2];
+    int i;
+    for(i = 0; i < 3; i++) {
+        const double acc = mfac * d[i];
+        #pragma omp atomic update
+        L->acc[i] += acc;
+    }
+    for(i = 0; i < 6; i++) {
+        #pragma omp atomic update
+        L->jac[i] += jac[i];
+    }
+    const double pot = mass * facpot;
+    #pragma omp atomic update
+    L->pot += pot;
+}
+
+/* Interaction between two well separated cells: monopole of each onto the local expansion of the other.
+ * Both the source monopole and the first order local expansion have errors of second order in the opening angle.*/
+static void
+fmm_cell_cell(struct FMMData * fmm, const int A, const int B, const double d[3], const double r)
+{
+    const struct NODE * nA = &fmm->tree->Nodes[A];
+    const struct NODE * nB = &fmm->tree->Nodes[B];
+    double fac = 1 / (r * r * r);
+    double fac2 = 3 * fac / (r * r);
+    double fac3 = 0, facpot = -1 / r, dummy = 1;
+    if(grav_apply_short_range_window_quad(r, &fac, &fac2, &fac3, fmm->cellsize))
+        return;
+    grav_apply_short_range_window(r, &dummy, &facpot, fmm->cellsize);
+    /* d points from B to A*/
+    if(fmm->NodeSink[B - fmm->tree->firstnode])
+        fmm_add_to_local(FMM_LOCAL(fmm, B), nA->mom.mass, d, fac, fac2, facpot);
+    if(fmm->NodeSink[A - fmm->tree->firstnode]) {
+        const double md[3] = {-d[0], -d[1], -d[2]};
+        fmm_add_to_local(FMM_LOCAL(fmm, A), nB->mom.mass, md, fac, fac2, facpot);
+    }
+}
+
+/* Direct interaction of the active particles in leaf A with all particles in leaf B*/
+static void
+fmm_leaf_leaf(struct FMMData * fmm, const int A, const int B)
+{
+    const struct NodeChild * nA = &fmm->tree->NodesCold[A].s;
+    const struct NodeChild * nB = &fmm->tree->NodesCold[B].s;
+    double x[NMAXCHILD], y[NMAXCHILD], z[NMAXCHILD], mass[NMAXCHILD];
+    int i, j;
+    for(j = 0; j < nB->noccupied; j++) {
+        const struct particle_data * pp = &P[nB->suns[j]];
+        x[j] = pp->Pos[0];
+        y[j] = pp->Pos[1];
+        z[j] = pp->Pos[2];
+        mass[j] = pp->Mass;
+    }
+    for(i = 0; i < nA->noccupied; i++) {
+        const int p = nA->suns[i];
+        if(!fmm->IsSink[p])
+            continue;
+        double acc[3] = {0}, pot = 0;
+        grav_short_range_accn_block(nB->noccupied, x, y, z, mass, P[p].Pos, fmm->BoxSize, fmm->h, fmm->cellsize, acc, &pot);
+        for(j = 0; j < 3; j++) {
+            #pragma omp atomic update
+            fmm->Acc[p][j] += acc[j];
+        }
+        #pragma omp atomic update
+        fmm->Pot[p] += pot;
+        /* Work estimate for the domain decomposition*/
+        #pragma omp atomic update
+        P[p].WalkCost += nB->noccupied;
+    }
+}
+
+static void fmm_interact(struct FMMData * fmm, const int A, const int B, const int depth);
+
+/* Interact the children of A with B, or with each other if A == B.*/
+static void
+fmm_split(struct FMMData * fmm, const int A, const int B, const int depth)
+{
+    const int * suns = fmm->tree->NodesCold[A].s.suns;
+    int i, j;
+    for(i = 0; i < NMAXCHILD && suns[i] >= 0; i++) {
+        /* Each pair of children once*/
+        for(j = i; j < NMAXCHILD; j++) {
+            const int ci = suns[i];
+            const int other = (A == B) ? suns[j] : B;
+            if(other < 0)
+                break;
+            if(depth < FMM_TASK_DEPTH) {
+                #pragma omp task default(none) firstprivate(ci, other, depth) shared(fmm)
+                fmm_interact(fmm, ci, other, depth + 1);
+            }
+            else
+                fmm_interact(fmm, ci, other, depth + 1);
+            if(A != B)
+                break;
+        }
+    }
+}
+
+/* Dual tree walk. Computes the interactions between all particles in A and all particles in B.
+ * If A == B, the interactions within A. Each pair of cells is visited once.*/
+static void
+fmm_interact(struct FMMData * fmm, const int A, const int B, const int depth)
+{
+    const ForceTree * tree = fmm->tree;
+    const struct NODE * nA = &tree->Nodes[A];
+    const struct NODE * nB = &tree->Nodes[B];
+
+    if(!fmm->NodeSink[A - tree->firstnode] && !fmm->NodeSink[B - tree->firstnode])
+        return;
+    if(nA->mom.mass == 0 || nB->mom.mass == 0)
+        return;
+
+    if(A == B) {
+        if(fmm_node_is_leaf(nA))
+            fmm_leaf_leaf(fmm, A, A);
+        else
+            fmm_split(fmm, A, A, depth);
+        return;
+    }
+
+    /* Discard cells which are further apart than the short-range cutoff*/
+    double gap2 = 0, d[3], r2 = 0;
+    int i;
+    for(i = 0; i < 3; i++) {
+        const double gap = fabs(NEAREST(nA->center[i] - nB->center[i], fmm->BoxSize)) - 0.5 * (nA->len + nB->len);
+        if(gap > 0)
+            gap2 += gap * gap;
+        d[i] = NEAREST(nA->mom.cofm[i] - nB->mom.cofm[i], fmm->BoxSize);
+        r2 += d[i] * d[i];
+    }
+    if(gap2 > fmm->Rcut2)
+        return;
+
+    /* Accept the cell pair if they are well separated and further apart than the softening*/
+    const double r = sqrt(r2);
+    const double rsum = fmm_node_radius(nA) + fmm_node_radius(nB);
+    if(rsum < fmm->theta * r && r - rsum > fmm->h) {
+        fmm_cell_cell(fmm, A, B, d, r);
+        return;
+    }
+
+    const int leafA = fmm_node_is_leaf(nA), leafB = fmm_node_is_leaf(nB);
+    if(leafA && leafB) {
+        fmm_leaf_leaf(fmm, A, B);
+        fmm_leaf_leaf(fmm, B, A);
+    }
+    /* Split the larger cell*/
+    else if(leafB || (!leafA && nA->len >= nB->len))
+        fmm_split(fmm, A, B, depth);
+    else
+        fmm_split(fmm, B, A, depth);
+}
+
+/* Shift the local expansion L to an offset dx and add it to out*/
+static void
+fmm_shift_local(const struct FMMLocal * L, const double dx[3], double acc[3], double * pot)
+{
+    const double * J = L->jac;
+    double Jdx[3];
+    Jdx[0] = J[0] * dx[0] + J[3] * dx[1] + J[4] * dx[2];
+    Jdx[1] = J[3] * dx[0] + J[1] * dx[1] + J[5] * dx[2];
+    Jdx[2] = J[4] * dx[0] + J[5] * dx[1] + J[2] * dx[2];
+    int i;
+    double adx = 0, dJdx = 0;
+    for(i = 0; i < 3; i++) {
+        acc[i] += L->acc[i] + Jdx[i];
+        adx += L->acc[i] * dx[i];
+        dJdx += dx[i] * Jdx[i];
+    }
+    /* The gradient of the potential is minus the acceleration*/
+    *pot += L->pot - adx - 0.5 * dJdx;
+}
+
+/* Pass local expansions down to the children of a node, and from leaves to the particles.*/
+static void
+fmm_push_down(struct FMMData * fmm, const int no)
+{
+    const ForceTree * tree = fmm->tree;
+    const struct NODE * nop = &tree->Nodes[no];
+    const struct NodeChild * ns = &tree->NodesCold[no].s;
+    if(!fmm->NodeSink[no - tree->firstnode])
+        return;
+    const struct FMMLocal * L = FMM_LOCAL(fmm, no);
+    int i, j;
+    if(fmm_node_is_leaf(nop)) {
+        for(i = 0; i < ns->noccupied; i++) {
+            const int p = ns->suns[i];
+            if(!fmm->IsSink[p])
+                continue;
+            double dx[3];
+            for(j = 0; j < 3; j++)
+                dx[j] = NEAREST(P[p].Pos[j] - nop->mom.cofm[j], fmm->BoxSize);
+            fmm_shift_local(L, dx, fmm->Acc[p], &fmm->Pot[p]);
+            P[p].WalkCost += 1;
+        }
+        return;
+    }
+    for(i = 0; i < NMAXCHILD && ns->suns[i] >= 0; i++) {
+        const int child = ns->suns[i];
+        struct FMMLocal * Lc = FMM_LOCAL(fmm, child);
+        double dx[3], acc[3] = {0}, pot = 0;
+        for(j = 0; j < 3; j++)
+            dx[j] = NEAREST(tree->Nodes[child].mom.cofm[j] - nop->mom.cofm[j], fmm->BoxSize);
+        fmm_shift_local(L, dx, acc, &pot);
+        for(j = 0; j < 3; j++)
+            Lc->acc[j] += acc[j];
+        for(j = 0; j < 6; j++)
+            Lc->jac[j] += L->jac[j];
+        Lc->pot += pot;
+        #pragma omp task default(none) firstprivate(child) shared(fmm)
+        fmm_push_down(fmm, child);
+    }
+}
+
+/* Mark the nodes containing active particles. Returns 1 if this node contains an active particle.*/
+static int
+fmm_mark_sinks(struct FMMData * fmm, const int no)
+{
+    const ForceTree * tree = fmm->tree;
+    const struct NODE * nop = &tree->Nodes[no];
+    const struct NodeChild * ns = &tree->NodesCold[no].s;
+    int i, sink = 0;
+    if(fmm_node_is_leaf(nop)) {
+        for(i = 0; i < ns->noccupied; i++)
+            sink |= fmm->IsSink[ns->suns[i]];
+    }
+    else {
+        for(i = 0; i < NMAXCHILD && ns->suns[i] >= 0; i++)
+            sink |= fmm_mark_sinks(fmm, ns->suns[i]);
+    }
+    fmm->NodeSink[no - tree->firstnode] = sink;
+    return sink;
+}
+
+void
+grav_short_fmm_local(const ActiveParticles * act, const ForceTree * tree, const double cellsize, const double Rcut, const double h, const double theta, double (*Acc)[3], double * Pot)
+{
+    struct FMMData fmm[1] = {0};
+    fmm->tree = tree;
+    fmm->cellsize = cellsize;
+    fmm->Rcut2 = Rcut * Rcut;
+    fmm->h = h;
+    fmm->theta = theta;
+    fmm->BoxSize = tree->BoxSize;
+    fmm->Acc = Acc;
+    fmm->Pot = Pot;
+
+    int64_t i;
+    memset(Acc, 0, PartManager->NumPart * sizeof(Acc[0]));
+    memset(Pot, 0, PartManager->NumPart * sizeof(Pot[0]));
+
+    fmm->IsSink = (char *) mymalloc("FMMIsSink", PartManager->NumPart * sizeof(char));
+    memset(fmm->IsSink, 0, PartManager->NumPart * sizeof(char));
+    #pragma omp parallel for
+    for(i = 0; i < act->NumActiveParticle; i++) {
+        const int p = act->ActiveParticle ? act->ActiveParticle[i] : i;
+        if(P[p].IsGarbage || P[p].Swallowed)
+            continue;
+        fmm->IsSink[p] = 1;
+    }
+    fmm->NodeSink = (char *) mymalloc("FMMNodeSink", tree->numnodes * sizeof(char));
+    memset(fmm->NodeSink, 0, tree->numnodes * sizeof(char));
+    fmm->Local = (struct FMMLocal *) mymalloc("FMMLocal", tree->numnodes * sizeof(struct FMMLocal));
+    memset(fmm->Local, 0, tree->numnodes * sizeof(struct FMMLocal));
+
+    /* The local top-level subtrees*/
+    int * toplocal = ta_malloc("toplocal", int, tree->NTopLeaves);
+    int ntoplocal = 0;
+    for(i = 0; i < tree->NTopLeaves; i++)
+        if(tree->TopLeaves[i].Task == tree->ThisTask)
+            toplocal[ntoplocal++] = tree->TopLeaves[i].treenode;
+
+    #pragma omp parallel
+    #pragma omp single nowait
+    {
+        int j, k;
+        for(j = 0; j < ntoplocal; j++) {
+            const int no = toplocal[j];
+            #pragma omp task default(none) firstprivate(no) shared(fmm)
+            fmm_mark_sinks(fmm, no);
+        }
+        #pragma omp taskwait
+        /* Interactions within and between the local subtrees.
+         * The taskgroup waits for all the tasks spawned by the dual tree walk.*/
+        #pragma omp taskgroup
+        {
+            for(j = 0; j < ntoplocal; j++)
+                for(k = j; k < ntoplocal; k++) {
+                    const int A = toplocal[j], B = toplocal[k];
+                    #pragma omp task default(none) firstprivate(A, B) shared(fmm)
+                    fmm_interact(fmm, A, B, 0);
+                }
+        }
+        for(j = 0; j < ntoplocal; j++) {
+            const int no = toplocal[j];
+            #pragma omp task default(none) firstprivate(no) shared(fmm)
+            fmm_push_down(fmm, no);
+        }
+    }
+
+    ta_free(toplocal);
+    myfree(fmm->Local);
+    myfree(fmm->NodeSink);
+    myfree(fmm->IsSink);
+    walltime_measure("/Tree/FMM");
+}
@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <limits.h>
+#include <omp.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ipc.h>
@@ -23,7 +25,8 @@
  *  active local particles, and particles are exported to other processors if
  *  needed, where they can receive additional force contributions. If the
  *  TreePM algorithm is enabled, the force computed will only be the
- *  short-range part.
+ *  short-range part. With TreeUseLET the remote tree nodes are instead imported
+ *  into a locally essential tree before the walk, see grav_short_let_build.
  */
 
 static struct gravshort_tree_params TreeParams;
@@ -72,6 +75,11 @@ set_gravshort_tree_params(ParameterSet * ps)
         TreeParams.Rcut = param_get_double(ps, "TreeRcut");
         TreeParams.FractionalGravitySoftening = param_get_double(ps, "GravitySoftening");
         TreeParams.MaxBHOpeningAngle = param_get_double(ps, "MaxBHOpeningAngle");
+        TreeParams.TreeUseQuadrupole = param_get_int(ps, "TreeUseQuadrupole");
+        TreeParams.TreeGroupSize = param_get_int(ps, "TreeGroupSize");
+        TreeParams.TreeUseFMM = param_get_int(ps, "TreeUseFMM");
+        TreeParams.FMMOpeningAngle = param_get_double(ps, "FMMOpeningAngle");
+        TreeParams.TreeUseLET = param_get_int(ps, "TreeUseLET");
     }
     MPI_Bcast(&TreeParams, sizeof(struct gravshort_tree_params), MPI_BYTE, 0, MPI_COMM_WORLD);
 }
@@ -81,6 +89,15 @@ force_treeev_shortrange(TreeWalkQueryGravShort * input,
         TreeWalkResultGravShort * output,
         LocalTreeWalk * lv);
 
+int
+force_treeev_shortrange_group(const int ntarget,
+        TreeWalkQueryGravShort * input,
+        TreeWalkResultGravShort * output,
+        LocalTreeWalk * lv);
+
+static ForceTree
+grav_short_let_build(const ActiveParticles * act, const ForceTree * tree, const double rcut, const double G);
+
 /*! This function computes the gravitational forces for all active particles from all particles in the tree.
  * Particles are only exported to other processors when really
  *  needed, thereby allowing a good use of the communication buffer.
@@ -112,8 +129,23 @@ grav_short_tree(const ActiveParticles * act, PetaPM * pm, ForceTree * tree, MyFl
     if(!tree->moments_computed_flag)
         endrun(2, "Gravtree called before tree moments computed!\n");
 
+    priv.LocalAcc = NULL;
+    priv.LocalPot = NULL;
+    if(TreeParams.TreeUseFMM) {
+        /* Forces from local particles: the tree walk then only does the other processors*/
+        priv.LocalAcc = (double (*) [3]) mymalloc("FMMAcc", PartManager->NumPart * sizeof(priv.LocalAcc[0]));
+        priv.LocalPot = (double *) mymalloc("FMMPot", PartManager->NumPart * sizeof(priv.LocalPot[0]));
+        grav_short_fmm_local(act, tree, priv.cellsize, priv.Rcut, FORCE_SOFTENING(), TreeParams.FMMOpeningAngle, priv.LocalAcc, priv.LocalPot);
+    }
+
+    /* Import the remote nodes the walk needs, so no particles are exported*/
+    ForceTree lettree = {0};
+    if(TreeParams.TreeUseLET)
+        lettree = grav_short_let_build(act, tree, priv.Rcut, priv.G);
+
     tw->ev_label = "GRAVTREE";
     tw->visit = (TreeWalkVisitFunction) force_treeev_shortrange;
+    tw->RecordCost = 1;
     /* gravity applies to all gravitationally active particles.*/
     tw->haswork = NULL;
     tw->reduce = (TreeWalkReduceResultFunction) grav_short_reduce;
@@ -122,8 +154,15 @@ grav_short_tree(const ActiveParticles * act, PetaPM * pm, ForceTree * tree, MyFl
     tw->query_type_elsize = sizeof(TreeWalkQueryGravShort);
     tw->result_type_elsize = sizeof(TreeWalkResultGravShort);
     tw->fill = (TreeWalkFillQueryFunction) grav_short_copy;
-    tw->tree = tree;
+    tw->tree = TreeParams.TreeUseLET ? &lettree : tree;
     tw->priv = &priv;
+    if(TreeParams.TreeGroupSize > 1 && !TreeParams.TreeUseFMM) {
+        tw->visit_group = (TreeWalkVisitGroupFunction) force_treeev_shortrange_group;
+        tw->GroupMaxSize = TreeParams.TreeGroupSize;
+        /* Keep groups small compared to the softening, so the conservative group opening criterion
+         * opens few extra nodes and the interactions are close to those of a single particle.*/
+        tw->GroupMaxExtent = FORCE_SOFTENING();
+    }
 
     treewalk_run(tw, act->ActiveParticle, act->NumActiveParticle);
 
@@ -148,47 +187,64 @@ grav_short_tree(const ActiveParticles * act, PetaPM * pm, ForceTree * tree, MyFl
      * avoiding the fully open O(N^2) case.*/
     if(TreeParams.TreeUseBH > 1)
         TreeParams.TreeUseBH = 0;
+    if(lettree.Nodes_base)
+        myfree(lettree.Nodes_base);
+    if(priv.LocalAcc) {
+        myfree(priv.LocalPot);
+        myfree(priv.LocalAcc);
+    }
     if(accelstorealloc)
         myfree(priv.Accel);
 }
 
-/* Add the acceleration from a node or particle to the output structure,
- * computing the short-range kernel and softening.*/
+/* Add the quadrupole correction to the acceleration from a node.
+ * quad is the second mass moment about the center of mass (the dipole vanishes there).
+ * With g(r) the softened short-range Green's function, and g1 = g'/r, g2 = g1'/r, g3 = g2'/r,
+ * the correction is a = -1/2 (g3 q + g2 T) dx - g2 Q.dx, where q = dx.Q.dx and T = Tr Q.
+ * fac = -g1, fac2 = g2 and fac3 = -g3 are computed here from the same spline kernel as grav_short_range_accn_block.*/
 static void
-apply_accn_to_output(TreeWalkResultGravShort * output, const double dx[3], const double r2, const double mass, const double cellsize)
+apply_quadrupole_accn_to_output(TreeWalkResultGravShort * output, const double dx[3], const double r2, const MyFloat quad[6], const double cellsize)
 {
     const double r = sqrt(r2);
-
     const double h = FORCE_SOFTENING();
-    double fac = mass / (r2 * r);
-    double facpot = -mass / r;
+    double fac = 1 / (r2 * r);
+    double fac2 = 3 / (r2 * r2 * r);
+    double fac3 = 15 / (r2 * r2 * r2 * r);
 
     if(r2 < h*h)
     {
-        double wp;
         const double h3_inv = 1.0 / h / h / h;
+        const double h5_inv = h3_inv / h / h;
+        const double h7_inv = h5_inv / h / h;
         const double u = r / h;
         if(u < 0.5) {
-            fac = mass * h3_inv * (10.666666666667 + u * u * (32.0 * u - 38.4));
-            wp = -2.8 + u * u * (5.333333333333 + u * u * (6.4 * u - 9.6));
+            fac = h3_inv * (10.666666666667 + u * u * (32.0 * u - 38.4));
+            fac2 = h5_inv * (76.8 - 96.0 * u);
+            fac3 = h7_inv * 96.0 / u;
         }
         else {
-            fac =
-                mass * h3_inv * (21.333333333333 - 48.0 * u +
-                        38.4 * u * u - 10.666666666667 * u * u * u - 0.066666666667 / (u * u * u));
-            wp =
-                -3.2 + 0.066666666667 / u + u * u * (10.666666666667 +
-                        u * (-16.0 + u * (9.6 - 2.133333333333 * u)));
+            const double u2 = u * u;
+            fac = h3_inv * (21.333333333333 - 48.0 * u +
+                        38.4 * u2 - 10.666666666667 * u2 * u - 0.066666666667 / (u2 * u));
+            fac2 = h5_inv * (48.0 / u - 76.8 + 32.0 * u - 0.2 / (u2 * u2 * u));
+            fac3 = h7_inv * (48.0 / u2 - 32.0 - 1.0 / (u2 * u2 * u2)) / u;
         }
-        facpot = mass / h * wp;
     }
 
-    if(0 == grav_apply_short_range_window(r, &fac, &facpot, cellsize)) {
-        int i;
-        for(i = 0; i < 3; i++)
-            output->Acc[i] += dx[i] * fac;
-        output->Potential += facpot;
-    }
+    if(grav_apply_short_range_window_quad(r, &fac, &fac2, &fac3, cellsize))
+        return;
+
+    double Qdx[3];
+    Qdx[0] = quad[0] * dx[0] + quad[3] * dx[1] + quad[4] * dx[2];
+    Qdx[1] = quad[3] * dx[0] + quad[1] * dx[1] + quad[5] * dx[2];
+    Qdx[2] = quad[4] * dx[0] + quad[5] * dx[1] + quad[2] * dx[2];
+    const double q = dx[0] * Qdx[0] + dx[1] * Qdx[1] + dx[2] * Qdx[2];
+    const double trace = quad[0] + quad[1] + quad[2];
+    const double facdx = 0.5 * (fac3 * q - fac2 * trace);
+    int i;
+    for(i = 0; i < 3; i++)
+        output->Acc[i] += facdx * dx[i] - fac2 * Qdx[i];
+    output->Potential += -0.5 * (fac2 * q - fac * trace);
 }
 
 /* Check whether a node should be discarded completely, its contents not contributing
@@ -198,8 +254,9 @@ static int
 shall_we_discard_node(const double len, const double r2, const double center[3], const double inpos[3], const double BoxSize, const double rcut, const double rcut2)
 {
     /* This checks the distance from the node center of mass
-     * is greater than the cutoff. */
-    if(r2 > rcut2)
+     * is greater than the cutoff. Nodes of zero size are particles in a locally essential tree:
+     * like the particles in an opened leaf, these are never discarded.*/
+    if(r2 > rcut2 && len > 0)
     {
         /* check whether we can stop walking along this branch */
         const double eff_dist = rcut + 0.5 * len;
@@ -217,11 +274,18 @@ shall_we_discard_node(const double len, const double r2, const double center[3],
  * If it should be discarded, 0 is returned.
  * If it should be used, 1 is returned, otherwise zero is returned. */
 static int
-shall_we_open_node(const double len, const double mass, const double r2, const double center[3], const double inpos[3], const double BoxSize, const double aold, const int TreeUseBH, const double BHOpeningAngle2)
+shall_we_open_node(const double len, const double mass, const double r2, const double center[3], const double inpos[3], const double BoxSize, const double aold, const int TreeUseBH, const double BHOpeningAngle2, const int TreeUseQuadrupole)
 {
-    /* Check the relative acceleration opening condition*/
-    if((TreeUseBH == 0) && (mass * len * len > r2 * r2 * aold))
-         return 1;
+    /* Check the relative acceleration opening condition.
+     * With quadrupoles the leading error term is the octupole, which is smaller by a further factor of len / r. */
+    if(TreeUseBH == 0) {
+        if(TreeUseQuadrupole) {
+            if(mass * len * len * len > r2 * r2 * sqrt(r2) * aold)
+                return 1;
+        }
+        else if(mass * len * len > r2 * r2 * aold)
+            return 1;
+    }
 
     double bhangle = len * len  / r2;
      /*Check Barnes-Hut opening angle*/
@@ -239,6 +303,65 @@ shall_we_open_node(const double len, const double mass, const double r2, const d
     return 0;
 }
 
+/* Number of interactions copied into the contiguous buffers passed to grav_short_range_accn_block*/
+#define GRAVSHORT_BLOCK 128
+
+/* Evaluate an interaction list, particles in cands and nodes in nodes, for each of ntarget particles.
+ * Positions and masses are copied in blocks out of the particle and node structs into contiguous arrays,
+ * so that the force kernel vectorises. Each block is reused for every target.*/
+static void
+gravshort_evaluate_list(const int ntarget, TreeWalkQueryGravShort * input, TreeWalkResultGravShort * output,
+        const int * cands, const int numcand, const int * nodes, const int nnodes, const ForceTree * tree, const double cellsize, const int TreeUseQuadrupole)
+{
+    const double BoxSize = tree->BoxSize;
+    const double h = FORCE_SOFTENING();
+    const int ntotal = numcand + nnodes;
+    double x[GRAVSHORT_BLOCK], y[GRAVSHORT_BLOCK], z[GRAVSHORT_BLOCK], mass[GRAVSHORT_BLOCK];
+    int start, j;
+    for(start = 0; start < ntotal; start += GRAVSHORT_BLOCK) {
+        const int nblock = ntotal - start < GRAVSHORT_BLOCK ? ntotal - start : GRAVSHORT_BLOCK;
+        int k;
+        for(k = 0; k < nblock; k++) {
+            const int n = start + k;
+            if(n < numcand) {
+                const struct particle_data * pp = &P[cands[n]];
+                x[k] = pp->Pos[0];
+                y[k] = pp->Pos[1];
+                z[k] = pp->Pos[2];
+                mass[k] = pp->Mass;
+            }
+            else {
+                const struct NODE * nop = &tree->Nodes[nodes[n - numcand]];
+                x[k] = nop->mom.cofm[0];
+                y[k] = nop->mom.cofm[1];
+                z[k] = nop->mom.cofm[2];
+                mass[k] = nop->mom.mass;
+            }
+        }
+        for(j = 0; j < ntarget; j++) {
+            double acc[3] = {0}, pot = 0;
+            grav_short_range_accn_block(nblock, x, y, z, mass, input[j].base.Pos, BoxSize, h, cellsize, acc, &pot);
+            for(k = 0; k < 3; k++)
+                output[j].Acc[k] += acc[k];
+            output[j].Potential += pot;
+        }
+    }
+    if(!TreeUseQuadrupole)
+        return;
+    for(j = 0; j < ntarget; j++) {
+        int n;
+        for(n = 0; n < nnodes; n++) {
+            const struct NODE * nop = &tree->Nodes[nodes[n]];
+            double dx[3];
+            int i;
+            for(i = 0; i < 3; i++)
+                dx[i] = NEAREST(nop->mom.cofm[i] - input[j].base.Pos[i], BoxSize);
+            const double r2 = dx[0] * dx[0] + dx[1] * dx[1] + dx[2] * dx[2];
+            apply_quadrupole_accn_to_output(&output[j], dx, r2, tree->NodesCold[nodes[n]].quad, cellsize);
+        }
+    }
+}
+
 /*! In the TreePM algorithm, the tree is walked only locally around the
  *  target coordinate.  Tree nodes that fall outside a box of half
  *  side-length Rcut= RCUT*ASMTH*MeshSize can be discarded. The short-range
@@ -262,6 +385,7 @@ int force_treeev_shortrange(TreeWalkQueryGravShort * input,
     const double rcut2 = rcut * rcut;
     const double aold = TreeParams.ErrTolForceAcc * input->OldAcc;
     const int TreeUseBH = TreeParams.TreeUseBH;
+    const int TreeUseQuadrupole = TreeParams.TreeUseQuadrupole;
     double BHOpeningAngle2 = TreeParams.BHOpeningAngle * TreeParams.BHOpeningAngle;
     /* Enforce a maximum opening angle even for relative acceleration criterion, to avoid
      * pathological cases. Default value is 0.9, from Volker Springel.*/
@@ -271,13 +395,27 @@ int force_treeev_shortrange(TreeWalkQueryGravShort * input,
     /*Input particle data*/
     const double * inpos = input->base.Pos;
 
+    /* Particle candidates are stored at the start of ngblist, accepted nodes at the end.*/
+    const int listsize = tree->NumParticles;
+
+    /* With the FMM, forces from local particles are already computed,
+     * so we walk only the parts of the tree on other processors.*/
+    const int RemoteOnly = GRAV_GET_PRIV(lv->tw)->LocalAcc && lv->mode != TREEWALK_GHOSTS;
+    if(RemoteOnly && lv->mode == TREEWALK_PRIMARY) {
+        int i;
+        for(i = 0; i < 3; i++)
+            output->Acc[i] += GRAV_GET_PRIV(lv->tw)->LocalAcc[lv->target][i];
+        output->Potential += GRAV_GET_PRIV(lv->tw)->LocalPot[lv->target];
+    }
+
     /*Start the tree walk*/
     int listindex, ninteractions=0;
 
     /* Primary treewalk only ever has one nodelist entry*/
     for(listindex = 0; listindex < NODELISTLENGTH; listindex++)
     {
-        int numcand = 0;
+        int numcand = 0, nnodes = 0;
+        int * nodes = lv->ngblist + listsize;
         /* Use the next node in the node list if we are doing a secondary walk.
          * For a primary walk the node list only ever contains one node. */
         int no = input->base.NodeList[listindex];
@@ -307,24 +445,43 @@ int force_treeev_shortrange(TreeWalkQueryGravShort * input,
                 continue;
             }
 
+            if(RemoteOnly && nop->f.TopLevel && nop->f.DependsOnLocalMass) {
+                /* Local top-level leaf: done by the FMM*/
+                if(!nop->f.InternalTopLevel) {
+                    no = nop->sibling;
+                    continue;
+                }
+                /* Top-level node containing local particles: always open so we only use remote mass*/
+                no = nop->first;
+                continue;
+            }
+
             /* This node accelerates the particle directly, and is not opened.*/
-            int open_node = shall_we_open_node(nop->len, nop->mom.mass, r2, nop->center, inpos, BoxSize, aold, TreeUseBH, BHOpeningAngle2);
+            int open_node = shall_we_open_node(nop->len, nop->mom.mass, r2, nop->center, inpos, BoxSize, aold, TreeUseBH, BHOpeningAngle2, TreeUseQuadrupole);
 
             if(!open_node)
             {
-                /* ok, node can be used */
-                no = nop->sibling;
-                if(lv->mode != TREEWALK_TOPTREE) {
-                    /* Compute the acceleration and apply it to the output structure*/
-                    apply_accn_to_output(output, dx, r2, nop->mom.mass, cellsize);
+                /* ok, node can be used.
+                 * Add it to the end of the interaction list, evaluating the list if it is full.*/
+                if(lv->mode != TREEWALK_TOPTREE && nop->mom.mass > 0) {
+                    if(numcand + nnodes + 1 > listsize) {
+                        gravshort_evaluate_list(1, input, output, lv->ngblist, numcand, nodes, nnodes, tree, cellsize, TreeUseQuadrupole);
+                        ninteractions += numcand + nnodes;
+                        numcand = nnodes = 0;
+                        nodes = lv->ngblist + listsize;
+                    }
+                    nodes--;
+                    nodes[0] = no;
+                    nnodes++;
                 }
+                no = nop->sibling;
                 continue;
             }
 
             if(lv->mode == TREEWALK_TOPTREE) {
                 if(nop->f.ChildType == PSEUDO_NODE_TYPE) {
                     /* Export the pseudo particle*/
-                    if(-1 == treewalk_export_particle(lv, nop->s.suns[0]))
+                    if(-1 == treewalk_export_particle(lv, nop->first))
                         return -1;
                     /* Move sideways*/
                     no = nop->sibling;
@@ -335,16 +492,23 @@ int force_treeev_shortrange(TreeWalkQueryGravShort * input,
                     no = nop->sibling;
                     continue;
                 }
-                no = nop->s.suns[0];
+                no = nop->first;
             }
             else {
                 /* Now we have a cell that needs to be opened.
                 * If it contains particles we can add them directly here */
                 if(nop->f.ChildType == PARTICLE_NODE_TYPE)
                 {
+                    const struct NodeChild * ns = &tree->NodesCold[no].s;
+                    if(numcand + nnodes + ns->noccupied > listsize) {
+                        gravshort_evaluate_list(1, input, output, lv->ngblist, numcand, nodes, nnodes, tree, cellsize, TreeUseQuadrupole);
+                        ninteractions += numcand + nnodes;
+                        numcand = nnodes = 0;
+                        nodes = lv->ngblist + listsize;
+                    }
                     /* Loop over child particles*/
-                    for(i = 0; i < nop->s.noccupied; i++) {
-                        int pp = nop->s.suns[i];
+                    for(i = 0; i < ns->noccupied; i++) {
+                        int pp = ns->suns[i];
                         lv->ngblist[numcand++] = pp;
                     }
                     no = nop->sibling;
@@ -356,23 +520,631 @@ int force_treeev_shortrange(TreeWalkQueryGravShort * input,
                 }
                 else //NODE_NODE_TYPE
                     /* This node contains other nodes and we need to open it.*/
-                    no = nop->s.suns[0];
+                    no = nop->first;
             }
         }
+        if(lv->mode != TREEWALK_TOPTREE) {
+            /* Compute the acceleration from the interaction list and apply it to the output structure*/
+            gravshort_evaluate_list(1, input, output, lv->ngblist, numcand, nodes, nnodes, tree, cellsize, TreeUseQuadrupole);
+            ninteractions += numcand + nnodes;
+        }
+    }
+    treewalk_add_counters(lv, ninteractions);
+    return 1;
+}
+
+/* Bounding box and opening threshold shared by a group of particles walked together.*/
+struct GravShortGroup {
+    double mid[3];
+    double half[3];
+    /* Smallest acceleration in the group, times ErrTolForceAcc*/
+    double aold;
+};
+
+/* Distance along one axis from x to the group bounding box. Zero if x is inside the box.*/
+static inline double
+group_distance(const double x, const double mid, const double half, const double BoxSize)
+{
+    const double d = fabs(NEAREST(x - mid, BoxSize)) - half;
+    return d > 0 ? d : 0;
+}
+
+/* Group versions of shall_we_discard_node and shall_we_open_node. The distances used
+ * are the smallest distances to any point in the group bounding box, so a node is
+ * discarded only if every particle in the group would discard it, and accepted only if every particle would accept it.*/
+static int
+shall_we_discard_node_group(const double len, const double r2, const double center[3], const struct GravShortGroup * grp, const double BoxSize, const double rcut, const double rcut2)
+{
+    if(r2 > rcut2 && len > 0)
+    {
+        const double eff_dist = rcut + 0.5 * len;
+        int i;
+        for(i=0; i < 3; i++)
+            if(group_distance(center[i], grp->mid[i], grp->half[i], BoxSize) > eff_dist)
+                return 1;
+    }
+    return 0;
+}
+
+static int
+shall_we_open_node_group(const double len, const double mass, const double r2, const double center[3], const struct GravShortGroup * grp, const double BoxSize, const int TreeUseBH, const double BHOpeningAngle2, const int TreeUseQuadrupole)
+{
+    /* The bounding box touches the center of mass. Nodes of zero size are
+     * particles sent to a locally essential tree, and are never opened.*/
+    if(r2 == 0 && len > 0)
+        return 1;
+    if(TreeUseBH == 0) {
+        if(TreeUseQuadrupole) {
+            if(mass * len * len * len > r2 * r2 * sqrt(r2) * grp->aold)
+                return 1;
+        }
+        else if(mass * len * len > r2 * r2 * grp->aold)
+            return 1;
+    }
+
+    if(len * len > r2 * BHOpeningAngle2)
+        return 1;
+
+    const double inside = 0.6 * len;
+    if(group_distance(center[0], grp->mid[0], grp->half[0], BoxSize) < inside &&
+        group_distance(center[1], grp->mid[1], grp->half[1], BoxSize) < inside &&
+        group_distance(center[2], grp->mid[2], grp->half[2], BoxSize) < inside)
+        return 1;
+
+    return 0;
+}
+
+/* Walk the tree for a group of particles. In the toptree this exports the particle lv->target
+ * to every pseudo particle the group opens. Otherwise it builds a shared interaction list:
+ * particle candidates from the start of lv->ngblist and accepted nodes from the end, evaluating it whenever it fills up.
+ * Returns the number of interactions per particle, or -1 if the export buffer is full. */
+static int64_t
+gravshort_group_walk(const struct GravShortGroup * grp, const int ntarget, TreeWalkQueryGravShort * input, TreeWalkResultGravShort * output, LocalTreeWalk * lv)
+{
+    const ForceTree * tree = lv->tw->tree;
+    const double BoxSize = tree->BoxSize;
+    const double cellsize = GRAV_GET_PRIV(lv->tw)->cellsize;
+    const double rcut = GRAV_GET_PRIV(lv->tw)->Rcut;
+    const double rcut2 = rcut * rcut;
+    const int TreeUseBH = TreeParams.TreeUseBH;
+    const int TreeUseQuadrupole = TreeParams.TreeUseQuadrupole;
+    double BHOpeningAngle2 = TreeParams.BHOpeningAngle * TreeParams.BHOpeningAngle;
+    if(TreeUseBH == 0)
+        BHOpeningAngle2 = TreeParams.MaxBHOpeningAngle * TreeParams.MaxBHOpeningAngle;
+
+    /* Space for the interaction list*/
+    const int listsize = tree->NumParticles;
+    int * nodes = lv->ngblist + listsize;
+    int numcand = 0, nnodes = 0;
+    int64_t ninteractions = 0;
+
+    int no = tree->firstnode;
+    while(no >= 0)
+    {
+        const struct NODE *nop = &tree->Nodes[no];
+
         int i;
-        for(i = 0; i < numcand; i++)
+        double r2 = 0;
+        for(i = 0; i < 3; i++) {
+            const double dx = group_distance(nop->mom.cofm[i], grp->mid[i], grp->half[i], BoxSize);
+            r2 += dx * dx;
+        }
+
+        if(shall_we_discard_node_group(nop->len, r2, nop->center, grp, BoxSize, rcut, rcut2))
         {
-            int pp = lv->ngblist[i];
-            double dx[3];
-            int j;
-            for(j = 0; j < 3; j++)
-                dx[j] = NEAREST(P[pp].Pos[j] - inpos[j], BoxSize);
-            const double r2 = dx[0] * dx[0] + dx[1] * dx[1] + dx[2] * dx[2];
-            /* Compute the acceleration and apply it to the output structure*/
-            apply_accn_to_output(output, dx, r2, P[pp].Mass, cellsize);
+            no = nop->sibling;
+            continue;
+        }
+
+        if(!shall_we_open_node_group(nop->len, nop->mom.mass, r2, nop->center, grp, BoxSize, TreeUseBH, BHOpeningAngle2, TreeUseQuadrupole))
+        {
+            if(lv->mode != TREEWALK_TOPTREE && nop->mom.mass > 0) {
+                if(numcand + nnodes + 1 > listsize) {
+                    gravshort_evaluate_list(ntarget, input, output, lv->ngblist, numcand, nodes, nnodes, tree, cellsize, TreeUseQuadrupole);
+                    ninteractions += numcand + nnodes;
+                    numcand = nnodes = 0;
+                    nodes = lv->ngblist + listsize;
+                }
+                nodes--;
+                nodes[0] = no;
+                nnodes++;
+            }
+            no = nop->sibling;
+            continue;
+        }
+
+        if(lv->mode == TREEWALK_TOPTREE) {
+            if(nop->f.ChildType == PSEUDO_NODE_TYPE) {
+                if(-1 == treewalk_export_particle(lv, nop->first))
+                    return -1;
+                no = nop->sibling;
+                continue;
+            }
+            if(nop->f.TopLevel && !nop->f.InternalTopLevel) {
+                no = nop->sibling;
+                continue;
+            }
+            no = nop->first;
+        }
+        else if(nop->f.ChildType == PARTICLE_NODE_TYPE)
+        {
+            const struct NodeChild * ns = &tree->NodesCold[no].s;
+            if(numcand + nnodes + ns->noccupied > listsize) {
+                gravshort_evaluate_list(ntarget, input, output, lv->ngblist, numcand, nodes, nnodes, tree, cellsize, TreeUseQuadrupole);
+                ninteractions += numcand + nnodes;
+                numcand = nnodes = 0;
+                nodes = lv->ngblist + listsize;
+            }
+            for(i = 0; i < ns->noccupied; i++)
+                lv->ngblist[numcand++] = ns->suns[i];
+            no = nop->sibling;
         }
-        ninteractions = numcand;
+        /* Pseudo particles opened by the group were exported in the toptree*/
+        else if (nop->f.ChildType == PSEUDO_NODE_TYPE)
+            no = nop->sibling;
+        else
+            no = nop->first;
     }
-    treewalk_add_counters(lv, ninteractions);
+    if(lv->mode != TREEWALK_TOPTREE) {
+        gravshort_evaluate_list(ntarget, input, output, lv->ngblist, numcand, nodes, nnodes, tree, cellsize, TreeUseQuadrupole);
+        ninteractions += numcand + nnodes;
+    }
+    return ninteractions;
+}
+
+/*! Short-range gravity for a group of nearby particles, sharing a single tree walk.
+ * The opening criterion is applied to the group bounding box, using the smallest acceleration in the group,
+ * so each particle sees a tree at least as open as it would on its own. The toptree uses the same criterion,
+ * so exactly the pseudo particles opened here are exported. Exported particles are walked on
+ * the remote processor individually by force_treeev_shortrange.
+ */
+int force_treeev_shortrange_group(const int ntarget,
+        TreeWalkQueryGravShort * input,
+        TreeWalkResultGravShort * output,
+        LocalTreeWalk * lv)
+{
+    struct GravShortGroup grp;
+    double min[3], max[3];
+    int i, j;
+    for(i = 0; i < 3; i++)
+        min[i] = max[i] = input[0].base.Pos[i];
+    double minacc = input[0].OldAcc;
+    for(j = 1; j < ntarget; j++) {
+        for(i = 0; i < 3; i++) {
+            min[i] = DMIN(min[i], input[j].base.Pos[i]);
+            max[i] = DMAX(max[i], input[j].base.Pos[i]);
+        }
+        minacc = DMIN(minacc, input[j].OldAcc);
+    }
+    for(i = 0; i < 3; i++) {
+        grp.mid[i] = 0.5 * (max[i] + min[i]);
+        grp.half[i] = 0.5 * (max[i] - min[i]);
+    }
+    grp.aold = TreeParams.ErrTolForceAcc * minacc;
+
+    if(lv->mode == TREEWALK_TOPTREE) {
+        /* Export each particle separately, so that all exports of a particle are contiguous.*/
+        for(j = 0; j < ntarget; j++) {
+            lv->target = lv->targets[j];
+            lv->NThisParticleExport = 0;
+            if(gravshort_group_walk(&grp, ntarget, input, output, lv) < 0)
+                return -1;
+        }
+        return 0;
+    }
+
+    const int64_t ninteractions = gravshort_group_walk(&grp, ntarget, input, output, lv);
+    for(j = 0; j < ntarget; j++)
+        treewalk_add_counters(lv, ninteractions);
     return 1;
 }
+
+/* Locally essential tree.
+ * Instead of exporting particles to the processors whose pseudo particles they open, each processor
+ * sends every other processor the parts of its local tree which the walk on that processor may need.
+ * These are grafted below the pseudo particles of a copy of the tree, so the walk is entirely local
+ * and the exchange is a single bulk communication. The nodes to send are found with the group criteria,
+ * applied to the bounding box of the active particles in each top-level leaf of the receiving processor:
+ * a node is sent if any box does not discard it, and its children are sent if any box opens it.
+ * The group criteria are conservative, so the walk for each particle finds every node it opens.*/
+
+/* A node or particle sent to another processor. Each node is followed by its children, in walk order.*/
+struct LETNode
+{
+    MyFloat len;
+    MyFloat center[3];
+    MyFloat cofm[3];
+    MyFloat mass;
+    MyFloat quad[6];
+    /* Number of children following this node*/
+    int nchild;
+    /* For the root of each subtree, the index of its top-level leaf in TopLeaves. Otherwise -1.*/
+    int topleaf;
+};
+
+/* Bounds of the active particles in a top-level leaf, while they are being accumulated*/
+struct LETBox
+{
+    double min[3];
+    double max[3];
+    double minacc;
+    int64_t n;
+};
+
+/* Finding the nodes to send to one processor*/
+struct LETWalk
+{
+    const ForceTree * tree;
+    /* Bounding boxes of the active particles on the receiving processor*/
+    const struct GravShortGroup * boxes;
+    double rcut;
+    double rcut2;
+    double BHOpeningAngle2;
+    int TreeUseBH;
+    int TreeUseQuadrupole;
+    /* Records are written here. If NULL they are only counted.*/
+    struct LETNode * out;
+    /* Scratch space of this thread for the lists of boxes still active at each depth below a top-level leaf:
+     * the list at depth d starts at active + d * nbox.*/
+    int * active;
+    int nbox;
+    int maxdepth;
+};
+
+/* Store node or particle no in rec. Particles become nodes of zero size.*/
+static void
+let_fill_node(struct LETNode * rec, const ForceTree * tree, const int no, const int nchild, const int topleaf)
+{
+    int i;
+    if(node_is_particle(no, tree)) {
+        rec->len = 0;
+        for(i = 0; i < 3; i++)
+            rec->center[i] = rec->cofm[i] = P[no].Pos[i];
+        rec->mass = P[no].Mass;
+        memset(rec->quad, 0, sizeof(rec->quad));
+    }
+    else {
+        const struct NODE * nop = &tree->Nodes[no];
+        rec->len = nop->len;
+        for(i = 0; i < 3; i++) {
+            rec->center[i] = nop->center[i];
+            rec->cofm[i] = nop->mom.cofm[i];
+        }
+        rec->mass = nop->mom.mass;
+        memcpy(rec->quad, tree->NodesCold[no].quad, sizeof(rec->quad));
+    }
+    rec->nchild = nchild;
+    rec->topleaf = topleaf;
+}
+
+/* Send node no, at depth below its top-level leaf, and the parts of its subtree needed by the nactive boxes
+ * listed in the scratch space for this depth.
+ * Top-level leaves (topleaf >= 0) are already pseudo particles on the receiving processor, so are only sent if opened.
+ * Records are written (or counted) from position n. Returns the position after the last record of the subtree.*/
+static int64_t
+let_send_node(const struct LETWalk * lw, const int no, const int depth, const int nactive, const int topleaf, int64_t n)
+{
+    const ForceTree * tree = lw->tree;
+    const struct NODE * nop = &tree->Nodes[no];
+    const struct NodeChild * ns = &tree->NodesCold[no].s;
+    if(nop->mom.mass == 0)
+        return n;
+    if(depth >= lw->maxdepth)
+        endrun(5, "Node %d is at depth %d below its top-level leaf, deeper than the tree (%d)\n", no, depth, lw->maxdepth);
+
+    /* A box which discards a node discards all its children, so only the others need to be checked below.*/
+    const int * active = lw->active + (int64_t) depth * lw->nbox;
+    int * newactive = lw->active + (int64_t) (depth + 1) * lw->nbox;
+    int nnew = 0, nopen = 0, b, i;
+    for(b = 0; b < nactive; b++) {
+        const struct GravShortGroup * grp = &lw->boxes[active[b]];
+        double r2 = 0;
+        for(i = 0; i < 3; i++) {
+            const double dx = group_distance(nop->mom.cofm[i], grp->mid[i], grp->half[i], tree->BoxSize);
+            r2 += dx * dx;
+        }
+        if(shall_we_discard_node_group(nop->len, r2, nop->center, grp, tree->BoxSize, lw->rcut, lw->rcut2))
+            continue;
+        newactive[nnew++] = active[b];
+        if(shall_we_open_node_group(nop->len, nop->mom.mass, r2, nop->center, grp, tree->BoxSize, lw->TreeUseBH, lw->BHOpeningAngle2, lw->TreeUseQuadrupole))
+            nopen++;
+    }
+    if(nnew == 0 || (topleaf >= 0 && nopen == 0))
+        return n;
+
+    const int64_t self = n++;
+    int nchild = 0;
+    if(nopen > 0 && nop->f.ChildType == PARTICLE_NODE_TYPE) {
+        for(i = 0; i < ns->noccupied; i++) {
+            if(lw->out)
+                let_fill_node(&lw->out[n], tree, ns->suns[i], 0, -1);
+            n++;
+        }
+        nchild = ns->noccupied;
+    }
+    else if(nopen > 0 && nop->f.ChildType == NODE_NODE_TYPE) {
+        for(i = 0; i < NMAXCHILD; i++) {
+            if(ns->suns[i] < 0)
+                continue;
+            const int64_t next = let_send_node(lw, ns->suns[i], depth + 1, nnew, -1, n);
+            if(next > n)
+                nchild++;
+            n = next;
+        }
+    }
+    if(lw->out)
+        let_fill_node(&lw->out[self], tree, no, nchild, topleaf);
+    return n;
+}
+
+/* Find the local nodes needed by the nbox boxes of another processor. Returns the number of records, writing them to out if it is not NULL.
+ * scratch is the space of this thread for the active box lists, with room for lw0->maxdepth + 1 lists of nbox entries.*/
+static int64_t
+let_send_task(const struct LETWalk * lw0, const struct GravShortGroup * boxes, const int nbox, int * scratch, struct LETNode * out)
+{
+    if(nbox == 0)
+        return 0;
+    struct LETWalk lw = *lw0;
+    lw.boxes = boxes;
+    lw.out = out;
+    lw.active = scratch;
+    lw.nbox = nbox;
+    int i;
+    for(i = 0; i < nbox; i++)
+        lw.active[i] = i;
+    int64_t n = 0;
+    for(i = 0; i < lw.tree->NTopLeaves; i++)
+        if(lw.tree->TopLeaves[i].Task == lw.tree->ThisTask)
+            n = let_send_node(&lw, lw.tree->TopLeaves[i].treenode, 0, nbox, i, n);
+    return n;
+}
+
+/* Graft the nchild records starting at recv[*pos], with their subtrees, below node parent of the locally essential tree.*/
+static void
+let_attach_children(ForceTree * let, const struct LETNode * recv, const int64_t nrecv, int64_t * pos, const int parent, const int nchild)
+{
+    struct NODE * pnop = &let->Nodes[parent];
+    struct NodeChild * ps = &let->NodesCold[parent].s;
+    if(nchild > NMAXCHILD || *pos + nchild > nrecv)
+        endrun(5, "Corrupt locally essential tree: node %d has %d children at %ld of %ld\n", parent, nchild, *pos, nrecv);
+    /* A node whose children are all discarded has nothing to open*/
+    pnop->f.ChildType = nchild > 0 ? NODE_NODE_TYPE : PARTICLE_NODE_TYPE;
+    ps->noccupied = nchild;
+    int c, i;
+    for(c = 0; c < NMAXCHILD; c++)
+        ps->suns[c] = -1;
+    for(c = 0; c < nchild; c++) {
+        const struct LETNode * rec = &recv[(*pos)++];
+        const int no = let->firstnode + let->numnodes++;
+        struct NODE * nop = &let->Nodes[no];
+        memset(nop, 0, sizeof(struct NODE));
+        nop->len = rec->len;
+        for(i = 0; i < 3; i++) {
+            nop->center[i] = rec->center[i];
+            nop->mom.cofm[i] = rec->cofm[i];
+        }
+        nop->mom.mass = rec->mass;
+        let->NodesCold[no].father = parent;
+        memcpy(let->NodesCold[no].quad, rec->quad, sizeof(rec->quad));
+        ps->suns[c] = no;
+        let_attach_children(let, recv, nrecv, pos, no, rec->nchild);
+    }
+    pnop->first = ps->suns[0];
+}
+
+/* Set the siblings below a grafted node: the next child, or after the last child the sibling of the parent.*/
+static void
+let_set_siblings(ForceTree * let, const int no)
+{
+    const struct NODE * nop = &let->Nodes[no];
+    const struct NodeChild * ns = &let->NodesCold[no].s;
+    if(nop->f.ChildType != NODE_NODE_TYPE)
+        return;
+    int c;
+    for(c = 0; c < ns->noccupied; c++) {
+        const int child = ns->suns[c];
+        let->Nodes[child].sibling = c + 1 < ns->noccupied ? ns->suns[c + 1] : nop->sibling;
+        let_set_siblings(let, child);
+    }
+}
+
+/* Build a locally essential tree for the short-range walk of the active particles: a copy of tree, with the nodes
+ * and particles on other processors which the walk may need grafted below the pseudo particles. The nodes are
+ * allocated with mymalloc and freed with myfree(Nodes_base). The Father array and TopLeaves are shared with tree. Collective.*/
+static ForceTree
+grav_short_let_build(const ActiveParticles * act, const ForceTree * tree, const double rcut, const double G)
+{
+    int NTask, t;
+    int64_t i;
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+
+    MPI_Datatype MPI_TYPE_LETBOX, MPI_TYPE_LETNODE;
+    MPI_Type_contiguous(sizeof(struct GravShortGroup), MPI_BYTE, &MPI_TYPE_LETBOX);
+    MPI_Type_commit(&MPI_TYPE_LETBOX);
+    MPI_Type_contiguous(sizeof(struct LETNode), MPI_BYTE, &MPI_TYPE_LETNODE);
+    MPI_Type_commit(&MPI_TYPE_LETNODE);
+
+    int * nboxtask = ta_malloc("LETBoxCount", int, NTask);
+    int * boxoffset = ta_malloc("LETBoxOffset", int, NTask + 1);
+
+    /* Number the local top-level leaves. Active particles outside them, which have drifted since the
+     * last domain decomposition, share a final box.*/
+    int maxleaf = tree->firstnode;
+    for(i = 0; i < tree->NTopLeaves; i++)
+        if(tree->TopLeaves[i].treenode > maxleaf)
+            maxleaf = tree->TopLeaves[i].treenode;
+    int * leafbox = ta_malloc("LETLeafBox", int, maxleaf - tree->firstnode + 1);
+    for(i = 0; i < maxleaf - tree->firstnode + 1; i++)
+        leafbox[i] = -1;
+    int nlocal = 0;
+    for(i = 0; i < tree->NTopLeaves; i++)
+        if(tree->TopLeaves[i].Task == tree->ThisTask)
+            leafbox[tree->TopLeaves[i].treenode - tree->firstnode] = nlocal++;
+
+    /* Bounding box and smallest acceleration of the active particles in each leaf*/
+    const int NumThreads = omp_get_max_threads();
+    struct LETBox * thrbox = (struct LETBox *) mymalloc2("LETThreadBoxes", NumThreads * (nlocal + 1) * sizeof(struct LETBox));
+    memset(thrbox, 0, NumThreads * (nlocal + 1) * sizeof(struct LETBox));
+    #pragma omp parallel for
+    for(i = 0; i < act->NumActiveParticle; i++) {
+        const int p = act->ActiveParticle ? act->ActiveParticle[i] : i;
+        if(P[p].IsGarbage || P[p].Swallowed)
+            continue;
+        const int leaf = leafbox[force_tree_find_topnode(P[p].Pos, tree) - tree->firstnode];
+        struct LETBox * box = &thrbox[omp_get_thread_num() * (nlocal + 1) + (leaf >= 0 ? leaf : nlocal)];
+        const double acc = grav_get_abs_accel(&P[p], G);
+        int k;
+        if(box->n == 0) {
+            for(k = 0; k < 3; k++)
+                box->min[k] = box->max[k] = P[p].Pos[k];
+            box->minacc = acc;
+        }
+        for(k = 0; k < 3; k++) {
+            box->min[k] = DMIN(box->min[k], P[p].Pos[k]);
+            box->max[k] = DMAX(box->max[k], P[p].Pos[k]);
+        }
+        box->minacc = DMIN(box->minacc, acc);
+        box->n++;
+    }
+    struct GravShortGroup * localboxes = ta_malloc("LETLocalBoxes", struct GravShortGroup, nlocal + 1);
+    int nbox = 0;
+    for(t = 0; t <= nlocal; t++) {
+        struct LETBox box = {0};
+        int thr, k;
+        for(thr = 0; thr < NumThreads; thr++) {
+            const struct LETBox * tb = &thrbox[thr * (nlocal + 1) + t];
+            if(tb->n == 0)
+                continue;
+            if(box.n == 0)
+                box = *tb;
+            for(k = 0; k < 3; k++) {
+                box.min[k] = DMIN(box.min[k], tb->min[k]);
+                box.max[k] = DMAX(box.max[k], tb->max[k]);
+            }
+            box.minacc = DMIN(box.minacc, tb->minacc);
+            box.n += tb->n;
+        }
+        if(box.n == 0)
+            continue;
+        for(k = 0; k < 3; k++) {
+            localboxes[nbox].mid[k] = 0.5 * (box.max[k] + box.min[k]);
+            localboxes[nbox].half[k] = 0.5 * (box.max[k] - box.min[k]);
+        }
+        localboxes[nbox].aold = TreeParams.ErrTolForceAcc * box.minacc;
+        nbox++;
+    }
+    myfree(thrbox);
+
+    MPI_Allgather(&nbox, 1, MPI_INT, nboxtask, 1, MPI_INT, MPI_COMM_WORLD);
+    boxoffset[0] = 0;
+    for(t = 0; t < NTask; t++)
+        boxoffset[t + 1] = boxoffset[t] + nboxtask[t];
+    struct GravShortGroup * allboxes = (struct GravShortGroup *) mymalloc2("LETBoxes", boxoffset[NTask] * sizeof(struct GravShortGroup));
+    MPI_Allgatherv(localboxes, nbox, MPI_TYPE_LETBOX, allboxes, nboxtask, boxoffset, MPI_TYPE_LETBOX, MPI_COMM_WORLD);
+    ta_free(localboxes);
+    ta_free(leafbox);
+
+    /* Use the same opening criteria as the walk*/
+    struct LETWalk lw = {0};
+    lw.tree = tree;
+    lw.rcut = rcut;
+    lw.rcut2 = rcut * rcut;
+    lw.TreeUseBH = TreeParams.TreeUseBH;
+    lw.TreeUseQuadrupole = TreeParams.TreeUseQuadrupole;
+    lw.BHOpeningAngle2 = TreeParams.BHOpeningAngle * TreeParams.BHOpeningAngle;
+    if(lw.TreeUseBH == 0)
+        lw.BHOpeningAngle2 = TreeParams.MaxBHOpeningAngle * TreeParams.MaxBHOpeningAngle;
+    /* Node sizes halve with each level, so the smallest node bounds the depth of the walk below a top-level leaf*/
+    double minlen = tree->BoxSize;
+    for(i = tree->firstnode; i < tree->firstnode + tree->numnodes; i++)
+        if(tree->Nodes[i].len > 0 && tree->Nodes[i].len < minlen)
+            minlen = tree->Nodes[i].len;
+    lw.maxdepth = (int) ceil(log2(tree->BoxSize / minlen)) + 2;
+    int maxbox = 0;
+    for(t = 0; t < NTask; t++)
+        if(nboxtask[t] > maxbox)
+            maxbox = nboxtask[t];
+    int * scratch = (int *) mymalloc2("LETActive", (int64_t) NumThreads * (lw.maxdepth + 1) * maxbox * sizeof(int));
+
+    /* Count the nodes for each processor, then fill them in*/
+    int * sendcount = ta_malloc("LETSendCount", int, NTask);
+    int * senddispl = ta_malloc("LETSendDispl", int, NTask);
+    int * recvcount = ta_malloc("LETRecvCount", int, NTask);
+    #pragma omp parallel for schedule(dynamic)
+    for(t = 0; t < NTask; t++) {
+        int64_t n = 0;
+        if(t != tree->ThisTask)
+            n = let_send_task(&lw, allboxes + boxoffset[t], nboxtask[t], scratch + (int64_t) omp_get_thread_num() * (lw.maxdepth + 1) * maxbox, NULL);
+        if(n > INT_MAX)
+            endrun(5, "Too many locally essential tree nodes for task %d: %ld\n", t, n);
+        sendcount[t] = n;
+    }
+    int64_t nsend = 0;
+    for(t = 0; t < NTask; t++) {
+        senddispl[t] = nsend;
+        nsend += sendcount[t];
+    }
+    if(nsend > INT_MAX)
+        endrun(5, "Too many locally essential tree nodes to send: %ld\n", nsend);
+    struct LETNode * sendbuf = (struct LETNode *) mymalloc2("LETExport", nsend * sizeof(struct LETNode));
+    #pragma omp parallel for schedule(dynamic)
+    for(t = 0; t < NTask; t++)
+        if(t != tree->ThisTask)
+            let_send_task(&lw, allboxes + boxoffset[t], nboxtask[t], scratch + (int64_t) omp_get_thread_num() * (lw.maxdepth + 1) * maxbox, sendbuf + senddispl[t]);
+
+    MPI_Alltoall_sparse(sendcount, recvcount, MPI_INT, MPI_COMM_WORLD);
+    int64_t nrecv = 0;
+    for(t = 0; t < NTask; t++)
+        nrecv += recvcount[t];
+    if(nrecv > INT_MAX - tree->numnodes)
+        endrun(5, "Too many locally essential tree nodes to receive: %ld\n", nrecv);
+    struct LETNode * recvbuf = (struct LETNode *) mymalloc2("LETImport", nrecv * sizeof(struct LETNode));
+    MPI_Alltoallv_smart(sendbuf, sendcount, senddispl, MPI_TYPE_LETNODE, recvbuf, recvcount, NULL, MPI_TYPE_LETNODE, MPI_COMM_WORLD);
+
+    /* Copy the tree, with space for the imported nodes after the local ones*/
+    ForceTree let = *tree;
+    let.allocnodes = tree->numnodes + nrecv;
+    let.Nodes_base = (struct NODE *) mymalloc("LETNodes", let.allocnodes * (sizeof(struct NODE) + sizeof(struct NodeCold)));
+    let.Nodes = let.Nodes_base - let.firstnode;
+    let.NodesCold_base = (struct NodeCold *) (let.Nodes_base + let.allocnodes);
+    let.NodesCold = let.NodesCold_base - let.firstnode;
+    memcpy(let.Nodes_base, tree->Nodes_base, tree->numnodes * sizeof(struct NODE));
+    memcpy(let.NodesCold_base, tree->NodesCold_base, tree->numnodes * sizeof(struct NodeCold));
+    /* Pseudo particles are numbered from lastnode, which moves to the end of the new allocation*/
+    let.lastnode = let.firstnode + let.allocnodes;
+    for(i = 0; i < let.NTopLeaves; i++) {
+        struct NODE * nop = &let.Nodes[let.TopLeaves[i].treenode];
+        if(nop->f.ChildType == PSEUDO_NODE_TYPE)
+            nop->first = let.NodesCold[let.TopLeaves[i].treenode].s.suns[0] = let.lastnode + i;
+    }
+    /* Replace the pseudo particles with the imported subtrees. Those which were not sent are discarded or accepted by every active particle.*/
+    int64_t pos = 0;
+    while(pos < nrecv) {
+        const struct LETNode * root = &recvbuf[pos++];
+        if(root->topleaf < 0 || root->topleaf >= let.NTopLeaves)
+            endrun(5, "Corrupt locally essential tree: root %ld has top leaf %d\n", pos - 1, root->topleaf);
+        const int no = let.TopLeaves[root->topleaf].treenode;
+        if(let.Nodes[no].f.ChildType != PSEUDO_NODE_TYPE)
+            endrun(5, "Imported nodes for top leaf %d (node %d) which is not a pseudo particle\n", root->topleaf, no);
+        let_attach_children(&let, recvbuf, nrecv, &pos, no, root->nchild);
+        let_set_siblings(&let, no);
+    }
+
+    myfree(recvbuf);
+    myfree(sendbuf);
+    myfree(scratch);
+    ta_free(recvcount);
+    ta_free(senddispl);
+    ta_free(sendcount);
+    myfree(allboxes);
+    ta_free(boxoffset);
+    ta_free(nboxtask);
+    MPI_Type_free(&MPI_TYPE_LETNODE);
+    MPI_Type_free(&MPI_TYPE_LETBOX);
+
+    int64_t totrecv;
+    MPI_Reduce(&nrecv, &totrecv, 1, MPI_INT64, MPI_SUM, 0, MPI_COMM_WORLD);
+    message(0, "Locally essential tree: imported %ld nodes and particles.\n", totrecv);
+    walltime_measure("/Tree/LET");
+    return let;
+}
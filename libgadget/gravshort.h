@@ -39,6 +39,10 @@ struct GravShortPriv {
     double cbrtrho0;
     /* Pointer to the place to store accelerations*/
     MyFloat (*Accel)[3];
+    /* Accelerations and potentials from local particles, computed by the FMM.
+     * If set, the tree walk only computes forces from other processors.*/
+    double (*LocalAcc)[3];
+    double * LocalPot;
 };
 
 #define GRAV_GET_PRIV(tw) ((struct GravShortPriv *) ((tw)->priv))
@@ -65,6 +65,15 @@ struct particle_data
     MyFloat Potential;		/* Gravitational potential. This is the total potential only on a PM timestep,
                              * after gravtree+gravpm is called. We do not save the potential on short timesteps
                              * for hierarchical gravity as it would only be from active particles.*/
+    /* Number of tree interactions evaluated for this particle in the gravity and SPH treewalks
+     * since the last full domain decomposition. Used by the domain decomposition as the work estimate.*/
+    float WalkCost;
+#ifdef PM_INCREMENTAL_DEPOSIT
+    /* Position and mass of the last deposit of this particle to the persistent PM density mesh,
+     * if the PM deposit is incremental. A zero mass means the particle is not on the mesh.*/
+    double PMDepositPos[3];
+    float PMDepositMass;
+#endif
 #ifdef DEBUG
     /* Kick times for both hydro and grav*/
     inttime_t Ti_kick_hydro;
@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <omp.h>
 /* do NOT use complex.h it breaks the code */
 
 #include "types.h"
@@ -18,13 +19,30 @@ layout_prepare(PetaPM * pm,
                PetaPMRegion * regions,
                const int Nregions,
                MPI_Comm comm);
+static int
+layout_prepare_like(PetaPM * pm,
+               struct Layout * L,
+               double * meshbuf,
+               PetaPMRegion * regions,
+               const int Nregions,
+               PetaPM * like,
+               const PetaPMRegion * likeregions,
+               const int Nlike);
 static void layout_finish(struct Layout * L);
-static void layout_build_and_exchange_cells_to_pfft(PetaPM * pm, struct Layout * L, double * meshbuf, double * real);
+static void layout_build_and_exchange_cells_to_pfft(PetaPM * pm, struct Layout * L, double * meshbuf, void * real);
 static void layout_build_and_exchange_cells_to_local(PetaPM * pm, struct Layout * L, double * meshbuf, double * real);
+static void layout_exchange_cells_to_local_fused(PetaPM * pm, struct Layout * L, void * meshfused, const int nfield);
+
+/* cell_iterator needs to be thread safe !
+ * The cells are doubles, or floats for the _single iterators.*/
+typedef void (* cell_iterator)(void * cell_value, void * comm_buffer);
+static void layout_iterate_cells(PetaPM * pm, struct Layout * L, cell_iterator iter, void * real, const int nfield, const int field);
+static void to_region(void * cell, void * region);
+static void to_region_single(void * cell, void * region);
 
-/* cell_iterator needs to be thread safe !*/
-typedef void (* cell_iterator)(double * cell_value, double * comm_buffer);
-static void layout_iterate_cells(PetaPM * pm, struct Layout * L, cell_iterator iter, double * real);
+/* Default maximum number of fields transformed and exchanged together by petapm_force_c2r.
+ * Each field needs its own copy of the local mesh and of the cell buffers.*/
+#define PETAPM_MAX_FUSED 4
 
 struct Pencil { /* a pencil starting at offset, with lenght len */
     int offset[3];
@@ -40,17 +58,45 @@ static int pos_get_target(PetaPM * pm, const int pos[2]);
 static int64_t reduce_int64(int64_t input, MPI_Comm comm);
 #ifdef DEBUG
 /* for debugging */
-static void verify_density_field(PetaPM * pm, double * real, double * meshbuf, const size_t meshsize);
+static void verify_density_field(PetaPM * pm, void * real, double * meshbuf, const size_t meshsize);
 #endif
 
 static MPI_Datatype MPI_PENCIL;
 
+/* The FFT meshes and the exchanged cells hold floats if pm->SinglePrecision and doubles otherwise.
+ * These access element i of such a mesh; the complex value ip is the elements 2 * ip and 2 * ip + 1.*/
+static inline double
+pm_get(const PetaPM * pm, const void * mesh, const size_t i)
+{
+    if(pm->SinglePrecision)
+        return ((const float *) mesh)[i];
+    return ((const double *) mesh)[i];
+}
+
+static inline void
+pm_set(const PetaPM * pm, void * mesh, const size_t i, const double value)
+{
+    if(pm->SinglePrecision)
+        ((float *) mesh)[i] = value;
+    else
+        ((double *) mesh)[i] = value;
+}
+
+static MPI_Datatype
+pm_mpi_type(const PetaPM * pm)
+{
+    return pm->SinglePrecision ? MPI_FLOAT : MPI_DOUBLE;
+}
+
+static void pm_execute_r2c(PetaPM * pm, void * real, void * complx);
+static void pm_execute_c2r(PetaPM * pm, void * complx, void * real);
+
 /*Used only in MP-GenIC*/
 pfft_complex *
 petapm_alloc_rhok(PetaPM * pm)
 {
-    pfft_complex * rho_k = (pfft_complex * ) mymalloc("PMrho_k", pm->priv->fftsize * sizeof(double));
-    memset(rho_k, 0, pm->priv->fftsize * sizeof(double));
+    pfft_complex * rho_k = (pfft_complex * ) mymalloc("PMrho_k", pm->priv->fftsize * pm->priv->elsize);
+    memset(rho_k, 0, pm->priv->fftsize * pm->priv->elsize);
     return rho_k;
 }
 
@@ -91,8 +137,11 @@ void
 petapm_module_init(int Nthreads)
 {
     pfft_init();
-
     pfft_plan_with_nthreads(Nthreads);
+#ifdef USE_PFFTF
+    pfftf_init();
+    pfftf_plan_with_nthreads(Nthreads);
+#endif
 
     /* initialize the MPI Datatype of pencil */
     MPI_Type_contiguous(sizeof(struct Pencil), MPI_BYTE, &MPI_PENCIL);
@@ -100,8 +149,12 @@ petapm_module_init(int Nthreads)
 }
 
 void
-petapm_init(PetaPM * pm, double BoxSize, double Asmth, int Nmesh, double G, MPI_Comm comm)
+petapm_init(PetaPM * pm, double BoxSize, double Asmth, int Nmesh, double G, int SinglePrecision, MPI_Comm comm)
 {
+#ifndef USE_PFFTF
+    if(SinglePrecision)
+        endrun(1, "Single precision PM meshes need the float pfft and fftw libraries: compile with OPT += -DUSE_PFFTF\n");
+#endif
     /* define the global long / short range force cut */
     pm->BoxSize = BoxSize;
     pm->Asmth = Asmth;
@@ -109,6 +162,14 @@ petapm_init(PetaPM * pm, double BoxSize, double Asmth, int Nmesh, double G, MPI_
     pm->G = G;
     pm->CellSize = BoxSize / Nmesh;
     pm->comm = comm;
+    pm->Window = PETAPM_WINDOW_CIC;
+    pm->Interlace = 0;
+    pm->MaxFused = PETAPM_MAX_FUSED;
+    pm->SinglePrecision = SinglePrecision;
+    pm->priv->elsize = SinglePrecision ? sizeof(float) : sizeof(double);
+    pm->priv->meshshift = NULL;
+    pm->priv->meshpersist = NULL;
+    pm->Persist = PETAPM_PERSIST_NONE;
 
     ptrdiff_t n[3] = {Nmesh, Nmesh, Nmesh};
     ptrdiff_t np[2];
@@ -173,16 +234,28 @@ petapm_init(PetaPM * pm, double BoxSize, double Asmth, int Nmesh, double G, MPI_
 
     /* planning the fft; need temporary arrays */
 
-    double * real = (double * ) mymalloc("PMreal", pm->priv->fftsize * sizeof(double));
-    pfft_complex * rho_k = (pfft_complex * ) mymalloc("PMrho_k", pm->priv->fftsize * sizeof(double));
-    pfft_complex * complx = (pfft_complex *) mymalloc("PMcomplex", pm->priv->fftsize * sizeof(double));
-
-    pm->priv->plan_forw = pfft_plan_dft_r2c_3d(
-        n, real, rho_k, pm->priv->comm_cart_2d, PFFT_FORWARD,
-        PFFT_TRANSPOSED_OUT | PFFT_ESTIMATE | PFFT_TUNE | PFFT_DESTROY_INPUT);
-    pm->priv->plan_back = pfft_plan_dft_c2r_3d(
-        n, complx, real, pm->priv->comm_cart_2d, PFFT_BACKWARD,
-        PFFT_TRANSPOSED_IN | PFFT_ESTIMATE | PFFT_TUNE | PFFT_DESTROY_INPUT);
+    void * real = mymalloc("PMreal", pm->priv->fftsize * pm->priv->elsize);
+    void * rho_k = mymalloc("PMrho_k", pm->priv->fftsize * pm->priv->elsize);
+    void * complx = mymalloc("PMcomplex", pm->priv->fftsize * pm->priv->elsize);
+
+    if(pm->SinglePrecision) {
+#ifdef USE_PFFTF
+        pm->priv->plan_forwf = pfftf_plan_dft_r2c_3d(
+            n, real, rho_k, pm->priv->comm_cart_2d, PFFT_FORWARD,
+            PFFT_TRANSPOSED_OUT | PFFT_ESTIMATE | PFFT_TUNE | PFFT_DESTROY_INPUT);
+        pm->priv->plan_backf = pfftf_plan_dft_c2r_3d(
+            n, complx, real, pm->priv->comm_cart_2d, PFFT_BACKWARD,
+            PFFT_TRANSPOSED_IN | PFFT_ESTIMATE | PFFT_TUNE | PFFT_DESTROY_INPUT);
+#endif
+    }
+    else {
+        pm->priv->plan_forw = pfft_plan_dft_r2c_3d(
+            n, real, rho_k, pm->priv->comm_cart_2d, PFFT_FORWARD,
+            PFFT_TRANSPOSED_OUT | PFFT_ESTIMATE | PFFT_TUNE | PFFT_DESTROY_INPUT);
+        pm->priv->plan_back = pfft_plan_dft_c2r_3d(
+            n, complx, real, pm->priv->comm_cart_2d, PFFT_BACKWARD,
+            PFFT_TRANSPOSED_IN | PFFT_ESTIMATE | PFFT_TUNE | PFFT_DESTROY_INPUT);
+    }
 
     myfree(complx);
     myfree(rho_k);
@@ -223,39 +296,69 @@ petapm_init(PetaPM * pm, double BoxSize, double Asmth, int Nmesh, double G, MPI_
 void
 petapm_destroy(PetaPM * pm)
 {
-    pfft_destroy_plan(pm->priv->plan_forw);
-    pfft_destroy_plan(pm->priv->plan_back);
+    if(pm->SinglePrecision) {
+#ifdef USE_PFFTF
+        pfftf_destroy_plan(pm->priv->plan_forwf);
+        pfftf_destroy_plan(pm->priv->plan_backf);
+#endif
+    }
+    else {
+        pfft_destroy_plan(pm->priv->plan_forw);
+        pfft_destroy_plan(pm->priv->plan_back);
+    }
     MPI_Comm_free(&pm->priv->comm_cart_2d);
+    if(pm->priv->meshpersist)
+        myfree(pm->priv->meshpersist);
     myfree(pm->Mesh2Task[0]);
 }
 
+void
+petapm_alloc_persistent(PetaPM * pm)
+{
+    const int nmesh = pm->Interlace ? 2 : 1;
+    pm->priv->meshpersist = mymalloc2("PMmeshpersist", nmesh * pm->priv->fftsize * pm->priv->elsize);
+    memset(pm->priv->meshpersist, 0, nmesh * pm->priv->fftsize * pm->priv->elsize);
+}
+
 /*
  * read out field to particle i, with value no need to be thread safe
  * (particle i is never done by same thread)
  * */
 typedef void (* pm_iterator)(PetaPM * pm, int i, double * mesh, double weight);
 static void pm_iterate(PetaPM * pm, pm_iterator iterator, PetaPMRegion * regions, const int Nregions);
-/* apply transfer function to value, kpos array is in x, y, z order */
+static void pm_iterate_fused(PetaPM * pm, PetaPMFunctions * functions, const int nfield, void * meshfused, PetaPMRegion * regions, const int Nregions);
+/* apply transfer function to value, kpos array is in x, y, z order.
+ * dst holds nfield interleaved complex meshes, of which field is written.*/
 static void pm_apply_transfer_function(PetaPM * pm,
-        pfft_complex * src,
-        pfft_complex * dst, petapm_transfer_func H);
+        void * src,
+        void * dst, const int field, const int nfield, petapm_transfer_func H);
+
+/*
+ * the quantity particle i deposits to the mesh
+ * */
+typedef double (* pm_deposit_func)(int i);
+static void pm_deposit(PetaPM * pm, pm_deposit_func deposit, PetaPMRegion * regions, const int Nregions, double * mesh, const double shift);
+static void pm_interlace(PetaPM * pm, void * real, void * complx, const enum PetaPMPersist persist);
+static void pm_shift_half_cell(PetaPM * pm, void * src, void * dst, const int sign);
 
-static void put_particle_to_mesh(PetaPM * pm, int i, double * mesh, double weight);
-static void put_star_to_mesh(PetaPM * pm, int i, double * mesh, double weight);
-static void put_sfr_to_mesh(PetaPM * pm, int i, double * mesh, double weight);
+static double particle_mass_to_mesh(int i);
+static double removed_mass_to_mesh(int i);
+static double star_mass_to_mesh(int i);
+static double sfr_to_mesh(int i);
 
 /*
  * 1. calls prepare to build the Regions covering particles
- * 2. CIC the particles
- * 3. Transform to rho_k
+ * 2. deposit the particles with the mass assignment window (twice, if interlacing)
+ * 3. Transform to rho_k (averaging the two deposits, if interlacing)
  * 4. apply global_transfer (if not NULL --
  *       this is the place to fill in gaussian seeds,
  *       the transfer is stacked onto all following transfers.
- * 5. for each transfer, readout in functions
- * 6.    apply transfer from global_transfer -> complex
- * 7.    transform to real
- * 8.    readout
- * 9. free regions
+ * 5. for each batch of up to pm->MaxFused functions, fewer if their buffers do not fit in memory:
+ * 6.    for each function, apply transfer from global_transfer -> complex
+ * 7.       transform to real and collect the cells to be sent back
+ * 8.    exchange the cells of all functions in the batch at once
+ * 9.    readout all functions in the batch with one pass over the particles
+ * 10. free regions
  * */
 
 PetaPMRegion *
@@ -271,7 +374,26 @@ petapm_force_init(
     PetaPMRegion * regions = prepare(pm, pstruct, userdata, Nregions);
     pm_init_regions(pm, regions, *Nregions);
 
-    pm_iterate(pm, put_particle_to_mesh, regions, *Nregions);
+    /* The removed particles are in the regions of the particles they are removed from*/
+    if(pstruct->removed)
+        pstruct->removed->RegionInd = pstruct->RegionInd;
+
+    pm_deposit(pm, particle_mass_to_mesh, regions, *Nregions, pm->priv->meshbuf, 0);
+    if(pstruct->removed) {
+        CPS = pstruct->removed;
+        pm_deposit(pm, removed_mass_to_mesh, regions, *Nregions, pm->priv->meshbuf, 0);
+        CPS = pstruct;
+    }
+    if(pm->Interlace && pm->priv->meshbufsize > 0) {
+        pm->priv->meshshift = (double *) mymalloc2("PMmeshshift", pm->priv->meshbufsize * sizeof(double));
+        memset(pm->priv->meshshift, 0, pm->priv->meshbufsize * sizeof(double));
+        pm_deposit(pm, particle_mass_to_mesh, regions, *Nregions, pm->priv->meshshift, 0.5);
+        if(pstruct->removed) {
+            CPS = pstruct->removed;
+            pm_deposit(pm, removed_mass_to_mesh, regions, *Nregions, pm->priv->meshshift, 0.5);
+            CPS = pstruct;
+        }
+    }
 
     layout_prepare(pm, &pm->priv->layout, pm->priv->meshbuf, regions, *Nregions, pm->comm);
 
@@ -279,9 +401,29 @@ petapm_force_init(
     return regions;
 }
 
-pfft_complex * petapm_force_r2c(PetaPM * pm,
-        PetaPMGlobalFunctions * global_functions
-        ) {
+/* Add the exchanged density mesh real to the persistent mesh number m, if persist is PETAPM_PERSIST_UPDATE,
+ * and store the result, if persist is not PETAPM_PERSIST_NONE.*/
+static void
+pm_persist(PetaPM * pm, void * real, const int m, const enum PetaPMPersist persist)
+{
+    if(persist == PETAPM_PERSIST_NONE)
+        return;
+    if(!pm->priv->meshpersist)
+        endrun(1, "No persistent density mesh: call petapm_alloc_persistent\n");
+    char * stored = (char *) pm->priv->meshpersist + (size_t) m * pm->priv->fftsize * pm->priv->elsize;
+    if(persist == PETAPM_PERSIST_UPDATE) {
+        size_t i;
+        #pragma omp parallel for
+        for(i = 0; i < pm->real_space_region.totalsize; i++)
+            pm_set(pm, real, i, pm_get(pm, real, i) + pm_get(pm, stored, i));
+    }
+    memcpy(stored, real, pm->priv->fftsize * pm->priv->elsize);
+}
+
+/* Exchange the deposited mesh to the pfft hosts and Fourier transform it.
+ * The returned mesh is allocated with mymalloc.*/
+static pfft_complex * pm_density_r2c(PetaPM * pm, const enum PetaPMPersist persist)
+{
     /* call pfft rho_k is CFT of rho */
 
     /* this is because
@@ -289,8 +431,8 @@ pfft_complex * petapm_force_r2c(PetaPM * pm,
      * CFT = DFT * dx **3
      * CFT[rho] = DFT [rho * dx **3] = DFT[CIC]
      * */
-    double * real = (double * ) mymalloc2("PMreal", pm->priv->fftsize * sizeof(double));
-    memset(real, 0, sizeof(double) * pm->priv->fftsize);
+    void * real = mymalloc2("PMreal", pm->priv->fftsize * pm->priv->elsize);
+    memset(real, 0, pm->priv->elsize * pm->priv->fftsize);
     layout_build_and_exchange_cells_to_pfft(pm, &pm->priv->layout, pm->priv->meshbuf, real);
     walltime_measure("/PMgrav/comm2");
 
@@ -298,28 +440,53 @@ pfft_complex * petapm_force_r2c(PetaPM * pm,
     verify_density_field(pm, real, pm->priv->meshbuf, pm->priv->meshbufsize);
     walltime_measure("/PMgrav/Verify");
 #endif
+    pm_persist(pm, real, 0, persist);
 
-    pfft_complex * complx = (pfft_complex *) mymalloc("PMcomplex", pm->priv->fftsize * sizeof(double));
-    pfft_execute_dft_r2c(pm->priv->plan_forw, real, complx);
+    pfft_complex * complx = (pfft_complex *) mymalloc("PMcomplex", pm->priv->fftsize * pm->priv->elsize);
+    pm_execute_r2c(pm, real, complx);
+    if(pm->Interlace)
+        pm_interlace(pm, real, complx, persist);
     myfree(real);
+    if(pm->priv->meshshift) {
+        myfree(pm->priv->meshshift);
+        pm->priv->meshshift = NULL;
+    }
+    return complx;
+}
 
-    pfft_complex * rho_k = (pfft_complex * ) mymalloc2("PMrho_k", pm->priv->fftsize * sizeof(double));
+pfft_complex * petapm_force_r2c(PetaPM * pm,
+        PetaPMGlobalFunctions * global_functions
+        ) {
+    pfft_complex * complx = pm_density_r2c(pm, pm->Persist);
+    pfft_complex * rho_k = (pfft_complex * ) mymalloc2("PMrho_k", pm->priv->fftsize * pm->priv->elsize);
 
     /*Do any analysis that may be required before the transfer function is applied*/
     petapm_transfer_func global_readout = global_functions->global_readout;
     if(global_readout)
-        pm_apply_transfer_function(pm, complx, rho_k, global_readout);
+        pm_apply_transfer_function(pm, complx, rho_k, 0, 1, global_readout);
     if(global_functions->global_analysis)
         global_functions->global_analysis(pm);
     /*Apply the transfer function*/
     petapm_transfer_func global_transfer = global_functions->global_transfer;
-    pm_apply_transfer_function(pm, complx, rho_k, global_transfer);
+    pm_apply_transfer_function(pm, complx, rho_k, 0, 1, global_transfer);
     walltime_measure("/PMgrav/r2c");
 
     myfree(complx);
     return rho_k;
 }
 
+/* Peak memory needed by petapm_force_c2r for a batch of nstored fields, including the interlaced copies.
+ * While each field is transformed, the cell buffer of the batch is live with the complex, shifted and real meshes.
+ * During the exchange, the cell buffer is live with the received cells and the local mesh of every field.*/
+static size_t
+petapm_fused_bytes(PetaPM * pm, const struct Layout * L, const int nstored)
+{
+    const size_t elsize = pm->priv->elsize;
+    const size_t transform = ((size_t) L->NcImport * nstored + (pm->Interlace ? 3 : 2) * pm->priv->fftsize) * elsize;
+    const size_t exchange = ((size_t) L->NcImport + L->NcExport + pm->priv->meshbufsize) * nstored * elsize;
+    return transform > exchange ? transform : exchange;
+}
+
 void
 petapm_force_c2r(PetaPM * pm,
         pfft_complex * rho_k,
@@ -328,29 +495,71 @@ petapm_force_c2r(PetaPM * pm,
         PetaPMFunctions * functions)
 {
 
+    struct Layout * L = &pm->priv->layout;
     PetaPMFunctions * f = functions;
-    for (f = functions; f->name; f ++) {
-        petapm_transfer_func transfer = f->transfer;
-        petapm_readout_func readout = f->readout;
-
-        pfft_complex * complx = (pfft_complex *) mymalloc("PMcomplex", pm->priv->fftsize * sizeof(double));
-        /* apply the greens function turn rho_k into potential in fourier space */
-        pm_apply_transfer_function(pm, rho_k, complx, transfer);
-        walltime_measure("/PMgrav/calc");
-
-        double * real = (double * ) mymalloc2("PMreal", pm->priv->fftsize * sizeof(double));
-        pfft_execute_dft_c2r(pm->priv->plan_back, complx, real);
-
-        walltime_measure("/PMgrav/c2r");
-        if(f == functions) // Once
-            report_memory_usage("PetaPM");
-        myfree(complx);
-        /* read out the potential: this will copy and free real.*/
-        layout_build_and_exchange_cells_to_local(pm, &pm->priv->layout, pm->priv->meshbuf, real);
+    while(f->name) {
+        /* The functions in this batch share one cell exchange and one readout pass.*/
+        int nfield = 0;
+        while(f[nfield].name && nfield < pm->MaxFused)
+            nfield++;
+
+        /* If interlacing, each function is also read out from the mesh shifted by half a cell,
+         * stored after the unshifted fields.*/
+        const int nmesh = pm->Interlace ? 2 : 1;
+        /* Fuse fewer functions if their buffers do not fit, down to one at a time.
+         * The batch must be the same on every rank, as the transforms and the exchange are collective.*/
+        const int nwanted = nfield;
+        const size_t freebytes = mymalloc_freebytes();
+        while(nfield > 1 && petapm_fused_bytes(pm, L, nfield * nmesh) + 4096 * 8 > freebytes)
+            nfield--;
+        MPI_Allreduce(MPI_IN_PLACE, &nfield, 1, MPI_INT, MPI_MIN, pm->comm);
+        if(nfield < nwanted && f == functions)
+            message(0, "Not enough memory to read out %d PM functions together: reading out %d at a time.\n", nwanted, nfield);
+        const int nstored = nfield * nmesh;
+
+        L->BufRecv = mymalloc("PMBufRecv", (size_t) L->NcImport * nstored * pm->priv->elsize);
+        cell_iterator iter = pm->SinglePrecision ? to_region_single : to_region;
+        int j;
+        for(j = 0; j < nfield; j++) {
+            pfft_complex * complx = (pfft_complex *) mymalloc("PMcomplex", pm->priv->fftsize * pm->priv->elsize);
+            /* apply the greens function turn rho_k into potential in fourier space */
+            pm_apply_transfer_function(pm, rho_k, complx, 0, 1, f[j].transfer);
+            pfft_complex * shifted = NULL;
+            if(pm->Interlace) {
+                shifted = (pfft_complex *) mymalloc("PMcomplexshift", pm->priv->fftsize * pm->priv->elsize);
+                pm_shift_half_cell(pm, complx, shifted, -1);
+            }
+            walltime_measure("/PMgrav/calc");
+
+            void * real = mymalloc2("PMreal", pm->priv->fftsize * pm->priv->elsize);
+            pm_execute_c2r(pm, complx, real);
+
+            walltime_measure("/PMgrav/c2r");
+            if(f + j == functions) // Once
+                report_memory_usage("PetaPM");
+            /* Collect the cells needed by the particle regions*/
+            layout_iterate_cells(pm, L, iter, real, nstored, j);
+            if(shifted) {
+                pm_execute_c2r(pm, shifted, real);
+                layout_iterate_cells(pm, L, iter, real, nstored, nfield + j);
+                walltime_measure("/PMgrav/c2r");
+            }
+            myfree(real);
+            if(shifted)
+                myfree(shifted);
+            myfree(complx);
+        }
+        void * meshfused = mymalloc2("PMmeshfused", pm->priv->meshbufsize * nstored * pm->priv->elsize);
+        /* Cells not covered by any pencil are read only by particles with zero weight*/
+        memset(meshfused, 0, pm->priv->meshbufsize * nstored * pm->priv->elsize);
+        /* This frees L->BufRecv*/
+        layout_exchange_cells_to_local_fused(pm, L, meshfused, nstored);
         walltime_measure("/PMgrav/comm");
 
-        pm_iterate(pm, readout, regions, Nregions);
+        pm_iterate_fused(pm, f, nfield, meshfused, regions, Nregions);
+        myfree(meshfused);
         walltime_measure("/PMgrav/readout");
+        f += nfield;
     }
 }
 
@@ -376,29 +585,98 @@ void petapm_force(PetaPM * pm, petapm_prepare_func prepare,
     petapm_force_finish(pm);
 }
 
+/* Fourier space analysis of several density meshes*/
+
+void *
+petapm_alloc_modes(PetaPM * pm, const int nfield)
+{
+    void * modes = mymalloc("PMmodes", (size_t) pm->priv->fftsize * nfield * pm->priv->elsize);
+    memset(modes, 0, (size_t) pm->priv->fftsize * nfield * pm->priv->elsize);
+    return modes;
+}
+
+void
+petapm_density_modes(PetaPM * pm,
+        petapm_prepare_func prepare,
+        PetaPMParticleStruct * pstruct,
+        void * userdata,
+        void * modes, const int field, const int nfield)
+{
+    int Nregions;
+    PetaPMRegion * regions = petapm_force_init(pm, prepare, pstruct, &Nregions, userdata);
+    pfft_complex * complx = pm_density_r2c(pm, PETAPM_PERSIST_NONE);
+    pm_apply_transfer_function(pm, complx, modes, field, nfield, NULL);
+    myfree(complx);
+    if(CPS->RegionInd)
+        myfree(CPS->RegionInd);
+    myfree(regions);
+    petapm_force_finish(pm);
+    walltime_measure("/PMgrav/r2c");
+}
+
+void
+petapm_analyse_modes(PetaPM * pm, void * modes, const int nfield, petapm_analysis_func analysis, void * userdata)
+{
+    PetaPMRegion * region = &pm->fourier_space_region;
+    size_t ip;
+
+#pragma omp parallel for
+    for(ip = 0; ip < region->totalsize; ip ++) {
+        ptrdiff_t tmp = ip;
+        int pos[3];
+        int kpos[3];
+        int64_t k2 = 0;
+        int k;
+        for(k = 0; k < 3; k ++) {
+            pos[k] = tmp / region->strides[k];
+            tmp -= pos[k] * region->strides[k];
+            pos[k] += region->offset[k];
+            kpos[k] = petapm_mesh_to_k(pm, pos[k]);
+            k2 += ((int64_t)kpos[k]) * kpos[k];
+        }
+        /* Fourier space is transposed: kpos is y, z, x */
+        pos[0] = kpos[2];
+        pos[1] = kpos[0];
+        pos[2] = kpos[1];
+        pfft_complex values[PETAPM_MAX_ANALYSIS];
+        int f;
+        for(f = 0; f < nfield; f++) {
+            values[f][0] = pm_get(pm, modes, 2 * (ip * nfield + f));
+            values[f][1] = pm_get(pm, modes, 2 * (ip * nfield + f) + 1);
+        }
+        analysis(pm, k2, pos, values, nfield, userdata);
+    }
+    walltime_measure("/PMgrav/analysis");
+}
+
 /* These functions are for the excursion set reionization module*/
 
-/* initialise one set of regions with custom iterator
- * this is the same as petapm_force_init with a custom iterator
- * (and no CPS definition since it's called multiple times)*/
+/* initialise one set of regions with custom deposit
+ * this is the same as petapm_force_init with a custom deposit
+ * (and no CPS definition since it's called multiple times).
+ * If like is not NULL, its layout is reused if it covers the new deposit.*/
 PetaPMRegion *
 petapm_reion_init(
         PetaPM * pm,
         petapm_prepare_func prepare,
-        pm_iterator iterator,
+        pm_deposit_func deposit,
         PetaPMParticleStruct * pstruct,
         int * Nregions,
-        void * userdata) {
+        void * userdata,
+        PetaPM * like,
+        const PetaPMRegion * likeregions,
+        const int Nlike) {
 
     *Nregions = 0;
     PetaPMRegion * regions = prepare(pm, pstruct, userdata, Nregions);
     pm_init_regions(pm, regions, *Nregions);
 
     walltime_measure("/PMreion/Misc");
-    pm_iterate(pm, iterator, regions, *Nregions);
+    pm_deposit(pm, deposit, regions, *Nregions, pm->priv->meshbuf, 0);
     walltime_measure("/PMreion/cic");
 
-    layout_prepare(pm, &pm->priv->layout, pm->priv->meshbuf, regions, *Nregions, pm->comm);
+    if(!like || !layout_prepare_like(pm, &pm->priv->layout, pm->priv->meshbuf, regions, *Nregions, like, likeregions, Nlike))
+        layout_prepare(pm, &pm->priv->layout, pm->priv->meshbuf, regions, *Nregions, pm->comm);
 
     walltime_measure("/PMreion/comm");
     return regions;
@@ -410,7 +688,12 @@ petapm_reion_init(
 /* differences from force c2r (why I think I need this separate)
  * radius loop (could do this with long list of same function + global R)
  * I'm pretty sure I need a third function type (reion loop) with all three grids
- * ,after c2r but iteration over the grid, instead of particles */
+ * ,after c2r but iteration over the grid, instead of particles
+ *
+ * The grids of Nbatch radii are filtered into one interleaved complex mesh
+ * and transformed back together, with one multi-transform c2r.
+ * reion_loop is then called for each radius of the batch, from the largest,
+ * so only Nbatch radii are in memory at once.*/
 void
 petapm_reion_c2r(PetaPM * pm_mass, PetaPM * pm_star, PetaPM * pm_sfr,
         pfft_complex * mass_unfiltered, pfft_complex * star_unfiltered, pfft_complex * sfr_unfiltered,
@@ -418,83 +701,103 @@ petapm_reion_c2r(PetaPM * pm_mass, PetaPM * pm_star, PetaPM * pm_sfr,
         const int Nregions,
         PetaPMFunctions * functions,
         petapm_reion_func reion_loop,
-        double R_max, double R_min, double R_delta, int use_sfr)
+        double R_max, double R_min, double R_delta, int use_sfr, int Nbatch)
 {
     PetaPMFunctions * f = functions;
-    double R = fmin(R_max,pm_mass->BoxSize);
-    int last_step = 0;
-    int f_count = 0;
     petapm_readout_func readout = f->readout;
+    PetaPM * pms[3] = {pm_mass, pm_star, pm_sfr};
+    pfft_complex * unfiltered[3] = {mass_unfiltered, star_unfiltered, sfr_unfiltered};
+    const int nfield = use_sfr ? 3 : 2;
 
-    /* TODO: seriously re-think the allocation ordering in this function */
-    double * mass_real = (double * ) mymalloc2("mass_real", pm_mass->priv->fftsize * sizeof(double));
-
+    /* The filter radii, from the largest. The last step will be unfiltered.*/
+    double * radii = ta_malloc("radii", double, MAX_R_ITERATIONS + 1);
+    double R = fmin(R_max,pm_mass->BoxSize);
+    int nradii = 0;
     //TODO: add CellLengthFactor for lowres (>1Mpc, see old find_HII_bubbles function)
-    while(!last_step) {
-        f_count++;
-        //The last step will be unfiltered
-        if(R/R_delta < R_min || R/R_delta < (pm_mass->CellSize) || f_count > MAX_R_ITERATIONS)
-        {
-            last_step = 1;
-            R = pm_mass->CellSize;
+    while(1) {
+        nradii++;
+        if(R/R_delta < R_min || R/R_delta < (pm_mass->CellSize) || nradii > MAX_R_ITERATIONS) {
+            radii[nradii - 1] = pm_mass->CellSize;
+            break;
         }
+        radii[nradii - 1] = R;
+        R = R / R_delta;
+    }
+    if(Nbatch < 1)
+        Nbatch = 1;
+    if(Nbatch > nradii)
+        Nbatch = nradii;
+    const int howmany = Nbatch * nfield;
 
-        //NOTE: The PetaPM structs for reionisation use the G variable for filter radius in order to use
-        //the transfer functions correctly
-        pm_mass->G = R;
-        pm_star->G = R;
-        if(use_sfr)pm_sfr->G = R;
-
-        //TODO: maybe allocate and free these outside the loop
-        pfft_complex * mass_filtered = (pfft_complex *) mymalloc("mass_filtered", pm_mass->priv->fftsize * sizeof(double));
-        pfft_complex * star_filtered = (pfft_complex *) mymalloc("star_filtered", pm_star->priv->fftsize * sizeof(double));
-        pfft_complex * sfr_filtered;
-        if(use_sfr){
-            sfr_filtered = (pfft_complex *) mymalloc("sfr_filtered", pm_sfr->priv->fftsize * sizeof(double));
-        }
+    /* TODO: seriously re-think the allocation ordering in this function */
+    double * mass_real = (double * ) mymalloc2("mass_real", pm_mass->priv->fftsize * sizeof(double));
 
-        /* apply the filtering at this radius */
+    /* The meshes of a batch, interleaved: field f of radius j is number j * nfield + f.*/
+    ptrdiff_t n[3] = {pm_mass->Nmesh, pm_mass->Nmesh, pm_mass->Nmesh};
+    ptrdiff_t local_ni[3], local_i_start[3], local_no[3], local_o_start[3];
+    const ptrdiff_t batchsize = 2 * pfft_local_size_many_dft_r2c(3, n, n, n, howmany,
+            PFFT_DEFAULT_BLOCKS, PFFT_DEFAULT_BLOCKS, pm_mass->priv->comm_cart_2d,
+            PFFT_TRANSPOSED_OUT, local_ni, local_i_start, local_no, local_o_start);
+    pfft_complex * filtered = (pfft_complex *) mymalloc("PMreion_filtered", batchsize * sizeof(double));
+    double * real = (double *) mymalloc("PMreion_real", batchsize * sizeof(double));
+    pfft_plan plan_batch = pfft_plan_many_dft_c2r(3, n, n, n, howmany,
+            PFFT_DEFAULT_BLOCKS, PFFT_DEFAULT_BLOCKS, filtered, real, pm_mass->priv->comm_cart_2d,
+            PFFT_BACKWARD, PFFT_TRANSPOSED_IN | PFFT_ESTIMATE | PFFT_DESTROY_INPUT);
+
+    const size_t realsize = pm_mass->real_space_region.totalsize;
+    int first;
+    for(first = 0; first < nradii; first += Nbatch) {
+        const int nthis = (nradii - first < Nbatch) ? nradii - first : Nbatch;
+        int j, k;
+        /* The unused meshes of the last batch*/
+        if(nthis < Nbatch)
+            memset(filtered, 0, batchsize * sizeof(double));
+
+        /* apply the filtering at each radius */
         /*We want the last step to be unfiltered,
          *  calling apply transfer with NULL should just copy the grids */
-
-        petapm_transfer_func transfer = last_step ? NULL : f->transfer;
-
-        pm_apply_transfer_function(pm_mass, mass_unfiltered, mass_filtered, transfer);
-        pm_apply_transfer_function(pm_star, star_unfiltered, star_filtered, transfer);
-        if(use_sfr){
-            pm_apply_transfer_function(pm_sfr, sfr_unfiltered, sfr_filtered, transfer);
+        for(j = 0; j < nthis; j++) {
+            const int last_step = (first + j == nradii - 1);
+            petapm_transfer_func transfer = last_step ? NULL : f->transfer;
+            for(k = 0; k < nfield; k++) {
+                //NOTE: The PetaPM structs for reionisation use the G variable for filter radius in order to use
+                //the transfer functions correctly
+                pms[k]->G = radii[first + j];
+                pm_apply_transfer_function(pms[k], unfiltered[k], filtered, j * nfield + k, howmany, transfer);
+            }
         }
         walltime_measure("/PMreion/calc");
 
-        double * star_real = (double * ) mymalloc2("star_real", pm_star->priv->fftsize * sizeof(double));
         /* back to real space */
-        pfft_execute_dft_c2r(pm_mass->priv->plan_back, mass_filtered, mass_real);
-        pfft_execute_dft_c2r(pm_star->priv->plan_back, star_filtered, star_real);
-        double * sfr_real = NULL;
-        if(use_sfr){
-            sfr_real = (double * ) mymalloc2("sfr_real", pm_sfr->priv->fftsize * sizeof(double));
-            pfft_execute_dft_c2r(pm_sfr->priv->plan_back, sfr_filtered, sfr_real);
-            myfree(sfr_filtered);
-        }
+        pfft_execute_dft_c2r(plan_batch, filtered, real);
         walltime_measure("/PMreion/c2r");
 
-        myfree(star_filtered);
-        myfree(mass_filtered);
-
-        /* the reion loop calculates the J21 and stores it,
-         * for now the mass_real grid will be reused to hold J21
-         * on the last filtering step*/
-        reion_loop(pm_mass,pm_star,pm_sfr,mass_real,star_real,sfr_real,last_step);
-
-        /* since we don't need to readout star and sfr grids...*/
-        /* on the last step, the mass grid is populated with J21 and read out*/
-        if(sfr_real){
-            myfree(sfr_real);
+        /* The filtered meshes are destroyed by the transform: reuse them for the star and sfr grids.*/
+        double * star_real = (double *) filtered;
+        double * sfr_real = use_sfr ? star_real + realsize : NULL;
+        for(j = 0; j < nthis; j++) {
+            const int last_step = (first + j == nradii - 1);
+            size_t i;
+            #pragma omp parallel for
+            for(i = 0; i < realsize; i++) {
+                mass_real[i] = real[i * howmany + j * nfield];
+                star_real[i] = real[i * howmany + j * nfield + 1];
+                if(use_sfr)
+                    sfr_real[i] = real[i * howmany + j * nfield + 2];
+            }
+            for(k = 0; k < nfield; k++)
+                pms[k]->G = radii[first + j];
+            /* the reion loop calculates the J21 and stores it,
+             * for now the mass_real grid will be reused to hold J21
+             * on the last filtering step*/
+            reion_loop(pm_mass,pm_star,pm_sfr,mass_real,star_real,sfr_real,last_step);
         }
-        myfree(star_real);
-
-        R = R / R_delta;
     }
+    pfft_destroy_plan(plan_batch);
+    myfree(real);
+    myfree(filtered);
+    ta_free(radii);
+
     //J21 grid is exchanged to pm_mass buffer and freed
     layout_build_and_exchange_cells_to_local(pm_mass, &pm_mass->priv->layout, pm_mass->priv->meshbuf, mass_real);
     walltime_measure("/PMreion/comm");
@@ -516,21 +819,26 @@ void petapm_reion(PetaPM * pm_mass, PetaPM * pm_star, PetaPM * pm_sfr,
         PetaPMParticleStruct * pstruct,
         PetaPMReionPartStruct * rstruct,
         petapm_reion_func reion_loop,
-        double R_max, double R_min, double R_delta, int use_sfr,
+        double R_max, double R_min, double R_delta, int use_sfr, int Nbatch,
         void * userdata) {
 
+    /* reion_loop works on the real space meshes, which must be double precision*/
+    if(pm_mass->SinglePrecision || pm_star->SinglePrecision || (use_sfr && pm_sfr->SinglePrecision))
+        endrun(1, "The excursion set meshes do not support single precision\n");
+
     //assigning CPS here due to three sets of regions
     CPS = pstruct;
     CPS_R = rstruct;
 
     /* initialise regions for each grid
-     * NOTE: these regions should be identical except for the grid buffer */
+     * NOTE: these regions should be identical except for the grid buffer.
+     * Stars and star forming gas are a subset of the mass, so their grids reuse the layout of the mass grid.*/
     int Nregions_mass, Nregions_star, Nregions_sfr;
-    PetaPMRegion * regions_mass = petapm_reion_init(pm_mass, prepare, put_particle_to_mesh, pstruct, &Nregions_mass, userdata);
-    PetaPMRegion * regions_star = petapm_reion_init(pm_star, prepare, put_star_to_mesh, pstruct, &Nregions_star, userdata);
-    PetaPMRegion * regions_sfr;
+    PetaPMRegion * regions_mass = petapm_reion_init(pm_mass, prepare, particle_mass_to_mesh, pstruct, &Nregions_mass, userdata, NULL, NULL, 0);
+    PetaPMRegion * regions_star = petapm_reion_init(pm_star, prepare, star_mass_to_mesh, pstruct, &Nregions_star, userdata, pm_mass, regions_mass, Nregions_mass);
+    PetaPMRegion * regions_sfr = NULL;
     if(use_sfr){
-        regions_sfr = petapm_reion_init(pm_sfr, prepare, put_sfr_to_mesh, pstruct, &Nregions_sfr, userdata);
+        regions_sfr = petapm_reion_init(pm_sfr, prepare, sfr_to_mesh, pstruct, &Nregions_sfr, userdata, pm_mass, regions_mass, Nregions_mass);
     }
 
     walltime_measure("/PMreion/comm2");
@@ -549,7 +857,7 @@ void petapm_reion(PetaPM * pm_mass, PetaPM * pm_star, PetaPM * pm_sfr,
         petapm_reion_c2r(pm_mass, pm_star, pm_sfr,
                mass_unfiltered, star_unfiltered, sfr_unfiltered,
                regions_mass, Nregions_mass, functions, reion_loop,
-               R_max, R_min, R_delta, use_sfr);
+               R_max, R_min, R_delta, use_sfr, Nbatch);
 
     //free everything in the correct order
     if(sfr_unfiltered){
@@ -641,8 +949,8 @@ layout_prepare (PetaPM * pm,
     }
     L->NcExport = NcExport;
 
-    MPI_Alltoall(L->NpSend, 1, MPI_INT, L->NpRecv, 1, MPI_INT, L->comm);
-    MPI_Alltoall(L->NcSend, 1, MPI_INT, L->NcRecv, 1, MPI_INT, L->comm);
+    MPI_Alltoall_sparse(L->NpSend, L->NpRecv, MPI_INT, L->comm);
+    MPI_Alltoall_sparse(L->NcSend, L->NcRecv, MPI_INT, L->comm);
 
     /* build the displacement array; why doesn't MPI build these automatically? */
     L->DpSend[0] = 0; L->DpRecv[0] = 0;
@@ -683,6 +991,78 @@ layout_prepare (PetaPM * pm,
     layout_exchange_pencils(L);
 }
 
+/* A cell is empty if there is no mass in it, in the mesh or the shifted mesh if interlacing*/
+static inline int
+layout_cell_empty(const double * meshbuf, const double * meshshift, const size_t i)
+{
+    return meshbuf[i] == 0.0 && (!meshshift || meshshift[i] == 0.0);
+}
+
+/* Reuse the layout of the mesh like, which has already been prepared, instead of building the pencils again.
+ * This skips the sort and the exchange of the pencils. It is possible if like has the same mesh and regions,
+ * and if its pencils contain all the non-zero cells of meshbuf, on every task.
+ * The pencils are copied, so the two layouts are freed independently.
+ * Returns 1 if the layout was reused, 0 if layout_prepare should be called instead.*/
+static int
+layout_prepare_like(PetaPM * pm,
+               struct Layout * L,
+               double * meshbuf,
+               PetaPMRegion * regions,
+               const int Nregions,
+               PetaPM * like,
+               const PetaPMRegion * likeregions,
+               const int Nlike)
+{
+    const struct Layout * LL = &like->priv->layout;
+    int ok = (pm->Nmesh == like->Nmesh) && (pm->comm == like->comm) && (Nregions == Nlike) && (pm->priv->meshbufsize == like->priv->meshbufsize);
+    int r, k;
+    for(r = 0; ok && r < Nregions; r++)
+        for(k = 0; k < 3; k++)
+            if(regions[r].offset[k] != likeregions[r].offset[k] || regions[r].size[k] != likeregions[r].size[k])
+                ok = 0;
+    if(ok) {
+        /* The pencils do not overlap, so they contain all non-zero cells if they contain as many as the mesh*/
+        int64_t nonzero = 0, covered = 0;
+        size_t i;
+        #pragma omp parallel for reduction(+: nonzero)
+        for(i = 0; i < pm->priv->meshbufsize; i++)
+            nonzero += !layout_cell_empty(meshbuf, pm->priv->meshshift, i);
+        #pragma omp parallel for reduction(+: covered)
+        for(i = 0; i < (size_t) LL->NpExport; i++) {
+            int j;
+            for(j = 0; j < LL->PencilSend[i].len; j++)
+                covered += !layout_cell_empty(meshbuf, pm->priv->meshshift, LL->PencilSend[i].meshbuf_first + j);
+        }
+        ok = (nonzero == covered);
+    }
+    MPI_Allreduce(MPI_IN_PLACE, &ok, 1, MPI_INT, MPI_LAND, pm->comm);
+    if(!ok)
+        return 0;
+
+    int NTask;
+    MPI_Comm_size(pm->comm, &NTask);
+    *L = *LL;
+    L->comm = pm->comm;
+    L->ibuffer = (int *) mymalloc("PMlayout", sizeof(int) * NTask * 8);
+    memcpy(L->ibuffer, LL->ibuffer, sizeof(int) * NTask * 8);
+    L->NpSend = &L->ibuffer[NTask * 0];
+    L->NpRecv = &L->ibuffer[NTask * 1];
+    L->NcSend = &L->ibuffer[NTask * 2];
+    L->NcRecv = &L->ibuffer[NTask * 3];
+    L->DcSend = &L->ibuffer[NTask * 4];
+    L->DcRecv = &L->ibuffer[NTask * 5];
+    L->DpSend = &L->ibuffer[NTask * 6];
+    L->DpRecv = &L->ibuffer[NTask * 7];
+    L->PencilSend = (struct Pencil *) mymalloc("PencilSend", L->NpExport * sizeof(struct Pencil));
+    memcpy(L->PencilSend, LL->PencilSend, L->NpExport * sizeof(struct Pencil));
+    L->PencilRecv = (struct Pencil *) mymalloc("PencilRecv", L->NpImport * sizeof(struct Pencil));
+    memcpy(L->PencilRecv, LL->PencilRecv, L->NpImport * sizeof(struct Pencil));
+    L->BufSend = NULL;
+    L->BufRecv = NULL;
+    message(0, "PetaPM: reusing the layout of %d pencils\n", L->NpExport);
+    return 1;
+}
+
 static void
 layout_build_pencils(PetaPM * pm,
                      struct Layout * L,
@@ -691,6 +1071,9 @@ layout_build_pencils(PetaPM * pm,
                      const int Nregions)
 {
     /* now build pencils to be exported */
+    const double * meshshift = pm->priv->meshshift;
+    /* An incremental deposit leaves the cells of the unchanged particles empty: they are still read out*/
+    const int compress = pm->Persist != PETAPM_PERSIST_UPDATE;
     int p0 = 0;
     int r;
     for (r = 0; r < Nregions; r++) {
@@ -709,11 +1092,11 @@ layout_build_pencils(PetaPM * pm,
                 p->meshbuf_first = (regions[r].buffer - meshbuf) +
                     regions[r].strides[0] * ix +
                     regions[r].strides[1] * iy;
-                /* now lets compress the pencil */
-                while((p->len > 0) && (meshbuf[p->meshbuf_first + p->len - 1] == 0.0)) {
+                /* now lets compress the pencil: the cells are sent if either deposit is non-zero */
+                while(compress && (p->len > 0) && layout_cell_empty(meshbuf, meshshift, p->meshbuf_first + p->len - 1)) {
                     p->len --;
                 }
-                while((p->len > 0) && (meshbuf[p->meshbuf_first] == 0.0)) {
+                while(compress && (p->len > 0) && layout_cell_empty(meshbuf, meshshift, p->meshbuf_first)) {
                     p->len --;
                     p->meshbuf_first++;
                     p->offset[2] ++;
@@ -746,7 +1129,7 @@ static void layout_exchange_pencils(struct Layout * L) {
         offset += L->NpSend[i];
     }
 
-    MPI_Alltoallv(
+    MPI_Alltoallv_node(
             L->PencilSend, L->NpSend, L->DpSend, MPI_PENCIL,
             L->PencilRecv, L->NpRecv, L->DpRecv, MPI_PENCIL,
             L->comm);
@@ -782,9 +1165,14 @@ static void layout_finish(struct Layout * L) {
 
 /* exchange cells to their pfft host, then reduce the cells to the pfft
  * array */
-static void to_pfft(double * cell, double * buf) {
+static void to_pfft(void * cell, void * buf) {
+#pragma omp atomic update
+            ((double *) cell)[0] += ((double *) buf)[0];
+}
+
+static void to_pfft_single(void * cell, void * buf) {
 #pragma omp atomic update
-            cell[0] += buf[0];
+            ((float *) cell)[0] += ((float *) buf)[0];
 }
 
 static void
@@ -792,38 +1180,44 @@ layout_build_and_exchange_cells_to_pfft(
         PetaPM * pm,
         struct Layout * L,
         double * meshbuf,
-        double * real)
+        void * real)
 {
-    L->BufSend = (double *) mymalloc("PMBufSend", L->NcExport * sizeof(double));
-    L->BufRecv = (double *) mymalloc("PMBufRecv", L->NcImport * sizeof(double));
+    L->BufSend = mymalloc("PMBufSend", L->NcExport * pm->priv->elsize);
+    L->BufRecv = mymalloc("PMBufRecv", L->NcImport * pm->priv->elsize);
 
     int i;
     int offset;
 
-    /* collect all cells into the send buffer */
+    /* collect all cells into the send buffer, rounding them if single precision */
     offset = 0;
     for(i = 0; i < L->NpExport; i ++) {
         struct Pencil * p = &L->PencilSend[i];
-        memcpy(L->BufSend + offset, &meshbuf[p->meshbuf_first],
+        if(pm->SinglePrecision) {
+            int j;
+            for(j = 0; j < p->len; j ++)
+                ((float *) L->BufSend)[offset + j] = meshbuf[p->meshbuf_first + j];
+        }
+        else
+            memcpy((double *) L->BufSend + offset, &meshbuf[p->meshbuf_first],
                 sizeof(double) * p->len);
         offset += p->len;
     }
 
     /* receive cells */
-    MPI_Alltoallv(
-            L->BufSend, L->NcSend, L->DcSend, MPI_DOUBLE,
-            L->BufRecv, L->NcRecv, L->DcRecv, MPI_DOUBLE,
+    MPI_Alltoallv_node(
+            L->BufSend, L->NcSend, L->DcSend, pm_mpi_type(pm),
+            L->BufRecv, L->NcRecv, L->DcRecv, pm_mpi_type(pm),
             L->comm);
 
 #if 0
     double massExport = 0;
     for(i = 0; i < L->NcExport; i ++) {
-        massExport += L->BufSend[i];
+        massExport += pm_get(pm, L->BufSend, i);
     }
 
     double massImport = 0;
     for(i = 0; i < L->NcImport; i ++) {
-        massImport += L->BufRecv[i];
+        massImport += pm_get(pm, L->BufRecv, i);
     }
     double totmassExport;
     double totmassImport;
@@ -832,15 +1226,19 @@ layout_build_and_exchange_cells_to_pfft(
     message(0, "totmassExport = %g totmassImport = %g\n", totmassExport, totmassImport);
 #endif
 
-    layout_iterate_cells(pm, L, to_pfft, real);
+    layout_iterate_cells(pm, L, pm->SinglePrecision ? to_pfft_single : to_pfft, real, 1, 0);
     myfree(L->BufRecv);
     myfree(L->BufSend);
 }
 
 /* readout cells on their pfft host, then exchange the cells to the domain
  * host */
-static void to_region(double * cell, double * region) {
-    *region = *cell;
+static void to_region(void * cell, void * region) {
+    *(double *) region = *(double *) cell;
+}
+
+static void to_region_single(void * cell, void * region) {
+    *(float *) region = *(float *) cell;
 }
 
 static void
@@ -850,21 +1248,22 @@ layout_build_and_exchange_cells_to_local(
         double * meshbuf,
         double * real)
 {
-    L->BufRecv = (double *) mymalloc("PMBufRecv", L->NcImport * sizeof(double));
+    /* Only used by the excursion set, which is double precision*/
+    L->BufRecv = mymalloc("PMBufRecv", L->NcImport * sizeof(double));
     int i;
     int offset;
 
     /*layout_iterate_cells transfers real to L->BufRecv*/
-    layout_iterate_cells(pm, L, to_region, real);
+    layout_iterate_cells(pm, L, to_region, real, 1, 0);
 
     /*Real is done now: reuse the memory for BufSend*/
     myfree(real);
     /*Now allocate BufSend, which is confusingly used to receive data*/
-    L->BufSend = (double *) mymalloc("PMBufSend", L->NcExport * sizeof(double));
+    L->BufSend = mymalloc("PMBufSend", L->NcExport * sizeof(double));
 
     /* exchange cells */
     /* notice the order is reversed from to_pfft */
-    MPI_Alltoallv(
+    MPI_Alltoallv_node(
             L->BufRecv, L->NcRecv, L->DcRecv, MPI_DOUBLE,
             L->BufSend, L->NcSend, L->DcSend, MPI_DOUBLE,
             L->comm);
@@ -874,7 +1273,7 @@ layout_build_and_exchange_cells_to_local(
     for(i = 0; i < L->NpExport; i ++) {
         struct Pencil * p = &L->PencilSend[i];
         memcpy(&meshbuf[p->meshbuf_first],
-                L->BufSend + offset,
+                (double *) L->BufSend + offset,
                 sizeof(double) * p->len);
         offset += p->len;
     }
@@ -882,7 +1281,48 @@ layout_build_and_exchange_cells_to_local(
     myfree(L->BufRecv);
 }
 
-/* iterate over the pairs of real field cells and RecvBuf cells
+/* Exchange the cells of nfield fields, already collected interleaved in L->BufRecv,
+ * from their pfft host to the domain host, and distribute them to meshfused.
+ * Field f of meshbuf cell i is stored in meshfused[i * nfield + f]. Frees L->BufRecv.*/
+static void
+layout_exchange_cells_to_local_fused(
+        PetaPM * pm,
+        struct Layout * L,
+        void * meshfused,
+        const int nfield)
+{
+    int i;
+    int offset;
+    const size_t cellsize = nfield * pm->priv->elsize;
+    /* One element is a cell with all its fields, so the cell counts of the layout can be reused.*/
+    MPI_Datatype MPI_CELL;
+    MPI_Type_contiguous(nfield, pm_mpi_type(pm), &MPI_CELL);
+    MPI_Type_commit(&MPI_CELL);
+
+    L->BufSend = mymalloc("PMBufSend", (size_t) L->NcExport * cellsize);
+
+    /* notice the order is reversed from to_pfft */
+    MPI_Alltoallv_node(
+            L->BufRecv, L->NcRecv, L->DcRecv, MPI_CELL,
+            L->BufSend, L->NcSend, L->DcSend, MPI_CELL,
+            L->comm);
+    MPI_Type_free(&MPI_CELL);
+
+    /* distribute BufSend to meshfused */
+    offset = 0;
+    for(i = 0; i < L->NpExport; i ++) {
+        struct Pencil * p = &L->PencilSend[i];
+        memcpy((char *) meshfused + (size_t) p->meshbuf_first * cellsize,
+                (char *) L->BufSend + (size_t) offset * cellsize,
+                cellsize * p->len);
+        offset += p->len;
+    }
+    myfree(L->BufSend);
+    myfree(L->BufRecv);
+}
+
+/* iterate over the pairs of real field cells and RecvBuf cells.
+ * RecvBuf holds nfield interleaved fields, of which field is used.
  *
  * !!! iter has to be thread safe. !!!
  * */
@@ -890,8 +1330,11 @@ static void
 layout_iterate_cells(PetaPM * pm,
                      struct Layout * L,
                      cell_iterator iter,
-                     double * real)
+                     void * real,
+                     const int nfield,
+                     const int field)
 {
+    const size_t elsize = pm->priv->elsize;
     int i;
 #pragma omp parallel for
     for(i = 0; i < L->NpImport; i ++) {
@@ -922,7 +1365,7 @@ layout_iterate_cells(PetaPM * pm,
             /*
              * operate on the pencil, either modifying real or BufRecv
              * */
-            iter(&real[linear], &L->BufRecv[p->first + j]);
+            iter((char *) real + linear * elsize, (char *) L->BufRecv + ((size_t) (p->first + j) * nfield + field) * elsize);
         }
     }
 }
@@ -950,34 +1393,74 @@ pm_init_regions(PetaPM * pm, PetaPMRegion * regions, const int Nregions)
 }
 
 
-static void
-pm_iterate_one(PetaPM * pm,
+/* Maximal number of cells in the mass assignment window of a particle*/
+#define PETAPM_MAX_CELLS (PETAPM_MAX_WINDOW * PETAPM_MAX_WINDOW * PETAPM_MAX_WINDOW)
+
+/* Weights of the mass assignment window for a particle at x, in cell units, along one dimension.
+ * Returns the first of the window cells, which are weighted by w[0], w[1], ... */
+static inline int
+pm_window_weights(const enum PetaPMWindow window, const double x, double w[PETAPM_MAX_WINDOW])
+{
+    int first;
+    double d;
+    switch(window) {
+        case PETAPM_WINDOW_TSC:
+            /* d is the distance from the centre of the nearest cell*/
+            first = floor(x + 0.5) - 1;
+            d = x - (first + 1);
+            w[0] = 0.5 * (0.5 - d) * (0.5 - d);
+            w[1] = 0.75 - d * d;
+            w[2] = 0.5 * (0.5 + d) * (0.5 + d);
+            break;
+        case PETAPM_WINDOW_PCS:
+            first = floor(x) - 1;
+            d = x - (first + 1);
+            w[0] = (1 - d) * (1 - d) * (1 - d) / 6.;
+            w[1] = (4 - 6 * d * d + 3 * d * d * d) / 6.;
+            w[2] = (4 - 6 * (1 - d) * (1 - d) + 3 * (1 - d) * (1 - d) * (1 - d)) / 6.;
+            w[3] = d * d * d / 6.;
+            break;
+        default:
+            first = floor(x);
+            d = x - first;
+            w[0] = 1 - d;
+            w[1] = d;
+    }
+    return first;
+}
+
+/* Find the region of particle i and the linear indices in the region buffer and weights of
+ * the pm->Window ** 3 cells of its mass assignment window. The particle is displaced by shift cells
+ * in each dimension. Returns NULL if the particle has no region.*/
+static PetaPMRegion *
+pm_window_cells(PetaPM * pm,
                int i,
-               pm_iterator iterator,
                PetaPMRegion * regions,
-               const int Nregions)
+               const int Nregions,
+               const double shift,
+               size_t linear[PETAPM_MAX_CELLS],
+               double weight[PETAPM_MAX_CELLS])
 {
     int k;
-    int iCell[3];  /* integer coordinate on the regional mesh */
-    double Res[3]; /* residual*/
+    const int W = pm->Window;
+    int iCell[3];  /* integer coordinate on the regional mesh of the first window cell*/
+    double w[3][PETAPM_MAX_WINDOW]; /* window weights in each dimension*/
     double * Pos = POS(i);
     const int RegionInd = CPS->RegionInd ? CPS->RegionInd[i] : 0;
 
     /* Asserts that the swallowed particles are not considered (region -2).*/
     if(RegionInd < 0)
-        return;
+        return NULL;
     /* This should never happen: it is pure paranoia and to avoid icc being crazy*/
     if(RegionInd >= Nregions)
         endrun(1, "Particle %d has region %d out of bounds %d\n", i, RegionInd, Nregions);
 
     PetaPMRegion * region = &regions[RegionInd];
     for(k = 0; k < 3; k++) {
-        double tmp = Pos[k] / pm->CellSize;
-        iCell[k] = floor(tmp);
-        Res[k] = tmp - iCell[k];
+        iCell[k] = pm_window_weights(pm->Window, Pos[k] / pm->CellSize + shift, w[k]);
         iCell[k] -= region->offset[k];
         /* seriously?! particles are supposed to be contained in cells */
-        if(iCell[k] >= region->size[k] - 1 || iCell[k] < 0) {
+        if(iCell[k] > region->size[k] - W || iCell[k] < 0) {
             endrun(1, "particle out of cell better stop %d (k=%d) %g %g %g region: %td %td\n", iCell[k],k,
                 Pos[0], Pos[1], Pos[2],
                 region->offset[k], region->size[k]);
@@ -985,22 +1468,41 @@ pm_iterate_one(PetaPM * pm,
     }
 
     int connection;
-    for(connection = 0; connection < 8; connection++) {
-        double weight = 1.0;
-        size_t linear = 0;
+    const int ncell = W * W * W;
+    for(connection = 0; connection < ncell; connection++) {
+        int rem = connection;
+        weight[connection] = 1.0;
+        linear[connection] = 0;
         for(k = 0; k < 3; k++) {
-            int offset = (connection >> k) & 1;
+            int offset = rem % W;
+            rem /= W;
             int tmp = iCell[k] + offset;
-            linear += tmp * region->strides[k];
-            weight *= offset?
-                /* offset == 1*/ (Res[k])    :
-                /* offset == 0*/ (1 - Res[k]);
+            linear[connection] += tmp * region->strides[k];
+            weight[connection] *= w[k][offset];
         }
-        if(linear >= region->totalsize) {
+        if(linear[connection] >= region->totalsize) {
             endrun(1, "particle linear index out of cell better stop\n");
         }
-        iterator(pm, i, &region->buffer[linear], weight);
     }
+    return region;
+}
+
+static void
+pm_iterate_one(PetaPM * pm,
+               int i,
+               pm_iterator iterator,
+               PetaPMRegion * regions,
+               const int Nregions)
+{
+    size_t linear[PETAPM_MAX_CELLS];
+    double weight[PETAPM_MAX_CELLS];
+    PetaPMRegion * region = pm_window_cells(pm, i, regions, Nregions, 0, linear, weight);
+    if(!region)
+        return;
+    int connection;
+    const int ncell = pm->Window * pm->Window * pm->Window;
+    for(connection = 0; connection < ncell; connection++)
+        iterator(pm, i, &region->buffer[linear[connection]], weight[connection]);
 }
 
 /*
@@ -1017,6 +1519,176 @@ static void pm_iterate(PetaPM * pm, pm_iterator iterator, PetaPMRegion * regions
     }
 }
 
+/*
+ * Read out nfield fields, stored interleaved in meshfused, to all particles in one pass:
+ * the window cells and weights are found once per particle and field f is read by functions[f].readout.
+ * If interlacing, the fields on the mesh shifted by half a cell follow the unshifted fields
+ * of each cell and the particles read the average of the two.
+ * */
+static void
+pm_iterate_fused(PetaPM * pm, PetaPMFunctions * functions, const int nfield, void * meshfused, PetaPMRegion * regions, const int Nregions)
+{
+    int i;
+    const int ncell = pm->Window * pm->Window * pm->Window;
+    const int nmesh = pm->Interlace ? 2 : 1;
+    const int nstored = nfield * nmesh;
+#pragma omp parallel for
+    for(i = 0; i < CPS->NumPart; i ++) {
+        size_t linear[PETAPM_MAX_CELLS];
+        double weight[PETAPM_MAX_CELLS];
+        int m;
+        for(m = 0; m < nmesh; m++) {
+            PetaPMRegion * region = pm_window_cells(pm, i, regions, Nregions, 0.5 * m, linear, weight);
+            if(!region)
+                break;
+            const size_t first = region->buffer - pm->priv->meshbuf;
+            int connection, f;
+            for(connection = 0; connection < ncell; connection++)
+                for(f = 0; f < nfield; f++) {
+                    double value = pm_get(pm, meshfused, (first + linear[connection]) * nstored + m * nfield + f);
+                    functions[f].readout(pm, i, &value, weight[connection] / nmesh);
+                }
+        }
+    }
+}
+
+/* Index of the block of mesh cells holding the first window cell of the particle, in the ordering used by pm_deposit:
+ * the blocks are cubes side cells across, coloured by the parity of their position in each dimension,
+ * and the blocks of each colour in all regions are numbered contiguously. blockstart[8 * r + colour] is the
+ * first block of that colour in region r.*/
+static inline int
+pm_deposit_block(const PetaPMRegion * region, const int r, const size_t linear0, const int side, const int * blockstart)
+{
+    int colour = 0, d;
+    int b = 0;
+    for(d = 0; d < 3; d++) {
+        const int ib = ((linear0 / region->strides[d]) % region->size[d]) / side;
+        const int nblock = (region->size[d] + side - 1) / side;
+        /* Number of blocks in this dimension with the parity of ib*/
+        const int nsame = (ib % 2) ? nblock / 2 : (nblock + 1) / 2;
+        colour |= (ib % 2) << d;
+        b = b * nsame + ib / 2;
+    }
+    return blockstart[8 * r + colour] + b;
+}
+
+/*
+ * Deposit of particles to the region meshes, without atomics. The cells of the
+ * regions are stored in mesh, which has the layout of pm->priv->meshbuf.
+ * Particles are displaced by shift cells, for interlacing.
+ *
+ * A particle with first window cell ix touches the cells ix to ix + pm->Window - 1
+ * of its region in each dimension. The regions are divided into cubic blocks at least pm->Window cells across,
+ * coloured by the parity of the block position in x, y and z. Particles in different blocks of the same colour
+ * never write to the same cell, so each block is done by one thread, one colour after the other.
+ * The particles of a block are deposited in the order of their index,
+ * so the mesh does not depend on the number of threads.
+ * */
+static void
+pm_deposit(PetaPM * pm, pm_deposit_func deposit, PetaPMRegion * regions, const int Nregions, double * mesh, const double shift)
+{
+    int r, c;
+    int64_t i;
+    const int ncell = pm->Window * pm->Window * pm->Window;
+    const int NumThreads = omp_get_max_threads();
+    /* Make about 64 blocks per thread: enough to balance the threads within each colour,
+     * while keeping the per thread block counts small.*/
+    int64_t totcells = 0;
+    for(r = 0; r < Nregions; r++)
+        totcells += regions[r].totalsize;
+    int side = pm->Window * (int) cbrt((double) totcells / ((double) ncell * 64 * NumThreads));
+    if(side < pm->Window)
+        side = pm->Window;
+    /* Number the blocks of all regions, colour by colour*/
+    int * blockstart = ta_malloc("blockstart", int, 8 * Nregions + 9);
+    int * colourstart = blockstart + 8 * Nregions;
+    int nblocks = 0;
+    for(c = 0; c < 8; c++) {
+        colourstart[c] = nblocks;
+        for(r = 0; r < Nregions; r++) {
+            int nb = 1, d;
+            for(d = 0; d < 3; d++) {
+                const int nblock = (regions[r].size[d] + side - 1) / side;
+                nb *= (c & (1 << d)) ? nblock / 2 : (nblock + 1) / 2;
+            }
+            blockstart[8 * r + c] = nblocks;
+            nblocks += nb;
+        }
+    }
+    colourstart[8] = nblocks;
+
+    int * block = (int *) mymalloc("PMblock", CPS->NumPart * sizeof(int));
+    int * order = (int *) mymalloc("PMorder", CPS->NumPart * sizeof(int));
+    /* Per thread counts of particles in each block, then the per thread insertion points*/
+    int64_t * count = (int64_t *) mymalloc("PMblockcount", (size_t) NumThreads * nblocks * sizeof(int64_t));
+    memset(count, 0, (size_t) NumThreads * nblocks * sizeof(int64_t));
+
+    /* The same static schedule is used for counting and placing, so the sort is stable.*/
+#pragma omp parallel num_threads(NumThreads)
+    {
+        const int tid = omp_get_thread_num();
+        int64_t * mycount = count + (size_t) tid * nblocks;
+        size_t linear[PETAPM_MAX_CELLS];
+        double weight[PETAPM_MAX_CELLS];
+#pragma omp for schedule(static)
+        for(i = 0; i < CPS->NumPart; i ++) {
+            block[i] = -1;
+            /* Most particles of an incremental deposit have nothing to deposit*/
+            if(deposit(i) == 0)
+                continue;
+            PetaPMRegion * region = pm_window_cells(pm, i, regions, Nregions, shift, linear, weight);
+            if(!region)
+                continue;
+            block[i] = pm_deposit_block(region, region - regions, linear[0], side, blockstart);
+            mycount[block[i]]++;
+        }
+#pragma omp single
+        {
+            /* Ordered by block, then by thread*/
+            int64_t start = 0;
+            int s, t;
+            for(s = 0; s < nblocks; s++)
+                for(t = 0; t < NumThreads; t++) {
+                    const int64_t n = count[(size_t) t * nblocks + s];
+                    count[(size_t) t * nblocks + s] = start;
+                    start += n;
+                }
+        }
+#pragma omp for schedule(static)
+        for(i = 0; i < CPS->NumPart; i ++) {
+            if(block[i] >= 0)
+                order[mycount[block[i]]++] = i;
+        }
+    }
+    /* After placing, the insertion point of the last thread is the end of the block*/
+    const int64_t * blockend = count + (size_t) (NumThreads - 1) * nblocks;
+
+    for(c = 0; c < 8; c++) {
+        int s;
+#pragma omp parallel for schedule(dynamic)
+        for(s = colourstart[c]; s < colourstart[c + 1]; s++) {
+            int64_t k;
+            for(k = s > 0 ? blockend[s - 1] : 0; k < blockend[s]; k++) {
+                const int p = order[k];
+                const double value = deposit(p);
+                if(value == 0)
+                    continue;
+                size_t linear[PETAPM_MAX_CELLS];
+                double weight[PETAPM_MAX_CELLS];
+                PetaPMRegion * region = pm_window_cells(pm, p, regions, Nregions, shift, linear, weight);
+                double * cells = mesh + (region->buffer - pm->priv->meshbuf);
+                int connection;
+                for(connection = 0; connection < ncell; connection++)
+                    cells[linear[connection]] += weight[connection] * value;
+            }
+        }
+    }
+    myfree(count);
+    myfree(order);
+    myfree(block);
+    ta_free(blockstart);
+}
+
 void petapm_region_init_strides(PetaPMRegion * region) {
     int k;
     size_t rt = 1;
@@ -1054,7 +1726,7 @@ static int pencil_cmp_target(const void * v1, const void * v2) {
 }
 
 #ifdef DEBUG
-static void verify_density_field(PetaPM * pm, double * real, double * meshbuf, const size_t meshsize) {
+static void verify_density_field(PetaPM * pm, void * real, double * meshbuf, const size_t meshsize) {
     /* verify the density field */
     double mass_Part = 0;
     int j;
@@ -1078,7 +1750,7 @@ static void verify_density_field(PetaPM * pm, double * real, double * meshbuf, c
     double mass_CIC = 0;
 #pragma omp parallel for reduction(+: mass_CIC)
     for(i = 0; i < pm->real_space_region.totalsize; i ++) {
-        mass_CIC += real[i];
+        mass_CIC += pm_get(pm, real, i);
     }
     double totmass_CIC = 0;
     MPI_Allreduce(&mass_CIC, &totmass_CIC, 1, MPI_DOUBLE, MPI_SUM, pm->comm);
@@ -1088,8 +1760,8 @@ static void verify_density_field(PetaPM * pm, double * real, double * meshbuf, c
 #endif
 
 static void pm_apply_transfer_function(PetaPM * pm,
-        pfft_complex * src,
-        pfft_complex * dst, petapm_transfer_func H
+        void * src,
+        void * dst, const int field, const int nfield, petapm_transfer_func H
         ){
     size_t ip = 0;
 
@@ -1120,43 +1792,116 @@ static void pm_apply_transfer_function(PetaPM * pm,
         pos[0] = kpos[2];
         pos[1] = kpos[0];
         pos[2] = kpos[1];
-        dst[ip][0] = src[ip][0];
-        dst[ip][1] = src[ip][1];
+        /* The transfer function always sees double precision values*/
+        pfft_complex value;
+        value[0] = pm_get(pm, src, 2 * ip);
+        value[1] = pm_get(pm, src, 2 * ip + 1);
         if(H) {
-            H(pm, k2, pos, &dst[ip]);
+            H(pm, k2, pos, &value);
         }
+        const size_t id = ip * nfield + field;
+        pm_set(pm, dst, 2 * id, value[0]);
+        pm_set(pm, dst, 2 * id + 1, value[1]);
     }
 
 }
 
+/* Multiply src by exp(sign * i k . dx / 2) and store in dst, which may be src.
+ * With sign = 1 this undoes the shift of a field displaced by half a cell in each dimension,
+ * with sign = -1 it displaces the field. */
+static void
+pm_shift_half_cell(PetaPM * pm, void * src, void * dst, const int sign)
+{
+    PetaPMRegion * region = &pm->fourier_space_region;
+    size_t ip;
+#pragma omp parallel for
+    for(ip = 0; ip < region->totalsize; ip ++) {
+        ptrdiff_t tmp = ip;
+        int ksum = 0;
+        int k;
+        for(k = 0; k < 3; k ++) {
+            int pos = tmp / region->strides[k];
+            tmp -= pos * region->strides[k];
+            ksum += petapm_mesh_to_k(pm, pos + region->offset[k]);
+        }
+        const double phase = sign * M_PI * ksum / pm->Nmesh;
+        const double c = cos(phase), s = sin(phase);
+        const double sre = pm_get(pm, src, 2 * ip), sim = pm_get(pm, src, 2 * ip + 1);
+        pm_set(pm, dst, 2 * ip, sre * c - sim * s);
+        pm_set(pm, dst, 2 * ip + 1, sre * s + sim * c);
+    }
+}
+
+/*
+ * Interlacing: complx holds the transform of the mesh deposit. The deposit with the particles
+ * shifted by half a cell is transformed, using real as scratch, and averaged with it after
+ * undoing the shift. The leading aliased images of the two deposits have opposite signs and cancel.
+ * */
+static void
+pm_interlace(PetaPM * pm, void * real, void * complx, const enum PetaPMPersist persist)
+{
+    memset(real, 0, pm->priv->elsize * pm->priv->fftsize);
+    layout_build_and_exchange_cells_to_pfft(pm, &pm->priv->layout, pm->priv->meshshift, real);
+    pm_persist(pm, real, 1, persist);
+    void * shifted = mymalloc("PMcomplexshift", pm->priv->fftsize * pm->priv->elsize);
+    pm_execute_r2c(pm, real, shifted);
+    pm_shift_half_cell(pm, shifted, shifted, 1);
+
+    size_t ip;
+#pragma omp parallel for
+    for(ip = 0; ip < 2 * pm->fourier_space_region.totalsize; ip ++) {
+        pm_set(pm, complx, ip, 0.5 * (pm_get(pm, complx, ip) + pm_get(pm, shifted, ip)));
+    }
+    myfree(shifted);
+    walltime_measure("/PMgrav/interlace");
+}
+
+/* Transforms with the plans of the precision of the mesh*/
+static void
+pm_execute_r2c(PetaPM * pm, void * real, void * complx)
+{
+#ifdef USE_PFFTF
+    if(pm->SinglePrecision)
+        pfftf_execute_dft_r2c(pm->priv->plan_forwf, real, complx);
+    else
+#endif
+        pfft_execute_dft_r2c(pm->priv->plan_forw, real, complx);
+}
+
+static void
+pm_execute_c2r(PetaPM * pm, void * complx, void * real)
+{
+#ifdef USE_PFFTF
+    if(pm->SinglePrecision)
+        pfftf_execute_dft_c2r(pm->priv->plan_backf, complx, real);
+    else
+#endif
+        pfft_execute_dft_c2r(pm->priv->plan_back, complx, real);
+}
 
 /**************
- * functions iterating over particle / mesh pairs
+ * quantities deposited to the mesh by pm_deposit
  ***************/
-static void put_particle_to_mesh(PetaPM * pm, int i, double * mesh, double weight) {
-    double Mass = *MASS(i);
+static double particle_mass_to_mesh(int i) {
     if(INACTIVE(i))
-        return;
-#pragma omp atomic update
-    mesh[0] += weight * Mass;
+        return 0;
+    return *MASS(i);
+}
+/* Mass of the last deposit, taken off the persistent mesh*/
+static double removed_mass_to_mesh(int i) {
+    return -particle_mass_to_mesh(i);
 }
 //escape fraction scaled GSM
-static void put_star_to_mesh(PetaPM * pm, int i, double * mesh, double weight) {
+static double star_mass_to_mesh(int i) {
     if(INACTIVE(i) || *TYPE(i) != 4)
-        return;
-    double Mass = *MASS(i);
-    double fesc = *FESC(i);
-#pragma omp atomic update
-    mesh[0] += weight * Mass * fesc;
+        return 0;
+    return *MASS(i) * *FESC(i);
 }
 //escape fraciton scaled SFR
-static void put_sfr_to_mesh(PetaPM * pm, int i, double * mesh, double weight) {
+static double sfr_to_mesh(int i) {
     if(INACTIVE(i) || *TYPE(i) != 0)
-        return;
-    double Sfr = *SFR(i);
-    double fesc = *FESCSPH(i);
-#pragma omp atomic update
-    mesh[0] += weight * Sfr * fesc;
+        return 0;
+    return *SFR(i) * *FESCSPH(i);
 }
 static int64_t reduce_int64(int64_t input, MPI_Comm comm) {
     int64_t result = 0;
@@ -4,6 +4,25 @@
 
 #include "powerspectrum.h"
 
+/* Mass assignment window of the mesh. The value is the number of cells
+ * covered by a particle in each dimension and the power of the sinc in the window. */
+enum PetaPMWindow {
+    PETAPM_WINDOW_CIC = 2,
+    PETAPM_WINDOW_TSC = 3,
+    PETAPM_WINDOW_PCS = 4,
+};
+#define PETAPM_MAX_WINDOW 4
+
+/* Use of the persistent density mesh of petapm_alloc_persistent by petapm_force_r2c*/
+enum PetaPMPersist {
+    /* The density is the deposit of this step*/
+    PETAPM_PERSIST_NONE = 0,
+    /* As NONE, and the density is stored*/
+    PETAPM_PERSIST_STORE = 1,
+    /* The deposit of this step is a change, added to the stored density. The sum is stored.*/
+    PETAPM_PERSIST_UPDATE = 2,
+};
+
 typedef struct Region {
     /* represents a region in the FFT Mesh */
     ptrdiff_t offset[3];
@@ -15,7 +34,7 @@ typedef struct Region {
     double center[3];
     double len;
     int numpart;
-    int no; /* node number for debugging */
+    int no; /* top leaf of the region, for debugging */
 } PetaPMRegion;
 
 /* a layout is the communication object, represent
@@ -39,8 +58,9 @@ struct Layout {
     int * DcSend;
     int * DcRecv;
 
-    double * BufSend;
-    double * BufRecv;
+    /* Cells exchanged with the pfft hosts, doubles or, if SinglePrecision, floats */
+    void * BufSend;
+    void * BufRecv;
     int * ibuffer;
 };
 
@@ -49,12 +69,21 @@ typedef struct PetaPMPriv {
     /* These varibles are initialized by petapm_init*/
 
     int fftsize;
+    /* Size of one real number on the FFT meshes: sizeof(float) if SinglePrecision, else sizeof(double)*/
+    size_t elsize;
     pfft_plan plan_forw;
     pfft_plan plan_back;
+    /* Used instead of plan_forw and plan_back if SinglePrecision*/
+    pfftf_plan plan_forwf;
+    pfftf_plan plan_backf;
     MPI_Comm comm_cart_2d;
 
     /* these variables are allocated every force calculation */
     double * meshbuf;
+    /* Mesh deposited with a half cell shift, if interlacing*/
+    double * meshshift;
+    /* Density mesh on the pfft hosts kept between steps (two if interlacing), or NULL*/
+    void * meshpersist;
     size_t meshbufsize;
     struct Layout layout;
 } PetaPMPriv;
@@ -69,6 +98,19 @@ typedef struct PetaPM {
     double Asmth;
     double BoxSize;
     double G;
+    /* Mass assignment window, CIC by default. Set after petapm_init.*/
+    enum PetaPMWindow Window;
+    /* If true, also deposit to a mesh shifted by half a cell
+     * and average the two in Fourier space to suppress aliasing.*/
+    int Interlace;
+    /* Largest number of readout functions transformed, exchanged and read out together by petapm_force_c2r.
+     * Fewer are used if their cell buffers do not fit in the free memory. Set after petapm_init.*/
+    int MaxFused;
+    /* If true, the FFT meshes and the exchanged cells are single precision. The mass deposit
+     * is still accumulated in double precision. Set by petapm_init.*/
+    int SinglePrecision;
+    /* Whether the deposit updates the persistent density mesh. Set before petapm_force.*/
+    enum PetaPMPersist Persist;
     PetaPMPriv priv[1];
     int ThisTask2d[2];
     int NTask2d[2];
@@ -76,7 +118,7 @@ typedef struct PetaPM {
     Power ps[1];
 } PetaPM;
 
-typedef struct {
+typedef struct PetaPMParticleStruct {
     void * Parts;
     size_t elsize;
     size_t offset_pos;
@@ -84,6 +126,9 @@ typedef struct {
     int * RegionInd;
     int (*active) (int i);
     int64_t NumPart;
+    /* If not NULL, the active particles of removed are deposited with negative mass, in the regions
+     * of the same particles of this struct: their last deposit to the persistent mesh, to be replaced.*/
+    struct PetaPMParticleStruct * removed;
 } PetaPMParticleStruct;
 
 /* extra particle info used in reionisation*/
@@ -109,6 +154,12 @@ typedef struct {
     petapm_readout_func readout;
 } PetaPMFunctions;
 
+/* Fourier space analysis of nfield meshes, called once for each mode with the value of the mode on each mesh.
+ * Called from several threads at once.*/
+typedef void (*petapm_analysis_func)(PetaPM * pm, int64_t k2, int kpos[3], pfft_complex * values, const int nfield, void * userdata);
+/* Maximal number of meshes analysed together*/
+#define PETAPM_MAX_ANALYSIS 8
+
 /* Reion Loop function, applied after c2r, doesn't iterate over all particles*/
 typedef void (*petapm_reion_func)(PetaPM * pm_mass, PetaPM * pm_star, PetaPM * pm_sfr, double * mass_real, double * star_real, double * sfr_real, int last_step);
 
@@ -126,8 +177,10 @@ typedef void * (*petapm_mfree_func)(void * ptr);
 
 void petapm_module_init(int Nthreads);
 
-void petapm_init(PetaPM * pm, double BoxSize, double Asmth, int Nmesh, double G, MPI_Comm comm);
+void petapm_init(PetaPM * pm, double BoxSize, double Asmth, int Nmesh, double G, int SinglePrecision, MPI_Comm comm);
 void petapm_destroy(PetaPM * pm);
+/* Allocate the persistent density mesh, after setting pm->Interlace. It is freed by petapm_destroy.*/
+void petapm_alloc_persistent(PetaPM * pm);
 void petapm_region_init_strides(PetaPMRegion * region);
 
 void petapm_force(PetaPM * pm,
@@ -142,6 +195,8 @@ PetaPMRegion * petapm_force_init(PetaPM * pm,
         PetaPMParticleStruct * pstruct,
         int * Nregions,
         void * userdata);
+/* If pm->SinglePrecision the returned mesh holds pfftf_complex values:
+ * it should only be passed on to petapm_force_c2r and freed.*/
 pfft_complex * petapm_force_r2c(PetaPM * pm,
         PetaPMGlobalFunctions * global_functions
         );
@@ -158,6 +213,18 @@ int *petapm_get_thistask2d(PetaPM * pm);
 int *petapm_get_ntask2d(PetaPM * pm);
 pfft_complex * petapm_alloc_rhok(PetaPM * pm);
 
+/* Allocate (with mymalloc) and zero nfield interleaved meshes of Fourier modes*/
+void * petapm_alloc_modes(PetaPM * pm, const int nfield);
+/* Deposit the active particles of pstruct in regions built by prepare, as petapm_force_init,
+ * and store the Fourier transform of their density in mesh field of the nfield meshes in modes.*/
+void petapm_density_modes(PetaPM * pm,
+        petapm_prepare_func prepare,
+        PetaPMParticleStruct * pstruct,
+        void * userdata,
+        void * modes, const int field, const int nfield);
+/* Call analysis for each local Fourier mode of the nfield meshes in modes. nfield is at most PETAPM_MAX_ANALYSIS.*/
+void petapm_analyse_modes(PetaPM * pm, void * modes, const int nfield, petapm_analysis_func analysis, void * userdata);
+
 void petapm_reion(PetaPM * pm_mass, PetaPM * pm_star, PetaPM * pm_sfr,
         petapm_prepare_func prepare,
         PetaPMGlobalFunctions * global_functions, //petapm_transfer_func global_transfer,
@@ -165,7 +232,7 @@ void petapm_reion(PetaPM * pm_mass, PetaPM * pm_star, PetaPM * pm_sfr,
         PetaPMParticleStruct * pstruct,
         PetaPMReionPartStruct * rstruct,
         petapm_reion_func reion_loop,
-        double R_max, double R_min, double R_delta, int use_sfr,
+        double R_max, double R_min, double R_delta, int use_sfr, int Nbatch,
         void * userdata);
 
 #endif
@@ -80,6 +80,8 @@ static struct run_params
     int MaxDomainTimeBinDepth; /* We should redo domain decompositions every timestep, after the timestep hierarchy gets deeper than this.
                                   Essentially forces a domain decompositon every 2^MaxDomainTimeBinDepth timesteps.*/
     int FastParticleType; /*!< flags a particle species to exclude timestep calculations.*/
+    int GasTreeRefit; /* Keep the gas tree between non-PM timesteps and refit it to the drifted particles, instead of rebuilding it.*/
+    double GasTreeRefitMaxMoved; /* Rebuild the gas tree if more than this fraction of particles have left their tree leaf.*/
 
     /* parameters determining output frequency */
     double AutoSnapshotTime;    /*!< cpu-time between regularly generated snapshots. */
@@ -164,6 +166,8 @@ set_all_global_params(ParameterSet * ps)
         All.StarformationOn = param_get_int(ps, "StarformationOn");
         All.MetalReturnOn = param_get_int(ps, "MetalReturnOn");
         All.MaxDomainTimeBinDepth = param_get_int(ps, "MaxDomainTimeBinDepth");
+        All.GasTreeRefit = param_get_int(ps, "GasTreeRefit");
+        All.GasTreeRefitMaxMoved = param_get_double(ps, "GasTreeRefitMaxMoved");
 
         /*Massive neutrino parameters*/
         All.CP.MassiveNuLinRespOn = param_get_int(ps, "MassiveNuLinRespOn");
@@ -332,9 +336,9 @@ run(const int RestartSnapNum, const inttime_t ti_init, const struct header_data
     PetaPM pm_star = {0};
     PetaPM pm_sfr = {0};
     if(All.ExcursionSetReionOn){
-        petapm_init(&pm_mass, PartManager->BoxSize, All.Asmth, All.UVBGdim, All.CP.GravInternal, MPI_COMM_WORLD);
-        petapm_init(&pm_star, PartManager->BoxSize, All.Asmth, All.UVBGdim, All.CP.GravInternal, MPI_COMM_WORLD);
-        petapm_init(&pm_sfr, PartManager->BoxSize, All.Asmth, All.UVBGdim, All.CP.GravInternal, MPI_COMM_WORLD);
+        petapm_init(&pm_mass, PartManager->BoxSize, All.Asmth, All.UVBGdim, All.CP.GravInternal, 0, MPI_COMM_WORLD);
+        petapm_init(&pm_star, PartManager->BoxSize, All.Asmth, All.UVBGdim, All.CP.GravInternal, 0, MPI_COMM_WORLD);
+        petapm_init(&pm_sfr, PartManager->BoxSize, All.Asmth, All.UVBGdim, All.CP.GravInternal, 0, MPI_COMM_WORLD);
     }
 
     DomainDecomp ddecomp[1] = {0};
@@ -351,6 +355,10 @@ run(const int RestartSnapNum, const inttime_t ti_init, const struct header_data
 
     double atime = get_atime(times.Ti_Current);
 
+    /* The gas tree. This is usually rebuilt every timestep, but if GasTreeRefit
+     * is set it is kept between short timesteps and refit to the new positions.*/
+    ForceTree gasTree = {0};
+
     while(1) /* main loop */
     {
         /* Find next synchronization point and the timebins active during this timestep.
@@ -412,10 +420,12 @@ run(const int RestartSnapNum, const inttime_t ti_init, const struct header_data
         /* drift and ddecomp decomposition */
         /* at first step this is a noop */
         if(extradomain || is_PM) {
+            /* A new domain means a new tree*/
+            force_tree_free(&gasTree);
             /* Sync positions of all particles */
             drift_all_particles(Ti_Last, times.Ti_Current, &All.CP, rel_random_shift);
-            /* full decomposition rebuilds the domain, needs keys.*/
-            domain_decompose_full(ddecomp);
+            /* rebalance (or fully decompose) the domain, needs keys.*/
+            domain_rebalance(ddecomp);
         } else {
             /* If it is not a PM step, do a shorter version
              * of the ddecomp decomp which just exchanges particles.
@@ -425,14 +435,22 @@ run(const int RestartSnapNum, const inttime_t ti_init, const struct header_data
             drift.CP = &All.CP;
             drift.ti0 = Ti_Last;
             drift.ti1 = times.Ti_Current;
-            int needfull = domain_maintain(ddecomp, &drift);
-            if(needfull)
-                domain_decompose_full(ddecomp);
+            int needfull = domain_maintain(ddecomp, &drift, &gasTree);
+            if(needfull) {
+                force_tree_free(&gasTree);
+                domain_rebalance(ddecomp);
+            }
         }
         update_lastactive_drift(&times);
 
+        /* Any kept gas tree is at the top of the heap, where the last step and domain_maintain left it.
+         * Build the active list below it, then move the tree above the active list, so that it is freed first.*/
+        if(force_tree_allocated(&gasTree))
+            force_tree_move(&gasTree, 1);
         ActiveParticles Act = init_empty_active_particles(PartManager);
         build_active_particles(&Act, &times, NumCurrentTiStep, atime, PartManager);
+        if(force_tree_allocated(&gasTree))
+            force_tree_move(&gasTree, 0);
 
         /* Are the particle neutrinos gravitating this timestep?
          * If so we need to add them to the tree.*/
@@ -442,7 +460,6 @@ run(const int RestartSnapNum, const inttime_t ti_init, const struct header_data
         if(sfr_need_to_compute_sph_grad_rho())
             GradRho_mag = (MyFloat *) mymalloc2("SPH_GradRho", sizeof(MyFloat) * SlotsManager->info[0].size);
 
-        ForceTree gasTree = {0};
         /* density() happens before gravity because it also initializes the predicted variables.
         * This ensures that prediction consistently uses the grav and hydro accel from the
         * timestep before this one, which matches Gadget-2/3. It was tested to make a small difference,
@@ -456,7 +473,10 @@ run(const int RestartSnapNum, const inttime_t ti_init, const struct header_data
              * However, hsml is the length that encloses NumNgb gas particles, so for density the tree needs only gas.
              * We add BHs so we can re-use the tree for mergers.
              * No moments (yet). We do need hmax for hydro, but we need to compute hsml first.*/
-            force_tree_rebuild_mask(&gasTree, ddecomp, GASMASK | BHMASK, All.OutputDir);
+            if(force_tree_allocated(&gasTree) && force_tree_refit(&gasTree, ddecomp, All.GasTreeRefitMaxMoved))
+                force_tree_free(&gasTree);
+            if(!force_tree_allocated(&gasTree))
+                force_tree_rebuild_mask(&gasTree, ddecomp, GASMASK | BHMASK, All.OutputDir);
             walltime_measure("/SPH/Build");
 
             /*Predicted SPH data.*/
@@ -511,7 +531,6 @@ run(const int RestartSnapNum, const inttime_t ti_init, const struct header_data
 
         if(is_PM)
         {
-            /* Tree freed in PM*/
             gravpm_force(&pm, ddecomp, &All.CP, atime, units.UnitLength_in_cm, All.OutputDir, header->TimeIC);
 
             /* compute and output energy statistics if desired. */
@@ -655,8 +674,10 @@ run(const int RestartSnapNum, const inttime_t ti_init, const struct header_data
             if(All.CoolingOn)
                 cooling_and_starformation(&Act, atime, get_dloga_for_bin(times.mintimebin, times.Ti_Current), &gasTree, GravAccel, ddecomp, &All.CP, GradRho_mag, &rnd, fds.FdSfr);
         }
-        /* We don't need this timestep's tree anymore.*/
-        force_tree_free(&gasTree);
+        /* We don't need this timestep's tree anymore, unless we will refit it on the next timestep.
+         * Snapshots and FOF re-order the particles, so only keep the tree between steps which do not write output.*/
+        if(!All.GasTreeRefit || is_PM || planned_sync)
+            force_tree_free(&gasTree);
 
         /* Compute the list of particles that cross a lightcone and write it to disc.
          * This should happen when kick and drift times are synchronised.*/
@@ -706,7 +727,7 @@ run(const int RestartSnapNum, const inttime_t ti_init, const struct header_data
                  * to one processor than there is room for.*/
                 slots_gc_sorted(PartManager, SlotsManager);
                 /* Do a domain exchange*/
-                if(domain_maintain(ddecomp, NULL))
+                if(domain_maintain(ddecomp, NULL, NULL))
                     endrun(0, "Domain exchange after FOF save particle did not complete!\n");
                 /* Not strictly necessary, but a good idea for performance*/
                 slots_gc_sorted(PartManager, SlotsManager);
@@ -786,7 +807,11 @@ run(const int RestartSnapNum, const inttime_t ti_init, const struct header_data
             apply_PM_half_kick(&All.CP, &times);
         }
 
-        /* We can now free the active list: the new step have new active particles*/
+        /* We can now free the active list: the new step have new active particles.
+         * Any kept gas tree is above it, so move the tree out of the way. It stays at the top of the heap
+         * until the next active list is built, as domain_maintain would otherwise move it there again.*/
+        if(force_tree_allocated(&gasTree))
+            force_tree_move(&gasTree, 1);
         free_active_particles(&Act);
 
         NumCurrentTiStep++;
@@ -851,6 +876,5 @@ runpower(const struct header_data * header)
     DomainDecomp ddecomp[1] = {0};
     /* ... read in initial model */
     domain_decompose_full(ddecomp);	/* do initial domain decomposition (gives equal numbers of particles) */
-    /*PM needs a tree*/
     gravpm_force(&pm, ddecomp, &All.CP, header->TimeSnapshot, header->UnitLength_in_cm, All.OutputDir, header->TimeSnapshot);
 }
@@ -120,6 +120,10 @@ slots_split_particle(int parent, double childmass, struct part_manager_type * pm
 
     pman->Base[child].Mass = childmass;
     pman->Base[parent].Mass -= childmass;
+#ifdef PM_INCREMENTAL_DEPOSIT
+    /* The child is not yet on the persistent PM mesh: its mass is still in the deposit of the parent*/
+    pman->Base[child].PMDepositMass = 0;
+#endif
 
     /*Invalidate the slot of the child. Call slots_convert soon afterwards!*/
     pman->Base[child].PI = -1;
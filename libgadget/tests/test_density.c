@@ -19,6 +19,7 @@
 #include <libgadget/forcetree.h>
 #include <libgadget/timestep.h>
 #include <libgadget/gravity.h>
+#include <libgadget/treewalk.h>
 
 #include "stub.h"
 
@@ -204,6 +205,16 @@ static void test_density_close(void ** state) {
     do_density_test(state, numpart, 0.131726, 1e-4);
 }
 
+static void test_density_async(void ** state) {
+    /* The pipelined export mode should find the same densities*/
+    struct density_testdata * data = * (struct density_testdata **) state;
+    data->dp.MaxNumNgbDeviation = 2;
+    set_densitypar(data->dp);
+    treewalk_set_async_export(1);
+    test_density_flat(state);
+    treewalk_set_async_export(0);
+}
+
 void do_random_test(void **state, gsl_rng * r, const int numpart)
 {
     /* Create a randomly space set of particles, 8x8x8, all of type 0. */
@@ -334,6 +345,7 @@ int main(void) {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_density_flat),
         cmocka_unit_test(test_density_close),
+        cmocka_unit_test(test_density_async),
         cmocka_unit_test(test_density_random),
     };
     return cmocka_run_group_tests_mpi(tests, setup_density, teardown_density);
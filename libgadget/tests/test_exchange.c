@@ -156,6 +156,45 @@ test_exchange_with_garbage(void **state)
     return;
 }
 
+static void
+test_exchange_compress(void **state)
+{
+    int64_t newSlots[6] = {NUMPART1, NUMPART1, NUMPART1, NUMPART1, NUMPART1, NUMPART1};
+
+    setup_particles(newSlots);
+    int i, k;
+    for(i = 0; i < PartManager->NumPart; i ++) {
+        for(k = 0; k < 3; k++) {
+            P[i].Pos[k] = 1000 + P[i].ID * 0.1 + k / 3.;
+            P[i].Vel[k] = -1. * P[i].ID / (k + 7.);
+        }
+        P[i].Mass = P[i].ID / 7.;
+        if(P[i].Type == 0)
+            SPHP(i).Density = P[i].ID / 3.;
+    }
+
+    /* The packed particles and slots must arrive bit for bit*/
+    exchange_set_compress(1);
+    int fail = domain_exchange(&test_exchange_layout_func, NULL, NULL, PartManager, SlotsManager, 10000, MPI_COMM_WORLD);
+    exchange_set_compress(0);
+    assert_all_true(!fail);
+
+    for(i = 0; i < PartManager->NumPart; i ++) {
+        if(P[i].IsGarbage)
+            continue;
+        for(k = 0; k < 3; k++) {
+            assert_true(P[i].Pos[k] == 1000 + P[i].ID * 0.1 + k / 3.);
+            assert_true(P[i].Vel[k] == -1. * P[i].ID / (k + 7.));
+        }
+        assert_true(P[i].Mass == (float) (P[i].ID / 7.));
+        if(P[i].Type == 0)
+            assert_true(SPHP(i).Density == P[i].ID / 3.);
+    }
+    domain_test_id_uniqueness(PartManager);
+    teardown_particles(state);
+    return;
+}
+
 static int
 test_exchange_layout_func_uneven(int i, const void * userdata)
 {
@@ -210,12 +249,118 @@ test_exchange_uneven(void **state)
     return;
 }
 
+/* Check that each particle is on the task of its top leaf and the leaves of each task are contiguous*/
+static void
+check_domain(DomainDecomp * ddecomp)
+{
+    int i;
+    assert_int_equal(ddecomp->Tasks[0].StartLeaf, 0);
+    assert_int_equal(ddecomp->Tasks[NTask-1].EndLeaf, ddecomp->NTopLeaves);
+    for(i = 0; i < NTask - 1; i++)
+        assert_int_equal(ddecomp->Tasks[i].EndLeaf, ddecomp->Tasks[i+1].StartLeaf);
+    for(i = 0; i < ddecomp->NTopLeaves; i++)
+        assert_int_equal(ddecomp->TopNodes[ddecomp->TopLeaves[i].topnode].Leaf, i);
+    for(i = 0; i < PartManager->NumPart; i++) {
+        if(P[i].IsGarbage)
+            continue;
+        const int leaf = domain_get_topleaf(PEANO(P[i].Pos, PartManager->BoxSize), ddecomp);
+        assert_int_equal(ddecomp->TopLeaves[leaf].Task, ThisTask);
+    }
+}
+
+static void
+test_domain_rebalance(void **state)
+{
+    int64_t newSlots[6] = {0, 256, 0, 0, 0, 0};
+
+    setup_particles(newSlots);
+    PartManager->BoxSize = 100;
+    DomainParams dp = {0};
+    dp.DomainOverDecompositionFactor = 4;
+    dp.TopNodeAllocFactor = 1;
+    dp.SetAsideFactor = 1;
+    dp.DomainIncrementalRebalance = 4;
+    set_domain_par(dp);
+
+    gsl_rng * r = gsl_rng_alloc(gsl_rng_mt19937);
+    gsl_rng_set(r, 11 + ThisTask);
+    int i, k;
+    for(i = 0; i < PartManager->NumPart; i ++)
+        for(k = 0; k < 3; k++)
+            P[i].Pos[k] = PartManager->BoxSize * gsl_rng_uniform(r);
+    DomainDecomp ddecomp[1] = {0};
+    domain_decompose_full(ddecomp);
+    check_domain(ddecomp);
+
+    /* Gather a third of the particles into a clump, which the rebalance must refine and spread out*/
+    for(i = 0; i < PartManager->NumPart; i ++) {
+        if(P[i].ID % 3)
+            continue;
+        /* Keep the old position in the velocity, to put the clump back later*/
+        for(k = 0; k < 3; k++) {
+            P[i].Vel[k] = P[i].Pos[k];
+            P[i].Pos[k] = 20 + 5 * gsl_rng_uniform(r);
+        }
+    }
+    int NTopLeaves = ddecomp->NTopLeaves;
+    /* The rebalance must not fall back to a full decomposition*/
+    assert_int_equal(domain_rebalance(ddecomp), 0);
+    check_domain(ddecomp);
+    /* With one task the clump is not above the cost limit of a leaf*/
+    if(NTask > 1)
+        assert_true(ddecomp->NTopLeaves > NTopLeaves);
+    domain_test_id_uniqueness(PartManager);
+
+    /* The load is balanced to within a factor of two*/
+    int64_t numpart = 0, maxpart = 0;
+    for(i = 0; i < PartManager->NumPart; i ++)
+        numpart += !P[i].IsGarbage;
+    MPI_Allreduce(&numpart, &maxpart, 1, MPI_INT64, MPI_MAX, MPI_COMM_WORLD);
+    message(0, "Largest particle load after rebalance: %ld of mean %d\n", maxpart, TotNumPart / NTask);
+    assert_true(maxpart <= 2 * TotNumPart / NTask);
+    MPI_Allreduce(MPI_IN_PLACE, &numpart, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    assert_int_equal(numpart, TotNumPart);
+
+    /* Put the clump back where it was, and refine the leaves with a larger over-decomposition*/
+    for(i = 0; i < PartManager->NumPart; i ++) {
+        if(P[i].ID % 3)
+            continue;
+        for(k = 0; k < 3; k++)
+            P[i].Pos[k] = P[i].Vel[k];
+    }
+    dp.DomainOverDecompositionFactor = 32;
+    set_domain_par(dp);
+    assert_int_equal(domain_rebalance(ddecomp), 0);
+    check_domain(ddecomp);
+
+    /* Empty half of the box, halving the over-decomposition so the cost limit of a leaf stays the same.
+     * The leaves in the empty half are merged and no leaves are refined.*/
+    for(i = 0; i < PartManager->NumPart; i ++)
+        if(P[i].Pos[0] < PartManager->BoxSize / 2)
+            slots_mark_garbage(i, PartManager, SlotsManager);
+    dp.DomainOverDecompositionFactor /= 2;
+    set_domain_par(dp);
+    NTopLeaves = ddecomp->NTopLeaves;
+    assert_int_equal(domain_rebalance(ddecomp), 0);
+    check_domain(ddecomp);
+    assert_true(ddecomp->NTopLeaves < NTopLeaves);
+    domain_test_id_uniqueness(PartManager);
+
+    gsl_rng_free(r);
+    domain_free(ddecomp);
+    slots_free(SlotsManager);
+    myfree(P);
+    MPI_Barrier(MPI_COMM_WORLD);
+}
+
 int main(void) {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_exchange_with_garbage),
         cmocka_unit_test(test_exchange),
         cmocka_unit_test(test_exchange_zero_slots),
         cmocka_unit_test(test_exchange_uneven),
+        cmocka_unit_test(test_exchange_compress),
+        cmocka_unit_test(test_domain_rebalance),
     };
     return cmocka_run_group_tests_mpi(tests, NULL, NULL);
 }
@@ -46,7 +46,7 @@ static int check_moments(const ForceTree * tb, const int numpart, const int nrea
         assert_true(fnode >= tb->firstnode && fnode < tb->lastnode);
         while(fnode > 0) {
             tb->Nodes[fnode].mom.mass -= P[i].Mass;
-            fnode = tb->Nodes[fnode].father;
+            fnode = tb->NodesCold[fnode].father;
             /*Validate father*/
             assert_true((fnode >= tb->firstnode && fnode < tb->lastnode) || fnode == -1);
         }
@@ -75,7 +75,7 @@ static int check_moments(const ForceTree * tb, const int numpart, const int nrea
                     break;
             }
             assert_int_equal(ances, sfather);
-/*                 printf("node %d ances %d sib %d next %d father %d sfather %d\n",node, ances, sib, nop->s.suns[0], father, sfather); */
+/*                 printf("node %d ances %d sib %d next %d father %d sfather %d\n",node, ances, sib, nop->first, father, sfather); */
         }
         else if(sib == -1)
             sibcntr++;
@@ -89,8 +89,8 @@ static int check_moments(const ForceTree * tb, const int numpart, const int nrea
             );
             /* something is wrong show the particles */
             if(tb->Nodes[node].f.ChildType == PARTICLE_NODE_TYPE)
-                for(i = 0; i < nop->s.noccupied; i++) {
-                    int nn = nop->s.suns[i];
+                for(i = 0; i < tb->NodesCold[node].s.noccupied; i++) {
+                    int nn = tb->NodesCold[node].s.suns[i];
                     printf("particles P[%d], Mass=%g\n", nn, P[nn].Mass);
                 }
         }
@@ -103,7 +103,7 @@ static int check_moments(const ForceTree * tb, const int numpart, const int nrea
         if(nop->f.ChildType == PARTICLE_NODE_TYPE)
             node = nop->sibling;
         else
-            node = nop->s.suns[0];
+            node = nop->first;
     }
 //     message(5, "count %d real %d\n", counter, nrealnode);
     assert_true(counter <= nrealnode);
@@ -124,18 +124,19 @@ static int check_tree(const ForceTree * tb, const int nnodes, const int numpart)
     for(i=firstnode; i<nnodes+firstnode; i++)
     {
         struct NODE * pNode = &(tb->Nodes[i]);
+        const struct NodeChild * s = &(tb->NodesCold[i].s);
         /*Just reserved free space with nothing in it*/
-        if(pNode->father < -1.5)
+        if(tb->NodesCold[i].father < -1.5)
             continue;
 
         int j;
         /* Full of particles*/
-        if(pNode->s.noccupied < 1<<16) {
-            tot_empty += NMAXCHILD - pNode->s.noccupied;
-            if(pNode->s.noccupied == 0)
+        if(s->noccupied < 1<<16) {
+            tot_empty += NMAXCHILD - s->noccupied;
+            if(s->noccupied == 0)
                 sevens++;
-            for(j=0; j<pNode->s.noccupied; j++) {
-                int child = pNode->s.suns[j];
+            for(j=0; j<s->noccupied; j++) {
+                int child = s->suns[j];
                 assert_true(child >= 0);
                 assert_true(child < firstnode);
                 P[child].PI += 1;
@@ -146,7 +147,7 @@ static int check_tree(const ForceTree * tb, const int nnodes, const int numpart)
         else {
             for(j=0; j<8; j++) {
                 /*Check children*/
-                int child = pNode->s.suns[j];
+                int child = s->suns[j];
                 assert_true(child < firstnode+nnodes);
                 assert_true(child >= firstnode);
                 assert_true(fabs(tb->Nodes[child].len/pNode->len - 0.5) < 1e-4);
@@ -170,6 +171,28 @@ static int check_tree(const ForceTree * tb, const int nnodes, const int numpart)
     return nrealnode - sevens;
 }
 
+/* Check that after renumbering a tree walk visits the nodes below the top-level tree in index order.*/
+static void check_walk_order(const ForceTree * tb)
+{
+    int node = tb->firstnode;
+    int last = -1;
+    while(node >= 0) {
+        assert_true(node >= tb->firstnode && node < tb->firstnode + tb->numnodes);
+        const struct NODE * nop = &tb->Nodes[node];
+        if(!nop->f.TopLevel) {
+            if(last >= 0)
+                assert_int_equal(node, last + 1);
+            last = node;
+        }
+        if(nop->f.ChildType == NODE_NODE_TYPE)
+            node = nop->first;
+        else
+            node = nop->sibling;
+    }
+    /* All non-top nodes were visited*/
+    assert_int_equal(last, tb->firstnode + tb->numnodes - 1);
+}
+
 static void do_tree_test(const int numpart, ForceTree tb, DomainDecomp * ddecomp)
 {
     /*Sort by peano key so this is more realistic*/
@@ -187,7 +210,7 @@ static void do_tree_test(const int numpart, ForceTree tb, DomainDecomp * ddecomp
     assert_true(tb.Nodes != NULL);
     /*So we know which nodes we have initialised*/
     for(i=0; i< maxnode; i++)
-        tb.Nodes_base[i].father = -2;
+        tb.NodesCold_base[i].father = -2;
     /*Time creating the nodes*/
     double start, end;
     start = MPI_Wtime();
@@ -206,9 +229,63 @@ static void do_tree_test(const int numpart, ForceTree tb, DomainDecomp * ddecomp
     ms = (end - start)*1000;
     printf("Updated moments in %.3g ms. Total mass: %g\n", ms, tb.Nodes[tb.firstnode].mom.mass);
     assert_true(fabs(tb.Nodes[tb.firstnode].mom.mass - numpart) < 0.5);
+    /* Put the nodes in walk order, as the tree build does*/
+    force_tree_renumber_nodes(&tb, ddecomp);
+    check_walk_order(&tb);
+    assert_true(fabs(tb.Nodes[tb.firstnode].mom.mass - numpart) < 0.5);
     check_moments(&tb, numpart, nrealnode);
 }
 
+/* Build the tree by inserting particles and from sorted keys, and check that the two trees are the same.*/
+static void do_sorted_tree_test(const int numpart, DomainDecomp * ddecomp)
+{
+    int i;
+    #pragma omp parallel for
+    for(i=0; i<numpart; i++) {
+        P[i].Mass = 1;
+        P[i].PI = 0;
+        P[i].IsGarbage = 0;
+        P[i].TopLeaf = 0;
+    }
+    PartManager->MaxPart = numpart;
+    PartManager->NumPart = numpart;
+    ActiveParticles Act = init_empty_active_particles(PartManager);
+    /* Clustered particles need more nodes than the tree build would allocate*/
+    ForceTree tb = force_treeallocate(numpart, numpart, ddecomp, 1, 0);
+    tb.mask = ALLMASK;
+    force_tree_create_nodes(&tb, &Act, ALLMASK, ddecomp);
+    assert_true(tb.numnodes < tb.lastnode - tb.firstnode);
+    force_update_node_parallel(&tb, ddecomp);
+    force_tree_renumber_nodes(&tb, ddecomp);
+
+    ForceTree sorted = force_treeallocate(numpart, numpart, ddecomp, 1, 0);
+    sorted.mask = ALLMASK;
+    for(i = 0; i < sorted.lastnode - sorted.firstnode; i++)
+        sorted.NodesCold_base[i].father = -2;
+    double start = MPI_Wtime();
+    assert_int_equal(force_tree_create_nodes_sorted(&sorted, &Act, ALLMASK, ddecomp), 0);
+    double end = MPI_Wtime();
+    printf("Number of nodes used: %d. Built sorted tree in %.3g ms\n", sorted.numnodes, (end - start)*1000);
+    assert_true(sorted.numnodes < sorted.lastnode - sorted.firstnode);
+    assert_int_equal(sorted.NumParticles, numpart);
+    check_tree(&sorted, sorted.numnodes, numpart);
+    force_update_node_parallel(&sorted, ddecomp);
+    force_tree_renumber_nodes(&sorted, ddecomp);
+    check_walk_order(&sorted);
+
+    /* Same nodes in the same walk order, with the particles in the same leaves*/
+    assert_int_equal(sorted.numnodes, tb.numnodes);
+    assert_true(fabs(sorted.Nodes[sorted.firstnode].mom.mass - tb.Nodes[tb.firstnode].mom.mass) < 0.5);
+    for(i = tb.firstnode; i < tb.firstnode + tb.numnodes; i++) {
+        assert_int_equal(sorted.Nodes[i].f.ChildType, tb.Nodes[i].f.ChildType);
+        assert_true(sorted.Nodes[i].len == tb.Nodes[i].len);
+    }
+    for(i = 0; i < numpart; i++)
+        assert_int_equal(sorted.Father[i], tb.Father[i]);
+    force_tree_free(&sorted);
+    force_tree_free(&tb);
+}
+
 /* Find the hmax value between a node and a particle.*/
 static double compute_distance(int i, struct NODE * node)
 {
@@ -248,7 +325,7 @@ static int check_hmax(const ForceTree * tb, const int numpart)
             /* Test whether hmax is set correctly*/
             assert_false(compute_distance(i, &tb->Nodes[j]) > tb->Nodes[j].mom.hmax+1e-5);
             assert_false(tb->Nodes[j].mom.hmax < 0);
-            j = tb->Nodes[j].father;
+            j = tb->NodesCold[j].father;
         }
     }
     return 0;
@@ -292,6 +369,66 @@ static void do_tree_mask_hmax_update_test(const int numpart, ForceTree * tb, Dom
     check_hmax(tb, numpart);
 }
 
+/* Move the particles of the gas tree from do_tree_mask_hmax_update_test a little,
+ * refit the tree and check that every particle is still inside its leaf.*/
+static void do_tree_refit_test(const int numpart, ForceTree * tb, DomainDecomp * ddecomp)
+{
+    /* Drop the unreachable nodes left by the build, as force_tree_build does*/
+    force_tree_renumber_nodes(tb, ddecomp);
+    RandTable rnd = set_random_numbers(29, 8192);
+    int i;
+    #pragma omp parallel for
+    for(i=0; i<numpart; i++) {
+        int j;
+        P[i].TopLeaf = 0;
+        /* Move by a fraction of the leaf size, so that some particles change leaf*/
+        const double maxmove = 0.2 * tb->Nodes[tb->Father[i]].len;
+        for(j = 0; j < 3; j++) {
+            P[i].Pos[j] += maxmove * (2 * get_random_number(3 * i + j, &rnd) - 1);
+            while(P[i].Pos[j] < 0)
+                P[i].Pos[j] += PartManager->BoxSize;
+            while(P[i].Pos[j] >= PartManager->BoxSize)
+                P[i].Pos[j] -= PartManager->BoxSize;
+        }
+    }
+    free_random_numbers(&rnd);
+    double start = MPI_Wtime();
+    assert_int_equal(force_tree_refit(tb, ddecomp, 1), 0);
+    double end = MPI_Wtime();
+    printf("Refit gas tree in %.3g ms\n", (end - start)*1000);
+    assert_int_equal(tb->NumParticles, numpart);
+    check_walk_order(tb);
+    ActiveParticles Act = init_empty_active_particles(PartManager);
+    force_update_hmax(&Act, tb, ddecomp);
+    assert_true(fabs(tb->Nodes[tb->firstnode].mom.mass - numpart) < 0.5);
+    check_hmax(tb, numpart);
+    /* Moving the tree copies only the used nodes and Father entries*/
+    struct NODE * nodes = (struct NODE *) malloc(tb->numnodes * sizeof(struct NODE));
+    struct NodeCold * cold = (struct NodeCold *) malloc(tb->numnodes * sizeof(struct NodeCold));
+    int * father = (int *) malloc(numpart * sizeof(int));
+    memcpy(nodes, tb->Nodes_base, tb->numnodes * sizeof(struct NODE));
+    memcpy(cold, tb->NodesCold_base, tb->numnodes * sizeof(struct NodeCold));
+    memcpy(father, tb->Father, numpart * sizeof(int));
+    force_tree_move(tb, 1);
+    force_tree_move(tb, 0);
+    assert_memory_equal(nodes, tb->Nodes_base, tb->numnodes * sizeof(struct NODE));
+    assert_memory_equal(cold, tb->NodesCold_base, tb->numnodes * sizeof(struct NodeCold));
+    assert_memory_equal(father, tb->Father, numpart * sizeof(int));
+    /* Too many particles change leaf if they all move half a box.
+     * This is detected before the tree is changed.*/
+    const int numnodes = tb->numnodes;
+    for(i=0; i<numpart; i++)
+        P[i].Pos[0] = fmod(P[i].Pos[0] + PartManager->BoxSize/2, PartManager->BoxSize);
+    assert_int_equal(force_tree_refit(tb, ddecomp, 0.05), 1);
+    assert_int_equal(tb->numnodes, numnodes);
+    assert_memory_equal(nodes, tb->Nodes_base, tb->numnodes * sizeof(struct NODE));
+    assert_memory_equal(cold, tb->NodesCold_base, tb->numnodes * sizeof(struct NodeCold));
+    assert_memory_equal(father, tb->Father, numpart * sizeof(int));
+    free(father);
+    free(cold);
+    free(nodes);
+}
+
 static void test_rebuild_flat(void ** state) {
     /*Set up the particle data*/
     int ncbrt = 128;
@@ -316,7 +453,7 @@ static void test_rebuild_flat(void ** state) {
     ForceTree tb = force_treeallocate(0.7*numpart, numpart, &ddecomp, 1, 0);
     /* So unused memory has Father < 0*/
     for(i = tb.firstnode; i < tb.lastnode; i++)
-        tb.Nodes[i].father = -10;
+        tb.NodesCold[i].father = -10;
 
     do_tree_test(numpart, tb, &ddecomp);
     force_tree_free(&tb);
@@ -400,12 +537,52 @@ static void test_rebuild_random(void ** state) {
         do_random_test(r, numpart, tb, &ddecomp);
     }
     force_tree_free(&tb);
+    do_sorted_tree_test(numpart, &ddecomp);
     tb = force_treeallocate(0.7*numpart, numpart, &ddecomp, 1, 0);
     do_tree_mask_hmax_update_test(numpart, &tb, &ddecomp);
+    do_tree_refit_test(numpart, &tb, &ddecomp);
     force_tree_free(&tb);
     myfree(PartManager->Base);
 }
 
+static void test_sorted_boundaries(void ** state) {
+    /* Put particles exactly on the planes between the children of tree nodes, where the key grid
+     * and the node centres may disagree, and check the sorted build puts them in the same nodes.*/
+    int ncbrt = 32;
+    struct forcetree_testdata * data = * (struct forcetree_testdata **) state;
+    DomainDecomp ddecomp = data->ddecomp;
+    gsl_rng * r = (gsl_rng *) data->r;
+    int numpart = ncbrt*ncbrt*ncbrt;
+    particle_alloc_memory(PartManager, 8, numpart);
+    int i;
+    for(i=0; i<numpart; i++) {
+        P[i].Type = 1;
+        /* Find the centre of a random node, as init_internal_node does*/
+        MyFloat len = PartManager->BoxSize*1.001;
+        MyFloat center[3] = {PartManager->BoxSize/2., PartManager->BoxSize/2., PartManager->BoxSize/2.};
+        const int depth = gsl_rng_uniform_int(r, 8);
+        int d, j;
+        for(d = 0; d < depth; d++) {
+            const MyFloat lenhalf = 0.25 * len;
+            len = 0.5 * len;
+            for(j = 0; j < 3; j++)
+                center[j] += (gsl_rng_uniform(r) > 0.5 ? 1 : -1) * lenhalf;
+        }
+        /* On one or two of the planes through the centre, and random inside the node otherwise*/
+        const int onplane = 1 + gsl_rng_uniform_int(r, 6);
+        for(j = 0; j < 3; j++) {
+            if(onplane & (1 << j))
+                P[i].Pos[j] = center[j];
+            else
+                P[i].Pos[j] = center[j] + len * 0.999 * (gsl_rng_uniform(r) - 0.5);
+        }
+    }
+    PartManager->NumPart = numpart;
+    ddecomp.TopLeaves[0].treenode = numpart;
+    do_sorted_tree_test(numpart, &ddecomp);
+    myfree(PartManager->Base);
+}
+
 /*Make a simple trivial domain for all data on a single processor*/
 void trivial_domain(DomainDecomp * ddecomp)
 {
@@ -464,6 +641,7 @@ int main(void) {
         cmocka_unit_test(test_rebuild_flat),
         cmocka_unit_test(test_rebuild_close),
         cmocka_unit_test(test_rebuild_random),
+        cmocka_unit_test(test_sorted_boundaries),
     };
     return cmocka_run_group_tests_mpi(tests, setup_tree, teardown_tree);
 }
@@ -159,7 +159,22 @@ static int check_against_force_direct(double ErrTolForceAcc)
     return 0;
 }
 
-static void do_force_test(int Nmesh, double Asmth, double ErrTolForceAcc, int direct)
+/* Tree parameters used by the force tests: Barnes-Hut on the first iteration, with
+ * the given opening angle. Tests switch on the optional tree features in the returned struct.*/
+static struct gravshort_tree_params
+test_tree_params(const double BHOpeningAngle)
+{
+    struct gravshort_tree_params treeacc = {0};
+    treeacc.BHOpeningAngle = BHOpeningAngle;
+    treeacc.TreeUseBH = 1;
+    treeacc.FMMOpeningAngle = 0.25;
+    treeacc.Rcut = 7;
+    treeacc.ErrTolForceAcc = 0.002;
+    treeacc.FractionalGravitySoftening = 1./30.;
+    return treeacc;
+}
+
+static void do_force_test(int Nmesh, double Asmth, struct gravshort_tree_params treeacc, int direct)
 {
     /*Sort by peano key so this is more realistic*/
     int i;
@@ -196,14 +211,6 @@ static void do_force_test(int Nmesh, double Asmth, double ErrTolForceAcc, int di
     force_tree_full(&Tree, &ddecomp, 1, NULL);
     const double rho0 = CP.Omega0 * 3 * CP.Hubble * CP.Hubble / (8 * M_PI * G);
 
-    /* Barnes-Hut on first iteration*/
-    struct gravshort_tree_params treeacc = {0};
-    treeacc.BHOpeningAngle = 0.175;
-    treeacc.TreeUseBH = 1;
-    treeacc.Rcut = 7;
-    treeacc.ErrTolForceAcc = ErrTolForceAcc;
-    treeacc.FractionalGravitySoftening = 1./30.;
-
     set_gravshort_treepar(treeacc);
     gravshort_set_softenings(PartManager->BoxSize / cbrt(PartManager->NumPart));
 
@@ -212,11 +219,49 @@ static void do_force_test(int Nmesh, double Asmth, double ErrTolForceAcc, int di
     grav_short_tree(&act, &pm, &Tree, NULL, rho0, 0);
     grav_short_tree(&act, &pm, &Tree, NULL, rho0, 0);
 
+    if(treeacc.TreeUseLET) {
+        /* Walking the locally essential tree should give the forces of a walk which exports particles.
+         * The Barnes-Hut criterion does not depend on the old acceleration, so both walks open the same nodes.*/
+        double * letaccn = (double *) mymalloc2("letaccn", sizeof(double) * 3 * PartManager->NumPart);
+        for(i = 0; i < PartManager->NumPart; i++) {
+            int k;
+            for(k = 0; k < 3; k++)
+                letaccn[3*i+k] = P[i].FullTreeGravAccel[k];
+        }
+        treeacc.TreeUseLET = 0;
+        set_gravshort_treepar(treeacc);
+        grav_short_tree(&act, &pm, &Tree, NULL, rho0, 0);
+        double maxerr = 0, meanacc = 0;
+        for(i = 0; i < PartManager->NumPart; i++) {
+            int k;
+            for(k = 0; k < 3; k++) {
+                maxerr = DMAX(maxerr, fabs(letaccn[3*i+k] - P[i].FullTreeGravAccel[k]));
+                meanacc += fabs(P[i].FullTreeGravAccel[k]);
+            }
+        }
+        MPI_Allreduce(MPI_IN_PLACE, &maxerr, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+        MPI_Allreduce(MPI_IN_PLACE, &meanacc, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+        int64_t tot_npart;
+        MPI_Allreduce(&PartManager->NumPart, &tot_npart, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+        meanacc /= (tot_npart * 3.);
+        message(0, "Max difference between locally essential tree and exported forces %g, mean force %g\n", maxerr, meanacc);
+        assert_true(maxerr < 1e-6 * meanacc);
+        myfree(letaccn);
+    }
+
+    /* Every particle should have recorded the work of its walks*/
+    for(i=0; i<PartManager->NumPart; i++)
+        assert_true(P[i].WalkCost > 0);
+
     force_tree_free(&Tree);
     petapm_destroy(&pm);
+    /* Decompose again, now balancing the measured work.*/
+    domain_decompose_full(&ddecomp);
+    for(i=0; i<PartManager->NumPart; i++)
+        assert_true(P[i].WalkCost == 0);
     domain_free(&ddecomp);
     if(direct)
-        check_against_force_direct(ErrTolForceAcc);
+        check_against_force_direct(treeacc.ErrTolForceAcc);
 }
 
 static void test_force_flat(void ** state) {
@@ -234,7 +279,7 @@ static void test_force_flat(void ** state) {
         P[i].Pos[2] = (PartManager->BoxSize/ncbrt) * (i % ncbrt);
     }
     PartManager->NumPart = numpart;
-    do_force_test(48, 1.5, 0.002, 0);
+    do_force_test(48, 1.5, test_tree_params(0.175), 0);
     /* For a homogeneous mass distribution, the force should be zero*/
     double meanerr=0, maxerr=-1;
     #pragma omp parallel for reduction(+: meanerr) reduction(max: maxerr)
@@ -276,11 +321,11 @@ static void test_force_close(void ** state) {
         P[i].Pos[2] = 4. + (i % ncbrt)/close;
     }
     PartManager->NumPart = numpart;
-    do_force_test(48, 1.5, 0.002, 1);
+    do_force_test(48, 1.5, test_tree_params(0.175), 1);
     myfree(P);
 }
 
-void do_random_test(gsl_rng * r, const int numpart)
+void do_random_test(gsl_rng * r, const int numpart, const struct gravshort_tree_params treeacc)
 {
     /* Create a regular grid of particles, 8x8x8, all of type 1,
      * in a box 8 kpc across.*/
@@ -301,19 +346,470 @@ void do_random_test(gsl_rng * r, const int numpart)
             P[i].Pos[j] = PartManager->BoxSize*0.1 + PartManager->BoxSize/32 * exp(pow(gsl_rng_uniform(r)-0.5,2));
     }
     PartManager->NumPart = numpart;
-    do_force_test(48, 1.5, 0.002, 1);
+    do_force_test(48, 1.5, treeacc, 1);
+}
+
+/* Check the tree force with these parameters for a random clustered particle distribution against direct summation*/
+static void random_force_test(void ** state, const struct gravshort_tree_params treeacc)
+{
+    int numpart = PartManager->NumPart;
+    struct forcetree_testdata * data = * (struct forcetree_testdata **) state;
+    particle_alloc_memory(PartManager, 8, numpart);
+    do_random_test(data->r, numpart, treeacc);
+    myfree(P);
 }
 
 static void test_force_random(void ** state) {
-    /*Set up the particle data*/
+    int i;
+    for(i=0; i<2; i++)
+        random_force_test(state, test_tree_params(0.175));
+}
+
+static void test_force_quadrupole(void ** state) {
+    /* With quadrupole moments a much larger opening angle should give the same force accuracy*/
+    struct gravshort_tree_params treeacc = test_tree_params(0.35);
+    treeacc.TreeUseQuadrupole = 1;
+    random_force_test(state, treeacc);
+}
+
+static void test_force_group(void ** state) {
+    /* Walking the tree for groups of particles should be at least as accurate as walking for each particle*/
+    struct gravshort_tree_params treeacc = test_tree_params(0.175);
+    treeacc.TreeGroupSize = 16;
+    random_force_test(state, treeacc);
+}
+
+static void test_force_fmm(void ** state) {
+    /* The fast multipole method for the local forces should be as accurate as the tree*/
+    struct gravshort_tree_params treeacc = test_tree_params(0.175);
+    treeacc.TreeUseFMM = 1;
+    random_force_test(state, treeacc);
+}
+
+static void test_force_let(void ** state) {
+    /* Walking a locally essential tree should give the same forces as exporting particles*/
+    struct gravshort_tree_params treeacc = test_tree_params(0.175);
+    treeacc.TreeUseLET = 1;
+    random_force_test(state, treeacc);
+}
+
+/* Compute only the long-range PM force, with the given mesh and mass assignment window*/
+static void pm_force_only(int Nmesh, double Asmth, enum PetaPMWindow window, int interlace, double * accn)
+{
+    int i;
+    #pragma omp parallel for
+    for(i=0; i<PartManager->NumPart; i++) {
+        P[i].Type = 1;
+        P[i].Mass = 1;
+        P[i].ID = i;
+        P[i].TimeBinHydro = 0;
+        P[i].TimeBinGravity = 0;
+        P[i].IsGarbage = 0;
+    }
+    DomainDecomp ddecomp = {0};
+    domain_decompose_full(&ddecomp);
+
+    set_gravpm_window(window, interlace);
+    PetaPM pm = {0};
+    gravpm_init_periodic(&pm, PartManager->BoxSize, Asmth, Nmesh, G);
+    Cosmology CP ={0};
+    CP.CMBTemperature = 2.72;
+    CP.HubbleParam = 0.7;
+    CP.Omega0 = 0.3;
+    CP.OmegaCDM = 0.3;
+    CP.OmegaLambda = 0.7;
+    struct UnitSystem units = get_unitsystem(3.085678e21, 1.989e43, 1e5);
+    init_cosmology(&CP, 0.01, units);
+    gravpm_force(&pm, &ddecomp, &CP, 0.1, CM_PER_MPC/1000., ".", 0.01);
+
+    for(i=0; i<PartManager->NumPart; i++) {
+        int k;
+        for(k=0; k<3; k++)
+            accn[3*i+k] = P[i].GravPM[k];
+    }
+    petapm_destroy(&pm);
+    domain_free(&ddecomp);
+    set_gravpm_window(PETAPM_WINDOW_CIC, 0);
+}
+
+/* Mean error of the PM force relative to the mean reference force*/
+static double pm_force_error(double * accn, double * ref, int numpart)
+{
+    double meanerr = 0, meanacc = 0;
+    int i;
+    for(i=0; i < 3*numpart; i++) {
+        meanerr += fabs(accn[i] - ref[i]);
+        meanacc += fabs(ref[i]);
+    }
+    return meanerr / meanacc;
+}
+
+/* Scalar softened short-range force and potential from one mass, as the tree walk computed it
+ * before the interactions were evaluated in blocks. Reference for grav_short_range_accn_block.*/
+static void
+scalar_short_range_accn(const double dx[3], const double r2, const double mass, const double h, const double cellsize, double acc[3], double * pot)
+{
+    const double r = sqrt(r2);
+    double fac = mass / (r2 * r);
+    double facpot = -mass / r;
+
+    if(r2 < h*h)
+    {
+        double wp;
+        const double h3_inv = 1.0 / h / h / h;
+        const double u = r / h;
+        if(u < 0.5) {
+            fac = mass * h3_inv * (10.666666666667 + u * u * (32.0 * u - 38.4));
+            wp = -2.8 + u * u * (5.333333333333 + u * u * (6.4 * u - 9.6));
+        }
+        else {
+            fac =
+                mass * h3_inv * (21.333333333333 - 48.0 * u +
+                        38.4 * u * u - 10.666666666667 * u * u * u - 0.066666666667 / (u * u * u));
+            wp =
+                -3.2 + 0.066666666667 / u + u * u * (10.666666666667 +
+                        u * (-16.0 + u * (9.6 - 2.133333333333 * u)));
+        }
+        facpot = mass / h * wp;
+    }
+
+    if(0 == grav_apply_short_range_window(r, &fac, &facpot, cellsize)) {
+        int i;
+        for(i = 0; i < 3; i++)
+            acc[i] += dx[i] * fac;
+        *pot += facpot;
+    }
+}
+
+static void test_short_range_kernel(void ** state) {
+    /* The vectorised block kernel should give the same force as the scalar kernel, pair by pair and summed,
+     * inside and outside the softening, across the periodic boundary and beyond the end of the window table.*/
+    struct forcetree_testdata * data = * (struct forcetree_testdata **) state;
+    gsl_rng * r = data->r;
+    const double BoxSize = 8, cellsize = BoxSize / 16, h = 0.3 * cellsize;
+    gravshort_fill_ntab(SHORTRANGE_FORCE_WINDOW_TYPE_EXACT, 1.5);
+    /* Not a multiple of the vector length, so the remainder loop is also checked*/
+    const int n = 1001;
+    double x[1001], y[1001], z[1001], mass[1001];
+    /* Close to a corner of the box, so some pairs are across the periodic boundary*/
+    const double pos[3] = {0.1 * cellsize, BoxSize - 0.2 * cellsize, 0.5 * BoxSize};
+    double refacc[3] = {0}, refpot = 0, accscale = 0, potscale = 0;
+    int i, k;
+    for(i = 0; i < n; i++) {
+        /* Distances from 1e-3 of the softening to beyond the 15 cells of the window table*/
+        const double dist = 1e-3 * h * pow(20 * cellsize / (1e-3 * h), gsl_rng_uniform(r));
+        double dir[3], norm = 0;
+        for(k = 0; k < 3; k++) {
+            dir[k] = gsl_rng_uniform(r) - 0.5;
+            norm += dir[k] * dir[k];
+        }
+        double dx[3];
+        for(k = 0; k < 3; k++)
+            dx[k] = dist * dir[k] / sqrt(norm);
+        x[i] = fmod(pos[0] + dx[0] + BoxSize, BoxSize);
+        y[i] = fmod(pos[1] + dx[1] + BoxSize, BoxSize);
+        z[i] = fmod(pos[2] + dx[2] + BoxSize, BoxSize);
+        mass[i] = 0.5 + gsl_rng_uniform(r);
+        dx[0] = NEAREST(x[i] - pos[0], BoxSize);
+        dx[1] = NEAREST(y[i] - pos[1], BoxSize);
+        dx[2] = NEAREST(z[i] - pos[2], BoxSize);
+        const double r2 = dx[0] * dx[0] + dx[1] * dx[1] + dx[2] * dx[2];
+        double pairacc[3] = {0}, pairpot = 0;
+        scalar_short_range_accn(dx, r2, mass[i], h, cellsize, pairacc, &pairpot);
+        double blockacc[3] = {0}, blockpot = 0;
+        grav_short_range_accn_block(1, x + i, y + i, z + i, mass + i, pos, BoxSize, h, cellsize, blockacc, &blockpot);
+        /* Compare to the size of the unwindowed potential and force, as the window goes through zero at large distance*/
+        const double rs = DMAX(sqrt(r2), h);
+        for(k = 0; k < 3; k++) {
+            assert_true(fabs(blockacc[k] - pairacc[k]) <= 1e-12 * mass[i] / (rs * rs));
+            refacc[k] += pairacc[k];
+        }
+        assert_true(fabs(blockpot - pairpot) <= 1e-12 * mass[i] / rs);
+        refpot += pairpot;
+        accscale += mass[i] / (rs * rs);
+        potscale += mass[i] / rs;
+    }
+    double acc[3] = {0}, pot = 0;
+    grav_short_range_accn_block(n, x, y, z, mass, pos, BoxSize, h, cellsize, acc, &pot);
+    message(0, "Block kernel: acc %g %g %g pot %g. Scalar kernel: acc %g %g %g pot %g\n",
+            acc[0], acc[1], acc[2], pot, refacc[0], refacc[1], refacc[2], refpot);
+    for(k = 0; k < 3; k++)
+        assert_true(fabs(acc[k] - refacc[k]) < 1e-12 * accscale);
+    assert_true(fabs(pot - refpot) < 1e-12 * potscale);
+}
+
+static void test_force_window(void ** state) {
+    /* Higher order mass assignment and interlacing should give a PM force on a mesh
+     * as coarse as the particle grid as accurate as CIC on a mesh twice as fine.*/
+    int numpart = PartManager->NumPart;
+    struct forcetree_testdata * data = * (struct forcetree_testdata **) state;
+    gsl_rng * r = data->r;
+    particle_alloc_memory(PartManager, 8, numpart);
+    int i;
+    for(i=0; i<numpart; i++) {
+        int j;
+        for(j=0; j<3; j++) {
+            if(i < numpart/2)
+                P[i].Pos[j] = PartManager->BoxSize * gsl_rng_uniform(r);
+            else
+                P[i].Pos[j] = PartManager->BoxSize/2 + PartManager->BoxSize/8 * exp(pow(gsl_rng_uniform(r)-0.5,2));
+        }
+    }
+    PartManager->NumPart = numpart;
+    double * ref = (double *) mymalloc("ref", 3*sizeof(double) * numpart);
+    double * accn = (double *) mymalloc("accn", 3*sizeof(double) * numpart);
+    /* The force split is at the same physical scale for all meshes: the reference uses a mesh six times finer.*/
+    const int Nmesh = cbrt(numpart);
+    pm_force_only(6 * Nmesh, 6 * 1.5, PETAPM_WINDOW_CIC, 0, ref);
+
+    pm_force_only(2 * Nmesh, 2 * 1.5, PETAPM_WINDOW_CIC, 0, accn);
+    double cicerr = pm_force_error(accn, ref, numpart);
+    pm_force_only(Nmesh, 1.5, PETAPM_WINDOW_TSC, 1, accn);
+    double tscerr = pm_force_error(accn, ref, numpart);
+    pm_force_only(Nmesh, 1.5, PETAPM_WINDOW_PCS, 1, accn);
+    double pcserr = pm_force_error(accn, ref, numpart);
+    message(0, "PM force error: CIC Nmesh %d: %g TSC interlaced Nmesh %d: %g PCS interlaced: %g\n", 2*Nmesh, cicerr, Nmesh, tscerr, pcserr);
+    assert_true(tscerr < cicerr);
+    assert_true(pcserr < cicerr);
+    assert_true(pcserr < 2e-3);
+
+    myfree(accn);
+    myfree(ref);
+    myfree(P);
+}
+
+#ifdef USE_PFFTF
+static void test_force_single_precision(void ** state) {
+    /* Single precision FFTs should change the PM force much less than the mesh discretization*/
+    int numpart = PartManager->NumPart;
+    struct forcetree_testdata * data = * (struct forcetree_testdata **) state;
+    gsl_rng * r = data->r;
+    particle_alloc_memory(PartManager, 8, numpart);
+    int i;
+    for(i=0; i<numpart; i++) {
+        int j;
+        for(j=0; j<3; j++)
+            P[i].Pos[j] = PartManager->BoxSize * gsl_rng_uniform(r);
+    }
+    PartManager->NumPart = numpart;
+    double * ref = (double *) mymalloc("ref", 3*sizeof(double) * numpart);
+    double * accn = (double *) mymalloc("accn", 3*sizeof(double) * numpart);
+    const int Nmesh = cbrt(numpart);
+    pm_force_only(Nmesh, 1.5, PETAPM_WINDOW_CIC, 0, ref);
+    set_gravpm_single_precision(1);
+    pm_force_only(Nmesh, 1.5, PETAPM_WINDOW_CIC, 0, accn);
+    double cicerr = pm_force_error(accn, ref, numpart);
+    pm_force_only(Nmesh, 1.5, PETAPM_WINDOW_TSC, 1, ref);
+    set_gravpm_single_precision(0);
+    pm_force_only(Nmesh, 1.5, PETAPM_WINDOW_TSC, 1, accn);
+    double tscerr = pm_force_error(accn, ref, numpart);
+    message(0, "Single precision PM force error: CIC %g TSC interlaced %g\n", cicerr, tscerr);
+    assert_true(cicerr < 1e-5);
+    assert_true(tscerr < 1e-5);
+
+    myfree(accn);
+    myfree(ref);
+    myfree(P);
+}
+#endif
+
+/* PM force on the particles, by ID, from a PM step of an already initialised mesh*/
+static void pm_force_step(PetaPM * pm, double * accn)
+{
+    DomainDecomp ddecomp = {0};
+    domain_decompose_full(&ddecomp);
+    Cosmology CP ={0};
+    CP.CMBTemperature = 2.72;
+    CP.HubbleParam = 0.7;
+    CP.Omega0 = 0.3;
+    CP.OmegaCDM = 0.3;
+    CP.OmegaLambda = 0.7;
+    struct UnitSystem units = get_unitsystem(3.085678e21, 1.989e43, 1e5);
+    init_cosmology(&CP, 0.01, units);
+    gravpm_force(pm, &ddecomp, &CP, 0.1, CM_PER_MPC/1000., ".", 0.01);
+    int i;
+    for(i=0; i<PartManager->NumPart; i++) {
+        int k;
+        for(k=0; k<3; k++)
+            accn[3*P[i].ID+k] = P[i].GravPM[k];
+    }
+    domain_free(&ddecomp);
+}
+
+#ifdef PM_INCREMENTAL_DEPOSIT
+static void test_force_incremental(void ** state) {
+    /* Depositing only the particles which moved or changed mass onto the stored mesh
+     * should give the same PM force as depositing all particles*/
+    int numpart = PartManager->NumPart;
+    struct forcetree_testdata * data = * (struct forcetree_testdata **) state;
+    gsl_rng * r = data->r;
+    particle_alloc_memory(PartManager, 8, numpart);
+    int i;
+    for(i=0; i<numpart; i++) {
+        int j;
+        for(j=0; j<3; j++)
+            P[i].Pos[j] = PartManager->BoxSize * gsl_rng_uniform(r);
+        P[i].Type = 1;
+        P[i].Mass = 1;
+        P[i].ID = i;
+        P[i].TimeBinHydro = 0;
+        P[i].TimeBinGravity = 0;
+        P[i].IsGarbage = 0;
+    }
+    PartManager->NumPart = numpart;
+    double * ref = (double *) mymalloc("ref", 3*sizeof(double) * numpart);
+    double * accn = (double *) mymalloc("accn", 3*sizeof(double) * numpart);
+    const int Nmesh = cbrt(numpart);
+    const double CellSize = PartManager->BoxSize / Nmesh;
+
+    set_gravpm_window(PETAPM_WINDOW_TSC, 1);
+    set_gravpm_incremental(0.1, 16);
+    PetaPM pm = {0};
+    gravpm_init_periodic(&pm, PartManager->BoxSize, 1.5, Nmesh, G);
+    pm_force_step(&pm, accn);
+    /* Move half of the particles, some across the box edge, and change some masses*/
+    for(i=0; i<PartManager->NumPart; i++) {
+        if(P[i].ID % 2 == 0) {
+            int j;
+            for(j=0; j<3; j++) {
+                P[i].Pos[j] += (gsl_rng_uniform(r) < 0.5 ? 0.3 : -0.3) * CellSize;
+                while(P[i].Pos[j] > PartManager->BoxSize)
+                    P[i].Pos[j] -= PartManager->BoxSize;
+                while(P[i].Pos[j] <= 0)
+                    P[i].Pos[j] += PartManager->BoxSize;
+            }
+        }
+        if(P[i].ID % 7 == 0)
+            P[i].Mass = 2;
+    }
+    pm_force_step(&pm, accn);
+    petapm_destroy(&pm);
+
+    set_gravpm_incremental(0, 16);
+    gravpm_init_periodic(&pm, PartManager->BoxSize, 1.5, Nmesh, G);
+    pm_force_step(&pm, ref);
+    petapm_destroy(&pm);
+    set_gravpm_window(PETAPM_WINDOW_CIC, 0);
+
+    double err = pm_force_error(accn, ref, numpart);
+    message(0, "Incremental PM force error: %g\n", err);
+    assert_true(err < 1e-10);
+
+    myfree(accn);
+    myfree(ref);
+    myfree(P);
+}
+#endif
+
+/* Read the k and power columns of a saved power spectrum. Returns the number of bins.*/
+static int read_power(const char * fname, double * kk, double * power, const int nmax)
+{
+    FILE * fp = fopen(fname, "r");
+    assert_true(fp);
+    char line[512];
+    int n = 0;
+    while(fgets(line, sizeof(line), fp) && n < nmax) {
+        if(line[0] == '#')
+            continue;
+        if(sscanf(line, "%lg %lg", &kk[n], &power[n]) == 2)
+            n++;
+    }
+    fclose(fp);
+    return n;
+}
+
+/* Run the PM step with the extra power spectra switched on, all particles moving with velocity vel along z*/
+static void pm_power_analysis(const double vel)
+{
+    int i;
+    for(i=0; i<PartManager->NumPart; i++) {
+        P[i].Vel[0] = P[i].Vel[1] = 0;
+        P[i].Vel[2] = vel;
+    }
+    DomainDecomp ddecomp = {0};
+    domain_decompose_full(&ddecomp);
+    set_gravpm_power_analysis(1, 2, 1);
+    PetaPM pm = {0};
+    gravpm_init_periodic(&pm, PartManager->BoxSize, 1.5, cbrt(PartManager->NumPart), G);
+    Cosmology CP ={0};
+    CP.CMBTemperature = 2.72;
+    CP.HubbleParam = 0.7;
+    CP.Omega0 = 0.3;
+    CP.OmegaCDM = 0.3;
+    CP.OmegaLambda = 0.7;
+    struct UnitSystem units = get_unitsystem(3.085678e21, 1.989e43, 1e5);
+    init_cosmology(&CP, 0.01, units);
+    gravpm_force(&pm, &ddecomp, &CP, 0.1, CM_PER_MPC/1000., ".", 0.01);
+    set_gravpm_power_analysis(0, 2, 0);
+    petapm_destroy(&pm);
+    domain_free(&ddecomp);
+}
+
+static void test_power_analysis(void ** state) {
+    /* Without velocities the redshift space monopole is the real space power,
+     * and the total power is the mass weighted sum of the species auto and cross power.*/
     int numpart = PartManager->NumPart;
     struct forcetree_testdata * data = * (struct forcetree_testdata **) state;
     gsl_rng * r = data->r;
     particle_alloc_memory(PartManager, 8, numpart);
     int i;
-    for(i=0; i<2; i++) {
-        do_random_test(r, numpart);
+    for(i=0; i<numpart; i++) {
+        int j;
+        for(j=0; j<3; j++)
+            P[i].Pos[j] = (i < numpart/2) ? PartManager->BoxSize * gsl_rng_uniform(r) : PartManager->BoxSize/3 + PartManager->BoxSize/10 * gsl_rng_uniform(r);
+        /* One third of the particles are gas, with a fifth of the mass*/
+        P[i].Type = (i % 3 == 0) ? 0 : 1;
+        P[i].Mass = (i % 3 == 0) ? 0.2 : 1;
+        P[i].ID = i;
+        P[i].IsGarbage = 0;
+        P[i].Swallowed = 0;
     }
+    PartManager->NumPart = numpart;
+    pm_power_analysis(0);
+
+    enum {NK = 64};
+    double kk[NK], ptot[NK], pell0[NK], pell2[NK], pcc[NK], pcb[NK], pbb[NK], tmp[NK];
+    int nk = read_power("./powerspectrum-0.1000.txt", kk, ptot, NK);
+    assert_true(nk > 4);
+    assert_int_equal(read_power("./powerspectrum-rsdz-ell0-0.1000.txt", tmp, pell0, NK), nk);
+    assert_int_equal(read_power("./powerspectrum-rsdz-ell2-0.1000.txt", tmp, pell2, NK), nk);
+    assert_int_equal(read_power("./powerspectrum-cdm-cdm-0.1000.txt", tmp, pcc, NK), nk);
+    assert_int_equal(read_power("./powerspectrum-cdm-baryon-0.1000.txt", tmp, pcb, NK), nk);
+    assert_int_equal(read_power("./powerspectrum-baryon-baryon-0.1000.txt", tmp, pbb, NK), nk);
+    double mc = 0, mb = 0;
+    for(i = 0; i < numpart; i++) {
+        if(i % 3 == 0)
+            mb += (float) 0.2;
+        else
+            mc += 1;
+    }
+    const double mt = mc + mb;
+    for(i = 0; i < nk; i++) {
+        assert_true(fabs(pell0[i] - ptot[i]) < 1e-5 * ptot[i]);
+        const double sum = (mc * mc * pcc[i] + 2 * mc * mb * pcb[i] + mb * mb * pbb[i]) / (mt * mt);
+        const double scale = (mc * mc * pcc[i] + 2 * mc * mb * fabs(pcb[i]) + mb * mb * pbb[i]) / (mt * mt);
+        assert_true(fabs(sum - ptot[i]) < 1e-4 * scale);
+    }
+
+    /* A uniform velocity moving every particle by exactly one cell along the line of sight does not change the multipoles*/
+    const double a = 0.1;
+    Cosmology CP ={0};
+    CP.CMBTemperature = 2.72;
+    CP.HubbleParam = 0.7;
+    CP.Omega0 = 0.3;
+    CP.OmegaCDM = 0.3;
+    CP.OmegaLambda = 0.7;
+    struct UnitSystem units = get_unitsystem(3.085678e21, 1.989e43, 1e5);
+    init_cosmology(&CP, 0.01, units);
+    const double cell = PartManager->BoxSize / (int) cbrt(numpart);
+    pm_power_analysis(cell * a * a * hubble_function(&CP, a));
+    double shifted[NK];
+    assert_int_equal(read_power("./powerspectrum-rsdz-ell0-0.1000.txt", tmp, shifted, NK), nk);
+    for(i = 0; i < nk; i++)
+        assert_true(fabs(shifted[i] - pell0[i]) < 1e-5 * pell0[i]);
+    assert_int_equal(read_power("./powerspectrum-rsdz-ell2-0.1000.txt", tmp, shifted, NK), nk);
+    for(i = 0; i < nk; i++)
+        assert_true(fabs(shifted[i] - pell2[i]) < 1e-5 * pell0[i]);
     myfree(P);
 }
 
@@ -327,6 +823,7 @@ static int setup_tree(void **state) {
     struct DomainParams dp = {0};
     dp.DomainOverDecompositionFactor = 2;
     dp.DomainUseGlobalSorting = 0;
+    dp.DomainUseWalkCost = 1;
     dp.TopNodeAllocFactor = 1.;
     dp.SetAsideFactor = 1;
     set_domain_par(dp);
@@ -352,6 +849,19 @@ int main(void) {
         cmocka_unit_test(test_force_flat),
         cmocka_unit_test(test_force_close),
         cmocka_unit_test(test_force_random),
+        cmocka_unit_test(test_force_quadrupole),
+        cmocka_unit_test(test_force_group),
+        cmocka_unit_test(test_force_fmm),
+        cmocka_unit_test(test_force_let),
+        cmocka_unit_test(test_short_range_kernel),
+        cmocka_unit_test(test_force_window),
+#ifdef USE_PFFTF
+        cmocka_unit_test(test_force_single_precision),
+#endif
+#ifdef PM_INCREMENTAL_DEPOSIT
+        cmocka_unit_test(test_force_incremental),
+#endif
+        cmocka_unit_test(test_power_analysis),
     };
     return cmocka_run_group_tests_mpi(tests, setup_tree, teardown_tree);
 }
@@ -0,0 +1,185 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <stdio.h>
+
+#include "stub.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <mpi.h>
+#include "../utils/endrun.h"
+#include "../utils/mymalloc.h"
+#include "../utils/system.h"
+#include "../utils/nodecomm.h"
+
+/* The value of element k sent from task src to task dest*/
+static int64_t
+element(int src, int dest, int k)
+{
+    return ((int64_t) src << 40) + ((int64_t) dest << 20) + k;
+}
+
+/* Send a varying number of elements, including none, from each task to each task with alltoallv
+ * and check that the right elements arrive in the right place. If nc is NULL, MPI_Alltoallv_sparse and
+ * MPI_Alltoallv_smart are used, otherwise nodecomm_alltoallv.
+ * The send buffer is in the shared heap if inheap is set, and must then be copied there otherwise.*/
+static void
+do_alltoallv_test(NodeComm * nc, const int seed, const int inheap)
+{
+    int NTask, ThisTask;
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+
+    int * sendcnts = ta_malloc("sendcnts", int, 4 * NTask);
+    int * sdispls = sendcnts + NTask;
+    int * recvcnts = sdispls + NTask;
+    int * rdispls = recvcnts + NTask;
+    int i;
+    for(i = 0; i < NTask; i++)
+        sendcnts[i] = (ThisTask * 7 + i * 3 + seed) % 5 * (i + 1);
+    MPI_Alltoall(sendcnts, 1, MPI_INT, recvcnts, 1, MPI_INT, MPI_COMM_WORLD);
+    /* Leave a gap before each block of the receive buffer*/
+    int nsend = 0, nrecv = 0;
+    for(i = 0; i < NTask; i++) {
+        sdispls[i] = nsend;
+        nsend += sendcnts[i];
+        rdispls[i] = nrecv + 1;
+        nrecv += recvcnts[i] + 1;
+    }
+    int64_t * sendbuf = inheap ? ta_malloc("sendbuf", int64_t, nsend + 1) : malloc(sizeof(int64_t) * (nsend + 1));
+    int64_t * recvbuf = ta_malloc("recvbuf", int64_t, nrecv + 1);
+    for(i = 0; i < NTask; i++) {
+        int k;
+        for(k = 0; k < sendcnts[i]; k++)
+            sendbuf[sdispls[i] + k] = element(ThisTask, i, k);
+    }
+    int pass;
+    for(pass = 0; pass < 2; pass++) {
+        memset(recvbuf, -1, sizeof(int64_t) * (nrecv + 1));
+        if(nc)
+            nodecomm_alltoallv(nc, sendbuf, sendcnts, sdispls, recvbuf, recvcnts, rdispls, MPI_INT64);
+        else if(pass == 0)
+            MPI_Alltoallv_sparse(sendbuf, sendcnts, sdispls, MPI_INT64, recvbuf, recvcnts, rdispls, MPI_INT64, MPI_COMM_WORLD);
+        else
+            MPI_Alltoallv_smart(sendbuf, sendcnts, sdispls, MPI_INT64, recvbuf, recvcnts, rdispls, MPI_INT64, MPI_COMM_WORLD);
+        for(i = 0; i < NTask; i++) {
+            int k;
+            assert_int_equal(recvbuf[rdispls[i] - 1], -1);
+            for(k = 0; k < recvcnts[i]; k++)
+                assert_int_equal(recvbuf[rdispls[i] + k], element(i, ThisTask, k));
+        }
+    }
+    ta_free(recvbuf);
+    if(inheap)
+        ta_free(sendbuf);
+    else
+        free(sendbuf);
+    ta_free(sendcnts);
+}
+
+static void
+test_nodecomm_layout(void ** state)
+{
+    int NTask, ThisTask;
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    NodeComm nc[1];
+    nodecomm_init(nc, MPI_COMM_WORLD, 2);
+    assert_int_equal(nc->NNodes, (NTask + 1) / 2);
+    assert_int_equal(nc->ThisNode, ThisTask / 2);
+    assert_int_equal(nc->NodeRank, ThisTask % 2);
+    int i;
+    for(i = 0; i < NTask; i++) {
+        assert_int_equal(nc->TaskNode[i], i / 2);
+        assert_int_equal(nc->NodeTasks[nc->NodeStart[i / 2] + nc->TaskNodeRank[i]], i);
+    }
+    assert_int_equal(nc->NodeStart[nc->NNodes], NTask);
+    nodecomm_free(nc);
+}
+
+static void
+test_nodecomm_alltoallv(void ** state)
+{
+    int NTask;
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+    /* The real nodes, then nodes of different sizes, all on this machine*/
+    int ranks_per_node;
+    for(ranks_per_node = 0; ranks_per_node <= NTask; ranks_per_node++) {
+        NodeComm nc[1];
+        nodecomm_init(nc, MPI_COMM_WORLD, ranks_per_node);
+        do_alltoallv_test(nc, ranks_per_node, 1);
+        do_alltoallv_test(nc, ranks_per_node + 1, 0);
+        nodecomm_free(nc);
+    }
+}
+
+static void
+test_nodecomm_world(void ** state)
+{
+    /* The sparse alltoallv uses the node communicator when it is enabled*/
+    nodecomm_set_world(1, 2);
+    do_alltoallv_test(NULL, 1, 1);
+    nodecomm_set_world(0, 0);
+    assert_null(nodecomm_world());
+    do_alltoallv_test(NULL, 2, 1);
+}
+
+static void
+test_nodecomm_exchange_buffers(void ** state)
+{
+    /* Each task of the node reads the buffers of the others in place*/
+    int ThisTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    NodeComm nc[1];
+    nodecomm_init(nc, MPI_COMM_WORLD, 2);
+    char ** peer = ta_malloc("peer", char *, nc->NodeSize);
+    int64_t * buf = (int64_t *) mymalloc("buf", sizeof(int64_t));
+    buf[0] = element(ThisTask, 0, 1);
+    nodecomm_exchange_buffers(nc, buf, peer);
+    int r;
+    for(r = 0; r < nc->NodeSize; r++) {
+        const int task = nc->NodeTasks[nc->NodeStart[nc->ThisNode] + r];
+        assert_int_equal(*(int64_t *) peer[r], element(task, 0, 1));
+    }
+    MPI_Barrier(MPI_COMM_WORLD);
+    myfree(buf);
+    ta_free(peer);
+    nodecomm_free(nc);
+}
+
+/* Move the MAIN heap into memory shared by the tasks of each node, as mymalloc_init does with NodeSharedComm*/
+static int
+setup_shared_heap(void ** state)
+{
+    allocator_destroy(A_TEMP);
+    allocator_destroy(A_MAIN);
+    const size_t size = 64 * 1024 * 1024;
+    char * heap = nodecomm_alloc_heap(MPI_COMM_WORLD, size);
+    allocator_init_buffer(A_MAIN, "MAIN", heap, size, 0);
+    allocator_init(A_TEMP, "TEMP", 8 * 1024 * 1024, 0, A_MAIN);
+    return 0;
+}
+
+static int
+teardown_shared_heap(void ** state)
+{
+    allocator_destroy(A_TEMP);
+    allocator_destroy(A_MAIN);
+    nodecomm_free_heap();
+    return 0;
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_nodecomm_layout),
+        cmocka_unit_test(test_nodecomm_alltoallv),
+        cmocka_unit_test(test_nodecomm_world),
+        cmocka_unit_test(test_nodecomm_exchange_buffers),
+    };
+    return cmocka_run_group_tests_mpi(tests, setup_shared_heap, teardown_shared_heap);
+}
@@ -0,0 +1,180 @@
+/*Test that the pipelined export mode of the treewalk finds the same neighbours as the synchronous one*/
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <math.h>
+#include <mpi.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <gsl/gsl_rng.h>
+
+#define qsort_openmp qsort
+
+#include <libgadget/treewalk.h>
+#include <libgadget/walltime.h>
+#include <libgadget/domain.h>
+#include <libgadget/forcetree.h>
+#include <libgadget/partmanager.h>
+#include <libgadget/slotsmanager.h>
+#include "stub.h"
+
+static struct ClockTable CT;
+
+/* Search radius of the neighbour walk, in units of the box*/
+#define NGB_RADIUS 0.08
+
+typedef struct {
+    TreeWalkQueryBase base;
+} TreeWalkQueryNgb;
+
+typedef struct {
+    TreeWalkResultBase base;
+    int64_t Ngb;
+    int64_t IDsum;
+} TreeWalkResultNgb;
+
+typedef struct {
+    TreeWalkNgbIterBase base;
+} TreeWalkNgbIterNgb;
+
+struct NgbPriv {
+    int64_t * Ngb;
+    int64_t * IDsum;
+};
+#define NGB_GET_PRIV(tw) ((struct NgbPriv *) ((tw)->priv))
+
+static void
+ngb_copy(int place, TreeWalkQueryNgb * input, TreeWalk * tw)
+{
+}
+
+static void
+ngb_reduce(int place, TreeWalkResultNgb * remote, enum TreeWalkReduceMode mode, TreeWalk * tw)
+{
+    TREEWALK_REDUCE(NGB_GET_PRIV(tw)->Ngb[place], remote->Ngb);
+    TREEWALK_REDUCE(NGB_GET_PRIV(tw)->IDsum[place], remote->IDsum);
+}
+
+static void
+ngb_ngbiter(TreeWalkQueryNgb * I, TreeWalkResultNgb * O, TreeWalkNgbIterNgb * iter, LocalTreeWalk * lv)
+{
+    if(iter->base.other == -1) {
+        iter->base.Hsml = NGB_RADIUS * PartManager->BoxSize;
+        iter->base.symmetric = NGB_TREEFIND_ASYMMETRIC;
+        iter->base.mask = DMMASK;
+        return;
+    }
+    if(iter->base.r2 < iter->base.Hsml * iter->base.Hsml) {
+        O->Ngb++;
+        O->IDsum += P[iter->base.other].ID;
+    }
+}
+
+/* Count the neighbours of every particle and sum their IDs. Returns the number of exports from this task.*/
+static int64_t
+do_ngb_walk(ForceTree * tree, int64_t * Ngb, int64_t * IDsum)
+{
+    TreeWalk tw[1] = {{0}};
+    tw->ev_label = "TEST_NGB";
+    tw->visit = (TreeWalkVisitFunction) treewalk_visit_ngbiter;
+    tw->ngbiter = (TreeWalkNgbIterFunction) ngb_ngbiter;
+    tw->ngbiter_type_elsize = sizeof(TreeWalkNgbIterNgb);
+    tw->haswork = NULL;
+    tw->fill = (TreeWalkFillQueryFunction) ngb_copy;
+    tw->reduce = (TreeWalkReduceResultFunction) ngb_reduce;
+    tw->type = TREEWALK_ALL;
+    tw->query_type_elsize = sizeof(TreeWalkQueryNgb);
+    tw->result_type_elsize = sizeof(TreeWalkResultNgb);
+    tw->tree = tree;
+    struct NgbPriv priv[1] = {{Ngb, IDsum}};
+    tw->priv = priv;
+    treewalk_run(tw, NULL, PartManager->NumPart);
+    return tw->Nexport_sum;
+}
+
+static void
+test_async_export(void **state)
+{
+    walltime_init(&CT);
+
+    struct DomainParams dp = {0};
+    dp.DomainOverDecompositionFactor = 1;
+    dp.DomainUseGlobalSorting = 0;
+    dp.TopNodeAllocFactor = 1.;
+    dp.SetAsideFactor = 1;
+    set_domain_par(dp);
+    init_forcetree_params(0.7);
+
+    int ThisTask, NTask;
+    MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
+    MPI_Comm_size(MPI_COMM_WORLD, &NTask);
+
+    const int NumPart = 4096;
+    particle_alloc_memory(PartManager, 1., 1.5 * NumPart);
+    PartManager->NumPart = NumPart;
+    /* DM only: no slots are enabled, but the exchange needs the particle type*/
+    slots_init(0.01 * PartManager->MaxPart, SlotsManager);
+    int64_t atleast[6] = {0};
+    slots_reserve(1, atleast, SlotsManager);
+    gsl_rng * r = gsl_rng_alloc(gsl_rng_mt19937);
+    gsl_rng_set(r, ThisTask);
+    int i;
+    for(i = 0; i < PartManager->NumPart; i ++) {
+        P[i].ID = i + NumPart * ThisTask;
+        P[i].Type = 1;
+        P[i].Mass = 1;
+        int j;
+        for(j=0; j<3; j++)
+            P[i].Pos[j] = PartManager->BoxSize * gsl_rng_uniform(r);
+    }
+    gsl_rng_free(r);
+
+    DomainDecomp ddecomp = {0};
+    domain_decompose_full(&ddecomp);
+    ForceTree tree = {0};
+    force_tree_rebuild_mask(&tree, &ddecomp, DMMASK, NULL);
+
+    const int n = PartManager->NumPart;
+    int64_t * Ngb = (int64_t *) mymalloc("Ngb", 6 * n * sizeof(int64_t));
+    int64_t * IDsum = Ngb + 3 * n;
+
+    /* Synchronous, pipelined, and pipelined with a small export buffer, so that there are several export rounds
+     * and a small budget for the imports.*/
+    int64_t nexport = do_ngb_walk(&tree, Ngb, IDsum);
+    treewalk_set_async_export(1);
+    do_ngb_walk(&tree, Ngb + n, IDsum + n);
+    treewalk_set_max_export_buffer(1024 * sizeof(TreeWalkQueryNgb));
+    do_ngb_walk(&tree, Ngb + 2 * n, IDsum + 2 * n);
+    treewalk_set_max_export_buffer(3584*1024*1024L);
+    treewalk_set_async_export(0);
+
+    MPI_Allreduce(MPI_IN_PLACE, &nexport, 1, MPI_INT64, MPI_SUM, MPI_COMM_WORLD);
+    if(NTask > 1)
+        assert_true(nexport > 0);
+    for(i = 0; i < n; i++) {
+        /* Every particle finds at least itself*/
+        assert_true(Ngb[i] >= 1);
+        assert_int_equal(Ngb[i], Ngb[i + n]);
+        assert_int_equal(IDsum[i], IDsum[i + n]);
+        assert_int_equal(Ngb[i], Ngb[i + 2 * n]);
+        assert_int_equal(IDsum[i], IDsum[i + 2 * n]);
+    }
+    message(0, "Walks agree: %ld exports\n", nexport);
+
+    myfree(Ngb);
+    force_tree_free(&tree);
+    domain_free(&ddecomp);
+    slots_free(SlotsManager);
+    myfree(P);
+    MPI_Barrier(MPI_COMM_WORLD);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_async_export),
+    };
+    return cmocka_run_group_tests_mpi(tests, NULL, NULL);
+}
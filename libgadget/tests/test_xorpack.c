@@ -0,0 +1,84 @@
+/*Tests for the lossless record packing*/
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <math.h>
+#include <mpi.h>
+#include <stdio.h>
+#include <string.h>
+#include <gsl/gsl_rng.h>
+
+#include <libgadget/utils/xorpack.h>
+#include <libgadget/utils/mymalloc.h>
+#include "stub.h"
+
+/* A record with a partial last word, as in structs without 64-bit members*/
+struct TestRecord {
+    double Pos[3];
+    int64_t ID;
+    float Mass;
+    int Type;
+    float Hsml;
+};
+
+#define NREC 4096
+
+static void
+test_xorpack(void ** state)
+{
+    gsl_rng * r = gsl_rng_alloc(gsl_rng_mt19937);
+    gsl_rng_set(r, 17);
+    struct TestRecord * rec = (struct TestRecord *) mymalloc("rec", NREC * sizeof(struct TestRecord));
+    struct TestRecord * out = (struct TestRecord *) mymalloc("out", NREC * sizeof(struct TestRecord));
+    memset(rec, 0, NREC * sizeof(struct TestRecord));
+    /* Nearby positions, consecutive IDs and equal masses*/
+    int i, k;
+    for(i = 0; i < NREC; i++) {
+        for(k = 0; k < 3; k++)
+            rec[i].Pos[k] = 1000 + 10 * gsl_rng_uniform(r);
+        rec[i].ID = 1000000 + i;
+        rec[i].Mass = 1.5;
+        rec[i].Type = 1;
+        rec[i].Hsml = gsl_rng_uniform(r);
+    }
+    /* Special values must survive*/
+    rec[7].Pos[0] = -0.;
+    rec[8].Pos[1] = NAN;
+    rec[9].ID = -1;
+
+    const size_t elsize = sizeof(struct TestRecord);
+    char * packed = (char *) mymalloc("packed", xorpack_bound(NREC, elsize));
+    const size_t size = xorpack_encode(rec, NREC, elsize, NULL);
+    assert_int_equal(xorpack_encode(rec, NREC, elsize, packed), size);
+    assert_true(size <= xorpack_bound(NREC, elsize));
+    message(0, "Packed %d records of %ld bytes into %ld bytes, ratio %g\n", NREC, elsize, size, (double) NREC * elsize / size);
+    /* The positions lose their common leading bytes, the other fields mostly vanish*/
+    assert_true(size < 0.6 * NREC * elsize);
+
+    assert_int_equal(xorpack_decode(packed, NREC, elsize, out), size);
+    assert_memory_equal(rec, out, NREC * elsize);
+
+    /* An odd record size and random bytes, which do not pack*/
+    const size_t oddsize = 13;
+    char * raw = (char *) rec;
+    for(i = 0; i < NREC * oddsize; i++)
+        raw[i] = gsl_rng_uniform_int(r, 256);
+    const size_t oddpacked = xorpack_encode(raw, NREC, oddsize, packed);
+    assert_true(oddpacked <= xorpack_bound(NREC, oddsize));
+    assert_int_equal(xorpack_decode(packed, NREC, oddsize, out), oddpacked);
+    assert_memory_equal(raw, out, NREC * oddsize);
+
+    myfree(packed);
+    myfree(out);
+    myfree(rec);
+    gsl_rng_free(r);
+}
+
+int main(void) {
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_xorpack),
+    };
+    return cmocka_run_group_tests_mpi(tests, NULL, NULL);
+}
@@ -21,15 +21,25 @@ static int ImportBufferBoost;
 /* 7/9/24: The code segfaults if the send/recv buffer is larger than 4GB in size.
  * Likely a 32-bit variable is overflowing but it is hard to debug. Easier to enforce a maximum buffer size.*/
 static size_t MaxExportBufferBytes = 3584*1024*1024L;
+/* Send exports and evaluate imports asynchronously, overlapping them with the primary walk.*/
+static int TreeWalkAsyncExport;
 
 /*Initialise global treewalk parameters*/
 void set_treewalk_params(ParameterSet * ps)
 {
     int ThisTask;
     MPI_Comm_rank(MPI_COMM_WORLD, &ThisTask);
-    if(ThisTask == 0)
+    if(ThisTask == 0) {
         ImportBufferBoost = param_get_int(ps, "ImportBufferBoost");
+        TreeWalkAsyncExport = param_get_int(ps, "TreeWalkAsyncExport");
+    }
     MPI_Bcast(&ImportBufferBoost, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&TreeWalkAsyncExport, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    int NodeSharedComm;
+    if(ThisTask == 0)
+        NodeSharedComm = param_get_int(ps, "NodeSharedComm");
+    MPI_Bcast(&NodeSharedComm, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    nodecomm_set_world(NodeSharedComm, 0);
 }
 
 /* This function is to allow a test which fills up the exchange buffer*/
@@ -38,7 +48,15 @@ void treewalk_set_max_export_buffer(const size_t maxbuf)
     MaxExportBufferBytes = maxbuf;
 }
 
-static void ev_primary(TreeWalk * tw);
+/* This function is to allow a test of the pipelined export mode*/
+void treewalk_set_async_export(const int async)
+{
+    TreeWalkAsyncExport = async;
+}
+
+struct AsyncComm;
+static void ev_primary(TreeWalk * tw, struct AsyncComm * ac);
+static void ev_async_help(TreeWalk * tw, struct AsyncComm * ac, LocalTreeWalk * lv);
 static int ev_ndone(TreeWalk * tw, MPI_Comm comm);
 
 static int
@@ -74,6 +92,55 @@ ev_init_thread(TreeWalk * const tw, LocalTreeWalk * lv)
         lv->DataIndexTable = NULL;
     if(tw->Ngblist)
         lv->ngblist = tw->Ngblist + thread_id * tw->tree->NumParticles;
+    lv->targets = NULL;
+}
+
+/* Split the WorkSet into groups of nearby particles, to be walked together by visit_group.
+ * Particles are stored in Peano-Hilbert order, so neighbours in the WorkSet are usually close in space.
+ * A new group is started when the current one reaches GroupMaxSize particles or
+ * its bounding box would exceed GroupMaxExtent in any dimension. Each thread groups
+ * a contiguous segment of the WorkSet, so groups never span segments.*/
+static void
+treewalk_build_groups(TreeWalk * tw)
+{
+    gadget_thread_arrays gthread = gadget_setup_thread_arrays("GroupStart", 0, tw->WorkSetSize + 1);
+    #pragma omp parallel
+    {
+        const int tid = omp_get_thread_num();
+        int * thrglocal = gthread.srcs[tid];
+        size_t ngthrlocal = 0;
+        int64_t start = tid * gthread.schedsz;
+        int64_t end = start + gthread.schedsz;
+        if(end > tw->WorkSetSize)
+            end = tw->WorkSetSize;
+        double min[3], max[3];
+        int cursize = 0;
+        int64_t k;
+        for(k = start; k < end; k++) {
+            const int i = tw->WorkSet ? tw->WorkSet[k] : k;
+            int newgroup = (cursize == 0 || cursize >= tw->GroupMaxSize);
+            int d;
+            for(d = 0; d < 3 && !newgroup; d++) {
+                if(DMAX(max[d], P[i].Pos[d]) - DMIN(min[d], P[i].Pos[d]) > tw->GroupMaxExtent)
+                    newgroup = 1;
+            }
+            if(newgroup) {
+                thrglocal[ngthrlocal++] = k;
+                cursize = 0;
+                for(d = 0; d < 3; d++)
+                    min[d] = max[d] = P[i].Pos[d];
+            }
+            for(d = 0; d < 3; d++) {
+                min[d] = DMIN(min[d], P[i].Pos[d]);
+                max[d] = DMAX(max[d], P[i].Pos[d]);
+            }
+            cursize++;
+        }
+        gthread.sizes[tid] = ngthrlocal;
+    }
+    tw->NGroup = gadget_compact_thread_arrays(&tw->GroupStart, &gthread);
+    tw->GroupStart = (int *) myrealloc(tw->GroupStart, sizeof(int) * (tw->NGroup + 1));
+    tw->GroupStart[tw->NGroup] = tw->WorkSetSize;
 }
 
 static void
@@ -93,6 +160,14 @@ ev_begin(TreeWalk * tw, int * active_set, const size_t size)
         may_have_garbage = 1;
     treewalk_build_queue(tw, active_set, size, may_have_garbage);
 
+    tw->GroupStart = NULL;
+    tw->NGroup = 0;
+    if(tw->visit_group && tw->GroupMaxSize > 1) {
+        if(tw->GroupMaxSize > TREEWALK_GROUP_MAX)
+            tw->GroupMaxSize = TREEWALK_GROUP_MAX;
+        treewalk_build_groups(tw);
+    }
+
     /* Start first iteration at the beginning*/
     tw->WorkSetStart = 0;
 
@@ -117,6 +192,11 @@ ev_begin(TreeWalk * tw, int * active_set, const size_t size)
     /*Use all free bytes for the tree buffer, as in exchange. Leave some free memory for array overhead.*/
     size_t freebytes = (size_t) mymalloc_freebytes();
     freebytes -= 4096 * 10 * bytesperbuffer;
+    /* With node aware communication the export buffer also holds the offsets of the exports to each task
+     * and the table of the exports of the node. These are in the shared heap, so are counted here.*/
+    NodeComm * nc = nodecomm_for(MPI_COMM_WORLD, MPI_BYTE, MPI_BYTE);
+    if(nc)
+        freebytes -= tw->NTask * sizeof(int64_t) + nc->NodeSize * sizeof(char *);
 
     tw->BunchSize = (size_t) floor(((double)freebytes)/ bytesperbuffer);
     if(tw->BunchSize * tw->query_type_elsize > MaxExportBufferBytes)
@@ -143,6 +223,8 @@ static void ev_finish(TreeWalk * tw)
 {
     if(tw->Ngblist)
         myfree(tw->Ngblist);
+    if(tw->GroupStart)
+        myfree(tw->GroupStart);
     if(!tw->work_set_stolen_from_active)
         myfree(tw->WorkSet);
 }
@@ -189,6 +271,25 @@ treewalk_reduce_result(TreeWalk * tw, TreeWalkResultBase * result, int i, enum T
 #endif
 }
 
+/* Set up the queries (and results, if output is not NULL) for all particles in group g.
+ * Returns the number of particles in the group.*/
+static int
+ev_init_group(TreeWalk * tw, const int64_t g, int * targets, TreeWalkQueryBase * input, TreeWalkResultBase * output)
+{
+    const int ntarget = tw->GroupStart[g+1] - tw->GroupStart[g];
+    int j;
+    for(j = 0; j < ntarget; j++) {
+        const int64_t k = tw->GroupStart[g] + j;
+        const int i = tw->WorkSet ? tw->WorkSet[k] : k;
+        TreeWalkQueryBase * query = (TreeWalkQueryBase *) ((char *) input + j * tw->query_type_elsize);
+        targets[j] = i;
+        treewalk_init_query(tw, query, i, NULL);
+        if(output)
+            treewalk_init_result(tw, (TreeWalkResultBase *) ((char *) output + j * tw->result_type_elsize), query);
+    }
+    return ntarget;
+}
+
 void
 treewalk_build_queue(TreeWalk * tw, int * active_set, const size_t size, int may_have_garbage)
 {
@@ -252,9 +353,9 @@ treewalk_build_queue(TreeWalk * tw, int * active_set, const size_t size, int may
     tw->WorkSetSize = nqueue;
 }
 
-/* returns struct containing export counts */
+/* Walk the local particles. If ac is not NULL, imports arriving during the walk are evaluated between particles.*/
 static void
-ev_primary(TreeWalk * tw)
+ev_primary(TreeWalk * tw, struct AsyncComm * ac)
 {
     int64_t maxNinteractions = 0, minNinteractions = 1L << 45, Ninteractions=0;
 #pragma omp parallel reduction(min:minNinteractions) reduction(max:maxNinteractions) reduction(+: Ninteractions)
@@ -263,6 +364,10 @@ ev_primary(TreeWalk * tw)
         /* Note: exportflag is local to each thread */
         ev_init_thread(tw, lv);
         lv->mode = TREEWALK_PRIMARY;
+        /* Used to evaluate imports in the pipelined mode*/
+        LocalTreeWalk lvghost[1];
+        ev_init_thread(tw, lvghost);
+        lvghost->mode = TREEWALK_GHOSTS;
 
         /* use old index to recover from a buffer overflow*/;
         TreeWalkQueryBase * input = (TreeWalkQueryBase *) alloca(tw->query_type_elsize);
@@ -271,21 +376,53 @@ ev_primary(TreeWalk * tw)
         * We do not need to worry about the export buffer filling up.*/
         /* chunk size: 1 and 1000 were slightly (3 percent) slower than 8.
         * FoF treewalk needs a larger chnksz to avoid contention.*/
-        int64_t chnksz = tw->WorkSetSize / (4*tw->NThread);
+        const int64_t NWork = tw->GroupStart ? tw->NGroup : tw->WorkSetSize;
+        int64_t chnksz = NWork / (4*tw->NThread);
         if(chnksz < 1)
             chnksz = 1;
         if(chnksz > 100)
             chnksz = 100;
         int k;
-        #pragma omp for schedule(dynamic, chnksz)
-        for(k = 0; k < tw->WorkSetSize; k++) {
-            const int i = tw->WorkSet ? tw->WorkSet[k] : k;
-            /* Primary never uses node list */
-            treewalk_init_query(tw, input, i, NULL);
-            treewalk_init_result(tw, output, input);
-            lv->target = i;
-            tw->visit(input, output, lv);
-            treewalk_reduce_result(tw, output, i, TREEWALK_PRIMARY);
+        if(tw->GroupStart) {
+            /* Walk each group of particles together*/
+            int targets[TREEWALK_GROUP_MAX];
+            TreeWalkQueryBase * ginput = (TreeWalkQueryBase *) alloca(tw->query_type_elsize * TREEWALK_GROUP_MAX);
+            TreeWalkResultBase * goutput = (TreeWalkResultBase *) alloca(tw->result_type_elsize * TREEWALK_GROUP_MAX);
+            lv->targets = targets;
+            #pragma omp for schedule(dynamic, chnksz)
+            for(k = 0; k < tw->NGroup; k++) {
+                const int ntarget = ev_init_group(tw, k, targets, ginput, goutput);
+                lv->target = targets[0];
+                const int64_t nstart = lv->Ninteractions;
+                tw->visit_group(ntarget, ginput, goutput, lv);
+                /* The group shares one walk, so split its cost evenly.*/
+                const float cost = (float) (lv->Ninteractions - nstart) / ntarget;
+                int j;
+                for(j = 0; j < ntarget; j++) {
+                    treewalk_reduce_result(tw, (TreeWalkResultBase *) ((char *) goutput + j * tw->result_type_elsize), targets[j], TREEWALK_PRIMARY);
+                    if(tw->RecordCost)
+                        P[targets[j]].WalkCost += cost;
+                }
+                if(ac)
+                    ev_async_help(tw, ac, lvghost);
+            }
+        }
+        else {
+            #pragma omp for schedule(dynamic, chnksz)
+            for(k = 0; k < tw->WorkSetSize; k++) {
+                const int i = tw->WorkSet ? tw->WorkSet[k] : k;
+                /* Primary never uses node list */
+                treewalk_init_query(tw, input, i, NULL);
+                treewalk_init_result(tw, output, input);
+                lv->target = i;
+                const int64_t nstart = lv->Ninteractions;
+                tw->visit(input, output, lv);
+                treewalk_reduce_result(tw, output, i, TREEWALK_PRIMARY);
+                if(tw->RecordCost)
+                    P[i].WalkCost += lv->Ninteractions - nstart;
+                if(ac)
+                    ev_async_help(tw, ac, lvghost);
+            }
         }
         if(maxNinteractions < lv->maxNinteractions)
             maxNinteractions = lv->maxNinteractions;
@@ -393,8 +530,11 @@ ev_toptree(TreeWalk * tw)
     int64_t currentIndex = tw->WorkSetStart;
     int BufferFullFlag = 0;
 
+    /* With particle groups the queue is over groups, not particles, and WorkSetStart is a group index.*/
+    const int64_t NWork = tw->GroupStart ? tw->NGroup : tw->WorkSetSize;
+
     if(tw->Nexportfull > 0)
-        message(0, "Toptree %s, iter %ld. First particle %ld size %ld.\n", tw->ev_label, tw->Nexportfull, tw->WorkSetStart, tw->WorkSetSize);
+        message(0, "Toptree %s, iter %ld. First particle %ld size %ld.\n", tw->ev_label, tw->Nexportfull, tw->WorkSetStart, NWork);
 
 #pragma omp parallel reduction(+: BufferFullFlag)
     {
@@ -408,6 +548,12 @@ ev_toptree(TreeWalk * tw)
 
         TreeWalkQueryBase * input = (TreeWalkQueryBase *) alloca(tw->query_type_elsize);
         TreeWalkResultBase * output = (TreeWalkResultBase *) alloca(tw->result_type_elsize);
+        int targets[TREEWALK_GROUP_MAX];
+        TreeWalkQueryBase * ginput = NULL;
+        if(tw->GroupStart) {
+            ginput = (TreeWalkQueryBase *) alloca(tw->query_type_elsize * TREEWALK_GROUP_MAX);
+            lv->targets = targets;
+        }
 
         /* We schedule dynamically so that we have reduced imbalance.
          * We do not use the openmp dynamic scheduling, but roll our own
@@ -415,7 +561,7 @@ ev_toptree(TreeWalk * tw)
         int64_t chnk = 0;
         /* chunk size: 1 and 1000 were slightly (3 percent) slower than 8.
          * FoF treewalk needs a larger chnksz to avoid contention.*/
-        int64_t chnksz = tw->WorkSetSize / (4*tw->NThread);
+        int64_t chnksz = NWork / (4*tw->NThread);
         if(chnksz < 1)
             chnksz = 1;
         if(chnksz > 1000)
@@ -435,37 +581,50 @@ ev_toptree(TreeWalk * tw)
                 /* This is a hand-rolled version of what openmp dynamic scheduling is doing.*/
                 end = chnk + chnksz;
                 /* Make sure we do not overflow the loop*/
-                if(end > tw->WorkSetSize)
-                    end = tw->WorkSetSize;
+                if(end > NWork)
+                    end = NWork;
             }
             /* Reduce the chunk size towards the end of the walk*/
-            if((tw->WorkSetSize  < end + chnksz * tw->NThread) && chnksz >= 2)
+            if((NWork < end + chnksz * tw->NThread) && chnksz >= 2)
                 chnksz /= 2;
             int k;
             for(k = chnk; k < end; k++) {
-                const int i = tw->WorkSet ? tw->WorkSet[k] : k;
-                /* Toptree never uses node list */
-                treewalk_init_query(tw, input, i, NULL);
-                lv->target = i;
-                /* Reset the number of exported particles.*/
-                lv->NThisParticleExport = 0;
-                const int rt = tw->visit(input, output, lv);
-                if(lv->NThisParticleExport > 1000)
-                    message(5, "%ld exports for particle %d! Odd.\n", lv->NThisParticleExport, i);
-                /* If we filled up, we need to remove the partially evaluated last particle from the export list,
+                /* Exports before this particle or group*/
+                const size_t Nexport_start = lv->Nexport;
+                int i, rt;
+                if(tw->GroupStart) {
+                    const int ntarget = ev_init_group(tw, k, targets, ginput, NULL);
+                    i = targets[0];
+                    lv->target = i;
+                    lv->NThisParticleExport = 0;
+                    rt = tw->visit_group(ntarget, ginput, output, lv);
+                }
+                else {
+                    i = tw->WorkSet ? tw->WorkSet[k] : k;
+                    /* Toptree never uses node list */
+                    treewalk_init_query(tw, input, i, NULL);
+                    lv->target = i;
+                    /* Reset the number of exported particles.*/
+                    lv->NThisParticleExport = 0;
+                    rt = tw->visit(input, output, lv);
+                    if(lv->NThisParticleExport > 1000)
+                        message(5, "%ld exports for particle %d! Odd.\n", lv->NThisParticleExport, i);
+                }
+                /* If we filled up, we need to remove the partially evaluated last particle (or group) from the export list,
                  * save the partially evaluated chunk, and leave this loop.*/
                 if(rt < 0) {
                     //message(5, "Export buffer full for particle %d chnk: %ld -> %ld on thread %d with %ld exports\n", i, chnk, end, tid, lv->NThisParticleExport);
                     /* export buffer has filled up, can't do more work.*/
                     BufferFull_thread = 1;
                     /* Drop partial exports on the current particle, whose toptree will be re-evaluated*/
-                    lv->Nexport -= lv->NThisParticleExport;
+                    lv->NThisParticleExport = lv->Nexport - Nexport_start;
+                    lv->Nexport = Nexport_start;
                     /* Check that the final export in the list is indeed from a different particle*/
                     if(lv->NThisParticleExport > 0 && lv->DataIndexTable[lv->Nexport-1].Index >= i)
                         endrun(5, "Something screwed up in export queue: nexp %ld (local %ld) last %d < index %d\n", lv->Nexport,
                             lv->NThisParticleExport, i, lv->DataIndexTable[lv->Nexport-1].Index);
                     /* Check that the earliest dropped export in the list is from the same particle*/
-                    if(lv->NThisParticleExport > 0 && lv->DataIndexTable[lv->Nexport].Index != i)
+                    if(!tw->GroupStart && lv->NThisParticleExport > 0 && lv->DataIndexTable[lv->Nexport].Index != i)
                         endrun(5, "Something screwed up in export queue: nexp %ld (local %ld) last %d != index %d\n", lv->Nexport,
                             lv->NThisParticleExport, i, lv->DataIndexTable[lv->Nexport].Index);
                     /* Store information for the current chunk, so we can resume successfully exactly where we left off.
@@ -475,7 +634,7 @@ ev_toptree(TreeWalk * tw)
                     break;
                 }
             }
-        } while(chnk < tw->WorkSetSize && BufferFull_thread == 0);
+        } while(chnk < NWork && BufferFull_thread == 0);
         tw->Nexport_thread[tid] = lv->Nexport;
         BufferFullFlag += BufferFull_thread;
     }
@@ -486,7 +645,7 @@ ev_toptree(TreeWalk * tw)
         for(i = 0; i < tw->NThread; i++)
             Nexport += tw->Nexport_thread[i];
         message(1, "Tree export buffer full on %d of %ld threads with %lu exports (%lu Mbytes). First particle %ld new start: %ld size %ld.\n",
-                        BufferFullFlag, tw->NThread, Nexport, Nexport*tw->query_type_elsize/1024/1024, tw->WorkSetStart, currentIndex, tw->WorkSetSize);
+                        BufferFullFlag, tw->NThread, Nexport, Nexport*tw->query_type_elsize/1024/1024, tw->WorkSetStart, currentIndex, NWork);
         if(currentIndex == tw->WorkSetStart)
             endrun(5, "Not enough export space to make progress! lastsuc %ld Bunchsize: %ld \n", currentIndex, tw->BunchSize);
     }
@@ -518,6 +677,10 @@ struct CommBuffer
     int * rqst_task;
     MPI_Request * rdata_all;
     int nrequest_all;
+    /* If set, databuf is in the heap shared by the tasks on this node, after the offset of the data for each task,
+     * and peer holds the offsets and data exported by each task of the node. peer is at the start of the allocation.*/
+    NodeComm * node;
+    char ** peer;
 };
 
 void alloc_commbuffer(struct CommBuffer * buffer, int NTask, int alloc_high)
@@ -532,6 +695,7 @@ void alloc_commbuffer(struct CommBuffer * buffer, int NTask, int alloc_high)
     }
     buffer->nrequest_all = 0;
     buffer->databuf = NULL;
+    buffer->node = NULL;
 }
 
 void free_impexpcount(struct ImpExpCounts * count)
@@ -541,6 +705,13 @@ void free_impexpcount(struct ImpExpCounts * count)
 
 void free_commbuffer(struct CommBuffer * buffer)
 {
+    if(buffer->node) {
+        /* Wait for the other tasks of the node to finish reading the buffer*/
+        MPI_Barrier(buffer->node->node);
+        myfree(buffer->peer);
+        buffer->node = NULL;
+        buffer->databuf = NULL;
+    }
     if(buffer->databuf) {
         myfree(buffer->databuf);
         buffer->databuf = NULL;
@@ -590,7 +761,38 @@ void wait_commbuffer(struct CommBuffer * buffer)
     MPI_Waitall(buffer->nrequest_all, buffer->rdata_all, MPI_STATUSES_IGNORE);
 }
 
-static struct CommBuffer ev_secondary(struct CommBuffer * imports, struct ImpExpCounts* counts, TreeWalk * tw)
+/* Evaluate the queries imported from a task and send the results back*/
+static void
+ev_secondary_task(TreeWalk * tw, struct ImpExpCounts * counts, const int task, const char * databufstart, struct CommBuffer * res_imports, MPI_Datatype type)
+{
+    const int64_t nimports_task = counts->Import_count[task];
+    char * dataresultstart = res_imports->databuf + counts->Import_offset[task] * tw->result_type_elsize;
+    /* This sends each set of imports to a parallel for loop. This may lead to suboptimal resource allocation if only a small number of imports come from a processor.
+    * If there are a large number of importing ranks each with a small number of imports, a better scheme could be to send each chunk to a separate openmp task.
+    * However, each openmp task by default only uses 1 thread. One may explicitly enable openmp nested parallelism, but I think that is not safe,
+    * or it would be enabled by default.*/
+    #pragma omp parallel
+        {
+            int64_t j;
+            LocalTreeWalk lv[1];
+
+            ev_init_thread(tw, lv);
+            lv->mode = TREEWALK_GHOSTS;
+            #pragma omp for
+            for(j = 0; j < nimports_task; j++) {
+                TreeWalkQueryBase * input = (TreeWalkQueryBase *) (databufstart + j * tw->query_type_elsize);
+                TreeWalkResultBase * output = (TreeWalkResultBase *) (dataresultstart + j * tw->result_type_elsize);
+                treewalk_init_result(tw, output, input);
+                lv->target = -1;
+                tw->visit(input, output, lv);
+            }
+        }
+    /* Send the completed data back*/
+    res_imports->rqst_task[res_imports->nrequest_all] = task;
+    MPI_Isend(dataresultstart, nimports_task, type, task, 101923, counts->comm, &res_imports->rdata_all[res_imports->nrequest_all++]);
+}
+
+static struct CommBuffer ev_secondary(struct CommBuffer * imports, struct CommBuffer * exports, struct ImpExpCounts* counts, TreeWalk * tw)
 {
     struct CommBuffer res_imports = {0};
     alloc_commbuffer(&res_imports, counts->NTask, 1);
@@ -599,6 +801,22 @@ static struct CommBuffer ev_secondary(struct CommBuffer * imports, struct ImpExp
     MPI_Datatype type;
     MPI_Type_contiguous(tw->result_type_elsize, MPI_BYTE, &type);
     MPI_Type_commit(&type);
+
+    /* The queries from the tasks on this node are read in place from their export buffers*/
+    NodeComm * nc = exports->node;
+    if(nc) {
+        const int * nodetasks = nc->NodeTasks + nc->NodeStart[nc->ThisNode];
+        int r;
+        for(r = 0; r < nc->NodeSize; r++) {
+            const int task = nodetasks[r];
+            if(task == nc->ThisTask || counts->Import_count[task] == 0)
+                continue;
+            char * peer = exports->peer[r];
+            const int64_t offset = ((int64_t *) peer)[nc->ThisTask];
+            ev_secondary_task(tw, counts, task, peer + counts->NTask * sizeof(int64_t) + offset * tw->query_type_elsize, &res_imports, type);
+        }
+    }
+
     int * complete_array = ta_malloc("completes", int, imports->nrequest_all);
 
     int tot_completed = 0;
@@ -616,33 +834,8 @@ static struct CommBuffer ev_secondary(struct CommBuffer * imports, struct ImpExp
             const int i = complete_array[j];
             /* Note the task number index is not the index in the request array (some tasks were skipped because we have zero exports)! */
             const int task = imports->rqst_task[i];
-            const int64_t nimports_task = counts->Import_count[task];
             // message(1, "starting at %d with %d for iport %d task %d\n", counts->Import_offset[task], counts->Import_count[task], i, task);
-            char * databufstart = imports->databuf + counts->Import_offset[task] * tw->query_type_elsize;
-            char * dataresultstart = res_imports.databuf + counts->Import_offset[task] * tw->result_type_elsize;
-            /* This sends each set of imports to a parallel for loop. This may lead to suboptimal resource allocation if only a small number of imports come from a processor.
-            * If there are a large number of importing ranks each with a small number of imports, a better scheme could be to send each chunk to a separate openmp task.
-            * However, each openmp task by default only uses 1 thread. One may explicitly enable openmp nested parallelism, but I think that is not safe,
-            * or it would be enabled by default.*/
-            #pragma omp parallel
-                {
-                    int64_t j;
-                    LocalTreeWalk lv[1];
-
-                    ev_init_thread(tw, lv);
-                    lv->mode = TREEWALK_GHOSTS;
-                    #pragma omp for
-                    for(j = 0; j < nimports_task; j++) {
-                        TreeWalkQueryBase * input = (TreeWalkQueryBase *) (databufstart + j * tw->query_type_elsize);
-                        TreeWalkResultBase * output = (TreeWalkResultBase *) (dataresultstart + j * tw->result_type_elsize);
-                        treewalk_init_result(tw, output, input);
-                        lv->target = -1;
-                        tw->visit(input, output, lv);
-                    }
-                }
-            /* Send the completed data back*/
-            res_imports.rqst_task[res_imports.nrequest_all] = task;
-            MPI_Isend(dataresultstart, nimports_task, type, task, 101923, counts->comm, &res_imports.rdata_all[res_imports.nrequest_all++]);
+            ev_secondary_task(tw, counts, task, imports->databuf + counts->Import_offset[task] * tw->query_type_elsize, &res_imports, type);
             tot_completed++;
         }
     };
@@ -651,8 +844,9 @@ static struct CommBuffer ev_secondary(struct CommBuffer * imports, struct ImpExp
     return res_imports;
 }
 
+/* Count the particles exported to each task from the thread export tables. No communication is done.*/
 static struct ImpExpCounts
-ev_export_import_counts(TreeWalk * tw, MPI_Comm comm)
+ev_export_counts(TreeWalk * tw, MPI_Comm comm)
 {
     int NTask;
     struct ImpExpCounts counts = {0};
@@ -680,39 +874,37 @@ ev_export_import_counts(TreeWalk * tw, MPI_Comm comm)
         /* This is the export count*/
         counts.Nexport += tw->Nexport_thread[i];
     }
-    /* Exchange the counts. Note this is synchronous so we need to ensure the toptree walk, which happens before this, is balanced.*/
-    MPI_Alltoall(counts.Export_count, 1, MPI_INT64, counts.Import_count, 1, MPI_INT64, counts.comm);
-    // message(1, "Exporting %ld particles. Thread 0 is %ld\n", counts.Nexport, tw->Nexport_thread[0]);
-
-    counts.Nimport = counts.Import_count[0];
     tw->NExportTargets = (counts.Export_count[0] > 0);
     for(i = 1; i < NTask; i++)
     {
-        counts.Nimport += counts.Import_count[i];
         counts.Export_offset[i] = counts.Export_offset[i - 1] + counts.Export_count[i - 1];
-        counts.Import_offset[i] = counts.Import_offset[i - 1] + counts.Import_count[i - 1];
         tw->NExportTargets += (counts.Export_count[i] > 0);
     }
     return counts;
 }
 
-/* Builds the list of exported particles and async sends the export queries. */
-static void ev_send_recv_export_import(struct ImpExpCounts * counts, TreeWalk * tw, struct CommBuffer * exports, struct CommBuffer * imports)
+static struct ImpExpCounts
+ev_export_import_counts(TreeWalk * tw, MPI_Comm comm)
 {
-    alloc_commbuffer(exports, counts->NTask, 0);
-    exports->databuf = (char *) mymalloc("ExportQuery", counts->Nexport * tw->query_type_elsize);
-
-    alloc_commbuffer(imports, counts->NTask, 0);
-    imports->databuf = (char *) mymalloc("ImportQuery", counts->Nimport * tw->query_type_elsize);
-
-    MPI_Datatype type;
-    MPI_Type_contiguous(tw->query_type_elsize, MPI_BYTE, &type);
-    MPI_Type_commit(&type);
+    struct ImpExpCounts counts = ev_export_counts(tw, comm);
+    /* Exchange the counts. Note this is synchronous so we need to ensure the toptree walk, which happens before this, is balanced.*/
+    MPI_Alltoall_sparse(counts.Export_count, counts.Import_count, MPI_INT64, counts.comm);
+    // message(1, "Exporting %ld particles. Thread 0 is %ld\n", counts.Nexport, tw->Nexport_thread[0]);
 
-    /* Post recvs before sends. This sometimes allows for a fastpath.*/
-    MPI_fill_commbuffer(imports, counts->Import_count, counts->Import_offset, type, COMM_RECV, 101922, counts->comm);
+    counts.Nimport = counts.Import_count[0];
+    int64_t i;
+    for(i = 1; i < counts.NTask; i++)
+    {
+        counts.Nimport += counts.Import_count[i];
+        counts.Import_offset[i] = counts.Import_offset[i - 1] + counts.Import_count[i - 1];
+    }
+    return counts;
+}
 
-    /* prepare particle data for export */
+/* Fill the export buffer with the queries for the exported particles, ordered by destination task.*/
+static void
+ev_pack_exports(struct ImpExpCounts * counts, TreeWalk * tw, char * databuf)
+{
     int64_t * real_send_count = ta_malloc("tmp_send_count", int64_t, tw->NTask);
     memset(real_send_count, 0, sizeof(int64_t)*tw->NTask);
     int64_t i;
@@ -723,7 +915,7 @@ static void ev_send_recv_export_import(struct ImpExpCounts * counts, TreeWalk *
             const int place = tw->ExportTable_thread[i][k].Index;
             const int task = tw->ExportTable_thread[i][k].Task;
             const int64_t bufpos = real_send_count[task] + counts->Export_offset[task];
-            TreeWalkQueryBase * input = (TreeWalkQueryBase*) (exports->databuf + bufpos * tw->query_type_elsize);
+            TreeWalkQueryBase * input = (TreeWalkQueryBase*) (databuf + bufpos * tw->query_type_elsize);
             real_send_count[task]++;
             treewalk_init_query(tw, input, place, tw->ExportTable_thread[i][k].NodeList);
         }
@@ -735,8 +927,60 @@ static void ev_send_recv_export_import(struct ImpExpCounts * counts, TreeWalk *
             endrun(6, "Inconsistent export to task %ld of %d: %ld expected %ld\n", i, tw->NTask, real_send_count[i], counts->Export_count[i]);
 #endif
     myfree(real_send_count);
-    MPI_fill_commbuffer(exports, counts->Export_count, counts->Export_offset, type, COMM_SEND, 101922, counts->comm);
+}
+
+/* Builds the list of exported particles and async sends the export queries. */
+static void ev_send_recv_export_import(struct ImpExpCounts * counts, TreeWalk * tw, struct CommBuffer * exports, struct CommBuffer * imports)
+{
+    alloc_commbuffer(exports, counts->NTask, 0);
+    NodeComm * nc = nodecomm_for(counts->comm, MPI_BYTE, MPI_BYTE);
+    if(nc) {
+        /* The exports follow the offset of the exports to each task, so that the tasks on this node
+         * can read their imports in place from the shared heap. Before these is the table of the exports of the node.*/
+        const size_t peersize = nc->NodeSize * sizeof(char *);
+        const size_t hdrsize = counts->NTask * sizeof(int64_t);
+        char * base = (char *) mymalloc("ExportQuery", peersize + hdrsize + counts->Nexport * tw->query_type_elsize);
+        memcpy(base + peersize, counts->Export_offset, hdrsize);
+        exports->peer = (char **) base;
+        exports->databuf = base + peersize + hdrsize;
+        exports->node = nc;
+    }
+    else
+        exports->databuf = (char *) mymalloc("ExportQuery", counts->Nexport * tw->query_type_elsize);
+
+    alloc_commbuffer(imports, counts->NTask, 0);
+    imports->databuf = (char *) mymalloc("ImportQuery", counts->Nimport * tw->query_type_elsize);
+
+    MPI_Datatype type;
+    MPI_Type_contiguous(tw->query_type_elsize, MPI_BYTE, &type);
+    MPI_Type_commit(&type);
+
+    /* Only the tasks on other nodes are sent messages*/
+    int64_t * Import_count = counts->Import_count;
+    int64_t * Export_count = counts->Export_count;
+    if(nc) {
+        Import_count = ta_malloc("Import_offnode", int64_t, 2 * counts->NTask);
+        Export_count = Import_count + counts->NTask;
+        int i;
+        for(i = 0; i < counts->NTask; i++) {
+            const int onnode = nc->TaskNode[i] == nc->ThisNode;
+            Import_count[i] = onnode ? 0 : counts->Import_count[i];
+            Export_count[i] = onnode ? 0 : counts->Export_count[i];
+        }
+    }
+
+    /* Post recvs before sends. This sometimes allows for a fastpath.*/
+    MPI_fill_commbuffer(imports, Import_count, counts->Import_offset, type, COMM_RECV, 101922, counts->comm);
+
+    /* prepare particle data for export */
+    ev_pack_exports(counts, tw, exports->databuf);
+    MPI_fill_commbuffer(exports, Export_count, counts->Export_offset, type, COMM_SEND, 101922, counts->comm);
     MPI_Type_free(&type);
+    if(nc) {
+        ta_free(Import_count);
+        /* Make the exports visible to the other tasks of the node, and find theirs. Collective on the node.*/
+        nodecomm_exchange_buffers(nc, (char *) exports->peer + nc->NodeSize * sizeof(char *), exports->peer);
+    }
     return;
 }
 
@@ -782,6 +1026,311 @@ static void ev_reduce_export_result(struct CommBuffer * exportbuf, struct ImpExp
     }
 }
 
+/* Tags for the pipelined export mode. Successive walks alternate between two pairs of tags,
+ * so that queries from a rank which has already started the next walk are not
+ * received by a rank still finishing the previous one.*/
+#define TAG_ASYNC_QUERY 101930
+#define TAG_ASYNC_RESULT 101931
+/* Attribute holding the parity of the next pipelined walk on each communicator, as for MPI_Alltoall_sparse:
+ * walks on different communicators are not ordered with respect to each other.*/
+static int async_walk_keyval = MPI_KEYVAL_INVALID;
+
+/* Returns the parity of this pipelined walk on comm, and flips it for the next walk.
+ * Every task of comm makes the same sequence of walks, so they agree on the tags.*/
+static int
+ev_async_parity(MPI_Comm comm)
+{
+    if(async_walk_keyval == MPI_KEYVAL_INVALID)
+        MPI_Comm_create_keyval(MPI_COMM_NULL_COPY_FN, MPI_COMM_NULL_DELETE_FN, &async_walk_keyval, NULL);
+    void * val;
+    int flag;
+    MPI_Comm_get_attr(comm, async_walk_keyval, &val, &flag);
+    const int parity = flag ? (int) (intptr_t) val : 0;
+    MPI_Comm_set_attr(comm, async_walk_keyval, (void *) (intptr_t) !parity);
+    return parity;
+}
+
+/* Number of imported queries claimed at a time by a thread*/
+#define ASYNC_IMPORT_CHUNK 16
+
+/* A block of queries imported from one task, followed in memory by the queries and then their results.
+ * Blocks are allocated from the top of the stack as they arrive and freed in reverse order once their results are sent.*/
+struct ImportBlock
+{
+    /* Block received before this one*/
+    struct ImportBlock * prev;
+    /* Request for sending the results back*/
+    MPI_Request request;
+    int task;
+    int64_t nimport;
+    /* Size of the allocation, including this header*/
+    size_t bytes;
+    /* Next query to be claimed by a thread and the number of queries evaluated.*/
+    int64_t next;
+    int64_t ndone;
+};
+
+#define IMPORT_QUERIES(block) ((char *) ((block) + 1))
+#define IMPORT_RESULTS(block, tw) (IMPORT_QUERIES(block) + (block)->nimport * (tw)->query_type_elsize)
+
+struct AsyncComm
+{
+    MPI_Comm comm;
+    MPI_Datatype query_type;
+    MPI_Datatype result_type;
+    int querytag;
+    int resulttag;
+    /* Most recent block whose results have been sent*/
+    struct ImportBlock * sent;
+    /* Block currently being evaluated, or NULL*/
+    struct ImportBlock * current;
+    /* Bytes held by the blocks which have not yet been freed, and the most they may hold.
+     * A block larger than the budget is still received if no other block is held, so that the walk progresses.*/
+    size_t nbytes;
+    size_t maxbytes;
+};
+
+/* Evaluate chunks of an import block until no unclaimed queries are left. May be called by several threads at once.*/
+static void
+ev_async_evaluate(TreeWalk * tw, struct ImportBlock * block, LocalTreeWalk * lv)
+{
+    while(1) {
+        const int64_t start = atomic_fetch_and_add_64(&block->next, ASYNC_IMPORT_CHUNK);
+        if(start >= block->nimport)
+            break;
+        int64_t end = start + ASYNC_IMPORT_CHUNK;
+        if(end > block->nimport)
+            end = block->nimport;
+        int64_t j;
+        for(j = start; j < end; j++) {
+            TreeWalkQueryBase * input = (TreeWalkQueryBase *) (IMPORT_QUERIES(block) + j * tw->query_type_elsize);
+            TreeWalkResultBase * output = (TreeWalkResultBase *) (IMPORT_RESULTS(block, tw) + j * tw->result_type_elsize);
+            treewalk_init_result(tw, output, input);
+            lv->target = -1;
+            tw->visit(input, output, lv);
+        }
+        #pragma omp flush
+        atomic_fetch_and_add_64(&block->ndone, end - start);
+    }
+}
+
+/* Receive a block of queries if one has arrived and it fits in the import budget. Master thread only.*/
+static struct ImportBlock *
+ev_async_receive(TreeWalk * tw, struct AsyncComm * ac)
+{
+    int flag;
+    MPI_Status status;
+    MPI_Iprobe(MPI_ANY_SOURCE, ac->querytag, ac->comm, &flag, &status);
+    if(!flag)
+        return NULL;
+    int nimport;
+    MPI_Get_count(&status, ac->query_type, &nimport);
+    const size_t bytes = sizeof(struct ImportBlock) + nimport * (tw->query_type_elsize + tw->result_type_elsize);
+    /* Leave the message with MPI until the blocks already held have been sent and freed*/
+    if(ac->nbytes > 0 && ac->nbytes + bytes > ac->maxbytes)
+        return NULL;
+    struct ImportBlock * block = (struct ImportBlock *) mymalloc2("ImportQuery", bytes);
+    ac->nbytes += bytes;
+    block->bytes = bytes;
+    block->prev = ac->sent;
+    block->request = MPI_REQUEST_NULL;
+    block->task = status.MPI_SOURCE;
+    block->nimport = nimport;
+    block->next = 0;
+    block->ndone = 0;
+    MPI_Recv(IMPORT_QUERIES(block), nimport, ac->query_type, block->task, ac->querytag, ac->comm, MPI_STATUS_IGNORE);
+    return block;
+}
+
+/* Start sending the results of the fully evaluated current block. Master thread only.*/
+static void
+ev_async_send_current(TreeWalk * tw, struct AsyncComm * ac)
+{
+    struct ImportBlock * block = ac->current;
+    MPI_Isend(IMPORT_RESULTS(block, tw), block->nimport, ac->result_type, block->task, ac->resulttag, ac->comm, &block->request);
+    ac->sent = block;
+    #pragma omp atomic write
+    ac->current = NULL;
+}
+
+/* Free sent blocks from the top of the stack. If wait is set, wait for all the sends to complete,
+ * otherwise stop at the first block still being sent. There must be no current block.*/
+static void
+ev_async_free_sent(struct AsyncComm * ac, const int wait)
+{
+    while(ac->sent) {
+        int done = 1;
+        if(wait)
+            MPI_Wait(&ac->sent->request, MPI_STATUS_IGNORE);
+        else
+            MPI_Test(&ac->sent->request, &done, MPI_STATUS_IGNORE);
+        if(!done)
+            break;
+        struct ImportBlock * prev = ac->sent->prev;
+        ac->nbytes -= ac->sent->bytes;
+        myfree(ac->sent);
+        ac->sent = prev;
+    }
+}
+
+/* Called by every thread between the particles of the primary walk. The master thread returns the results of the current
+ * block once it is done and picks up the next block to arrive. All threads help evaluate the current block.
+ * No blocks are freed here, as another thread may still hold a pointer to a finished block.*/
+static void
+ev_async_help(TreeWalk * tw, struct AsyncComm * ac, LocalTreeWalk * lv)
+{
+    struct ImportBlock * block;
+    if(omp_get_thread_num() == 0) {
+        block = ac->current;
+        if(block) {
+            int64_t ndone;
+            #pragma omp atomic read
+            ndone = block->ndone;
+            if(ndone == block->nimport) {
+                #pragma omp flush
+                ev_async_send_current(tw, ac);
+            }
+        }
+        if(!ac->current) {
+            block = ev_async_receive(tw, ac);
+            if(block) {
+                #pragma omp flush
+                #pragma omp atomic write
+                ac->current = block;
+            }
+        }
+    }
+    #pragma omp atomic read
+    block = ac->current;
+    if(block) {
+        #pragma omp flush
+        ev_async_evaluate(tw, block, lv);
+    }
+}
+
+/* Evaluate the rest of the current block with all threads and send the results.*/
+static void
+ev_async_finish_current(TreeWalk * tw, struct AsyncComm * ac)
+{
+    if(!ac->current)
+        return;
+    double tstart = second();
+    #pragma omp parallel
+    {
+        LocalTreeWalk lv[1];
+        ev_init_thread(tw, lv);
+        lv->mode = TREEWALK_GHOSTS;
+        ev_async_evaluate(tw, ac->current, lv);
+    }
+    ev_async_send_current(tw, ac);
+    double tend = second();
+    tw->timecomp2 += timediff(tstart, tend);
+}
+
+/* Evaluate any imports that have arrived. Returns 1 if there were some.*/
+static int
+ev_async_serve(TreeWalk * tw, struct AsyncComm * ac)
+{
+    ev_async_finish_current(tw, ac);
+    ev_async_free_sent(ac, 0);
+    ac->current = ev_async_receive(tw, ac);
+    if(!ac->current)
+        return 0;
+    ev_async_finish_current(tw, ac);
+    return 1;
+}
+
+/* Pipelined version of the export loop in treewalk_run. The exports from each toptree round are sent
+ * directly to their destination tasks, which find the size with a probe, so there is no alltoall of the counts.
+ * The primary walk starts as soon as the first round is sent and imports are evaluated as they arrive:
+ * between particles of the primary walk, and while waiting for the results of our own exports.
+ * Each task enters a non-blocking barrier once it has all its results, and keeps evaluating imports
+ * until every task has done so.*/
+static void
+ev_run_async(TreeWalk * tw, MPI_Comm comm)
+{
+    double tstart, tend;
+    struct AsyncComm ac = {0};
+    ac.comm = comm;
+    const int parity = ev_async_parity(comm);
+    ac.querytag = TAG_ASYNC_QUERY + 2 * parity;
+    ac.resulttag = TAG_ASYNC_RESULT + 2 * parity;
+    /* The imports may use the memory set aside for them by ev_begin, as in the synchronous walk*/
+    ac.maxbytes = (1 + ImportBufferBoost) * tw->BunchSize * tw->NThread * (tw->query_type_elsize + tw->result_type_elsize);
+    MPI_Type_contiguous(tw->query_type_elsize, MPI_BYTE, &ac.query_type);
+    MPI_Type_commit(&ac.query_type);
+    MPI_Type_contiguous(tw->result_type_elsize, MPI_BYTE, &ac.result_type);
+    MPI_Type_commit(&ac.result_type);
+
+    int BufferFull = 0;
+    do {
+        tstart = second();
+        BufferFull = ev_toptree(tw);
+        struct ImpExpCounts counts = ev_export_counts(tw, comm);
+        struct CommBuffer exports = {0}, results = {0};
+        alloc_commbuffer(&exports, counts.NTask, 0);
+        exports.databuf = (char *) mymalloc("ExportQuery", counts.Nexport * tw->query_type_elsize);
+        ev_pack_exports(&counts, tw, exports.databuf);
+        alloc_commbuffer(&results, counts.NTask, 0);
+        results.databuf = (char *) mymalloc("ExportResult", counts.Nexport * tw->result_type_elsize);
+        MPI_fill_commbuffer(&results, counts.Export_count, counts.Export_offset, ac.result_type, COMM_RECV, ac.resulttag, comm);
+        MPI_fill_commbuffer(&exports, counts.Export_count, counts.Export_offset, ac.query_type, COMM_SEND, ac.querytag, comm);
+        tend = second();
+        tw->timecomp0 += timediff(tstart, tend);
+
+        if(tw->Nexportfull == 0) {
+            tstart = second();
+            ev_primary(tw, &ac);
+            ev_async_finish_current(tw, &ac);
+            /* No blocks are freed during the primary walk. Their results have receives posted, so wait for them here.*/
+            ev_async_free_sent(&ac, 1);
+            tend = second();
+            tw->timecomp1 += timediff(tstart, tend);
+        }
+        /* Evaluate imports until our own results are back*/
+        tstart = second();
+        const double timecomp2 = tw->timecomp2;
+        int done = 0;
+        while(1) {
+            MPI_Testall(results.nrequest_all, results.rdata_all, &done, MPI_STATUSES_IGNORE);
+            if(done)
+                break;
+            ev_async_serve(tw, &ac);
+        }
+        tend = second();
+        tw->timewait1 += timediff(tstart, tend) - (tw->timecomp2 - timecomp2);
+
+        tstart = second();
+        ev_reduce_export_result(&results, &counts, tw);
+        wait_commbuffer(&exports);
+        tend = second();
+        tw->timecommsumm += timediff(tstart, tend);
+        free_commbuffer(&results);
+        free_commbuffer(&exports);
+        free_impexpcount(&counts);
+        tw->Nexportfull++;
+    } while(BufferFull);
+
+    /* Keep evaluating imports until all tasks have their results*/
+    tstart = second();
+    const double timecomp2 = tw->timecomp2;
+    MPI_Request barrier;
+    MPI_Ibarrier(comm, &barrier);
+    int done = 0;
+    while(1) {
+        MPI_Test(&barrier, &done, MPI_STATUS_IGNORE);
+        if(done)
+            break;
+        ev_async_serve(tw, &ac);
+    }
+    /* Every query has now been received and its results sent*/
+    ev_async_free_sent(&ac, 1);
+    tend = second();
+    tw->timewait1 += timediff(tstart, tend) - (tw->timecomp2 - timecomp2);
+    MPI_Type_free(&ac.result_type);
+    MPI_Type_free(&ac.query_type);
+}
+
 /* run a treewalk on an active_set.
  *
  * active_set : a list of indices of particles. If active_set is NULL,
@@ -822,7 +1371,9 @@ treewalk_run(TreeWalk * tw, int * active_set, size_t size)
         int Ndone = 0;
         /* Needs to be outside loop because it allocates restart information*/
         alloc_export_memory(tw);
-        do
+        if(TreeWalkAsyncExport)
+            ev_run_async(tw, MPI_COMM_WORLD);
+        else do
         {
             tstart = second();
             /* First do the toptree and export particles for sending.*/
@@ -839,7 +1390,7 @@ treewalk_run(TreeWalk * tw, int * active_set, size_t size)
             /* Only do this on the first iteration, as we only need to do it once.*/
             tstart = second();
             if(tw->Nexportfull == 0)
-                ev_primary(tw); /* do local particles and prepare export list */
+                ev_primary(tw, NULL); /* do local particles and prepare export list */
             tend = second();
             tw->timecomp1 += timediff(tstart, tend);
             /* Do processing of received particles. We implement a queue that
@@ -848,7 +1399,7 @@ treewalk_run(TreeWalk * tw, int * active_set, size_t size)
             /* Posts recvs to get the export results (which are sent in ev_secondary).*/
             struct CommBuffer res_exports = {0};
             ev_recv_export_result(&res_exports, &counts, tw);
-            struct CommBuffer res_imports = ev_secondary(&imports, &counts, tw);
+            struct CommBuffer res_imports = ev_secondary(&imports, &exports, &counts, tw);
             // report_memory_usage(tw->ev_label);
             free_commbuffer(&imports);
             tend = second();
@@ -1090,7 +1641,7 @@ ngb_treefind_threads(TreeWalkQueryBase * I,
         if(lv->mode == TREEWALK_TOPTREE) {
             if(current->f.ChildType == PSEUDO_NODE_TYPE) {
                 /* Export the pseudo particle*/
-                if(-1 == treewalk_export_particle(lv, current->s.suns[0]))
+                if(-1 == treewalk_export_particle(lv, current->first))
                     return -1;
                 /* Move sideways*/
                 no = current->sibling;
@@ -1106,9 +1657,9 @@ ngb_treefind_threads(TreeWalkQueryBase * I,
             /* Node contains relevant particles, add them.*/
             if(current->f.ChildType == PARTICLE_NODE_TYPE) {
                 int i;
-                int * suns = current->s.suns;
-                for (i = 0; i < current->s.noccupied; i++) {
-                    lv->ngblist[numcand++] = suns[i];
+                const struct NodeChild * cs = &tree->NodesCold[no].s;
+                for (i = 0; i < cs->noccupied; i++) {
+                    lv->ngblist[numcand++] = cs->suns[i];
                 }
                 /* Move sideways*/
                 no = current->sibling;
@@ -1126,7 +1677,7 @@ ngb_treefind_threads(TreeWalkQueryBase * I,
             }
         }
         /* ok, we need to open the node */
-        no = current->s.suns[0];
+        no = current->first;
     }
 
     return numcand;
@@ -1180,7 +1731,7 @@ int treewalk_visit_nolist_ngbiter(TreeWalkQueryBase * I,
             if(lv->mode == TREEWALK_TOPTREE) {
                 if(current->f.ChildType == PSEUDO_NODE_TYPE) {
                     /* Export the pseudo particle*/
-                    if(-1 == treewalk_export_particle(lv, current->s.suns[0]))
+                    if(-1 == treewalk_export_particle(lv, current->first))
                         return -1;
                     /* Move sideways*/
                     no = current->sibling;
@@ -1196,10 +1747,10 @@ int treewalk_visit_nolist_ngbiter(TreeWalkQueryBase * I,
             else {
                 if(current->f.ChildType == PARTICLE_NODE_TYPE) {
                     int i;
-                    int * suns = current->s.suns;
-                    for (i = 0; i < current->s.noccupied; i++) {
+                    const struct NodeChild * cs = &tree->NodesCold[no].s;
+                    for (i = 0; i < cs->noccupied; i++) {
                         /* Now evaluate a particle for the list*/
-                        int other = suns[i];
+                        int other = cs->suns[i];
                         /* Skip garbage*/
                         if(P[other].IsGarbage)
                             continue;
@@ -1243,7 +1794,7 @@ int treewalk_visit_nolist_ngbiter(TreeWalkQueryBase * I,
                 }
             }
             /* ok, we need to open the node */
-            no = current->s.suns[0];
+            no = current->first;
         }
     }
 
@@ -10,6 +10,9 @@
  * was because we were sorting the DIT, so had incentive to keep it small.*/
 #define  NODELISTLENGTH 4
 
+/* Maximum number of particles in a group walked together by visit_group.*/
+#define TREEWALK_GROUP_MAX 64
+
 enum NgbTreeFindSymmetric {
     NGB_TREEFIND_SYMMETRIC,
     NGB_TREEFIND_ASYMMETRIC,
@@ -74,6 +77,9 @@ typedef struct {
     data_index * DataIndexTable;
 
     int * ngblist;
+    /* Particle indices of the current group, when walking with visit_group.
+     * Exports in the toptree should set target from this.*/
+    const int * targets;
     int64_t maxNinteractions;
     int64_t minNinteractions;
     int64_t Ninteractions;
@@ -81,6 +87,11 @@ typedef struct {
 
 typedef int (*TreeWalkVisitFunction) (TreeWalkQueryBase * input, TreeWalkResultBase * output, LocalTreeWalk * lv);
 
+/* Visit a group of ntarget nearby particles with a single tree walk. input and output are arrays of ntarget queries and results,
+ * with sizes query_type_elsize and result_type_elsize. In the toptree, each particle should be exported to every
+ * pseudo-particle the group opens, setting lv->target from lv->targets and resetting lv->NThisParticleExport for each particle.*/
+typedef int (*TreeWalkVisitGroupFunction) (const int ntarget, TreeWalkQueryBase * input, TreeWalkResultBase * output, LocalTreeWalk * lv);
+
 typedef void (*TreeWalkNgbIterFunction) (TreeWalkQueryBase * input, TreeWalkResultBase * output, TreeWalkNgbIterBase * iter, LocalTreeWalk * lv);
 
 typedef int (*TreeWalkHasWorkFunction) (const int i, TreeWalk * tw);
@@ -112,6 +123,11 @@ struct TreeWalk {
     size_t ngbiter_type_elsize;
 
     TreeWalkVisitFunction visit;                /* Function to be called between a tree node and a particle */
+    TreeWalkVisitGroupFunction visit_group;     /* Optional. If set, used instead of visit for the toptree and primary walks,
+                                                   on groups of nearby particles. Exported particles are still evaluated with visit.*/
+    /* Maximum number of particles and maximum bounding box size of a particle group for visit_group*/
+    int GroupMaxSize;
+    double GroupMaxExtent;
     TreeWalkHasWorkFunction haswork; /* Is the particle part of this interaction? */
     TreeWalkFillQueryFunction fill;       /* Copy the useful attributes of a particle to a query.
                                             Note: This may be called multiple times including after a reduce and so MUST NOT copy attributes modified by reduce. */
@@ -119,6 +135,9 @@ struct TreeWalk {
     TreeWalkNgbIterFunction ngbiter;     /* called for each pair of particles if visit is set to ngbiter */
     TreeWalkProcessFunction postprocess; /* postprocess finalizes quantities for each particle, e.g. divide the normalization */
     TreeWalkProcessFunction preprocess; /* Preprocess initializes quantities for each particle */
+    /* If true, the interactions evaluated for each local particle are added to P[i].WalkCost,
+     * which the domain decomposition uses as a work estimate. Work done for imported particles is not recorded.*/
+    int RecordCost;
     int64_t NThread; /*Number of OpenMP threads*/
 
     /* performance metrics */
@@ -176,6 +195,11 @@ struct TreeWalk {
     int * WorkSet;
     /* Size of the workset list*/
     int64_t WorkSetSize;
+    /* Offsets of particle groups in the WorkSet, if visit_group is used, or NULL.
+     * Group g is WorkSet entries GroupStart[g] to GroupStart[g+1] - 1.*/
+    int * GroupStart;
+    /* Number of particle groups*/
+    int64_t NGroup;
     /* Redo counters and queues*/
     size_t *NPLeft;
     int **NPRedo;
@@ -236,4 +260,7 @@ void treewalk_add_counters(LocalTreeWalk * lv, const int64_t ninteractions);
 /* Change the size of the export buffer, for tests*/
 void treewalk_set_max_export_buffer(size_t maxbuf);
 
+/* Enable or disable the pipelined export mode, for tests*/
+void treewalk_set_async_export(const int async);
+
 #endif
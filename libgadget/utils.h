@@ -17,6 +17,7 @@
 #include "utils/event.h"
 #include "utils/openmpsort.h"
 #include "utils/system.h"
+#include "utils/nodecomm.h"
 #include "utils/string.h"
 #include "utils/endrun.h"
 #include "utils/interp.h"
@@ -40,6 +40,29 @@ allocator_init(Allocator * alloc, const char * name, const size_t request_size,
     alloc->base = rawbase + ALIGNMENT - ((size_t) rawbase % ALIGNMENT);
     alloc->size = size;
     alloc->use_malloc = 0;
+    alloc->external = 0;
+    strncpy(alloc->name, name, 11);
+    alloc->refcount = 1;
+    alloc->top = alloc->size;
+    alloc->bottom = 0;
+
+    allocator_reset(alloc, zero);
+
+    return 0;
+}
+
+int
+allocator_init_buffer(Allocator * alloc, const char * name, char * buffer, const size_t buffer_size, const int zero)
+{
+    if(buffer_size < 2 * ALIGNMENT)
+        return ALLOC_ENOMEMORY;
+    alloc->parent = NULL;
+    alloc->rawbase = buffer;
+    alloc->base = buffer + ALIGNMENT - ((size_t) buffer % ALIGNMENT);
+    /* Whole aligned blocks which fit in the buffer after the aligned base*/
+    alloc->size = ((buffer_size - ALIGNMENT) / ALIGNMENT) * ALIGNMENT;
+    alloc->use_malloc = 0;
+    alloc->external = 1;
     strncpy(alloc->name, name, 11);
     alloc->refcount = 1;
     alloc->top = alloc->size;
@@ -68,6 +91,7 @@ allocator_malloc_init(Allocator * alloc, const char * name, const size_t request
 
     alloc->parent = parent;
     alloc->use_malloc = 1;
+    alloc->external = 0;
     alloc->rawbase = rawbase;
     alloc->base = rawbase;
     alloc->size = size;
@@ -181,7 +205,7 @@ allocator_destroy(Allocator * alloc)
     }
     if(alloc->parent)
         allocator_dealloc(alloc->parent, alloc->rawbase);
-    else
+    else if(!alloc->external)
         free(alloc->rawbase);
     return 0;
 }
@@ -26,6 +26,7 @@ struct Allocator {
 
     int refcount;
     int use_malloc; /* only do the book keeping. delegate to libc malloc/free */
+    int external; /* the memory was supplied by the caller, who frees it after allocator_destroy */
 };
 
 typedef struct AllocatorIter AllocatorIter;
@@ -47,6 +48,11 @@ struct AllocatorIter {
 int
 allocator_init(Allocator * alloc, const char * name, const size_t size, const int zero, Allocator * parent);
 
+/* Set up an allocator in a buffer owned by the caller, for example memory shared between tasks.
+ * The usable size is buffer_size less up to two alignment blocks.*/
+int
+allocator_init_buffer(Allocator * alloc, const char * name, char * buffer, const size_t buffer_size, const int zero);
+
 int
 allocator_malloc_init(Allocator * alloc, const char * name, const size_t size, const int zero, Allocator * parent);
 
@@ -12,6 +12,7 @@
 #include "memory.h"
 #include "system.h"
 #include "endrun.h"
+#include "nodecomm.h"
 
 /* The main allocator is used to store large objects, e.g. tree, toptree */
 Allocator A_MAIN[1];
@@ -64,7 +65,20 @@ mymalloc_init(double MaxMemSizePerNode)
         endrun(2, "Mem too small! MB/node=%g, nodespercpu = %g NTask = %d\n", MaxMemSizePerNode, nodespercpu, NTask);
 
 
-    if (MPIU_Any(ALLOC_ENOMEMORY == allocator_init(A_MAIN, "MAIN", n, 1, NULL), MPI_COMM_WORLD)) {
+    int status;
+#ifndef VALGRIND
+    /* With node aware communication the heap is one shared memory window per node,
+     * so that the tasks of a node can read each other's buffers in place.
+     * Allow for two blocks of alignment.*/
+    if(nodecomm_world()) {
+        char * shared = nodecomm_alloc_heap(MPI_COMM_WORLD, n + 8192);
+        status = allocator_init_buffer(A_MAIN, "MAIN", shared, n + 8192, 1);
+        message(0, "MAIN memory allocator is shared between the tasks of each node.\n");
+    }
+    else
+#endif
+        status = allocator_init(A_MAIN, "MAIN", n, 1, NULL);
+    if (MPIU_Any(ALLOC_ENOMEMORY == status, MPI_COMM_WORLD)) {
         endrun(0, "Insufficient memory for the MAIN allocator on at least one nodes."
                   "Requestion %td bytes. Try reducing MaxMemSizePerNode. Also check the node health status.\n", n);
     }
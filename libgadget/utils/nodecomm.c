@@ -0,0 +1,382 @@
+#include <mpi.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+
+#include "nodecomm.h"
+#include "mymalloc.h"
+#include "endrun.h"
+#include "system.h"
+
+/* Tag of the aggregated messages between nodes*/
+#define TAG_NODECOMM 101942
+
+static NodeComm NodeWorld;
+static int NodeWorldEnabled;
+
+/* The MAIN heap, if it is allocated in a shared memory window of the tasks of each node.
+ * The window stays locked for the whole run: stores are made visible with MPI_Win_sync.*/
+static struct NodeHeap {
+    MPI_Comm comm;
+    MPI_Win win;
+    char * base;
+    size_t size;
+    /* Start of the heap of each task of comm on the same node, NULL for tasks on other nodes*/
+    char ** TaskBase;
+} NodeHeap;
+
+char *
+nodecomm_alloc_heap(MPI_Comm comm, const size_t size)
+{
+    if(NodeHeap.base)
+        endrun(5, "The shared heap is already allocated\n");
+    int NTask, ThisTask;
+    MPI_Comm_size(comm, &NTask);
+    MPI_Comm_rank(comm, &ThisTask);
+    MPI_Comm node;
+    MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, ThisTask, MPI_INFO_NULL, &node);
+    MPI_Info info;
+    MPI_Info_create(&info);
+    /* Each task only allocates from its own part of the window, so it may be placed in memory local to the task*/
+    MPI_Info_set(info, "alloc_shared_noncontig", "true");
+    MPI_Win_allocate_shared(size, 1, info, node, &NodeHeap.base, &NodeHeap.win);
+    MPI_Info_free(&info);
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, NodeHeap.win);
+    NodeHeap.comm = comm;
+    NodeHeap.size = size;
+
+    /* Find the heaps of the tasks on this node by their rank in comm*/
+    MPI_Alloc_mem(sizeof(char *) * NTask, MPI_INFO_NULL, &NodeHeap.TaskBase);
+    memset(NodeHeap.TaskBase, 0, sizeof(char *) * NTask);
+    int NodeSize;
+    MPI_Comm_size(node, &NodeSize);
+    int * tasks;
+    MPI_Alloc_mem(sizeof(int) * NodeSize, MPI_INFO_NULL, &tasks);
+    MPI_Allgather(&ThisTask, 1, MPI_INT, tasks, 1, MPI_INT, node);
+    int r;
+    for(r = 0; r < NodeSize; r++) {
+        MPI_Aint peersize;
+        int disp;
+        MPI_Win_shared_query(NodeHeap.win, r, &peersize, &disp, &NodeHeap.TaskBase[tasks[r]]);
+    }
+    MPI_Free_mem(tasks);
+    MPI_Comm_free(&node);
+    return NodeHeap.base;
+}
+
+void
+nodecomm_free_heap(void)
+{
+    if(!NodeHeap.base)
+        return;
+    MPI_Free_mem(NodeHeap.TaskBase);
+    MPI_Win_unlock_all(NodeHeap.win);
+    MPI_Win_free(&NodeHeap.win);
+    memset(&NodeHeap, 0, sizeof(NodeHeap));
+}
+
+int
+nodecomm_in_heap(const void * ptr, const size_t size)
+{
+    const char * p = (const char *) ptr;
+    return NodeHeap.base && p >= NodeHeap.base && p + size <= NodeHeap.base + NodeHeap.size;
+}
+
+void
+nodecomm_exchange_buffers(NodeComm * nc, const void * ptr, char ** peer)
+{
+    if(!NodeHeap.base || nc->comm != NodeHeap.comm)
+        endrun(5, "Node aware communication needs the heap to be shared between the tasks of each node\n");
+    if(ptr && !nodecomm_in_heap(ptr, 0))
+        endrun(5, "Buffer %p is not in the shared heap\n", ptr);
+    int64_t offset = ptr ? (const char *) ptr - NodeHeap.base : -1;
+    int64_t * offsets = ta_malloc("offsets", int64_t, nc->NodeSize);
+    /* The allgather orders the stores before it on each task before the loads after it on the others*/
+    MPI_Win_sync(NodeHeap.win);
+    MPI_Allgather(&offset, 1, MPI_INT64, offsets, 1, MPI_INT64, nc->node);
+    MPI_Win_sync(NodeHeap.win);
+    const int * nodetasks = nc->NodeTasks + nc->NodeStart[nc->ThisNode];
+    int r;
+    for(r = 0; r < nc->NodeSize; r++) {
+        char * base = NodeHeap.TaskBase[nodetasks[r]];
+        if(offsets[r] >= 0 && !base)
+            endrun(5, "Task %d is in the node of task %d but does not share its heap\n", nodetasks[r], nc->ThisTask);
+        peer[r] = offsets[r] >= 0 ? base + offsets[r] : NULL;
+    }
+    ta_free(offsets);
+}
+
+void
+nodecomm_init(NodeComm * nc, MPI_Comm comm, const int ranks_per_node)
+{
+    nc->comm = comm;
+    MPI_Comm_size(comm, &nc->NTask);
+    MPI_Comm_rank(comm, &nc->ThisTask);
+    if(ranks_per_node > 0)
+        MPI_Comm_split(comm, nc->ThisTask / ranks_per_node, nc->ThisTask, &nc->node);
+    else
+        MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, nc->ThisTask, MPI_INFO_NULL, &nc->node);
+    MPI_Comm_size(nc->node, &nc->NodeSize);
+    MPI_Comm_rank(nc->node, &nc->NodeRank);
+
+    const int NTask = nc->NTask;
+    MPI_Alloc_mem(sizeof(int) * (4 * NTask + 1), MPI_INFO_NULL, &nc->TaskNode);
+    nc->TaskNodeRank = nc->TaskNode + NTask;
+    nc->NodeTasks = nc->TaskNodeRank + NTask;
+    nc->NodeStart = nc->NodeTasks + NTask;
+
+    /* Label each node by its lowest task. The gathered labels and node ranks
+     * are stored temporarily in the NodeTasks and NodeStart tables.*/
+    int mine[2] = {nc->ThisTask, nc->NodeRank};
+    MPI_Allreduce(MPI_IN_PLACE, &mine[0], 1, MPI_INT, MPI_MIN, nc->node);
+    int * all = nc->NodeTasks;
+    MPI_Allgather(mine, 2, MPI_INT, all, 2, MPI_INT, comm);
+    int i;
+    for(i = 0; i < NTask; i++) {
+        nc->TaskNode[i] = all[2 * i];
+        nc->TaskNodeRank[i] = all[2 * i + 1];
+    }
+    /* Number the nodes in order of their lowest task, which comes before the other tasks of the node*/
+    nc->NNodes = 0;
+    for(i = 0; i < NTask; i++) {
+        if(nc->TaskNode[i] == i)
+            nc->TaskNode[i] = nc->NNodes++;
+        else
+            nc->TaskNode[i] = nc->TaskNode[nc->TaskNode[i]];
+    }
+    nc->ThisNode = nc->TaskNode[nc->ThisTask];
+
+    memset(nc->NodeStart, 0, sizeof(int) * (nc->NNodes + 1));
+    for(i = 0; i < NTask; i++)
+        nc->NodeStart[nc->TaskNode[i] + 1]++;
+    for(i = 0; i < nc->NNodes; i++)
+        nc->NodeStart[i + 1] += nc->NodeStart[i];
+    for(i = 0; i < NTask; i++)
+        nc->NodeTasks[nc->NodeStart[nc->TaskNode[i]] + nc->TaskNodeRank[i]] = i;
+}
+
+void
+nodecomm_free(NodeComm * nc)
+{
+    MPI_Free_mem(nc->TaskNode);
+    MPI_Comm_free(&nc->node);
+    memset(nc, 0, sizeof(NodeComm));
+}
+
+void
+nodecomm_set_world(const int enable, const int ranks_per_node)
+{
+    if(NodeWorldEnabled)
+        nodecomm_free(&NodeWorld);
+    NodeWorldEnabled = 0;
+    if(!enable)
+        return;
+    nodecomm_init(&NodeWorld, MPI_COMM_WORLD, ranks_per_node);
+    NodeWorldEnabled = 1;
+    message(0, "Node aware communication between %d nodes, %d tasks on the first node.\n", NodeWorld.NNodes, NodeWorld.NodeStart[1]);
+}
+
+NodeComm *
+nodecomm_world(void)
+{
+    if(!NodeWorldEnabled)
+        return NULL;
+    return &NodeWorld;
+}
+
+NodeComm *
+nodecomm_for(MPI_Comm comm, MPI_Datatype sendtype, MPI_Datatype recvtype)
+{
+    if(!NodeWorldEnabled || comm != NodeWorld.comm || NodeHeap.comm != comm)
+        return NULL;
+    /* With one task per node there is nothing to share or aggregate*/
+    if(NodeWorld.NNodes == NodeWorld.NTask)
+        return NULL;
+    MPI_Aint lb, sendext, recvext;
+    int sendsize, recvsize;
+    MPI_Type_get_extent(sendtype, &lb, &sendext);
+    MPI_Type_get_extent(recvtype, &lb, &recvext);
+    MPI_Type_size(sendtype, &sendsize);
+    MPI_Type_size(recvtype, &recvsize);
+    if(sendext != recvext || sendsize != sendext || recvsize != recvext)
+        return NULL;
+    return &NodeWorld;
+}
+
+/* The header published by each task: the counts sent to each task,
+ * the counts received from each task, and the offset in the shared heap of the data sent to each task.*/
+#define HDR_SEND(hdr, task) (((int64_t *) (hdr))[task])
+#define HDR_RECV(hdr, task) (((int64_t *) (hdr))[NTask + (task)])
+#define HDR_OFFSET(hdr, task) (((int64_t *) (hdr))[2 * NTask + (task)])
+
+/* Number of elements in the message from the tasks of node src to the tasks of this node,
+ * found from the receive counts of this node.*/
+static int64_t
+nodecomm_incoming(NodeComm * nc, char ** peer, const int src)
+{
+    const int NTask = nc->NTask;
+    int64_t size = 0;
+    int s, r;
+    for(s = nc->NodeStart[src]; s < nc->NodeStart[src + 1]; s++)
+        for(r = 0; r < nc->NodeSize; r++)
+            size += HDR_RECV(peer[r], nc->NodeTasks[s]);
+    return size;
+}
+
+int
+nodecomm_alltoallv(NodeComm * nc, const void *sendbuf, const int *sendcnts, const int *sdispls,
+        void *recvbuf, const int *recvcnts, const int *rdispls, MPI_Datatype type)
+{
+    const int NTask = nc->NTask;
+    const int ThisTask = nc->ThisTask;
+    MPI_Aint lb, elsize;
+    MPI_Type_get_extent(type, &lb, &elsize);
+
+    char ** peer = ta_malloc("peers", char *, 2 * nc->NodeSize);
+    char ** peerrecv = peer + nc->NodeSize;
+    int64_t * base = ta_malloc("base", int64_t, nc->NodeSize);
+
+    const size_t hdrsize = 3 * NTask * sizeof(int64_t);
+    char * hdr = (char *) mymalloc("NodeHeader", hdrsize);
+    int64_t nsend = 0, extent = 0;
+    int i;
+    for(i = 0; i < NTask; i++) {
+        nsend += sendcnts[i];
+        if(sendcnts[i] > 0 && sdispls[i] + (int64_t) sendcnts[i] > extent)
+            extent = sdispls[i] + (int64_t) sendcnts[i];
+    }
+    /* The tasks on this node read the send buffer in place if it is in the shared heap.
+     * Otherwise it is copied there, ordered by target task.*/
+    const char * senddata = (const char *) sendbuf;
+    char * staging = NULL;
+    if(!nodecomm_in_heap(sendbuf, extent * elsize)) {
+        staging = (char *) mymalloc("NodeSendStaging", nsend * elsize + 1);
+        int64_t offset = 0;
+        for(i = 0; i < NTask; i++) {
+            memcpy(staging + offset * elsize, (const char *) sendbuf + sdispls[i] * elsize, sendcnts[i] * elsize);
+            offset += sendcnts[i];
+        }
+    }
+    int64_t offset = 0;
+    for(i = 0; i < NTask; i++) {
+        HDR_SEND(hdr, i) = sendcnts[i];
+        HDR_RECV(hdr, i) = recvcnts[i];
+        if(staging)
+            HDR_OFFSET(hdr, i) = staging + offset * elsize - hdr;
+        else
+            HDR_OFFSET(hdr, i) = senddata + sdispls[i] * elsize - hdr;
+        offset += sendcnts[i];
+    }
+    nodecomm_exchange_buffers(nc, hdr, peer);
+
+    /* Read the data from the tasks on this node in place*/
+    const int * nodetasks = nc->NodeTasks + nc->NodeStart[nc->ThisNode];
+    int r;
+    for(r = 0; r < nc->NodeSize; r++) {
+        const int src = nodetasks[r];
+        if(HDR_SEND(peer[r], ThisTask) != recvcnts[src])
+            endrun(5, "Task %d sends %ld elements but %d are expected\n", src, HDR_SEND(peer[r], ThisTask), recvcnts[src]);
+        memcpy((char *) recvbuf + rdispls[src] * elsize, peer[r] + HDR_OFFSET(peer[r], ThisTask), recvcnts[src] * elsize);
+    }
+
+    /* The messages between each pair of nodes are shared out between the tasks of the nodes:
+     * the message from node a to node b is sent by the task of node a with rank b % (size of a)
+     * and received by the task of node b with rank a % (size of b).*/
+    int64_t nrecv = 0;
+    int n;
+    for(n = 0; n < nc->NNodes; n++)
+        if(n != nc->ThisNode && n % nc->NodeSize == nc->NodeRank)
+            nrecv += nodecomm_incoming(nc, peer, n);
+    char * recvmsg = (char *) mymalloc("NodeRecvMsg", nrecv * elsize + 1);
+
+    MPI_Request * requests = (MPI_Request *) mymalloc("requests", 2 * nc->NNodes * sizeof(MPI_Request));
+    int nrequests = 0;
+    nrecv = 0;
+    for(n = 0; n < nc->NNodes; n++) {
+        if(n == nc->ThisNode || n % nc->NodeSize != nc->NodeRank)
+            continue;
+        const int64_t size = nodecomm_incoming(nc, peer, n);
+        if(size > INT_MAX)
+            endrun(5, "Message of %ld elements from node %d is too large\n", size, n);
+        const int nsize = nc->NodeStart[n + 1] - nc->NodeStart[n];
+        const int sender = nc->NodeTasks[nc->NodeStart[n] + nc->ThisNode % nsize];
+        if(size > 0)
+            MPI_Irecv(recvmsg + nrecv * elsize, size, type, sender, TAG_NODECOMM, nc->comm, &requests[nrequests++]);
+        nrecv += size;
+    }
+
+    /* Gather the messages to the other nodes from the send buffers of this node*/
+    int64_t nout = 0;
+    for(n = 0; n < nc->NNodes; n++) {
+        if(n == nc->ThisNode || n % nc->NodeSize != nc->NodeRank)
+            continue;
+        for(r = 0; r < nc->NodeSize; r++)
+            for(i = nc->NodeStart[n]; i < nc->NodeStart[n + 1]; i++)
+                nout += HDR_SEND(peer[r], nc->NodeTasks[i]);
+    }
+    char * sendmsg = (char *) mymalloc("NodeSendMsg", nout * elsize);
+    nout = 0;
+    for(n = 0; n < nc->NNodes; n++) {
+        if(n == nc->ThisNode || n % nc->NodeSize != nc->NodeRank)
+            continue;
+        const int64_t start = nout;
+        for(r = 0; r < nc->NodeSize; r++)
+            for(i = nc->NodeStart[n]; i < nc->NodeStart[n + 1]; i++) {
+                const int dest = nc->NodeTasks[i];
+                const int64_t cnt = HDR_SEND(peer[r], dest);
+                memcpy(sendmsg + nout * elsize, peer[r] + HDR_OFFSET(peer[r], dest), cnt * elsize);
+                nout += cnt;
+            }
+        if(nout - start > INT_MAX)
+            endrun(5, "Message of %ld elements to node %d is too large\n", nout - start, n);
+        const int nsize = nc->NodeStart[n + 1] - nc->NodeStart[n];
+        const int receiver = nc->NodeTasks[nc->NodeStart[n] + nc->ThisNode % nsize];
+        if(nout > start)
+            MPI_Isend(sendmsg + start * elsize, nout - start, type, receiver, TAG_NODECOMM, nc->comm, &requests[nrequests++]);
+    }
+    MPI_Waitall(nrequests, requests, MPI_STATUSES_IGNORE);
+    nodecomm_exchange_buffers(nc, recvmsg, peerrecv);
+
+    /* Copy this task's blocks out of the received messages. Each message holds the blocks
+     * from each task of the sending node to each task of this node, ordered by sender then receiver.*/
+    memset(base, 0, sizeof(int64_t) * nc->NodeSize);
+    for(n = 0; n < nc->NNodes; n++) {
+        if(n == nc->ThisNode)
+            continue;
+        const int h = n % nc->NodeSize;
+        const char * msg = peerrecv[h] + base[h] * elsize;
+        int64_t pos = 0;
+        for(i = nc->NodeStart[n]; i < nc->NodeStart[n + 1]; i++) {
+            const int src = nc->NodeTasks[i];
+            for(r = 0; r < nc->NodeSize; r++) {
+                const int64_t cnt = HDR_RECV(peer[r], src);
+                if(r == nc->NodeRank && cnt > 0)
+                    memcpy((char *) recvbuf + rdispls[src] * elsize, msg + pos * elsize, cnt * elsize);
+                pos += cnt;
+            }
+        }
+        base[h] += pos;
+    }
+    /* Wait for the other tasks to finish reading the buffers of this task*/
+    MPI_Barrier(nc->node);
+    myfree(sendmsg);
+    myfree(requests);
+    myfree(recvmsg);
+    if(staging)
+        myfree(staging);
+    myfree(hdr);
+    ta_free(base);
+    ta_free(peer);
+    return 0;
+}
+
+int
+MPI_Alltoallv_node(void *sendbuf, int *sendcnts, int *sdispls,
+        MPI_Datatype sendtype, void *recvbuf, int *recvcnts,
+        int *rdispls, MPI_Datatype recvtype, MPI_Comm comm)
+{
+    NodeComm * nc = nodecomm_for(comm, sendtype, recvtype);
+    if(!nc)
+        return MPI_Alltoallv(sendbuf, sendcnts, sdispls, sendtype, recvbuf, recvcnts, rdispls, recvtype, comm);
+    return nodecomm_alltoallv(nc, sendbuf, sendcnts, sdispls, recvbuf, recvcnts, rdispls, sendtype);
+}
@@ -0,0 +1,74 @@
+#ifndef NODECOMM_H
+#define NODECOMM_H
+
+#include <mpi.h>
+
+/* The tasks of a communicator grouped by the shared memory node they run on.
+ * The MAIN heap of each task is allocated in one MPI shared memory window per node at startup,
+ * so tasks on one node read each other's heap buffers in place, and the data sent between two nodes
+ * goes as one message per pair of nodes, instead of one message per pair of tasks.*/
+typedef struct NodeComm {
+    /* The whole communicator*/
+    MPI_Comm comm;
+    int NTask;
+    int ThisTask;
+    /* The tasks on this node*/
+    MPI_Comm node;
+    int NodeSize;
+    int NodeRank;
+    int NNodes;
+    int ThisNode;
+    /* Node of each task of comm, and its rank within the node*/
+    int * TaskNode;
+    int * TaskNodeRank;
+    /* The tasks of node n are NodeTasks[NodeStart[n] .. NodeStart[n+1]), in order of node rank.*/
+    int * NodeStart;
+    int * NodeTasks;
+} NodeComm;
+
+/* Group the tasks of comm by node. Collective on comm.
+ * If ranks_per_node > 0, the nodes are instead blocks of ranks_per_node consecutive tasks,
+ * which must still be able to share memory. This is for testing the off-node path on one machine.
+ * The tables are allocated with MPI_Alloc_mem, so this may be called before the memory manager is set up.*/
+void nodecomm_init(NodeComm * nc, MPI_Comm comm, const int ranks_per_node);
+void nodecomm_free(NodeComm * nc);
+
+/* Allocate size bytes for the MAIN heap in a shared memory window of the tasks on each node of comm.
+ * The window is allocated once and kept until nodecomm_free_heap. Collective on comm.*/
+char * nodecomm_alloc_heap(MPI_Comm comm, const size_t size);
+void nodecomm_free_heap(void);
+
+/* True if the size bytes at ptr are in the shared heap of this task*/
+int nodecomm_in_heap(const void * ptr, const size_t size);
+
+/* Publish the buffer ptr, which must be in the shared heap, or NULL, to the other tasks of the node,
+ * and set peer to the buffer published by each task of the node, in order of node rank.
+ * The stores to the heap by each task before this call are visible to the others after it. Collective on the node.*/
+void nodecomm_exchange_buffers(NodeComm * nc, const void * ptr, char ** peer);
+
+/* Enable (or disable, if enable = 0) node aware communication for MPI_COMM_WORLD. Collective.
+ * It is only used once the heap is shared with nodecomm_alloc_heap.*/
+void nodecomm_set_world(const int enable, const int ranks_per_node);
+
+/* The node communicator of MPI_COMM_WORLD, or NULL if node aware communication is disabled.*/
+NodeComm * nodecomm_world(void);
+
+/* The node communicator to use for an alltoallv on comm with these types, or NULL if there is none:
+ * comm must be the communicator of nodecomm_world and of the shared heap,
+ * and the types must be contiguous and of the same extent.*/
+NodeComm * nodecomm_for(MPI_Comm comm, MPI_Datatype sendtype, MPI_Datatype recvtype);
+
+/* As MPI_Alltoallv on nc->comm, for a contiguous type. Needs the shared heap.
+ * The tasks on the same node copy their part directly from the send buffer, which is first copied
+ * into the heap only if it is not already there. The data sent to each other node is gathered
+ * from the send buffers by one task of the node and sent as one message,
+ * which is received into the heap and copied out by the receiving tasks.*/
+int nodecomm_alltoallv(NodeComm * nc, const void *sendbuf, const int *sendcnts, const int *sdispls,
+        void *recvbuf, const int *recvcnts, const int *rdispls, MPI_Datatype type);
+
+/* As MPI_Alltoallv, using nodecomm_alltoallv if node aware communication is enabled for comm.*/
+int MPI_Alltoallv_node(void *sendbuf, int *sendcnts, int *sdispls,
+        MPI_Datatype sendtype, void *recvbuf, int *recvcnts,
+        int *rdispls, MPI_Datatype recvtype, MPI_Comm comm);
+
+#endif
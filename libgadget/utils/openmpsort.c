@@ -375,3 +375,73 @@ void qsort_openmp(void *base, size_t nmemb, size_t size,
     }
     myfree(tmp);
 }
+
+/* Number of bits sorted in each pass of the radix sort.*/
+#define RADIX_BITS 8
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+
+/* Sort an array of elements of size bytes by the uint64_t key at the start of each element.
+ * This is a least-significant digit radix sort: each pass counts the digits on each thread,
+ * then scatters the elements in a stable order. Passes where every key has the same digit are skipped.*/
+void radix_sort_openmp(void *base, size_t nmemb, size_t size)
+{
+    if(nmemb <= 1)
+        return;
+    const int nthr = omp_get_max_threads();
+    char * tmp = (char *) mymalloc("radixsort", size * nmemb);
+    size_t * hist = ta_malloc("radixhist", size_t, (size_t) nthr * RADIX_BUCKETS);
+    char * src = (char *) base;
+    char * dst = tmp;
+    int shift;
+    for(shift = 0; shift < 64; shift += RADIX_BITS) {
+        int skip = 0;
+#pragma omp parallel
+        {
+            const int tid = omp_get_thread_num();
+            const int nt = omp_get_num_threads();
+            const size_t start = nmemb * tid / nt;
+            const size_t end = nmemb * (tid + 1) / nt;
+            size_t * myhist = hist + tid * RADIX_BUCKETS;
+            size_t i;
+            for(i = 0; i < RADIX_BUCKETS; i++)
+                myhist[i] = 0;
+            for(i = start; i < end; i++)
+                myhist[(*(uint64_t *) (src + i * size) >> shift) & (RADIX_BUCKETS - 1)]++;
+#pragma omp barrier
+            /* Turn the counts into the offset of each digit on each thread*/
+#pragma omp single
+            {
+                size_t offset = 0;
+                int d, t;
+                for(d = 0; d < RADIX_BUCKETS; d++) {
+                    size_t count = 0;
+                    for(t = 0; t < nt; t++) {
+                        const size_t c = hist[t * RADIX_BUCKETS + d];
+                        hist[t * RADIX_BUCKETS + d] = offset;
+                        offset += c;
+                        count += c;
+                    }
+                    if(count == nmemb)
+                        skip = 1;
+                }
+            }
+            if(!skip) {
+                for(i = start; i < end; i++) {
+                    const int d = (*(uint64_t *) (src + i * size) >> shift) & (RADIX_BUCKETS - 1);
+                    memcpy(dst + myhist[d] * size, src + i * size, size);
+                    myhist[d]++;
+                }
+            }
+        }
+        if(!skip) {
+            char * swap = src;
+            src = dst;
+            dst = swap;
+        }
+    }
+    /* The sorted data is in the temporary array after an odd number of passes*/
+    if(src != base)
+        memcpy(base, src, size * nmemb);
+    ta_free(hist);
+    myfree(tmp);
+}
@@ -6,4 +6,8 @@
 void qsort_openmp(void *base, size_t nmemb, size_t size,
                          int(*compar)(const void *, const void *));
 
+/* Stable parallel radix sort of an array of elements of size bytes,
+ * ordered by the uint64_t key which must be the first member of each element.*/
+void radix_sort_openmp(void *base, size_t nmemb, size_t size);
+
 #endif
@@ -18,6 +18,7 @@
 #include "system.h"
 #include "mymalloc.h"
 #include "endrun.h"
+#include "nodecomm.h"
 
 /* NOTE:
  *
@@ -259,8 +260,7 @@ int MPI_Alltoallv_smart(void *sendbuf, int *sendcnts, int *sdispls,
     if(recvcnts == NULL) {
         a_recvcnts = ta_malloc("recvcnts", int, NTask);
         recvcnts = a_recvcnts;
-        MPI_Alltoall(sendcnts, 1, MPI_INT,
-                     recvcnts, 1, MPI_INT, comm);
+        MPI_Alltoall_sparse(sendcnts, recvcnts, MPI_INT, comm);
     }
     if(recvbuf == NULL) {
         int totalrecv = 0;
@@ -290,7 +290,12 @@ int MPI_Alltoallv_smart(void *sendbuf, int *sendcnts, int *sdispls,
     int tot_dense = 0, ret;
     MPI_Allreduce(&dense, &tot_dense, 1, MPI_INT, MPI_SUM, comm);
 
-    if(tot_dense != 0) {
+    NodeComm * nc = nodecomm_for(comm, sendtype, recvtype);
+    if(nc) {
+        ret = nodecomm_alltoallv(nc, sendbuf, sendcnts, sdispls,
+                    recvbuf, recvcnts, rdispls, sendtype);
+    }
+    else if(tot_dense != 0) {
         ret = MPI_Alltoallv(sendbuf, sendcnts, sdispls,
                     sendtype, recvbuf,
                     recvcnts, rdispls, recvtype, comm);
@@ -313,6 +318,10 @@ int MPI_Alltoallv_sparse(void *sendbuf, int *sendcnts, int *sdispls,
         MPI_Datatype sendtype, void *recvbuf, int *recvcnts,
         int *rdispls, MPI_Datatype recvtype, MPI_Comm comm) {
 
+    NodeComm * nc = nodecomm_for(comm, sendtype, recvtype);
+    if(nc)
+        return nodecomm_alltoallv(nc, sendbuf, sendcnts, sdispls, recvbuf, recvcnts, rdispls, sendtype);
+
     int ThisTask;
     int NTask;
     MPI_Comm_rank(comm, &ThisTask);
@@ -370,6 +379,85 @@ int MPI_Alltoallv_sparse(void *sendbuf, int *sendcnts, int *sdispls,
     return 0;
 }
 
+/* Tags of MPI_Alltoall_sparse. A task may start the next call before the others
+ * have left the current one, but not two calls ahead, so successive calls alternate two tags.*/
+#define TAG_ALLTOALL_SPARSE 101940
+/* Attribute holding the parity of the next call on each communicator: calls on different
+ * communicators are not ordered with respect to each other. The parity is the attribute value itself.*/
+static int alltoall_sparse_keyval = MPI_KEYVAL_INVALID;
+
+/* Returns the tag of this call of MPI_Alltoall_sparse on comm, and flips the parity for the next call.
+ * Every task of comm makes the same sequence of calls, so they agree on the tag.*/
+static int
+alltoall_sparse_tag(MPI_Comm comm)
+{
+    if(alltoall_sparse_keyval == MPI_KEYVAL_INVALID)
+        MPI_Comm_create_keyval(MPI_COMM_NULL_COPY_FN, MPI_COMM_NULL_DELETE_FN, &alltoall_sparse_keyval, NULL);
+    void * val;
+    int flag;
+    MPI_Comm_get_attr(comm, alltoall_sparse_keyval, &val, &flag);
+    const int parity = flag ? (int) (intptr_t) val : 0;
+    MPI_Comm_set_attr(comm, alltoall_sparse_keyval, (void *) (intptr_t) !parity);
+    return TAG_ALLTOALL_SPARSE + parity;
+}
+
+int MPI_Alltoall_sparse(const void * sendbuf, void * recvbuf, MPI_Datatype type, MPI_Comm comm)
+{
+    int ThisTask;
+    int NTask;
+    MPI_Comm_rank(comm, &ThisTask);
+    MPI_Comm_size(comm, &NTask);
+    ptrdiff_t lb, elsize;
+    MPI_Type_get_extent(type, &lb, &elsize);
+    const int tag = alltoall_sparse_tag(comm);
+
+    char * zero = ta_malloc("zero", char, elsize);
+    memset(zero, 0, elsize);
+    MPI_Request * requests = (MPI_Request *) mymalloc("requests", NTask * sizeof(MPI_Request));
+    int n_requests = 0;
+    int i;
+    /* Synchronous sends complete only once they are received*/
+    for(i = 1; i < NTask; i++) {
+        const int target = (ThisTask + i) % NTask;
+        const char * elem = (const char *) sendbuf + elsize * target;
+        if(memcmp(elem, zero, elsize) == 0)
+            continue;
+        MPI_Issend(elem, 1, type, target, tag, comm, &requests[n_requests++]);
+    }
+    memset(recvbuf, 0, elsize * NTask);
+    memcpy((char *) recvbuf + elsize * ThisTask, (const char *) sendbuf + elsize * ThisTask, elsize);
+
+    /* Receive until every task has had all its sends received, which
+     * the non-blocking barrier signals once every task has entered it.*/
+    MPI_Request barrier = MPI_REQUEST_NULL;
+    int barrier_active = 0;
+    while(1) {
+        int flag;
+        MPI_Status status;
+        MPI_Iprobe(MPI_ANY_SOURCE, tag, comm, &flag, &status);
+        if(flag) {
+            MPI_Recv((char *) recvbuf + elsize * status.MPI_SOURCE, 1, type, status.MPI_SOURCE, tag, comm, MPI_STATUS_IGNORE);
+            continue;
+        }
+        int done;
+        if(barrier_active) {
+            MPI_Test(&barrier, &done, MPI_STATUS_IGNORE);
+            if(done)
+                break;
+        }
+        else {
+            MPI_Testall(n_requests, requests, &done, MPI_STATUSES_IGNORE);
+            if(done) {
+                MPI_Ibarrier(comm, &barrier);
+                barrier_active = 1;
+            }
+        }
+    }
+    myfree(requests);
+    ta_free(zero);
+    return 0;
+}
+
 /* return the number of hosts */
 int
 cluster_get_num_hosts(void)
@@ -69,6 +69,12 @@ int MPI_Alltoallv_sparse(void *sendbuf, int *sendcnts, int *sdispls,
         MPI_Datatype sendtype, void *recvbuf, int *recvcnts,
         int *rdispls, MPI_Datatype recvtype, MPI_Comm comm);
 
+/* As MPI_Alltoall of one element of type per task, for sparse data. Only the elements which are
+ * not all zero bytes are sent, and the others are received as zero. The receiving tasks are found by
+ * the non-blocking consensus algorithm (synchronous sends and a non-blocking barrier), so the cost
+ * scales with the number of non-zero elements rather than the number of tasks.*/
+int MPI_Alltoall_sparse(const void * sendbuf, void * recvbuf, MPI_Datatype type, MPI_Comm comm);
+
 double timediff(double t0, double t1);
 double second(void);
 size_t sizemax(size_t a, size_t b);
@@ -0,0 +1,99 @@
+#include <stdint.h>
+#include <string.h>
+#include "xorpack.h"
+
+/* Number of bytes in a record header: a 4-bit byte count per word*/
+static inline size_t
+xorpack_header(const size_t elsize)
+{
+    const size_t nwords = (elsize + 7) / 8;
+    return (nwords + 1) / 2;
+}
+
+/* Load the n <= 8 bytes at p into a word*/
+static inline uint64_t
+xorpack_load(const char * p, const size_t n)
+{
+    uint64_t w = 0;
+    memcpy(&w, p, n);
+    return w;
+}
+
+/* Number of bytes up to the most significant non-zero byte of x*/
+static inline int
+xorpack_nbytes(const uint64_t x)
+{
+    if(x == 0)
+        return 0;
+    return (64 - __builtin_clzll(x) + 7) / 8;
+}
+
+size_t
+xorpack_bound(const size_t nrec, const size_t elsize)
+{
+    return nrec * (elsize + xorpack_header(elsize));
+}
+
+size_t
+xorpack_encode(const void * rec, const size_t nrec, const size_t elsize, char * out)
+{
+    const size_t nwords = (elsize + 7) / 8;
+    const size_t nheader = xorpack_header(elsize);
+    const char * prev = NULL;
+    size_t size = 0;
+    size_t i;
+    for(i = 0; i < nrec; i++) {
+        const char * cur = (const char *) rec + i * elsize;
+        unsigned char * header = out ? (unsigned char *) out + size : NULL;
+        if(header)
+            memset(header, 0, nheader);
+        size += nheader;
+        size_t w;
+        for(w = 0; w < nwords; w++) {
+            const size_t n = (elsize - 8 * w < 8) ? elsize - 8 * w : 8;
+            uint64_t x = xorpack_load(cur + 8 * w, n);
+            if(prev)
+                x ^= xorpack_load(prev + 8 * w, n);
+            const int nb = xorpack_nbytes(x);
+            if(out) {
+                header[w / 2] |= nb << (4 * (w % 2));
+                int b;
+                for(b = 0; b < nb; b++)
+                    out[size + b] = (x >> (8 * b)) & 0xff;
+            }
+            size += nb;
+        }
+        prev = cur;
+    }
+    return size;
+}
+
+size_t
+xorpack_decode(const char * in, const size_t nrec, const size_t elsize, void * rec)
+{
+    const size_t nwords = (elsize + 7) / 8;
+    const size_t nheader = xorpack_header(elsize);
+    const char * prev = NULL;
+    size_t size = 0;
+    size_t i;
+    for(i = 0; i < nrec; i++) {
+        char * cur = (char *) rec + i * elsize;
+        const unsigned char * header = (const unsigned char *) in + size;
+        size += nheader;
+        size_t w;
+        for(w = 0; w < nwords; w++) {
+            const size_t n = (elsize - 8 * w < 8) ? elsize - 8 * w : 8;
+            const int nb = (header[w / 2] >> (4 * (w % 2))) & 0xf;
+            uint64_t x = 0;
+            int b;
+            for(b = 0; b < nb; b++)
+                x |= ((uint64_t) (unsigned char) in[size + b]) << (8 * b);
+            size += nb;
+            if(prev)
+                x ^= xorpack_load(prev + 8 * w, n);
+            memcpy(cur + 8 * w, &x, n);
+        }
+        prev = cur;
+    }
+    return size;
+}
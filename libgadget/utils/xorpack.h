@@ -0,0 +1,23 @@
+#ifndef XORPACK_H
+#define XORPACK_H
+
+#include <stddef.h>
+
+/* Lossless packing of arrays of fixed size records, to reduce the bytes sent between tasks.
+ * Each 64-bit word of a record is xored with the same word of the previous record and only
+ * the bytes up to the most significant non-zero byte of the result are stored, after a 4-bit count.
+ * Records which differ little from their predecessor pack into few bytes: fields which are
+ * the same, positions of nearby particles, which share the exponent and the leading mantissa bits,
+ * and consecutive integers like particle IDs. Unpacking restores the records bit for bit.*/
+
+/* Largest packed size of nrec records of elsize bytes*/
+size_t xorpack_bound(const size_t nrec, const size_t elsize);
+
+/* Pack nrec records of elsize bytes into out and return the packed size.
+ * If out is NULL only the packed size is returned.*/
+size_t xorpack_encode(const void * rec, const size_t nrec, const size_t elsize, char * out);
+
+/* Unpack nrec records of elsize bytes from in. Returns the number of bytes read.*/
+size_t xorpack_decode(const char * in, const size_t nrec, const size_t elsize, void * rec);
+
+#endif
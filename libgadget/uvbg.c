@@ -47,6 +47,7 @@ static struct UVBGParams {
     double EscapeFractionScaling;
     int ReionUseParticleSFR;
     double ReionSFRTimescale;
+    int ReionFilterBatch;
     int UVBGdim;
 
     double Time;
@@ -78,6 +79,7 @@ void set_uvbg_params(ParameterSet * ps) {
         uvbg_params.EscapeFractionScaling = param_get_double(ps, "EscapeFractionScaling");
         uvbg_params.ReionUseParticleSFR = param_get_int(ps, "ReionUseParticleSFR");
         uvbg_params.ReionSFRTimescale = param_get_double(ps, "ReionSFRTimescale");
+        uvbg_params.ReionFilterBatch = param_get_int(ps, "ReionFilterBatch");
         uvbg_params.UVBGdim = param_get_int(ps,"UVBGdim");
     }
 
@@ -573,7 +575,7 @@ void calculate_uvbg(PetaPM * pm_mass, PetaPM * pm_star, PetaPM * pm_sfr, int Wri
     message(0, "Away to call find_HII_bubbles...\n");
     petapm_reion(pm_mass,pm_star,pm_sfr,makeregion,&global_functions
             ,functions,&pstruct,&rstruct,reion_loop_pm,Rmax,Rmin,Rdelta
-            ,uvbg_params.ReionUseParticleSFR,NULL);
+            ,uvbg_params.ReionUseParticleSFR,uvbg_params.ReionFilterBatch,NULL);
 
     //TODO: In line with Meraxes, should we multiply J21 with a halo bias parameter for particles in a group??
 
@@ -30,7 +30,7 @@ _cmocka_run_group_tests_mpi(const char * name, const struct CMUnitTest tests[],
     }
     /* allocate some memory for MAIN and TEMP */
 
-    allocator_init(A_MAIN, "MAIN", 650 * 1024 * 1024, 0, NULL);
+    allocator_init(A_MAIN, "MAIN", 800 * 1024 * 1024, 0, NULL);
     allocator_init(A_TEMP, "TEMP", 8 * 1024 * 1024, 0, A_MAIN);
 
     message(0, "GADGET_TESTDATA_ROOT : %s\n", GADGET_TESTDATA_ROOT);